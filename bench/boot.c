@@ -0,0 +1,292 @@
+/*
+    boot.c times booting a cache directory of FILES JSON files (one per
+    city, as with CITY_CACHE_LOG 0), read and parsed on the boot pool:
+    - threads: every pool thread opens, reads and parses its own files
+      with json_load_file(), as city_read_dir() did before bulkio
+    - posix:   every pool thread reads its own files with bulkio_read()
+      and parses them, what city_read_dir() does without io_uring
+    - uring:   all files read with bulkio_read() on a ring first, then
+      parsed on the pool, what city_read_dir() does with io_uring
+    Cold runs first drop the files from the page cache with
+    posix_fadvise(), so the data comes from the disk; their inodes stay
+    cached. Also times a flush of BENCH_FLUSH files, each written and
+    fsync'd, with and without io_uring.
+
+    Usage: boot [FILES...]
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "bulkio.h"
+#include "city.h"
+#include "jansson.h"
+#include "pool.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_ROUNDS 3  /* runs per cell, the median is shown */
+#define BENCH_FLUSH 256 /* files written and fsync'd per flush */
+#define BENCH_TEXT_MAX 256
+
+enum { BENCH_THREADS, BENCH_POSIX, BENCH_URING, BENCH_MODES };
+
+static const char*  bench_modes[] = {"threads", "posix", "uring"};
+static const size_t bench_sizes[] = {10000, 100000};
+
+/* ----- Struct for one boot ----- */
+typedef struct {
+    bulkio_file_t* files;
+    int            mode;
+    unsigned char* parsed;
+} bench_load_t;
+
+/* ----- PRIVATE FUNCTIONS ----- */
+double bench_now(void);
+int    bench_cmp(const void* a, const void* b);
+int    bench_fill(const char* dir, bulkio_file_t* files, size_t from,
+                  size_t to);
+void   bench_text(char* buf, size_t max, size_t i);
+void   bench_evict(bulkio_file_t* files, size_t n);
+double bench_boot(pool_t* pool, bench_load_t* load, size_t n, bool cold);
+void   bench_item(size_t i, void* userp);
+double bench_flush(const char* dir, bool uring);
+
+int main(int argc, char** argv) {
+    size_t    num_sizes = argc > 1 ? (size_t)argc - 1 : 2;
+    size_t*   sizes     = malloc(num_sizes * sizeof(size_t));
+    size_t    max       = 0;
+    bulkio_t* io        = NULL;
+    pool_t*   pool      = NULL;
+    for (size_t i = 0; i < num_sizes; i++) {
+        sizes[i] = argc > 1 ? (size_t)atol(argv[i + 1]) : bench_sizes[i];
+        if (sizes[i] == 0) {
+            fprintf(stderr, "Usage: %s [FILES...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        max = sizes[i] > max ? sizes[i] : max;
+    }
+    const char* tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char        dir[512];
+    snprintf(dir, sizeof(dir), "%s/etherskies-boot-XXXXXX", tmp);
+    bench_load_t load;
+    load.files  = calloc(max, sizeof(bulkio_file_t));
+    load.parsed = malloc(max);
+    if (!sizes || !load.files || !load.parsed) {
+        printf("Malloc failed\n");
+        return EXIT_FAILURE;
+    }
+    if (!mkdtemp(dir) || pool_create(&pool, CITY_BOOT_THREADS) != STATUS_OK ||
+        bulkio_create(&io, true) != STATUS_OK) {
+        perror(dir);
+        return EXIT_FAILURE;
+    }
+    if (!bulkio_uring(io)) {
+        printf("io_uring is not available, uring falls back to POSIX\n");
+    }
+    bulkio_dispose(&io);
+
+    printf("%-8s %-8s %10s %10s\n", "files", "path", "cold ms", "warm ms");
+    int    status  = EXIT_SUCCESS;
+    size_t written = 0;
+    for (size_t s = 0; s < num_sizes && status == EXIT_SUCCESS; s++) {
+        size_t n = sizes[s];
+        if (n > written) {
+            if (bench_fill(dir, load.files, written, n) != STATUS_OK) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            written = n;
+            sync(); /* dirty pages cannot be dropped */
+        }
+        for (int mode = 0; mode < BENCH_MODES; mode++) {
+            double cold[BENCH_ROUNDS];
+            double warm[BENCH_ROUNDS];
+            load.mode = mode;
+            for (int r = 0; r < BENCH_ROUNDS; r++) {
+                cold[r] = bench_boot(pool, &load, n, true);
+                warm[r] = bench_boot(pool, &load, n, false);
+            }
+            qsort(cold, BENCH_ROUNDS, sizeof(double), bench_cmp);
+            qsort(warm, BENCH_ROUNDS, sizeof(double), bench_cmp);
+            printf("%-8zu %-8s %10.1f %10.1f\n", n, bench_modes[mode],
+                   cold[BENCH_ROUNDS / 2] * 1e3, warm[BENCH_ROUNDS / 2] * 1e3);
+            for (size_t i = 0; i < n; i++) {
+                if (!load.parsed[i]) {
+                    printf("%s could not be parsed\n", load.files[i].path);
+                    status = EXIT_FAILURE;
+                    break;
+                }
+            }
+        }
+    }
+
+    double flush[2][BENCH_ROUNDS];
+    for (int r = 0; r < BENCH_ROUNDS && status == EXIT_SUCCESS; r++) {
+        flush[0][r] = bench_flush(dir, false);
+        flush[1][r] = bench_flush(dir, true);
+        if (flush[0][r] < 0 || flush[1][r] < 0) {
+            status = EXIT_FAILURE;
+        }
+    }
+    if (status == EXIT_SUCCESS) {
+        qsort(flush[0], BENCH_ROUNDS, sizeof(double), bench_cmp);
+        qsort(flush[1], BENCH_ROUNDS, sizeof(double), bench_cmp);
+        printf("flush of %d files: posix %.1f ms, uring %.1f ms\n",
+               BENCH_FLUSH, flush[0][BENCH_ROUNDS / 2] * 1e3,
+               flush[1][BENCH_ROUNDS / 2] * 1e3);
+    }
+
+    for (size_t i = 0; i < written; i++) {
+        unlink(load.files[i].path);
+        free((char*)load.files[i].path);
+    }
+    rmdir(dir);
+    pool_dispose(&pool);
+    free(load.files);
+    free(load.parsed);
+    free(sizes);
+    return status;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int bench_cmp(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+bench_fill() writes cache files from up to to, laid out the way
+city_write_files() writes them.
+*/
+int bench_fill(const char* dir, bulkio_file_t* files, size_t from,
+               size_t to) {
+    char text[BENCH_TEXT_MAX];
+    for (size_t i = from; i < to; i++) {
+        char* path = malloc(strlen(dir) + 32);
+        if (!path) {
+            printf("Malloc failed\n");
+            return STATUS_FAIL;
+        }
+        sprintf(path, "%s/City%zu.json", dir, i);
+        files[i].path = path;
+        bench_text(text, sizeof(text), i);
+        FILE* f = fopen(path, "w");
+        if (!f || fputs(text, f) == EOF || fclose(f) != 0) {
+            perror(path);
+            return STATUS_FAIL;
+        }
+    }
+    return STATUS_OK;
+}
+
+void bench_text(char* buf, size_t max, size_t i) {
+    double lat = 55.0 + (double)(i % 1500) / 100.0;
+    double lon = 11.0 + (double)(i / 1500 % 1300) / 100.0;
+    snprintf(buf, max,
+             "{\n    \"name\": \"City%zu\",\n"
+             "    \"fp\": \"./cities/City%zu_%.2f_%.2f.json\",\n"
+             "    \"lat\": %.15f,\n    \"lon\": %.15f,\n"
+             "    \"temp\": %.1f,\n    \"windspeed\": %.1f,\n"
+             "    \"rel_hum\": %.1f,\n    \"cached_at\": %ld\n}",
+             i, i, lat, lon, lat, lon, (double)(i % 40) - 10.0,
+             (double)(i % 15), (double)(i % 100), (long)time(NULL));
+}
+
+void bench_evict(bulkio_file_t* files, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int fd = open(files[i].path, O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+/*
+bench_boot() reads and parses the first n files with load->mode and
+returns the seconds it took, ring setup included.
+*/
+double bench_boot(pool_t* pool, bench_load_t* load, size_t n, bool cold) {
+    for (size_t i = 0; i < n; i++) {
+        load->files[i].data  = NULL;
+        load->files[i].error = 0;
+    }
+    memset(load->parsed, 0, n);
+    if (cold) {
+        bench_evict(load->files, n);
+    }
+
+    double start = bench_now();
+    if (load->mode == BENCH_URING) {
+        bulkio_t* io = NULL;
+        if (bulkio_create(&io, true) == STATUS_OK) {
+            bulkio_read(io, load->files, n);
+            bulkio_dispose(&io);
+        }
+    }
+    pool_run(pool, n, bench_item, load);
+    return bench_now() - start;
+}
+
+void bench_item(size_t i, void* userp) {
+    bench_load_t*  load = userp;
+    bulkio_file_t* file = &load->files[i];
+    json_error_t   error;
+    json_t*        root = NULL;
+    if (load->mode == BENCH_THREADS) {
+        root = json_load_file(file->path, 0, &error);
+    } else {
+        if (!file->data && !file->error) {
+            bulkio_read(NULL, file, 1);
+        }
+        if (file->data) {
+            root = json_loadb(file->data, file->len, 0, &error);
+        }
+        free(file->data);
+        file->data = NULL;
+    }
+    load->parsed[i] = root != NULL;
+    json_decref(root);
+}
+
+/*
+bench_flush() writes BENCH_FLUSH temp files the way city_write_files()
+does and returns the seconds it took, or -1 if a file failed.
+*/
+double bench_flush(const char* dir, bool uring) {
+    bulkio_file_t files[BENCH_FLUSH];
+    char          paths[BENCH_FLUSH][512];
+    char          texts[BENCH_FLUSH][BENCH_TEXT_MAX];
+    for (size_t i = 0; i < BENCH_FLUSH; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/Flush%zu.json.tmp", dir, i);
+        bench_text(texts[i], sizeof(texts[i]), i);
+        files[i].path = paths[i];
+        files[i].data = texts[i];
+        files[i].len  = strlen(texts[i]);
+    }
+
+    bulkio_t* io    = NULL;
+    double    start = bench_now();
+    if (bulkio_create(&io, uring) != STATUS_OK) {
+        return -1.0;
+    }
+    int status = bulkio_write(io, files, BENCH_FLUSH);
+    bulkio_dispose(&io);
+    double took = bench_now() - start;
+
+    for (size_t i = 0; i < BENCH_FLUSH; i++) {
+        unlink(paths[i]);
+    }
+    return status == STATUS_OK ? took : -1.0;
+}
@@ -0,0 +1,281 @@
+/*
+    cacheage.c times the file tier of a lookup, the freshness check and
+    the load of the cached values, on CITIES cities:
+    - two parses: what http_get_weather_data() did before, one
+      json_load_file() of the city's JSON file for cached_at and, if it
+      was fresh, another one for the values
+    - cache log:  city_load_cache(), which checks cached_at in the log's
+      index without reading the record and parses the record once
+    Fresh lookups load the values, stale ones only find out they are
+    stale. The files and the log are warm in the page cache, so this is
+    the parsing and system call cost, not the disk's. The fastest of
+    BENCH_ROUNDS rounds is shown. The cache log has
+    to take at most half the time of two parses on fresh lookups.
+
+    Usage: cacheage [CITIES]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "city.h"
+#include "jansson.h"
+#include "snapshot.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_CITIES 1000
+#define BENCH_QUERIES 10000 /* lookups per path and kind */
+#define BENCH_ROUNDS 5      /* of BENCH_QUERIES, the fastest is shown */
+#define BENCH_MAX_AGE 900   /* seconds data stays fresh, as in HTTP.c */
+#define BENCH_SPEEDUP_MIN 2.0
+#define BENCH_NAME_MAX 64
+
+/* ----- Syllables generated names are made of ----- */
+static const char* bench_syllables[] = {
+    "ba", "ko", "ri", "st", "de", "lu", "mo", "ga", "vi", "ny",
+    "or", "ha", "tu", "be", "le", "sk", "ne", "ro", "by", "as",
+};
+
+/* ----- PRIVATE FUNCTIONS ----- */
+double bench_now(void);
+void   bench_name(size_t i, char* buf, size_t max);
+int    bench_dataset(city_list_t* list, size_t n);
+int    bench_old_age(const char* fp);
+int    bench_old_load(city_list_t* list, city_id_t id);
+int    bench_old(city_list_t* list, city_id_t id, int max_age);
+
+int main(int argc, char** argv) {
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : BENCH_CITIES;
+    if (n == 0) {
+        fprintf(stderr, "Usage: %s [CITIES]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /*city_init() needs a directory to boot from, and talks on stdout*/
+    const char* tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char        dir[512];
+    snprintf(dir, sizeof(dir), "%s/etherskies-cacheage-XXXXXX", tmp);
+    fflush(stdout);
+    FILE* out  = fdopen(dup(STDOUT_FILENO), "w");
+    int   null = open("/dev/null", O_WRONLY);
+    if (!out || null < 0 || dup2(null, STDOUT_FILENO) < 0 || !mkdtemp(dir) ||
+        chdir(dir) != 0) {
+        perror(dir);
+        return EXIT_FAILURE;
+    }
+    close(null);
+
+    city_list_t* list   = NULL;
+    int          status = EXIT_FAILURE;
+    if (city_init(&list) != STATUS_OK) {
+        return EXIT_FAILURE;
+    }
+    if (bench_dataset(list, n) == STATUS_OK) {
+        status = EXIT_SUCCESS;
+    }
+
+    fprintf(out, "%zu cities, %d lookups per round\n", n, BENCH_QUERIES);
+    fprintf(out, "%-8s %14s %14s %10s\n", "lookup", "two parses us",
+            "cache log us", "speedup");
+    srand(1);
+    for (int fresh = 1; fresh >= 0 && status == EXIT_SUCCESS; fresh--) {
+        int       max_age = fresh ? BENCH_MAX_AGE : -1;
+        city_id_t ids[BENCH_QUERIES];
+        for (int q = 0; q < BENCH_QUERIES; q++) {
+            ids[q] = (city_id_t)((size_t)rand() % list->size);
+        }
+
+        unsigned old_hits = 0;
+        unsigned log_hits = 0;
+        double   old      = -1.0;
+        double   log      = -1.0;
+        for (int r = 0; r < BENCH_ROUNDS; r++) {
+            double start = bench_now();
+            for (int q = 0; q < BENCH_QUERIES; q++) {
+                old_hits += bench_old(list, ids[q], max_age) == STATUS_OK;
+            }
+            double t = (bench_now() - start) / BENCH_QUERIES;
+            old      = old < 0 || t < old ? t : old;
+
+            start = bench_now();
+            for (int q = 0; q < BENCH_QUERIES; q++) {
+                int age;
+                log_hits += city_load_cache(list, ids[q], max_age, &age) ==
+                            STATUS_OK;
+            }
+            t   = (bench_now() - start) / BENCH_QUERIES;
+            log = log < 0 || t < log ? t : log;
+        }
+
+        unsigned want = fresh ? BENCH_QUERIES * BENCH_ROUNDS : 0;
+        fprintf(out, "%-8s %14.2f %14.2f %9.1fx\n", fresh ? "fresh" : "stale",
+                old * 1e6, log * 1e6, old / log);
+        if (old_hits != want || log_hits != want) {
+            fprintf(out, "two parses loaded %u, cache log %u, of %u\n",
+                    old_hits, log_hits, want);
+            status = EXIT_FAILURE;
+        } else if (fresh && old / log < BENCH_SPEEDUP_MIN) {
+            fprintf(out, "the cache log is not %.0fx faster\n",
+                    BENCH_SPEEDUP_MIN);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    for (city_id_t id = 0; id < list->size; id++) {
+        unlink(list->text[id].fp);
+    }
+    city_dispose(&list);
+    rmdir(CITY_CACHE_DIR);
+    unlink(CITY_CACHE_LOG_PATH);
+    unlink(SNAPSHOT_PATH);
+    if (chdir("/") != 0 || rmdir(dir) != 0) {
+        fprintf(stderr, "%s was not removed\n", dir);
+    }
+    fclose(out);
+    return status;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+bench_name() spells i in base 20 with two-letter syllables, so every i
+gets a name of its own.
+*/
+void bench_name(size_t i, char* buf, size_t max) {
+    size_t count = sizeof(bench_syllables) / sizeof(bench_syllables[0]);
+    size_t len   = 0;
+    do {
+        len += snprintf(buf + len, max - len, "%s", bench_syllables[i % count]);
+        i /= count;
+    } while ((i > 0 || len < 4) && len + 3 < max);
+    buf[0] = (char)toupper((unsigned char)buf[0]);
+}
+
+/*
+bench_dataset() adds generated cities up to n, gives them all fresh
+weather and saves them twice: to the cache log, and to a JSON file per
+city laid out as the old http_save_cache() wrote it.
+*/
+int bench_dataset(city_list_t* list, size_t n) {
+    char name[BENCH_NAME_MAX];
+    for (size_t i = list->size; i < n; i++) {
+        bench_name(i, name, sizeof(name));
+        city_data_t data = {.name      = name,
+                            .lat       = -60.0 + (double)(i / 2000) * 0.15,
+                            .lon       = -179.9 + (double)(i % 2000) * 0.15,
+                            .temp      = INIT_VAL,
+                            .windspeed = INIT_VAL,
+                            .rel_hum   = INIT_VAL};
+        if (city_add(list, &data, NULL) != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+    }
+
+    city_id_t* ids = malloc(list->size * sizeof(city_id_t));
+    if (!ids) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    mkdir(CITY_CACHE_DIR, 0755);
+    int status = STATUS_OK;
+    for (city_id_t id = 0; id < list->size && status == STATUS_OK; id++) {
+        list->temp[id]      = (double)(id % 40) - 10.0;
+        list->windspeed[id] = (double)(id % 15);
+        list->rel_hum[id]   = (double)(id % 100);
+        list->cached_at[id] = time(NULL);
+        ids[id]             = id;
+
+        json_t* root = json_object();
+        json_object_set_new(root, "name", json_string(list->text[id].name));
+        json_object_set_new(root, "fp", json_string(list->text[id].fp));
+        json_object_set_new(root, "lat", json_real(list->lat[id]));
+        json_object_set_new(root, "lon", json_real(list->lon[id]));
+        json_object_set_new(root, "temp", json_real(list->temp[id]));
+        json_object_set_new(root, "windspeed",
+                            json_real(list->windspeed[id]));
+        json_object_set_new(root, "rel_hum", json_real(list->rel_hum[id]));
+        json_object_set_new(root, "cached_at",
+                            json_integer((json_int_t)list->cached_at[id]));
+        if (!root ||
+            json_dump_file(root, list->text[id].fp, JSON_INDENT(4)) != 0) {
+            perror(list->text[id].fp);
+            status = STATUS_FAIL;
+        }
+        json_decref(root);
+    }
+    if (status == STATUS_OK &&
+        city_save_batch(list, ids, list->size) != STATUS_OK) {
+        status = STATUS_FAIL;
+    }
+    free(ids);
+    return status;
+}
+
+/* ----- THE OLD FILE TIER ----- */
+/*
+bench_old() is the file tier of http_get_weather_data() before the
+cache log: the age first, then the values, each with a parse of its own.
+*/
+int bench_old(city_list_t* list, city_id_t id, int max_age) {
+    int age = bench_old_age(list->text[id].fp);
+    if (age < 0 || age > max_age) {
+        return STATUS_FAIL;
+    }
+    return bench_old_load(list, id);
+}
+
+/*
+bench_old_age() is the old http_cache_age_seconds().
+*/
+int bench_old_age(const char* fp) {
+    json_error_t error;
+    json_t*      root = json_load_file(fp, 0, &error);
+    if (!root) {
+        return -1;
+    }
+    json_t* jat = json_object_get(root, "cached_at");
+    if (!json_is_integer(jat)) {
+        json_decref(root);
+        return -1;
+    }
+    int age = (int)(time(NULL) - json_integer_value(jat));
+    json_decref(root);
+    return age;
+}
+
+/*
+bench_old_load() is the old http_load_cache(), writing to the columns.
+*/
+int bench_old_load(city_list_t* list, city_id_t id) {
+    json_error_t error;
+    json_t*      root = json_load_file(list->text[id].fp, 0, &error);
+    if (!root) {
+        return STATUS_FAIL;
+    }
+    json_t* jtemp      = json_object_get(root, "temp");
+    json_t* jwind      = json_object_get(root, "windspeed");
+    json_t* jhum       = json_object_get(root, "rel_hum");
+    json_t* jcached_at = json_object_get(root, "cached_at");
+    if (jtemp && json_is_number(jtemp))
+        list->temp[id] = json_number_value(jtemp);
+    if (jwind && json_is_number(jwind))
+        list->windspeed[id] = json_number_value(jwind);
+    if (jhum && json_is_number(jhum))
+        list->rel_hum[id] = json_number_value(jhum);
+    list->cached_at[id] = (jcached_at && json_is_integer(jcached_at))
+                              ? (time_t)json_integer_value(jcached_at)
+                              : 0;
+    json_decref(root);
+    return STATUS_OK;
+}
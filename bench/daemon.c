@@ -0,0 +1,189 @@
+/*
+    daemon.c benchmarks a running daemon (etherskies --serve) with many
+    concurrent clients. Every client connects once and sends GET requests
+    one at a time, waiting for each reply, so every request is a full
+    round trip. Throughput and the latency percentiles are printed.
+
+    Usage: daemon SOCKET [CLIENTS] [REQUESTS] [CITY]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_CLIENTS 32    /* concurrent clients */
+#define BENCH_REQUESTS 2000 /* requests per client */
+#define BENCH_WAIT_S 10     /* how long to wait for the daemon to boot */
+
+/* ----- Struct for one client ----- */
+typedef struct {
+    const char* path;
+    const char* city;
+    unsigned    requests;
+    double*     latency; /* seconds, one per request */
+    unsigned    done;
+    unsigned    failed;
+} bench_client_t;
+
+/* ----- PRIVATE FUNCTIONS ----- */
+int    bench_connect(const char* path);
+void*  bench_client(void* userp);
+double bench_now(void);
+int    bench_cmp(const void* a, const void* b);
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s SOCKET [CLIENTS] [REQUESTS] [CITY]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char* path     = argv[1];
+    unsigned    clients  = argc > 2 ? atoi(argv[2]) : BENCH_CLIENTS;
+    unsigned    requests = argc > 3 ? atoi(argv[3]) : BENCH_REQUESTS;
+    const char* city     = argc > 4 ? argv[4] : "Stockholm";
+    if (clients == 0 || requests == 0) {
+        fprintf(stderr, "CLIENTS and REQUESTS must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    /*Wait for the daemon, and warm the city up so it is not timed*/
+    struct timespec pause = {0, 50000000};
+    int             fd    = -1;
+    double          start = bench_now();
+    while ((fd = bench_connect(path)) < 0 &&
+           bench_now() - start < BENCH_WAIT_S) {
+        nanosleep(&pause, NULL);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "No daemon on %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    char warm[256];
+    int  len = snprintf(warm, sizeof(warm), "GET %s\n", city);
+    if (write(fd, warm, len) != len || read(fd, warm, sizeof(warm)) <= 0) {
+        fprintf(stderr, "Daemon did not answer\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    bench_client_t* cs      = calloc(clients, sizeof(bench_client_t));
+    pthread_t*      threads = calloc(clients, sizeof(pthread_t));
+    double*         all     = calloc((size_t)clients * requests,
+                                     sizeof(double));
+    if (!cs || !threads || !all) {
+        printf("Malloc failed\n");
+        return EXIT_FAILURE;
+    }
+    start = bench_now();
+    for (unsigned i = 0; i < clients; i++) {
+        cs[i].path     = path;
+        cs[i].city     = city;
+        cs[i].requests = requests;
+        cs[i].latency  = all + (size_t)i * requests;
+        pthread_create(&threads[i], NULL, bench_client, &cs[i]);
+    }
+    size_t   done   = 0;
+    unsigned failed = 0;
+    for (unsigned i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        /*Pack the latencies of every client together for sorting*/
+        memmove(all + done, cs[i].latency, cs[i].done * sizeof(double));
+        done += cs[i].done;
+        failed += cs[i].failed;
+    }
+    double spent = bench_now() - start;
+
+    qsort(all, done, sizeof(double), bench_cmp);
+    int status = done == (size_t)clients * requests && failed == 0
+                     ? EXIT_SUCCESS
+                     : EXIT_FAILURE;
+    printf("%u clients, %zu requests (%u failed) in %.2f s\n", clients, done,
+           failed, spent);
+    if (done > 0) {
+        printf("%.0f requests/s, latency p50 %.1f us, p99 %.1f us, "
+               "max %.1f us\n",
+               done / spent, all[done / 2] * 1e6,
+               all[(size_t)(done * 0.99)] * 1e6, all[done - 1] * 1e6);
+    }
+    free(cs);
+    free(threads);
+    free(all);
+    return status;
+}
+
+int bench_connect(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+bench_client() sends its requests one after the other. A reply is read
+until its newline; one reply never spans two requests since only one is
+outstanding at a time.
+*/
+void* bench_client(void* userp) {
+    bench_client_t* c  = userp;
+    int             fd = bench_connect(c->path);
+    if (fd < 0) {
+        c->failed = c->requests;
+        return NULL;
+    }
+    char req[256];
+    char reply[1024];
+    int  len = snprintf(req, sizeof(req), "GET %s\n", c->city);
+    for (unsigned i = 0; i < c->requests; i++) {
+        double start = bench_now();
+        if (write(fd, req, len) != len) {
+            break;
+        }
+        size_t got = 0;
+        while (got == 0 || reply[got - 1] != '\n') {
+            ssize_t n = read(fd, reply + got, sizeof(reply) - got);
+            if (n <= 0 || got + n == sizeof(reply)) {
+                got = 0;
+                break;
+            }
+            got += n;
+        }
+        if (got == 0) {
+            break;
+        }
+        if (reply[0] != '+') {
+            c->failed++;
+        }
+        c->latency[c->done++] = bench_now() - start;
+    }
+    close(fd);
+    return NULL;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int bench_cmp(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,174 @@
+/*
+    geo.c benchmarks the spatial index against a brute-force scan:
+    - building the k-d tree over POINTS random cities
+    - nearest city to random points
+    - every city within BENCH_RADIUS_KM of random points
+
+    Every answer of the tree is checked against the scan, which computes
+    the haversine distance to every city. Mismatches fail the benchmark.
+
+    Usage: geo [POINTS] [QUERIES]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "city.h"
+#include "geo.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_POINTS 200000 /* cities in the index */
+#define BENCH_QUERIES 2000  /* queries of each kind */
+#define BENCH_RADIUS_KM 50.0
+
+/* ----- PRIVATE FUNCTIONS ----- */
+void     bench_random_point(double* out_lat, double* out_lon);
+uint32_t bench_scan_nearest(const double* lat, const double* lon, uint32_t n,
+                            double q_lat, double q_lon);
+size_t   bench_scan_within(const double* lat, const double* lon, uint32_t n,
+                           double q_lat, double q_lon, double km,
+                           uint32_t* out_ids);
+double   bench_now(void);
+
+int main(int argc, char** argv) {
+    uint32_t n       = argc > 1 ? (uint32_t)atol(argv[1]) : BENCH_POINTS;
+    unsigned queries = argc > 2 ? (unsigned)atoi(argv[2]) : BENCH_QUERIES;
+    if (n == 0 || queries == 0) {
+        fprintf(stderr, "Usage: %s [POINTS] [QUERIES]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    double*   lat  = malloc(n * sizeof(double));
+    double*   lon  = malloc(n * sizeof(double));
+    double*   q    = malloc(queries * 2 * sizeof(double));
+    uint32_t* got  = malloc(n * sizeof(uint32_t));
+    uint32_t* want = malloc(n * sizeof(uint32_t));
+    if (!lat || !lon || !q || !got || !want) {
+        printf("Malloc failed\n");
+        return EXIT_FAILURE;
+    }
+    srand(1);
+    for (uint32_t i = 0; i < n; i++) {
+        bench_random_point(&lat[i], &lon[i]);
+    }
+    for (unsigned i = 0; i < queries; i++) {
+        bench_random_point(&q[2 * i], &q[2 * i + 1]);
+    }
+
+    geo_t  geo   = {0};
+    double start = bench_now();
+    if (geo_build(&geo, lat, lon, n) != STATUS_OK) {
+        return EXIT_FAILURE;
+    }
+    double build = bench_now() - start;
+    printf("%u cities, %u queries of each kind\n", n, queries);
+    printf("build:   %8.2f ms\n", build * 1e3);
+
+    /*Nearest city*/
+    unsigned mismatched = 0;
+    start               = bench_now();
+    for (unsigned i = 0; i < queries; i++) {
+        geo_nearest(&geo, q[2 * i], q[2 * i + 1], &got[i]);
+    }
+    double tree = bench_now() - start;
+    start       = bench_now();
+    for (unsigned i = 0; i < queries; i++) {
+        want[i] = bench_scan_nearest(lat, lon, n, q[2 * i], q[2 * i + 1]);
+    }
+    double scan = bench_now() - start;
+    for (unsigned i = 0; i < queries; i++) {
+        if (got[i] != want[i]) {
+            mismatched++;
+        }
+    }
+    printf("nearest: %8.2f us per query, scan %8.2f us, %.0fx faster\n",
+           tree / queries * 1e6, scan / queries * 1e6, scan / tree);
+
+    /*Every city within the radius, sorted the same way for comparing*/
+    size_t found = 0;
+    tree         = 0;
+    scan         = 0;
+    for (unsigned i = 0; i < queries; i++) {
+        start           = bench_now();
+        size_t tree_n   = geo_within(&geo, q[2 * i], q[2 * i + 1],
+                                     BENCH_RADIUS_KM, got);
+        tree           += bench_now() - start;
+        start           = bench_now();
+        size_t scan_n   = bench_scan_within(lat, lon, n, q[2 * i],
+                                            q[2 * i + 1], BENCH_RADIUS_KM,
+                                            want);
+        scan           += bench_now() - start;
+        geo_sort(got, tree_n, lat, lon, q[2 * i], q[2 * i + 1]);
+        geo_sort(want, scan_n, lat, lon, q[2 * i], q[2 * i + 1]);
+        if (tree_n != scan_n ||
+            memcmp(got, want, tree_n * sizeof(uint32_t)) != 0) {
+            mismatched++;
+        }
+        found += tree_n;
+    }
+    printf("within:  %8.2f us per query, scan %8.2f us, %.0fx faster "
+           "(%.1f cities within %.0f km on average)\n",
+           tree / queries * 1e6, scan / queries * 1e6, scan / tree,
+           (double)found / queries, BENCH_RADIUS_KM);
+    if (mismatched) {
+        printf("%u queries disagreed with the scan\n", mismatched);
+    }
+
+    geo_free(&geo);
+    free(lat);
+    free(lon);
+    free(q);
+    free(got);
+    free(want);
+    return mismatched ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+bench_random_point() picks a point uniformly on the sphere: sin(lat) is
+uniform, not lat, or the poles would be crowded.
+*/
+void bench_random_point(double* out_lat, double* out_lon) {
+    double z = 2.0 * rand() / RAND_MAX - 1.0;
+    *out_lat = asin(z) * 180.0 / 3.14159265358979323846;
+    *out_lon = 360.0 * rand() / RAND_MAX - 180.0;
+}
+
+/*
+bench_scan_nearest() is the brute-force nearest city: haversine to every
+city, what the index has to beat.
+*/
+uint32_t bench_scan_nearest(const double* lat, const double* lon, uint32_t n,
+                            double q_lat, double q_lon) {
+    uint32_t best   = 0;
+    double   best_d = HUGE_VAL;
+    for (uint32_t i = 0; i < n; i++) {
+        double d = geo_distance_km(q_lat, q_lon, lat[i], lon[i]);
+        if (d < best_d) {
+            best   = i;
+            best_d = d;
+        }
+    }
+    return best;
+}
+
+size_t bench_scan_within(const double* lat, const double* lon, uint32_t n,
+                         double q_lat, double q_lon, double km,
+                         uint32_t* out_ids) {
+    size_t found = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (geo_distance_km(q_lat, q_lon, lat[i], lon[i]) <= km) {
+            out_ids[found++] = i;
+        }
+    }
+    return found;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,102 @@
+/*
+    grid.c reports how many upstream requests the weather model cells
+    save on a dense set of cities: POINTS places spread over Skåne
+    (about 110 x 130 km, close to the number of named localities there).
+    Without cells every city is one request, with them every cell is one.
+    The cell sizes tried are those of common forecast models.
+
+    Usage: grid [POINTS]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "city.h"
+#include "grid.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_POINTS 2000
+#define BENCH_LAT_MIN 55.35
+#define BENCH_LAT_MAX 56.45
+#define BENCH_LON_MIN 12.45
+#define BENCH_LON_MAX 14.55
+
+/* ----- Grids to try ----- */
+typedef struct {
+    double      deg;
+    const char* model;
+} bench_grid_t;
+
+static const bench_grid_t bench_grids[] = {
+    {0.0, "none, a request per city"},
+    {0.01, "1 km, e.g. MET Nordic"},
+    {0.0625, "7 km, e.g. ICON-EU"},
+    {GRID_CELL_DEG, "GRID_CELL_DEG"},
+    {0.25, "25 km, e.g. GFS"},
+};
+
+/* ----- PRIVATE FUNCTIONS ----- */
+double bench_now(void);
+
+int main(int argc, char** argv) {
+    uint32_t n = argc > 1 ? (uint32_t)atol(argv[1]) : BENCH_POINTS;
+    if (n == 0) {
+        fprintf(stderr, "Usage: %s [POINTS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    double* lat = malloc(n * sizeof(double));
+    double* lon = malloc(n * sizeof(double));
+    if (!lat || !lon) {
+        printf("Malloc failed\n");
+        return EXIT_FAILURE;
+    }
+    srand(1);
+    for (uint32_t i = 0; i < n; i++) {
+        lat[i] = BENCH_LAT_MIN +
+                 (BENCH_LAT_MAX - BENCH_LAT_MIN) * rand() / RAND_MAX;
+        lon[i] = BENCH_LON_MIN +
+                 (BENCH_LON_MAX - BENCH_LON_MIN) * rand() / RAND_MAX;
+    }
+
+    printf("%u cities in %.2f-%.2f N, %.2f-%.2f E\n", n, BENCH_LAT_MIN,
+           BENCH_LAT_MAX, BENCH_LON_MIN, BENCH_LON_MAX);
+    printf("%-8s %9s %10s %12s  %s\n", "cell deg", "requests", "saved",
+           "insert ns", "grid");
+    int status = EXIT_SUCCESS;
+    for (size_t g = 0; g < sizeof(bench_grids) / sizeof(bench_grids[0]);
+         g++) {
+        grid_t grid;
+        grid_init(&grid, bench_grids[g].deg);
+        double start = bench_now();
+        for (uint32_t i = 0; i < n; i++) {
+            if (grid_insert(&grid, i, lat[i], lon[i]) != STATUS_OK) {
+                status = EXIT_FAILURE;
+            }
+        }
+        double spent = bench_now() - start;
+
+        /*Every cell is fetched once, as its first city*/
+        uint32_t requests = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            if (grid_first(&grid, i) == i) {
+                requests++;
+            }
+        }
+        printf("%-8.4g %9u %9.1f%% %12.1f  %s\n", bench_grids[g].deg,
+               requests, 100.0 * (n - requests) / n, spent / n * 1e9,
+               bench_grids[g].model);
+        grid_free(&grid);
+    }
+
+    free(lat);
+    free(lon);
+    return status;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
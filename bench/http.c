@@ -0,0 +1,181 @@
+/*
+    http.c counts the connections and TLS handshakes behind REQUESTS GETs
+    of URL, and times them:
+    - one handle each: a new easy handle per request with nothing shared,
+      as every request was made before the HTTP context
+    - context:         http_get_url() on one thread, through the handle
+      pool and the share of an HTTP context
+    - context, N:      the same from THREADS threads at once, so as many
+      connections are opened at first and TLS sessions can be resumed
+
+    URL defaults to Open-Meteo. To run offline, point it at a local
+    server; for TLS put one that keeps connections open behind a
+    self-signed certificate, and name that in ETHERSKIES_CA_FILE (see the
+    README). Every request has to succeed.
+
+    Usage: http [URL] [REQUESTS] [THREADS]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "HTTP.h"
+#include "city.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_URL                                                             \
+    "https://api.open-meteo.com/v1/forecast?latitude=59.33&longitude=18.07" \
+    "&current=temperature_2m,relative_humidity_2m,wind_speed_10m"
+#define BENCH_REQUESTS 200
+#define BENCH_THREADS 8
+
+/* ----- Struct for one thread of requests ----- */
+typedef struct {
+    http_ctx_t* http;
+    const char* url;
+    unsigned    requests;
+    unsigned    failed;
+} bench_job_t;
+
+/* ----- PRIVATE FUNCTIONS ----- */
+double bench_now(void);
+size_t bench_sink(void* buffer, size_t size, size_t nmemb, void* userp);
+void*  bench_context(void* userp);
+int    bench_alone(http_ctx_t* stats, const char* url, unsigned requests);
+void   bench_print(FILE* out, const char* mode, const http_ctx_t* http,
+                   double secs);
+
+int main(int argc, char** argv) {
+    const char* url      = argc > 1 ? argv[1] : BENCH_URL;
+    unsigned    requests = argc > 2 ? (unsigned)atoi(argv[2]) : BENCH_REQUESTS;
+    unsigned    threads  = argc > 3 ? (unsigned)atoi(argv[3]) : BENCH_THREADS;
+    if (requests == 0 || threads == 0 || threads > requests) {
+        fprintf(stderr, "Usage: %s [URL] [REQUESTS] [THREADS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /*The library talks on stdout, the results go to the real one*/
+    fflush(stdout);
+    FILE* out  = fdopen(dup(STDOUT_FILENO), "w");
+    int   null = open("/dev/null", O_WRONLY);
+    if (!out || null < 0 || dup2(null, STDOUT_FILENO) < 0) {
+        perror("stdout");
+        return EXIT_FAILURE;
+    }
+    close(null);
+
+    fprintf(out, "%u GETs of %s\n", requests, url);
+    fprintf(out, "%-16s %10s %12s %12s %10s %12s\n", "mode", "requests",
+            "connections", "handshakes", "ms each", "connect ms");
+    int status = EXIT_SUCCESS;
+
+    http_ctx_t* http = NULL;
+    if (http_init(&http) != STATUS_OK) {
+        return EXIT_FAILURE;
+    }
+    double start = bench_now();
+    if (bench_alone(http, url, requests) != STATUS_OK) {
+        status = EXIT_FAILURE;
+    }
+    bench_print(out, "one handle each", http, bench_now() - start);
+    http_dispose(&http);
+
+    for (int round = 0; round < 2 && status == EXIT_SUCCESS; round++) {
+        unsigned n = round == 0 ? 1 : threads;
+        if (http_init(&http) != STATUS_OK) {
+            return EXIT_FAILURE;
+        }
+        pthread_t   tids[n];
+        bench_job_t jobs[n];
+        start = bench_now();
+        for (unsigned t = 0; t < n; t++) {
+            jobs[t] = (bench_job_t){http, url, requests / n, 0};
+            if (t < requests % n) {
+                jobs[t].requests++;
+            }
+            pthread_create(&tids[t], NULL, bench_context, &jobs[t]);
+        }
+        for (unsigned t = 0; t < n; t++) {
+            pthread_join(tids[t], NULL);
+            if (jobs[t].failed > 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+        char mode[32];
+        snprintf(mode, sizeof(mode), n == 1 ? "context" : "context, %u", n);
+        bench_print(out, mode, http, bench_now() - start);
+        http_dispose(&http);
+    }
+    if (status != EXIT_SUCCESS) {
+        fprintf(out, "Not every request succeeded\n");
+    }
+    fclose(out);
+    return status;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+size_t bench_sink(void* buffer, size_t size, size_t nmemb, void* userp) {
+    (void)buffer;
+    (void)userp;
+    return size * nmemb;
+}
+
+/*
+bench_alone() makes the requests the way they were made before the
+context, each on a handle of its own. Only the counters of stats are
+used.
+*/
+int bench_alone(http_ctx_t* stats, const char* url, unsigned requests) {
+    for (unsigned i = 0; i < requests; i++) {
+        CURL* curl = curl_easy_init();
+        if (!curl) {
+            return STATUS_FAIL;
+        }
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, bench_sink);
+        if (getenv(HTTP_CA_ENV)) {
+            curl_easy_setopt(curl, CURLOPT_CAINFO, getenv(HTTP_CA_ENV));
+        }
+        CURLcode res = curl_easy_perform(curl);
+        http_stats_add(stats, curl);
+        curl_easy_cleanup(curl);
+        if (res != CURLE_OK) {
+            fprintf(stderr, "%s\n", curl_easy_strerror(res));
+            return STATUS_FAIL;
+        }
+    }
+    return STATUS_OK;
+}
+
+void* bench_context(void* userp) {
+    bench_job_t* job = userp;
+    for (unsigned i = 0; i < job->requests; i++) {
+        http_membuf_t body;
+        if (http_get_url(job->http, job->url, &body) != STATUS_OK) {
+            job->failed++;
+            continue;
+        }
+        http_buf_put(job->http, &body);
+    }
+    return NULL;
+}
+
+void bench_print(FILE* out, const char* mode, const http_ctx_t* http,
+                 double secs) {
+    const http_stats_t* stats = &http->stats;
+    unsigned long       n     = stats->requests ? stats->requests : 1;
+    fprintf(out, "%-16s %10lu %12lu %12lu %10.2f %12.2f\n", mode,
+            stats->requests, stats->connects, stats->handshakes,
+            secs * 1e3 / n, stats->connect_time * 1e3 / n);
+}
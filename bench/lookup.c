@@ -0,0 +1,258 @@
+/*
+    lookup.c times looking a city up by name with the hash index
+    (city_find(), what city_get() tries first) against the strcmp scan
+    city_get() did before: a walk over a doubly-linked list of separately
+    allocated nodes, data and names. The store grows to every size given
+    (1k, 10k and 100k cities by default) and at each size looks up
+    BENCH_QUERIES names that are there and as many that are not, which
+    the scan has to compare with every name. Past BENCH_SCAN_CELLS
+    compares the scan runs on the first queries only.
+
+    The list is built in one go, so its nodes lie closer together than
+    those of a list built while parsing the cache, and the scan is if
+    anything flattered. Both have to find every known name and no other.
+
+    Usage: lookup [CITIES...]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "city.h"
+#include "snapshot.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_QUERIES 10000  /* names looked up per size and kind */
+#define BENCH_SCAN_CELLS 1e8 /* compares, the scan gets fewer queries past */
+#define BENCH_NAME_MAX 64
+
+static const size_t bench_sizes[] = {1000, 10000, 100000};
+
+/* ----- Syllables generated names are made of ----- */
+static const char* bench_syllables[] = {
+    "ba", "ko", "ri", "st", "de", "lu", "mo", "ga", "vi", "ny",
+    "or", "ha", "tu", "be", "le", "sk", "ne", "ro", "by", "as",
+};
+
+/* ----- Struct for the old linked list ----- */
+typedef struct bench_node bench_node_t;
+struct bench_node {
+    bench_node_t* prev;
+    bench_node_t* next;
+    city_data_t*  data;
+};
+
+/* ----- PRIVATE FUNCTIONS ----- */
+double        bench_now(void);
+void          bench_name(size_t i, char* buf, size_t max);
+int           bench_grow(city_list_t* list, bench_node_t** head,
+                         bench_node_t** tail, size_t n);
+bench_node_t* bench_scan(bench_node_t* head, const char* name);
+void          bench_free(bench_node_t* head);
+
+int main(int argc, char** argv) {
+    size_t sizes[16];
+    size_t num_sizes = 0;
+    for (int a = 1; a < argc && num_sizes < 16; a++) {
+        sizes[num_sizes] = (size_t)atol(argv[a]);
+        if (sizes[num_sizes++] == 0) {
+            fprintf(stderr, "Usage: %s [CITIES...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (num_sizes == 0) {
+        num_sizes = sizeof(bench_sizes) / sizeof(bench_sizes[0]);
+        memcpy(sizes, bench_sizes, sizeof(bench_sizes));
+    }
+
+    /*city_init() needs a directory to boot from, and talks on stdout*/
+    const char* tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char        dir[512];
+    snprintf(dir, sizeof(dir), "%s/etherskies-lookup-XXXXXX", tmp);
+    fflush(stdout);
+    FILE* out  = fdopen(dup(STDOUT_FILENO), "w");
+    int   null = open("/dev/null", O_WRONLY);
+    if (!out || null < 0 || dup2(null, STDOUT_FILENO) < 0 || !mkdtemp(dir) ||
+        chdir(dir) != 0) {
+        perror(dir);
+        return EXIT_FAILURE;
+    }
+    close(null);
+
+    city_list_t* list = NULL;
+    if (city_init(&list) != STATUS_OK) {
+        return EXIT_FAILURE;
+    }
+    bench_node_t* head = NULL;
+    bench_node_t* tail = NULL;
+
+    fprintf(out, "%-8s %-8s %12s %12s %10s\n", "cities", "names", "index ns",
+            "scan ns", "speedup");
+    srand(1);
+    int status = EXIT_SUCCESS;
+    for (size_t s = 0; s < num_sizes && status == EXIT_SUCCESS; s++) {
+        size_t n = sizes[s];
+        if (bench_grow(list, &head, &tail, n) != STATUS_OK) {
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        /*The scan is O(n), so at 100k it gets fewer queries*/
+        unsigned scans = BENCH_QUERIES;
+        if ((double)scans * n > BENCH_SCAN_CELLS) {
+            scans = (unsigned)(BENCH_SCAN_CELLS / n) + 1;
+        }
+        for (int known = 1; known >= 0; known--) {
+            char (*names)[BENCH_NAME_MAX] =
+                malloc(BENCH_QUERIES * sizeof(*names));
+            if (!names) {
+                fprintf(out, "Malloc failed\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+            for (unsigned q = 0; q < BENCH_QUERIES; q++) {
+                size_t i = (size_t)rand() % n;
+                if (known) {
+                    snprintf(names[q], BENCH_NAME_MAX, "%s",
+                             list->text[i].name);
+                } else {
+                    bench_name(n + i, names[q], BENCH_NAME_MAX);
+                }
+            }
+
+            unsigned  hits  = 0;
+            city_id_t id    = 0;
+            double    start = bench_now();
+            for (unsigned q = 0; q < BENCH_QUERIES; q++) {
+                hits += city_find(list, names[q], &id) == STATUS_OK;
+            }
+            double index = (bench_now() - start) / BENCH_QUERIES;
+
+            unsigned scan_hits = 0;
+            start              = bench_now();
+            for (unsigned q = 0; q < scans; q++) {
+                scan_hits += bench_scan(head, names[q]) != NULL;
+            }
+            double scan = (bench_now() - start) / scans;
+
+            if (hits != (known ? BENCH_QUERIES : 0) ||
+                scan_hits != (known ? scans : 0)) {
+                fprintf(out, "index found %u of %u names, scan %u of %u\n",
+                        hits, BENCH_QUERIES, scan_hits, scans);
+                status = EXIT_FAILURE;
+            }
+            fprintf(out, "%-8zu %-8s %12.1f %12.1f %9.0fx\n", n,
+                    known ? "known" : "unknown", index * 1e9, scan * 1e9,
+                    scan / index);
+            free(names);
+        }
+    }
+
+    bench_free(head);
+    city_dispose(&list);
+    unlink(CITY_CACHE_LOG_PATH);
+    unlink(SNAPSHOT_PATH);
+    if (chdir("/") != 0 || rmdir(dir) != 0) {
+        fprintf(stderr, "%s was not removed\n", dir);
+    }
+    fclose(out);
+    return status;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+bench_name() spells i in base 20 with two-letter syllables, so every i
+gets a name of its own.
+*/
+void bench_name(size_t i, char* buf, size_t max) {
+    size_t count = sizeof(bench_syllables) / sizeof(bench_syllables[0]);
+    size_t len   = 0;
+    do {
+        len += snprintf(buf + len, max - len, "%s", bench_syllables[i % count]);
+        i /= count;
+    } while ((i > 0 || len < 4) && len + 3 < max);
+    buf[0] = (char)toupper((unsigned char)buf[0]);
+}
+
+/*
+bench_grow() adds generated cities to the store until it holds n, and
+appends a node for every city of the store not yet in the list, so both
+hold the same names in the same order.
+*/
+int bench_grow(city_list_t* list, bench_node_t** head, bench_node_t** tail,
+               size_t n) {
+    char name[BENCH_NAME_MAX];
+    for (size_t i = list->size; i < n; i++) {
+        bench_name(i, name, sizeof(name));
+        city_data_t data = {.name      = name,
+                            .lat       = -60.0 + (double)(i / 2000) * 0.15,
+                            .lon       = -179.9 + (double)(i % 2000) * 0.15,
+                            .temp      = INIT_VAL,
+                            .windspeed = INIT_VAL,
+                            .rel_hum   = INIT_VAL};
+        if (city_add(list, &data, NULL) != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+    }
+
+    size_t have = 0;
+    for (bench_node_t* node = *tail; node; node = node->prev) {
+        have++;
+    }
+    for (size_t i = have; i < list->size; i++) {
+        bench_node_t* node = calloc(1, sizeof(bench_node_t));
+        city_data_t*  data = calloc(1, sizeof(city_data_t));
+        char*         copy = malloc(strlen(list->text[i].name) + 1);
+        if (!node || !data || !copy) {
+            printf("Malloc failed\n");
+            free(node);
+            free(data);
+            free(copy);
+            return STATUS_FAIL;
+        }
+        strcpy(copy, list->text[i].name);
+        data->name = copy;
+        node->data = data;
+        node->prev = *tail;
+        if (*tail) {
+            (*tail)->next = node;
+        } else {
+            *head = node; /* return through out-ptr */
+        }
+        *tail = node; /* return through out-ptr */
+    }
+    return STATUS_OK;
+}
+
+/*
+bench_scan() is the lookup city_get() did before the index.
+*/
+bench_node_t* bench_scan(bench_node_t* head, const char* name) {
+    for (bench_node_t* node = head; node; node = node->next) {
+        if (strcmp(node->data->name, name) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+void bench_free(bench_node_t* head) {
+    while (head) {
+        bench_node_t* next = head->next;
+        free(head->data->name);
+        free(head->data);
+        free(head);
+        head = next;
+    }
+}
@@ -0,0 +1,163 @@
+/*
+    parse.c benchmarks parsing of forecast responses:
+    - streaming, with jstream fed in curl sized chunks
+    - buffered, with jansson through http_json_parse_batch()
+
+    Every payload given on the command line is parsed by both for about
+    BENCH_SECONDS each, and the throughput is printed in MB/s.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "HTTP.h"
+#include "city.h"
+#include "jstream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_SECONDS 0.5
+#define BENCH_CHUNK 16384 /* CURL_MAX_WRITE_SIZE, the most curl hands over */
+
+/* ----- PRIVATE FUNCTIONS ----- */
+char*  bench_read(const char* path, size_t* out_len);
+size_t bench_count(const char* body);
+double bench_now(void);
+int    bench_stream(const char* body, size_t len, city_list_t* list,
+                    const city_id_t* ids, size_t n);
+int    bench_jansson(const char* body, size_t len, city_list_t* list,
+                     const city_id_t* ids, size_t n);
+
+typedef int (*bench_fn)(const char* body, size_t len, city_list_t* list,
+                        const city_id_t* ids, size_t n);
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s payload.json...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /*Only the weather columns are written by either parser*/
+    static double    temp[HTTP_BATCH_MAX];
+    static double    windspeed[HTTP_BATCH_MAX];
+    static double    rel_hum[HTTP_BATCH_MAX];
+    static city_id_t ids[HTTP_BATCH_MAX];
+    city_list_t      list;
+    memset(&list, 0, sizeof(list));
+    list.size      = HTTP_BATCH_MAX;
+    list.temp      = temp;
+    list.windspeed = windspeed;
+    list.rel_hum   = rel_hum;
+    for (city_id_t id = 0; id < HTTP_BATCH_MAX; id++) {
+        ids[id] = id;
+    }
+
+    const char* names[] = {"stream", "jansson"};
+    bench_fn    fns[]   = {bench_stream, bench_jansson};
+    int         status  = EXIT_SUCCESS;
+    for (int a = 1; a < argc; a++) {
+        size_t len  = 0;
+        char*  body = bench_read(argv[a], &len);
+        if (!body) {
+            status = EXIT_FAILURE;
+            continue;
+        }
+        size_t n = bench_count(body);
+
+        for (int f = 0; f < 2; f++) {
+            if (fns[f](body, len, &list, ids, n) != STATUS_OK) {
+                fprintf(stderr, "%s: %s failed to parse\n", argv[a], names[f]);
+                status = EXIT_FAILURE;
+                continue;
+            }
+            unsigned long runs  = 0;
+            double        start = bench_now();
+            double        spent = 0.0;
+            do {
+                fns[f](body, len, &list, ids, n);
+                runs++;
+                spent = bench_now() - start;
+            } while (spent < BENCH_SECONDS);
+            printf("%-32s %3zu locations %7s %9.1f MB/s %9.2f us/response\n",
+                   argv[a], n, names[f], len * runs / spent / 1e6,
+                   spent * 1e6 / runs);
+        }
+        free(body);
+    }
+    return status;
+}
+
+char* bench_read(const char* path, size_t* out_len) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* body = len >= 0 ? malloc(len + 1) : NULL;
+    if (!body || fread(body, 1, len, f) != (size_t)len) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        free(body);
+        fclose(f);
+        return NULL;
+    }
+    body[len] = '\0';
+    fclose(f);
+
+    *out_len = len; /* return through out-ptr */
+    return body;
+}
+
+/*
+bench_count() tells how many locations a payload holds, which is what the
+request for it would have asked for.
+*/
+size_t bench_count(const char* body) {
+    size_t n = 0;
+    for (const char* p = body; (p = strstr(p, "\"current\":{")); p++) {
+        n++;
+    }
+    return n > HTTP_BATCH_MAX ? HTTP_BATCH_MAX : n;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+bench_stream() parses the way http_get_current() does, one curl chunk at
+a time.
+*/
+int bench_stream(const char* body, size_t len, city_list_t* list,
+                 const city_id_t* ids, size_t n) {
+    city_data_t rows[HTTP_BATCH_MAX];
+    jstream_t   parser;
+    http_stream_start(&parser, rows, n);
+    for (size_t off = 0; off < len; off += BENCH_CHUNK) {
+        size_t chunk = len - off < BENCH_CHUNK ? len - off : BENCH_CHUNK;
+        if (jstream_feed(&parser, body + off, chunk) != STATUS_OK) {
+            break;
+        }
+    }
+    if (jstream_finish(&parser) != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+    http_stream_apply(list, rows, ids, n);
+    return STATUS_OK;
+}
+
+/*
+bench_jansson() parses the buffered body; the buffering itself is not
+counted.
+*/
+int bench_jansson(const char* body, size_t len, city_list_t* list,
+                  const city_id_t* ids, size_t n) {
+    (void)len;
+    return http_json_parse_batch((char*)body, list, ids, n);
+}
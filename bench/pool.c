@@ -0,0 +1,239 @@
+/*
+    pool.c times booting a cache directory of FILES JSON files (one per
+    city, as with CITY_CACHE_LOG 0) on boot pools of 1 to THREADS
+    threads. Every item is read with bulkio_read() and parsed, as
+    city_load_item() does without io_uring, and the rows are then merged
+    in item order on the calling thread, as city_load_all() does. Cold
+    runs first drop the files from the page cache with posix_fadvise(),
+    so the data comes from the disk; their inodes stay cached.
+
+    THREADS defaults to one per online core (what CITY_BOOT_THREADS 0
+    picks); more than that shows what oversubscribing costs.
+
+    Usage: pool [FILES] [THREADS]
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "bulkio.h"
+#include "city.h"
+#include "jansson.h"
+#include "pool.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_FILES 50000 /* files in the generated cache directory */
+#define BENCH_ROUNDS 3    /* runs per cell, the median is shown */
+#define BENCH_TEXT_MAX 256
+
+/* ----- Struct for one parsed file ----- */
+typedef struct {
+    double lat;
+    double lon;
+    double temp;
+    bool   parsed;
+} bench_row_t;
+
+/* ----- Struct for one boot ----- */
+typedef struct {
+    bulkio_file_t* files;
+    bench_row_t*   rows;
+    double         sum; /* of the merged rows, so the merge is not skipped */
+} bench_load_t;
+
+/* ----- PRIVATE FUNCTIONS ----- */
+double bench_now(void);
+int    bench_cmp(const void* a, const void* b);
+int    bench_fill(const char* dir, bulkio_file_t* files, size_t n);
+void   bench_evict(bulkio_file_t* files, size_t n);
+double bench_boot(pool_t* pool, bench_load_t* load, size_t n, bool cold);
+void   bench_item(size_t i, void* userp);
+double bench_median(double* runs);
+
+int main(int argc, char** argv) {
+    size_t   n   = argc > 1 ? (size_t)atol(argv[1]) : BENCH_FILES;
+    unsigned max = argc > 2 ? (unsigned)atoi(argv[2])
+                            : pool_default_threads();
+    if (n == 0 || max == 0) {
+        fprintf(stderr, "Usage: %s [FILES] [THREADS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char* tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char        dir[512];
+    snprintf(dir, sizeof(dir), "%s/etherskies-pool-XXXXXX", tmp);
+    bench_load_t load;
+    load.files = calloc(n, sizeof(bulkio_file_t));
+    load.rows  = malloc(n * sizeof(bench_row_t));
+    if (!load.files || !load.rows) {
+        printf("Malloc failed\n");
+        return EXIT_FAILURE;
+    }
+    if (!mkdtemp(dir)) {
+        perror(dir);
+        return EXIT_FAILURE;
+    }
+
+    int status = bench_fill(dir, load.files, n);
+    sync(); /* dirty pages cannot be dropped */
+    printf("%zu files, %u online cores\n", n, pool_default_threads());
+    printf("%-8s %10s %8s %10s %8s\n", "threads", "cold ms", "speedup",
+           "warm ms", "speedup");
+    double base_cold = 0.0;
+    double base_warm = 0.0;
+    for (unsigned t = 1; t <= max && status == STATUS_OK; t++) {
+        pool_t* pool = NULL;
+        if (pool_create(&pool, t) != STATUS_OK) {
+            status = STATUS_FAIL;
+            break;
+        }
+        double cold[BENCH_ROUNDS];
+        double warm[BENCH_ROUNDS];
+        for (int r = 0; r < BENCH_ROUNDS; r++) {
+            cold[r] = bench_boot(pool, &load, n, true);
+            warm[r] = bench_boot(pool, &load, n, false);
+        }
+        pool_dispose(&pool);
+        for (size_t i = 0; i < n; i++) {
+            if (!load.rows[i].parsed) {
+                printf("%s could not be parsed\n", load.files[i].path);
+                status = STATUS_FAIL;
+                break;
+            }
+        }
+
+        double c = bench_median(cold);
+        double w = bench_median(warm);
+        if (t == 1) {
+            base_cold = c;
+            base_warm = w;
+        }
+        printf("%-8u %10.1f %7.2fx %10.1f %7.2fx\n", t, c * 1e3,
+               base_cold / c, w * 1e3, base_warm / w);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (load.files[i].path) {
+            unlink(load.files[i].path);
+            free((char*)load.files[i].path);
+        }
+    }
+    rmdir(dir);
+    free(load.files);
+    free(load.rows);
+    return status == STATUS_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int bench_cmp(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+double bench_median(double* runs) {
+    qsort(runs, BENCH_ROUNDS, sizeof(double), bench_cmp);
+    return runs[BENCH_ROUNDS / 2];
+}
+
+/*
+bench_fill() writes n cache files laid out the way city_write_files()
+writes them.
+*/
+int bench_fill(const char* dir, bulkio_file_t* files, size_t n) {
+    char text[BENCH_TEXT_MAX];
+    for (size_t i = 0; i < n; i++) {
+        char* path = malloc(strlen(dir) + 32);
+        if (!path) {
+            printf("Malloc failed\n");
+            return STATUS_FAIL;
+        }
+        sprintf(path, "%s/City%zu.json", dir, i);
+        files[i].path = path;
+
+        double lat = 55.0 + (double)(i % 1500) / 100.0;
+        double lon = 11.0 + (double)(i / 1500 % 1300) / 100.0;
+        snprintf(text, sizeof(text),
+                 "{\n    \"name\": \"City%zu\",\n"
+                 "    \"fp\": \"./cities/City%zu_%.2f_%.2f.json\",\n"
+                 "    \"lat\": %.15f,\n    \"lon\": %.15f,\n"
+                 "    \"temp\": %.1f,\n    \"windspeed\": %.1f,\n"
+                 "    \"rel_hum\": %.1f,\n    \"cached_at\": %ld\n}",
+                 i, i, lat, lon, lat, lon, (double)(i % 40) - 10.0,
+                 (double)(i % 15), (double)(i % 100), (long)time(NULL));
+        FILE* f = fopen(path, "w");
+        if (!f || fputs(text, f) == EOF || fclose(f) != 0) {
+            perror(path);
+            return STATUS_FAIL;
+        }
+    }
+    return STATUS_OK;
+}
+
+void bench_evict(bulkio_file_t* files, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int fd = open(files[i].path, O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+/*
+bench_boot() reads and parses the first n files on the pool, merges the
+rows in order and returns the seconds it took.
+*/
+double bench_boot(pool_t* pool, bench_load_t* load, size_t n, bool cold) {
+    for (size_t i = 0; i < n; i++) {
+        load->files[i].data  = NULL;
+        load->files[i].error = 0;
+    }
+    memset(load->rows, 0, n * sizeof(bench_row_t));
+    if (cold) {
+        bench_evict(load->files, n);
+    }
+
+    double start = bench_now();
+    pool_run(pool, n, bench_item, load);
+    load->sum = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        if (load->rows[i].parsed) {
+            load->sum += load->rows[i].lat + load->rows[i].lon +
+                         load->rows[i].temp;
+        }
+    }
+    return bench_now() - start;
+}
+
+void bench_item(size_t i, void* userp) {
+    bench_load_t*  load = userp;
+    bulkio_file_t* file = &load->files[i];
+    json_error_t   error;
+    json_t*        root = NULL;
+    bulkio_read(NULL, file, 1);
+    if (file->data) {
+        root = json_loadb(file->data, file->len, 0, &error);
+        free(file->data);
+        file->data = NULL;
+    }
+    json_t* jlat  = json_object_get(root, "lat");
+    json_t* jlon  = json_object_get(root, "lon");
+    json_t* jtemp = json_object_get(root, "temp");
+    if (json_is_number(jlat) && json_is_number(jlon)) {
+        load->rows[i].lat    = json_number_value(jlat);
+        load->rows[i].lon    = json_number_value(jlon);
+        load->rows[i].temp   = jtemp ? json_number_value(jtemp) : INIT_VAL;
+        load->rows[i].parsed = true;
+    }
+    json_decref(root);
+}
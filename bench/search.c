@@ -0,0 +1,267 @@
+/*
+    search.c times the name search over POINTS made-up city names, built
+    from syllables with and without diacritics so that folding matters.
+    Every query is a name that is cut short (prefix), has one random
+    edit (fuzzy) or both (suggest, what city_get() runs). Some fuzzy
+    queries are also answered by comparing them with every folded name,
+    to check the trie finds as many names and to show what it saves.
+
+    Usage: search [POINTS]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "city.h"
+#include "search.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_POINTS 100000
+#define BENCH_QUERIES 10000
+#define BENCH_SCANS 100     /* queries also answered by the full scan */
+#define BENCH_P99_MAX 1e-3 /* seconds a query may take, 99th percentile */
+#define BENCH_NAME_MAX 64
+
+/* ----- Syllables names are made of ----- */
+static const char* bench_syllables[] = {
+    "bo",  "rå",  "ki",  "sta", "dé",  "lun", "mö",  "ga",  "vik", "ny",
+    "ør",  "hav", "tü",  "ber", "lé",  "ska", "ñe",  "ro",  "by",  "ås",
+    "fel", "zá",  "mar", "çe",  "hol", "ti",  "ün",  "pra", "gö",  "sen",
+};
+
+static const char* bench_modes[] = {"prefix", "fuzzy", "suggest"};
+
+/* ----- PRIVATE FUNCTIONS ----- */
+double   bench_now(void);
+int      bench_cmp(const void* a, const void* b);
+void     bench_name(char* buf, size_t max);
+void     bench_edit(const char* name, char* out, size_t max);
+void     bench_cut(char* query);
+unsigned bench_dist(const uint32_t* a, size_t a_len, const uint32_t* b,
+                    size_t b_len);
+
+int main(int argc, char** argv) {
+    uint32_t n = argc > 1 ? (uint32_t)atol(argv[1]) : BENCH_POINTS;
+    if (n == 0) {
+        fprintf(stderr, "Usage: %s [POINTS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    char (*names)[BENCH_NAME_MAX]   = malloc(n * sizeof(*names));
+    uint32_t(*keys)[SEARCH_KEY_MAX] = malloc(n * sizeof(*keys));
+    size_t* key_len                 = malloc(n * sizeof(size_t));
+    double* times                   = malloc(BENCH_QUERIES * sizeof(double));
+    if (!names || !keys || !key_len || !times) {
+        printf("Malloc failed\n");
+        return EXIT_FAILURE;
+    }
+    srand(1);
+    for (uint32_t i = 0; i < n; i++) {
+        bench_name(names[i], BENCH_NAME_MAX);
+        key_len[i] = search_fold(names[i], keys[i], SEARCH_KEY_MAX);
+    }
+
+    search_t search;
+    memset(&search, 0, sizeof(search_t));
+    double start = bench_now();
+    for (uint32_t i = 0; i < n; i++) {
+        if (search_insert(&search, i, names[i]) != STATUS_OK) {
+            printf("Insert failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    printf("%u names, trie of %u nodes built in %.1f ms\n", n, search.size,
+           (bench_now() - start) * 1e3);
+
+    printf("%-8s %10s %10s %10s %8s\n", "query", "mean us", "p99 us",
+           "max us", "hits");
+    int status = EXIT_SUCCESS;
+    for (int mode = 0; mode < 3; mode++) {
+        double total = 0.0;
+        size_t found = 0;
+        for (int q = 0; q < BENCH_QUERIES; q++) {
+            char         query[BENCH_NAME_MAX];
+            search_hit_t hits[SEARCH_HITS_MAX];
+            const char*  name = names[rand() % n];
+            if (mode == 0) {
+                snprintf(query, sizeof(query), "%s", name);
+            } else {
+                bench_edit(name, query, sizeof(query));
+            }
+            if (mode != 1) {
+                bench_cut(query);
+            }
+
+            double t = bench_now();
+            size_t got;
+            if (mode == 0) {
+                got = search_prefix(&search, query, hits, SEARCH_HITS_MAX);
+            } else if (mode == 1) {
+                got = search_fuzzy(&search, query, 1, hits, SEARCH_HITS_MAX);
+            } else {
+                got = search_suggest(&search, query, hits, SEARCH_HITS_MAX);
+            }
+            times[q] = bench_now() - t;
+            total += times[q];
+            found += got > 0;
+        }
+        qsort(times, BENCH_QUERIES, sizeof(double), bench_cmp);
+        double p99 = times[BENCH_QUERIES * 99 / 100];
+        printf("%-8s %10.2f %10.2f %10.2f %7.1f%%\n", bench_modes[mode],
+               total / BENCH_QUERIES * 1e6, p99 * 1e6,
+               times[BENCH_QUERIES - 1] * 1e6, 100.0 * found / BENCH_QUERIES);
+        if (p99 > BENCH_P99_MAX) {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    /*The full scan gets the names folded beforehand, the trie no help*/
+    double trie_time = 0.0;
+    double scan_time = 0.0;
+    int    mismatch  = 0;
+    for (int q = 0; q < BENCH_SCANS; q++) {
+        char         query[BENCH_NAME_MAX];
+        uint32_t     qkey[SEARCH_KEY_MAX];
+        search_hit_t hits[SEARCH_HITS_MAX];
+        bench_edit(names[rand() % n], query, sizeof(query));
+        size_t qlen = search_fold(query, qkey, SEARCH_KEY_MAX);
+
+        double t   = bench_now();
+        size_t got = search_fuzzy(&search, query, 1, hits, SEARCH_HITS_MAX);
+        trie_time += bench_now() - t;
+
+        t              = bench_now();
+        size_t matches = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            matches += bench_dist(qkey, qlen, keys[i], key_len[i]) <= 1;
+        }
+        scan_time += bench_now() - t;
+
+        size_t want = matches < SEARCH_HITS_MAX ? matches : SEARCH_HITS_MAX;
+        if (got != want) {
+            mismatch++;
+        }
+    }
+    printf("fuzzy, trie %.2f us, full scan %.2f us per query\n",
+           trie_time / BENCH_SCANS * 1e6, scan_time / BENCH_SCANS * 1e6);
+    if (mismatch) {
+        printf("%d of %d queries found a different number of names\n",
+               mismatch, BENCH_SCANS);
+        status = EXIT_FAILURE;
+    }
+
+    search_free(&search);
+    free(names);
+    free(keys);
+    free(key_len);
+    free(times);
+    return status;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int bench_cmp(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+bench_name() strings two to four syllables together, capitalising the
+first letter when it is ASCII.
+*/
+void bench_name(char* buf, size_t max) {
+    size_t count = sizeof(bench_syllables) / sizeof(bench_syllables[0]);
+    int    parts = 2 + rand() % 3;
+    buf[0]       = '\0';
+    for (int i = 0; i < parts; i++) {
+        strncat(buf, bench_syllables[rand() % count], max - strlen(buf) - 1);
+    }
+    if (buf[0] >= 'a' && buf[0] <= 'z') {
+        buf[0] -= 'a' - 'A';
+    }
+}
+
+/*
+bench_edit() copies name with one ASCII letter dropped, doubled, swapped
+with the next one or replaced.
+*/
+void bench_edit(const char* name, char* out, size_t max) {
+    size_t len = strlen(name);
+    size_t at  = (size_t)rand() % len;
+    while ((unsigned char)name[at] >= 0x80) {
+        at = (size_t)rand() % len; /* every syllable has an ASCII letter */
+    }
+    snprintf(out, max, "%s", name);
+    switch (rand() % 4) {
+    case 0:
+        memmove(out + at, out + at + 1, len - at);
+        break;
+    case 1:
+        if (len + 1 < max) {
+            memmove(out + at + 1, out + at, len - at + 1);
+        }
+        break;
+    case 2:
+        if (at + 1 < len && (unsigned char)out[at + 1] < 0x80) {
+            char swap   = out[at];
+            out[at]     = out[at + 1];
+            out[at + 1] = swap;
+        }
+        break;
+    default:
+        out[at] = 'a' + rand() % 26;
+        break;
+    }
+}
+
+/*
+bench_cut() keeps a little more than the first half of query, never
+cutting a character in two.
+*/
+void bench_cut(char* query) {
+    size_t len = strlen(query);
+    size_t cut = len / 2 + 1;
+    while (cut < len && (query[cut] & 0xC0) == 0x80) {
+        cut++;
+    }
+    query[cut] = '\0';
+}
+
+/*
+bench_dist() is the textbook edit distance with swapped letters, the way
+the full scan has to compute it for every key.
+*/
+unsigned bench_dist(const uint32_t* a, size_t a_len, const uint32_t* b,
+                    size_t b_len) {
+    unsigned d[SEARCH_KEY_MAX + 1][SEARCH_KEY_MAX + 1];
+    for (size_t i = 0; i <= a_len; i++) {
+        d[i][0] = (unsigned)i;
+    }
+    for (size_t j = 0; j <= b_len; j++) {
+        d[0][j] = (unsigned)j;
+    }
+    for (size_t i = 1; i <= a_len; i++) {
+        for (size_t j = 1; j <= b_len; j++) {
+            unsigned best = d[i - 1][j - 1] + (a[i - 1] != b[j - 1]);
+            if (d[i - 1][j] + 1 < best) {
+                best = d[i - 1][j] + 1;
+            }
+            if (d[i][j - 1] + 1 < best) {
+                best = d[i][j - 1] + 1;
+            }
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] &&
+                a[i - 2] == b[j - 1] && d[i - 2][j - 2] + 1 < best) {
+                best = d[i - 2][j - 2] + 1;
+            }
+            d[i][j] = best;
+        }
+    }
+    return d[a_len][b_len];
+}
@@ -0,0 +1,204 @@
+/*
+    startup.c times city_init() on made-up caches of 1k, 10k and 100k
+    cities (or the sizes given), booting:
+    - snapshot: from the snapshot written at the last exit, mapped and
+      used in place (city_read_snapshot())
+    - log:      from the cache log, every record parsed, as when the
+      snapshot is missing or stale (city_read_cache())
+    The files are warm in the page cache. Every boot has to come up with
+    all the cities.
+
+    Usage: startup [CITIES...]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "city.h"
+#include "snapshot.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_ROUNDS 5 /* boots per cell, the median is shown */
+#define BENCH_NAME_MAX 64
+
+static const size_t bench_sizes[] = {1000, 10000, 100000};
+
+/* ----- Syllables generated names are made of ----- */
+static const char* bench_syllables[] = {
+    "ba", "ko", "ri", "st", "de", "lu", "mo", "ga", "vi", "ny",
+    "or", "ha", "tu", "be", "le", "sk", "ne", "ro", "by", "as",
+};
+
+/* ----- PRIVATE FUNCTIONS ----- */
+double bench_now(void);
+int    bench_cmp(const void* a, const void* b);
+void   bench_name(size_t i, char* buf, size_t max);
+int    bench_dataset(size_t n);
+double bench_boot(size_t n, bool from_log);
+
+int main(int argc, char** argv) {
+    size_t sizes[16];
+    size_t num_sizes = 0;
+    for (int a = 1; a < argc && num_sizes < 16; a++) {
+        sizes[num_sizes] = (size_t)atol(argv[a]);
+        if (sizes[num_sizes++] == 0) {
+            fprintf(stderr, "Usage: %s [CITIES...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (num_sizes == 0) {
+        num_sizes = sizeof(bench_sizes) / sizeof(bench_sizes[0]);
+        memcpy(sizes, bench_sizes, sizeof(bench_sizes));
+    }
+
+    /*city_init() talks on stdout, the results go to the real one*/
+    fflush(stdout);
+    FILE* out  = fdopen(dup(STDOUT_FILENO), "w");
+    int   null = open("/dev/null", O_WRONLY);
+    if (!out || null < 0 || dup2(null, STDOUT_FILENO) < 0) {
+        perror("stdout");
+        return EXIT_FAILURE;
+    }
+    close(null);
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("getcwd");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(out, "%-8s %14s %14s %10s\n", "cities", "snapshot ms", "log ms",
+            "speedup");
+    int status = EXIT_SUCCESS;
+    for (size_t s = 0; s < num_sizes && status == EXIT_SUCCESS; s++) {
+        const char* tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+        char        dir[512];
+        snprintf(dir, sizeof(dir), "%s/etherskies-startup-XXXXXX", tmp);
+        if (!mkdtemp(dir) || chdir(dir) != 0) {
+            perror(dir);
+            return EXIT_FAILURE;
+        }
+
+        double snap = -1.0;
+        double log  = -1.0;
+        if (bench_dataset(sizes[s]) == STATUS_OK) {
+            snap = bench_boot(sizes[s], false);
+            log  = bench_boot(sizes[s], true);
+        }
+        if (snap < 0 || log < 0) {
+            fprintf(out, "Boot failed at %zu cities\n", sizes[s]);
+            status = EXIT_FAILURE;
+        } else {
+            fprintf(out, "%-8zu %14.2f %14.2f %9.0fx\n", sizes[s], snap * 1e3,
+                    log * 1e3, log / snap);
+        }
+        unlink(CITY_CACHE_LOG_PATH);
+        unlink(SNAPSHOT_PATH);
+        if (chdir(cwd) != 0 || rmdir(dir) != 0) {
+            fprintf(stderr, "%s was not removed\n", dir);
+        }
+    }
+    fclose(out);
+    return status;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int bench_cmp(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+bench_name() spells i in base 20 with two-letter syllables, so every i
+gets a name of its own.
+*/
+void bench_name(size_t i, char* buf, size_t max) {
+    size_t count = sizeof(bench_syllables) / sizeof(bench_syllables[0]);
+    size_t len   = 0;
+    do {
+        len += snprintf(buf + len, max - len, "%s", bench_syllables[i % count]);
+        i /= count;
+    } while ((i > 0 || len < 4) && len + 3 < max);
+    buf[0] = (char)toupper((unsigned char)buf[0]);
+}
+
+/*
+bench_dataset() boots an empty directory, which gives the bootstrap
+cities, adds generated cities up to n, gives them all fresh weather and
+saves them, so the cache log and the snapshot written on dispose hold n
+cities.
+*/
+int bench_dataset(size_t n) {
+    city_list_t* list = NULL;
+    if (city_init(&list) != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+    char name[BENCH_NAME_MAX];
+    for (size_t i = list->size; i < n; i++) {
+        bench_name(i, name, sizeof(name));
+        city_data_t data = {.name      = name,
+                            .lat       = -60.0 + (double)(i / 2000) * 0.15,
+                            .lon       = -179.9 + (double)(i % 2000) * 0.15,
+                            .temp      = INIT_VAL,
+                            .windspeed = INIT_VAL,
+                            .rel_hum   = INIT_VAL};
+        if (city_add(list, &data, NULL) != STATUS_OK) {
+            city_dispose(&list);
+            return STATUS_FAIL;
+        }
+    }
+
+    city_id_t* ids    = malloc(list->size * sizeof(city_id_t));
+    int        status = ids ? STATUS_OK : STATUS_FAIL;
+    for (city_id_t id = 0; ids && id < list->size; id++) {
+        list->temp[id]      = (double)(id % 40) - 10.0;
+        list->windspeed[id] = (double)(id % 15);
+        list->rel_hum[id]   = (double)(id % 100);
+        list->cached_at[id] = time(NULL);
+        ids[id]             = id;
+    }
+    if (ids && city_save_batch(list, ids, list->size) != STATUS_OK) {
+        status = STATUS_FAIL;
+    }
+    free(ids);
+    city_dispose(&list);
+    return status;
+}
+
+/*
+bench_boot() returns the median seconds of BENCH_ROUNDS boots, or -1 if
+one did not come up with n cities. From the log the snapshot is removed
+before every boot (and written again by city_dispose()).
+*/
+double bench_boot(size_t n, bool from_log) {
+    double runs[BENCH_ROUNDS];
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        city_list_t* list = NULL;
+        if (from_log) {
+            unlink(SNAPSHOT_PATH);
+        }
+        double start  = bench_now();
+        int    status = city_init(&list);
+        runs[r]       = bench_now() - start;
+        if (status != STATUS_OK || list->size != n) {
+            if (status == STATUS_OK) {
+                city_dispose(&list);
+            }
+            return -1.0;
+        }
+        city_dispose(&list);
+    }
+    qsort(runs, BENCH_ROUNDS, sizeof(double), bench_cmp);
+    return runs[BENCH_ROUNDS / 2];
+}
@@ -0,0 +1,515 @@
+/*
+    suite.c times the hot paths of a lookup on made-up datasets of
+    CITIES cities (the 16 bootstrap cities plus generated ones, each in
+    its own weather model cell):
+    - city_init() from the snapshot and from the cache log
+      (city_read_cache())
+    - city_get() by exact name, with a typo and by coordinates
+    - city_print_list()
+    - city_save_cache()
+    - http_get_cached() from memory and from the cache log
+    - http_get_weather_data() served from memory, from the cache log and
+      from the network, the network being the stand-in for the forecast
+      API of mock.c on 127.0.0.1, injecting nothing
+    and http_json_parse() on every recorded payload given.
+
+    Every path runs for about BENCH_SECONDS (at least BENCH_RUNS_MIN
+    times) and the results are printed as JSON, one object per path and
+    size with min, median and p99 in microseconds, so two runs can be
+    diffed. Whatever the library prints meanwhile goes to /dev/null.
+
+    Usage: suite [CITIES...] [payload.json...]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "HTTP.h"
+#include "city.h"
+#include "jansson.h"
+#include "meteo.h"
+#include "mock.h"
+#include "snapshot.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SECONDS 0.5
+#define BENCH_RUNS_MIN 5
+#define BENCH_RUNS_MAX 100000
+#define BENCH_NETWORK_MAX 500 /* cities fetched per size, one each */
+#define BENCH_QUERIES 4096    /* lines queued on stdin for city_get() */
+#define BENCH_NAME_MAX 64
+
+static const size_t bench_sizes[] = {16, 1000, 10000, 100000};
+
+/* ----- Syllables generated names are made of ----- */
+static const char* bench_syllables[] = {
+    "ba", "ko", "ri", "st", "de", "lu", "mo", "ga", "vi", "ny",
+    "or", "ha", "tu", "be", "le", "sk", "ne", "ro", "by", "as",
+};
+
+/* ----- Struct for the runs of one path ----- */
+typedef struct {
+    double* times;
+    size_t  runs;
+    double  spent;
+    double  start;
+} bench_t;
+
+/* ----- PRIVATE FUNCTIONS ----- */
+double bench_now(void);
+int    bench_cmp(const void* a, const void* b);
+bool   bench_more(bench_t* b);
+void   bench_start(bench_t* b);
+void   bench_stop(bench_t* b);
+void   bench_report(bench_t* b, const char* name, size_t cities);
+void   bench_name(size_t i, char* buf, size_t max);
+int    bench_dataset(size_t n);
+int    bench_boot(bench_t* b, size_t n);
+int    bench_lookups(bench_t* b, city_list_t* list, size_t n);
+int    bench_queries(city_list_t* list, int kind);
+int    bench_caching(bench_t* b, http_ctx_t* http, city_list_t* list,
+                     size_t n);
+int    bench_payload(bench_t* b, const char* path);
+void   bench_clean(void);
+
+static FILE* bench_out;   /* the real stdout, for the results */
+static int   bench_first; /* no result printed yet */
+
+int main(int argc, char** argv) {
+    size_t sizes[16];
+    size_t num_sizes = 0;
+    for (int a = 1; a < argc; a++) {
+        if (isdigit((unsigned char)argv[a][0]) && num_sizes < 16) {
+            sizes[num_sizes++] = (size_t)atol(argv[a]);
+        }
+    }
+    if (num_sizes == 0) {
+        num_sizes = sizeof(bench_sizes) / sizeof(bench_sizes[0]);
+        memcpy(sizes, bench_sizes, sizeof(bench_sizes));
+    }
+
+    bench_t b;
+    b.times = malloc(BENCH_RUNS_MAX * sizeof(double));
+    b.runs  = 0;
+    b.spent = 0.0;
+    if (!b.times) {
+        printf("Malloc failed\n");
+        return EXIT_FAILURE;
+    }
+
+    /*Results go to the real stdout, the library's output nowhere*/
+    fflush(stdout);
+    bench_out = fdopen(dup(STDOUT_FILENO), "w");
+    int null  = open("/dev/null", O_WRONLY);
+    if (!bench_out || null < 0 || dup2(null, STDOUT_FILENO) < 0) {
+        perror("stdout");
+        return EXIT_FAILURE;
+    }
+    close(null);
+
+    /*The stand-in answers at once, so the network tier is the client's*/
+    mock_config_t config;
+    mock_t*       mock = NULL;
+    char          base[64];
+    mock_defaults(&config);
+    config.port = 0;
+    if (mock_start(&mock, &config) != STATUS_OK) {
+        return EXIT_FAILURE;
+    }
+    snprintf(base, sizeof(base), "http://127.0.0.1:%d/v1/forecast",
+             mock->port);
+    meteo_set_base(base);
+
+    fprintf(bench_out, "{\n  \"unit\": \"us\",\n  \"results\": [");
+    bench_first = 1;
+    int status  = EXIT_SUCCESS;
+    for (int a = 1; a < argc && status == EXIT_SUCCESS; a++) {
+        if (!isdigit((unsigned char)argv[a][0]) &&
+            bench_payload(&b, argv[a]) != STATUS_OK) {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("getcwd");
+        return EXIT_FAILURE;
+    }
+    for (size_t s = 0; s < num_sizes && status == EXIT_SUCCESS; s++) {
+        const char* tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+        char        dir[512];
+        snprintf(dir, sizeof(dir), "%s/etherskies-bench-XXXXXX", tmp);
+        if (!mkdtemp(dir) || chdir(dir) != 0) {
+            perror(dir);
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        city_list_t* list = NULL;
+        http_ctx_t*  http = NULL;
+        if (bench_dataset(sizes[s]) != STATUS_OK ||
+            bench_boot(&b, sizes[s]) != STATUS_OK ||
+            city_init(&list) != STATUS_OK || http_init(&http) != STATUS_OK ||
+            bench_lookups(&b, list, sizes[s]) != STATUS_OK ||
+            bench_caching(&b, http, list, sizes[s]) != STATUS_OK) {
+            fprintf(stderr, "Benchmark failed at %zu cities\n", sizes[s]);
+            status = EXIT_FAILURE;
+        }
+        if (http) {
+            http_dispose(&http);
+        }
+        if (list) {
+            city_dispose(&list);
+        }
+        bench_clean();
+        if (chdir(cwd) != 0 || rmdir(dir) != 0) {
+            fprintf(stderr, "%s was not removed\n", dir);
+        }
+    }
+    fprintf(bench_out, "\n  ]\n}\n");
+    fclose(bench_out);
+    mock_stop(&mock);
+    free(b.times);
+    return status;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int bench_cmp(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* ----- TIMING ----- */
+bool bench_more(bench_t* b) {
+    return b->runs < BENCH_RUNS_MAX &&
+           (b->runs < BENCH_RUNS_MIN || b->spent < BENCH_SECONDS);
+}
+
+void bench_start(bench_t* b) {
+    b->start = bench_now();
+}
+
+void bench_stop(bench_t* b) {
+    double took         = bench_now() - b->start;
+    b->times[b->runs++] = took;
+    b->spent += took;
+}
+
+/*
+bench_report() prints the runs so far as one result and starts over.
+*/
+void bench_report(bench_t* b, const char* name, size_t cities) {
+    if (b->runs > 0) {
+        qsort(b->times, b->runs, sizeof(double), bench_cmp);
+        fprintf(bench_out,
+                "%s\n    {\"name\": \"%s\", \"cities\": %zu, \"runs\": %zu, "
+                "\"min\": %.3f, \"median\": %.3f, \"p99\": %.3f}",
+                bench_first ? "" : ",", name, cities, b->runs,
+                b->times[0] * 1e6, b->times[b->runs / 2] * 1e6,
+                b->times[(b->runs - 1) * 99 / 100] * 1e6);
+        fflush(bench_out);
+        bench_first = 0;
+    }
+    b->runs  = 0;
+    b->spent = 0.0;
+}
+
+/* ----- DATASETS ----- */
+/*
+bench_name() spells i in base 20 with two-letter syllables, so every i
+gets a name of its own.
+*/
+void bench_name(size_t i, char* buf, size_t max) {
+    size_t count = sizeof(bench_syllables) / sizeof(bench_syllables[0]);
+    size_t len   = 0;
+    do {
+        len += snprintf(buf + len, max - len, "%s", bench_syllables[i % count]);
+        i /= count;
+    } while ((i > 0 || len < 4) && len + 3 < max);
+    buf[0] = (char)toupper((unsigned char)buf[0]);
+}
+
+/*
+bench_dataset() boots an empty directory, which gives the bootstrap
+cities, adds generated cities up to n, gives them all fresh weather and
+saves them, so the cache log and the snapshot written on dispose hold n
+cities.
+*/
+int bench_dataset(size_t n) {
+    city_list_t* list = NULL;
+    if (city_init(&list) != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+    char name[BENCH_NAME_MAX];
+    for (size_t i = list->size; i < n; i++) {
+        bench_name(i, name, sizeof(name));
+        city_data_t data = {.name      = name,
+                            .lat       = -60.0 + (double)(i / 2000) * 0.15,
+                            .lon       = -179.9 + (double)(i % 2000) * 0.15,
+                            .temp      = INIT_VAL,
+                            .windspeed = INIT_VAL,
+                            .rel_hum   = INIT_VAL};
+        if (city_add(list, &data, NULL) != STATUS_OK) {
+            city_dispose(&list);
+            return STATUS_FAIL;
+        }
+    }
+
+    city_id_t* ids    = malloc(list->size * sizeof(city_id_t));
+    int        status = ids ? STATUS_OK : STATUS_FAIL;
+    for (city_id_t id = 0; ids && id < list->size; id++) {
+        list->temp[id]      = (double)(id % 40) - 10.0;
+        list->windspeed[id] = (double)(id % 15);
+        list->rel_hum[id]   = (double)(id % 100);
+        list->cached_at[id] = time(NULL);
+        ids[id]             = id;
+    }
+    if (ids && city_save_batch(list, ids, list->size) != STATUS_OK) {
+        status = STATUS_FAIL;
+    }
+    free(ids);
+    city_dispose(&list);
+    return status;
+}
+
+/*
+bench_boot() times city_init() from the snapshot, then from the cache
+log alone by removing the snapshot before every run.
+*/
+int bench_boot(bench_t* b, size_t n) {
+    static const char* names[] = {"city_init/snapshot", "city_init/log"};
+    for (int from_log = 0; from_log < 2; from_log++) {
+        while (bench_more(b)) {
+            city_list_t* list = NULL;
+            if (from_log) {
+                unlink(SNAPSHOT_PATH);
+            }
+            bench_start(b);
+            int status = city_init(&list);
+            bench_stop(b);
+            if (status != STATUS_OK || list->size != n) {
+                return STATUS_FAIL;
+            }
+            city_dispose(&list);
+        }
+        bench_report(b, names[from_log], n);
+    }
+    return STATUS_OK;
+}
+
+/* ----- LOOKUPS ----- */
+/*
+bench_lookups() times city_get() reading names (as typed, with one
+letter dropped) and coordinates from stdin, and city_print_list().
+*/
+int bench_lookups(bench_t* b, city_list_t* list, size_t n) {
+    static const char* names[] = {"city_get/name", "city_get/typo",
+                                  "city_get/coords"};
+    for (int kind = 0; kind < 3; kind++) {
+        if (bench_queries(list, kind) != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+        for (int q = 0; q < BENCH_QUERIES && bench_more(b); q++) {
+            city_id_t id;
+            bench_start(b);
+            int status = city_get(list, &id);
+            bench_stop(b);
+            if (status != STATUS_OK && kind != 1) {
+                return STATUS_FAIL; /* a typo may be ambiguous */
+            }
+        }
+        bench_report(b, names[kind], n);
+    }
+
+    while (bench_more(b)) {
+        bench_start(b);
+        city_print_list(&list);
+        fflush(stdout);
+        bench_stop(b);
+    }
+    bench_report(b, "city_print_list", n);
+    return STATUS_OK;
+}
+
+/*
+bench_queries() writes BENCH_QUERIES lines of one kind for random cities
+and makes them stdin.
+*/
+int bench_queries(city_list_t* list, int kind) {
+    FILE* f = fopen("queries.txt", "w");
+    if (!f) {
+        perror("queries.txt");
+        return STATUS_FAIL;
+    }
+    for (int q = 0; q < BENCH_QUERIES; q++) {
+        city_id_t id = (city_id_t)rand() % list->size;
+        char      line[BENCH_NAME_MAX];
+        snprintf(line, sizeof(line), "%s", list->text[id].name);
+        if (kind == 1) {
+            size_t at = 1 + (size_t)rand() % (strlen(line) - 1);
+            memmove(line + at, line + at + 1, strlen(line + at));
+        } else if (kind == 2) {
+            snprintf(line, sizeof(line), "%.4f,%.4f", list->lat[id],
+                     list->lon[id]);
+        }
+        fprintf(f, "%s\n", line);
+    }
+    fclose(f);
+    return freopen("queries.txt", "r", stdin) ? STATUS_OK : STATUS_FAIL;
+}
+
+/* ----- CACHING ----- */
+/*
+bench_caching() times saving to cache, finding data with
+http_get_cached() and the tiers of http_get_weather_data(). For the
+file tiers the city's weather is dropped from memory before every run;
+the network tier adds a new city, in a cell of its own, for every run.
+*/
+int bench_caching(bench_t* b, http_ctx_t* http, city_list_t* list,
+                  size_t n) {
+    while (bench_more(b)) {
+        city_id_t id = (city_id_t)rand() % n;
+        bench_start(b);
+        city_save_cache(list, id);
+        bench_stop(b);
+    }
+    bench_report(b, "city_save_cache", n);
+    if (city_flush() != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+
+    static const char* cached[] = {"http_get_cached/memory",
+                                   "http_get_cached/file"};
+    for (int file = 0; file < 2; file++) {
+        while (bench_more(b)) {
+            city_id_t     id = (city_id_t)rand() % n;
+            http_source_t source;
+            int           age;
+            if (file) {
+                list->temp[id] = INIT_VAL;
+            }
+            bench_start(b);
+            int status = http_get_cached(list, id, DATA_MAX_AGE_S, &source,
+                                         &age);
+            bench_stop(b);
+            if (status != STATUS_OK ||
+                source != (file ? HTTP_FROM_FILE : HTTP_FROM_MEMORY)) {
+                return STATUS_FAIL;
+            }
+        }
+        bench_report(b, cached[file], n);
+    }
+
+    static const char* tiers[] = {"http_get_weather_data/memory",
+                                  "http_get_weather_data/file"};
+    for (int file = 0; file < 2; file++) {
+        while (bench_more(b)) {
+            city_id_t id = (city_id_t)rand() % n;
+            if (file) {
+                list->temp[id] = INIT_VAL;
+            }
+            bench_start(b);
+            int status = http_get_weather_data(http, list, id);
+            bench_stop(b);
+            if (status != STATUS_OK) {
+                return STATUS_FAIL;
+            }
+        }
+        bench_report(b, tiers[file], n);
+    }
+
+    char name[BENCH_NAME_MAX];
+    for (size_t i = 0; i < BENCH_NETWORK_MAX && bench_more(b); i++) {
+        city_id_t id;
+        bench_name(n + i, name, sizeof(name));
+        city_data_t data = {.name      = name,
+                            .lat       = 20.0 + (double)(i / 2000) * 0.15,
+                            .lon       = -179.9 + (double)(i % 2000) * 0.15,
+                            .temp      = INIT_VAL,
+                            .windspeed = INIT_VAL,
+                            .rel_hum   = INIT_VAL};
+        if (city_add(list, &data, &id) != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+        bench_start(b);
+        int status = http_get_weather_data(http, list, id);
+        bench_stop(b);
+        if (status != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+    }
+    bench_report(b, "http_get_weather_data/network", n);
+    return STATUS_OK;
+}
+
+/* ----- PAYLOADS ----- */
+/*
+bench_payload() times http_json_parse() on a recorded response, or
+http_json_parse_batch() if it holds several locations. Only the weather
+columns of a list are written, so a list of just those will do.
+*/
+int bench_payload(bench_t* b, const char* path) {
+    static double    temp[HTTP_BATCH_MAX];
+    static double    windspeed[HTTP_BATCH_MAX];
+    static double    rel_hum[HTTP_BATCH_MAX];
+    static city_id_t ids[HTTP_BATCH_MAX];
+    city_list_t      list;
+    memset(&list, 0, sizeof(list));
+    list.size      = HTTP_BATCH_MAX;
+    list.temp      = temp;
+    list.windspeed = windspeed;
+    list.rel_hum   = rel_hum;
+    for (city_id_t id = 0; id < HTTP_BATCH_MAX; id++) {
+        ids[id] = id;
+    }
+
+    json_error_t error;
+    json_t*      root = json_load_file(path, 0, &error);
+    if (!root) {
+        fprintf(stderr, "%s: %s\n", path, error.text);
+        return STATUS_FAIL;
+    }
+    size_t n    = json_is_array(root) ? json_array_size(root) : 1;
+    char*  body = json_dumps(root, JSON_COMPACT);
+    json_decref(root);
+    if (!body || n > HTTP_BATCH_MAX) {
+        free(body);
+        return STATUS_FAIL;
+    }
+
+    const char* file = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    char        name[256];
+    snprintf(name, sizeof(name), "%s/%s",
+             n > 1 ? "http_json_parse_batch" : "http_json_parse", file);
+    int status = STATUS_OK;
+    while (bench_more(b) && status == STATUS_OK) {
+        bench_start(b);
+        status = n > 1 ? http_json_parse_batch(body, &list, ids, n)
+                       : http_json_parse(body, &list, 0);
+        bench_stop(b);
+    }
+    bench_report(b, name, n);
+    free(body);
+    return status;
+}
+
+void bench_clean(void) {
+    freopen("/dev/null", "r", stdin);
+    unlink("queries.txt");
+    unlink(SNAPSHOT_PATH);
+    unlink(SNAPSHOT_PATH ".tmp");
+    unlink(CITY_CACHE_LOG_PATH);
+    unlink(CITY_CACHE_LOG_PATH ".tmp");
+}
@@ -1,75 +1,414 @@
 /*
     HTTP.c contains functions that:
+    - handles the HTTP context (handle pool and shared caches)
     - handles networking via libcurl
     - handles logic related to checking cache age
-    - handles parsing JSON-string
+    - handles parsing JSON-string, streamed while it arrives or with
+      jansson as a fallback
 */
 
 #include "HTTP.h"
 
 #include "city.h"
 #include "jansson.h"
+#include "jstream.h"
 
 #include <curl/curl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 /* ----- PRIVATE FUNCTIONS ----- */
-int http_load_cache(city_node_t* city_node, char* fp);
-int http_cache_age_seconds(char* filepath);
+int   http_json_current(json_t* root, city_list_t* city_list, city_id_t id);
+int   http_json_row(json_t* root, city_data_t* row);
+void  http_rows_clear(city_data_t* rows, size_t n);
+int   http_get_weather_locked(http_ctx_t* http_ctx, city_list_t* city_list,
+                              city_id_t id, http_source_t* out_source);
+void  http_refresh_queue(http_ctx_t* http_ctx, city_list_t* city_list,
+                         city_id_t id);
+int   http_refresh_start(http_ctx_t* http_ctx);
+void  http_refresh_touch(http_ctx_t* http_ctx, city_list_t* city_list,
+                         city_id_t id);
+void* http_refresh_worker(void* userp);
+void  http_refresh(http_ctx_t* http_ctx, city_list_t* city_list, city_id_t id);
+int   http_flight(http_ctx_t* http_ctx, city_list_t* city_list, city_id_t id);
+void  http_share_lock(CURL* curl, curl_lock_data data,
+                      curl_lock_access access, void* userp);
+void  http_share_unlock(CURL* curl, curl_lock_data data, void* userp);
 
 /* ------------------- */
-/* ----- NETWORK ----- */
+/* ----- CONTEXT ----- */
 /*
-http_get() uses standard CURL operations:
--calls http_write_data with every recived
--returns http_membuf_t data on success (dynamically allocated string)
+http_init() sets up libcurl once for the whole program and creates the
+share that all easy handles are attached to. The share is protected by
+one mutex per kind of shared data, so handles may be used from several
+threads.
+*/
+int http_init(http_ctx_t** http_ctx) {
+    if (!http_ctx) {
+        return STATUS_FAIL;
+    }
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        fprintf(stderr, "Curl global init failed\n");
+        return STATUS_FAIL;
+    }
+
+    http_ctx_t* ctx = calloc(1, sizeof(http_ctx_t));
+    if (!ctx) {
+        printf("Malloc failed\n");
+        curl_global_cleanup();
+        return STATUS_FAIL;
+    }
+    if (schedule_create(&ctx->schedule, DATA_MAX_AGE_S,
+                        HTTP_REFRESH_BUDGET) != STATUS_OK) {
+        free(ctx);
+        curl_global_cleanup();
+        return STATUS_FAIL;
+    }
+    ctx->share = curl_share_init();
+    if (!ctx->share) {
+        fprintf(stderr, "Curl share returned NULL\n");
+        schedule_dispose(&ctx->schedule);
+        free(ctx);
+        curl_global_cleanup();
+        return STATUS_FAIL;
+    }
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&ctx->share_locks[i], NULL);
+    }
+    pthread_mutex_init(&ctx->pool_lock, NULL);
+    pthread_mutex_init(&ctx->list_lock, NULL);
+    pthread_cond_init(&ctx->refresh_cond, NULL);
+    pthread_cond_init(&ctx->flight_cond, NULL);
+    for (unsigned i = 0; i < HTTP_FLIGHTS_MAX; i++) {
+        pthread_cond_init(&ctx->flights[i].done, NULL);
+    }
+
+    curl_share_setopt(ctx->share, CURLSHOPT_LOCKFUNC, http_share_lock);
+    curl_share_setopt(ctx->share, CURLSHOPT_UNLOCKFUNC, http_share_unlock);
+    curl_share_setopt(ctx->share, CURLSHOPT_USERDATA, (void*)ctx);
+    curl_share_setopt(ctx->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(ctx->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(ctx->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    *http_ctx = ctx; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+/*
+http_dispose() stops the refresh worker, dropping refreshes that have not
+started yet, and prints the statistics of the run. Then it cleans up the
+pooled handles and buffers, and the share the handles are attached to.
+Must be called before the city list the worker refreshes is disposed.
+*/
+int http_dispose(http_ctx_t** http_ctx) {
+    if (!http_ctx || !*http_ctx) {
+        fprintf(stderr, "Pointer to HTTP context or context is NULL\n");
+        return STATUS_FAIL;
+    }
+    http_ctx_t* ctx = *http_ctx;
+    pthread_mutex_lock(&ctx->pool_lock);
+    ctx->refresher_quit = true;
+    pthread_cond_signal(&ctx->refresh_cond);
+    pthread_mutex_unlock(&ctx->pool_lock);
+    if (ctx->refresher_running) {
+        pthread_join(ctx->refresher, NULL);
+    }
+
+    http_stats_t* stats = &ctx->stats;
+    if (stats->requests > 0) {
+        printf("HTTP: %lu requests, %lu new connections, %lu TLS handshakes, "
+               "%.1f ms average (%.1f ms connecting).\n",
+               stats->requests, stats->connects, stats->handshakes,
+               stats->total_time * 1000.0 / stats->requests,
+               stats->connect_time * 1000.0 / stats->requests);
+    }
+    if (stats->buf_fetches > 0) {
+        printf("HTTP: %.1f buffer reallocs and %.1f frees per 1000 "
+               "buffered fetches.\n",
+               stats->buf_reallocs * 1000.0 / stats->buf_fetches,
+               stats->buf_frees * 1000.0 / stats->buf_fetches);
+    }
+    if (stats->stale_served > 0) {
+        printf("HTTP: %lu stale answers, %lu refreshed in the background.\n",
+               stats->stale_served, stats->refreshed);
+    }
+    if (ctx->flights_issued > 0) {
+        printf("HTTP: %lu cells fetched, %lu lookups shared a fetch in "
+               "flight.\n",
+               ctx->flights_issued, ctx->flights_shared);
+    }
+    if (ctx->schedule->refreshes > 0) {
+        printf("HTTP: %lu refreshes ahead of expiry, %lu waits for budget, "
+               "%lu cities went cold.\n",
+               ctx->schedule->refreshes, ctx->schedule->deferred,
+               ctx->schedule->dropped);
+    }
+
+    for (unsigned i = 0; i < ctx->idle; i++) {
+        curl_easy_cleanup(ctx->pool[i]);
+    }
+    for (unsigned i = 0; i < ctx->idle_bufs; i++) {
+        free(ctx->bufs[i].data);
+    }
+    curl_share_cleanup(ctx->share);
+    schedule_dispose(&ctx->schedule);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&ctx->share_locks[i]);
+    }
+    pthread_mutex_destroy(&ctx->pool_lock);
+    pthread_mutex_destroy(&ctx->list_lock);
+    pthread_cond_destroy(&ctx->refresh_cond);
+    pthread_cond_destroy(&ctx->flight_cond);
+    for (unsigned i = 0; i < HTTP_FLIGHTS_MAX; i++) {
+        pthread_cond_destroy(&ctx->flights[i].done);
+    }
+    free(ctx);
+    curl_global_cleanup();
+
+    *http_ctx = NULL;
+    return STATUS_OK;
+}
+
+void http_share_lock(CURL* curl, curl_lock_data data, curl_lock_access access,
+                     void* userp) {
+    (void)curl;
+    (void)access;
+    http_ctx_t* ctx = userp;
+    pthread_mutex_lock(&ctx->share_locks[data]);
+}
+
+void http_share_unlock(CURL* curl, curl_lock_data data, void* userp) {
+    (void)curl;
+    http_ctx_t* ctx = userp;
+    pthread_mutex_unlock(&ctx->share_locks[data]);
+}
+
+/* ----- HANDLE POOL ----- */
+/*
+http_acquire() hands out an idle easy handle, or creates a new one if the
+pool is empty. New handles get the options that never change between
+requests; callers only set the url and write target.
 */
-char* http_get(city_node_t* city_node) {
+CURL* http_acquire(http_ctx_t* http_ctx) {
+    pthread_mutex_lock(&http_ctx->pool_lock);
+    CURL* curl = NULL;
+    if (http_ctx->idle > 0) {
+        curl = http_ctx->pool[--http_ctx->idle];
+    }
+    pthread_mutex_unlock(&http_ctx->pool_lock);
+    if (curl) {
+        return curl;
+    }
 
-    CURL* curl = curl_easy_init();
+    curl = curl_easy_init();
     if (!curl) {
         fprintf(stderr, "Curled returned NULL\n");
         return NULL;
     }
+    curl_easy_setopt(curl, CURLOPT_SHARE, http_ctx->share);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, http_write_data);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    /*Shared or not, curl keeps only 4 open connections by default*/
+    curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, (long)HTTP_POOL_SIZE);
+    if (getenv(HTTP_CA_ENV)) {
+        curl_easy_setopt(curl, CURLOPT_CAINFO, getenv(HTTP_CA_ENV));
+    }
+    return curl;
+}
 
-    http_membuf_t chunk = {0};
-
-    curl_easy_setopt(curl, CURLOPT_URL, city_node->data->url);
+/*
+http_release() puts a handle back in the pool, or cleans it up if the
+pool is already full. The write callback is reset, so a handle that
+streamed leaves the pool buffering again.
+*/
+void http_release(http_ctx_t* http_ctx, CURL* curl) {
+    if (!curl) {
+        return;
+    }
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, http_write_data);
+    pthread_mutex_lock(&http_ctx->pool_lock);
+    if (http_ctx->idle < HTTP_POOL_SIZE) {
+        http_ctx->pool[http_ctx->idle++] = curl;
+        curl = NULL;
+    }
+    pthread_mutex_unlock(&http_ctx->pool_lock);
+    if (curl) {
+        curl_easy_cleanup(curl);
+    }
+}
+
+/*
+http_stats_add() records a finished transfer. A request that reused a
+warm connection reports zero new connects and no TLS handshake time.
+Handshakes resumed from a shared TLS session count too: curl does not
+tell them apart from full ones.
+*/
+void http_stats_add(http_ctx_t* http_ctx, CURL* curl) {
+    long   connects   = 0;
+    double total      = 0.0;
+    double connect    = 0.0;
+    double appconnect = 0.0;
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+
+    /*Stats are rare enough to share the pool lock*/
+    pthread_mutex_lock(&http_ctx->pool_lock);
+    http_stats_t* stats = &http_ctx->stats;
+    stats->requests++;
+    stats->total_time += total;
+    if (connects > 0) {
+        stats->connects++;
+        stats->connect_time += appconnect > connect ? appconnect : connect;
+        if (appconnect > 0.0) {
+            stats->handshakes++;
+        }
+    }
+    pthread_mutex_unlock(&http_ctx->pool_lock);
+}
+
+/* ----- BUFFER POOL ----- */
+/*
+http_buf_get() hands out an idle response buffer, emptied but with its
+memory kept, or an unallocated one if the pool is empty.
+*/
+void http_buf_get(http_ctx_t* http_ctx, http_membuf_t* buf) {
+    memset(buf, 0, sizeof(http_membuf_t));
+    pthread_mutex_lock(&http_ctx->pool_lock);
+    if (http_ctx->idle_bufs > 0) {
+        *buf = http_ctx->bufs[--http_ctx->idle_bufs];
+    }
+    pthread_mutex_unlock(&http_ctx->pool_lock);
+    buf->size     = 0;
+    buf->curl     = NULL;
+    buf->reallocs = 0;
+}
+
+/*
+http_buf_put() gives a buffer back to the pool. It is freed instead if the
+pool is full, or if it grew past HTTP_BUF_KEEP_MAX so one odd response
+does not pin a lot of memory. buf is emptied either way.
+*/
+void http_buf_put(http_ctx_t* http_ctx, http_membuf_t* buf) {
+    if (!buf->data) {
+        return;
+    }
+    pthread_mutex_lock(&http_ctx->pool_lock);
+    if (http_ctx->idle_bufs < HTTP_POOL_SIZE && buf->cap <= HTTP_BUF_KEEP_MAX) {
+        http_ctx->bufs[http_ctx->idle_bufs++] = *buf;
+    } else {
+        free(buf->data);
+        http_ctx->stats.buf_frees++;
+    }
+    pthread_mutex_unlock(&http_ctx->pool_lock);
+    memset(buf, 0, sizeof(http_membuf_t));
+}
+
+/* ------------------- */
+/* ----- NETWORK ----- */
+/*
+http_get() fetches the url of a single city through http_get_url().
+*/
+int http_get(http_ctx_t* http_ctx, city_list_t* list, city_id_t id,
+             http_membuf_t* out_body) {
+    if (!list || id >= list->size || !list->text[id].url) {
+        return STATUS_FAIL;
+    }
+    return http_get_url(http_ctx, list->text[id].url, out_body);
+}
+
+/*
+http_get_url() uses standard CURL operations on a pooled handle:
+-calls http_write_data with every recived
+-returns the body in a pooled buffer through out_body, as a string, which
+ the caller gives back with http_buf_put()
+*/
+int http_get_url(http_ctx_t* http_ctx, const char* url,
+                 http_membuf_t* out_body) {
+
+    CURL* curl = http_acquire(http_ctx);
+    if (!curl) {
+        return STATUS_FAIL;
+    }
+
+    http_membuf_t chunk;
+    http_buf_get(http_ctx, &chunk);
+    chunk.curl = curl;
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
     /*This is *userp in http_write_data()*/
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&chunk);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 
     CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        fprintf(stderr, "Curl performed bad: %s\n", curl_easy_strerror(res));
-        curl_easy_cleanup(curl);
-        return NULL;
+    http_stats_add(http_ctx, curl);
+    http_release(http_ctx, curl);
+    chunk.curl = NULL;
+
+    pthread_mutex_lock(&http_ctx->pool_lock);
+    http_ctx->stats.buf_fetches++;
+    http_ctx->stats.buf_reallocs += chunk.reallocs;
+    pthread_mutex_unlock(&http_ctx->pool_lock);
+
+    if (res != CURLE_OK || !chunk.data) {
+        if (res != CURLE_OK)
+            fprintf(stderr, "Curl performed bad: %s\n",
+                    curl_easy_strerror(res));
+        else
+            fprintf(stderr, "Empty response from %s\n", url);
+        http_buf_put(http_ctx, &chunk);
+        return STATUS_FAIL;
     }
-    curl_easy_cleanup(curl);
 
-    return chunk.data;
+    *out_body = chunk; /* return through out-ptr */
+    return STATUS_OK;
 }
 
 /*
 http_write_data() is a callback used by libCURL. Each time a chunk of data
-is received, it reallocates and appends it to the buffer in http_membuf_t.
+is received, it is appended to the buffer in http_membuf_t. The buffer is
+only reallocated when the chunk does not fit: to the Content-Length of the
+response if the server sent one, otherwise to twice its size.
 */
 size_t http_write_data(void* buffer, size_t size, size_t nmemb, void* userp) {
 
-    size_t bytes = size * nmemb;
-    printf("\nRecived chunk: %zu bytes\n", bytes);
-    /*Realloc with the size of recived chunk*/
+    size_t         bytes = size * nmemb;
     http_membuf_t* mem_t = userp;
-    char*          ptr   = realloc(mem_t->data, mem_t->size + bytes + 1);
-    if (!ptr) {
-        printf("Returned 0 to CURL!\n");
-        return STATUS_FAIL;
+    size_t         need  = mem_t->size + bytes + 1;
+
+    /*Headers are all in by the first chunk of the body*/
+    curl_off_t length = -1;
+    if (mem_t->size == 0 && mem_t->curl) {
+        curl_easy_getinfo(mem_t->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                          &length);
+    }
+    if (length > 0 && (size_t)length + 1 > need) {
+        need = (size_t)length + 1;
+    }
+
+    if (need > mem_t->cap) {
+        size_t cap = need;
+        if (length <= 0) {
+            cap = mem_t->cap * 2 > HTTP_BUF_MIN ? mem_t->cap * 2 : HTTP_BUF_MIN;
+            while (cap < need) {
+                cap *= 2;
+            }
+        }
+        char* ptr = realloc(mem_t->data, cap);
+        if (!ptr) {
+            /*Anything but bytes aborts the transfer*/
+            printf("Returned 0 to CURL!\n");
+            return 0;
+        }
+        mem_t->data = ptr;
+        mem_t->cap  = cap;
+        mem_t->reallocs++;
     }
-    mem_t->data = ptr;
     /*Copies the new data into the buffer:
     data points to the start off the buffer -> size says how many bytes already
     exists
@@ -81,136 +420,527 @@ size_t http_write_data(void* buffer, size_t size, size_t nmemb, void* userp) {
     return bytes;
 }
 
-/* ----- CACHING LOGIC ----- */
 /*
-http_get_weather_data handles logic for dealing with cache.
-The priority is:
-    1) data in struct is fresh
-    2) cache files exist with fresh data
-    3) no data in struct, no fresh cache data, fretch from network
-If data needs to be fetched it calls http_get and the result is
-passed to http_json_parse() which in turn passes its product to
-city_save_cache().
-*/
-int http_get_weather_data(city_node_t* city_node) {
-
-    /*Check if struct data is fresh*/
-    if (city_node->data->temp != INIT_VAL && !http_is_old(city_node)) {
-        printf("Using fresh in-memory data for %s (age %ld seconds).\n",
-               city_node->data->name,
-               (long)difftime(time(NULL), city_node->data->cached_at));
-        return STATUS_OK;
+http_write_stream() is the streaming counterpart of http_write_data(): each
+chunk goes straight into the jstream_t in userp and is not kept. Returning
+0 makes curl abort the transfer as soon as the parser gives up.
+*/
+size_t http_write_stream(void* buffer, size_t size, size_t nmemb,
+                         void* userp) {
+    size_t bytes = size * nmemb;
+    if (jstream_feed(userp, buffer, bytes) != STATUS_OK) {
+        return 0;
     }
+    return bytes;
+}
 
-    /*Check if there is a file for city in cache and if the data is fresh*/
-    int file_age = http_cache_age_seconds(city_node->data->fp);
-    if (file_age >= 0 && file_age <= DATA_MAX_AGE_S) {
+/*
+http_stream_start() prepares rows and parser for a streamed response with
+n locations. The weather fields start as INIT_VAL so http_stream_apply()
+can tell which ones the response had.
+*/
+void http_stream_start(jstream_t* parser, city_data_t* rows, size_t n) {
+    http_rows_clear(rows, n);
+    jstream_init(parser, rows, n);
+}
 
-        if (http_load_cache(city_node, city_node->data->fp) == 0) {
-            /*Check that data in fetched cache is not INIT_VAL*/
-            if (city_node->data->temp != INIT_VAL) {
-                printf("Using fresh cached file for %s (age %d seconds).\n",
-                       city_node->data->name, file_age);
-                return STATUS_OK;
-            }
-            printf("Cache exist but has no weather data\n");
-        } else {
-            fprintf(stderr, "Failed to read cached JSON for %s.\n",
-                    city_node->data->name);
-        }
+void http_rows_clear(city_data_t* rows, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        rows[i].temp      = INIT_VAL;
+        rows[i].windspeed = INIT_VAL;
+        rows[i].rel_hum   = INIT_VAL;
     }
+}
 
-    /*All checks done, fetch from network*/
-    printf("Data missing, old, or cache invalid. Fetching from Meteo...\n");
-    char* http_response = http_get(city_node);
-    if (!http_response) {
-        fprintf(stderr, "HTTP request failed.\n");
-        return STATUS_FAIL;
+/*
+http_stream_apply() copies the fields found by the parser into the
+cities. Fields the response did not have are left as they were, the same
+as http_json_current() does.
+*/
+void http_stream_apply(city_list_t* list, const city_data_t* rows,
+                       const city_id_t* ids, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (rows[i].temp != INIT_VAL)
+            list->temp[ids[i]] = rows[i].temp;
+        if (rows[i].windspeed != INIT_VAL)
+            list->windspeed[ids[i]] = rows[i].windspeed;
+        if (rows[i].rel_hum != INIT_VAL)
+            list->rel_hum[ids[i]] = rows[i].rel_hum;
     }
+}
 
-    if (http_json_parse(http_response, city_node) != 0) {
-        fprintf(stderr, "Failed to parse HTTP response.\n");
-        free(http_response);
+/*
+http_get_rows() fetches url and parses the "current" values of n locations
+into rows while the response streams in, without buffering the body. The
+city list is not touched. Returns STATUS_EXIT if the response was beyond
+the streaming parser, so the caller can use http_get_rows_json().
+*/
+int http_get_rows(http_ctx_t* http_ctx, const char* url, city_data_t* rows,
+                  size_t n) {
+    if (n == 0 || n > HTTP_BATCH_MAX) {
+        return STATUS_FAIL;
+    }
+    CURL* curl = http_acquire(http_ctx);
+    if (!curl) {
         return STATUS_FAIL;
     }
 
-    if (city_save_cache(city_node->data) != 0)
-        fprintf(stderr, "Failed to save cache for %s\n", city_node->data->name);
+    jstream_t parser;
+    http_stream_start(&parser, rows, n);
 
-    free(http_response);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, http_write_stream);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&parser);
 
-    return STATUS_OK;
+    CURLcode res = curl_easy_perform(curl);
+    http_stats_add(http_ctx, curl);
+    http_release(http_ctx, curl);
+
+    /*A write error means the parser stopped the transfer*/
+    if (res != CURLE_OK && res != CURLE_WRITE_ERROR) {
+        fprintf(stderr, "Curl performed bad: %s\n", curl_easy_strerror(res));
+        return STATUS_FAIL;
+    }
+    int status = jstream_finish(&parser);
+    if (status == STATUS_FAIL) {
+        fprintf(stderr, "Unexpected response for %zu locations.\n", n);
+    }
+    return status;
 }
 
-/* ----- CACHING ----- */
 /*
-http_load_cache() loads weather/cache data for a city from a JSON file.
-It updates the provided city_node's city_data_t fields (temp, windspeed,
-rel_hum, cached_at) with the values found in the JSON file.
+http_get_current() fetches url through http_get_rows() and copies the
+values into the n cities in ids. A response the streaming parser cannot
+follow is fetched again and parsed with http_get_current_json().
 */
-int http_load_cache(city_node_t* city_node, char* fp) {
-    if (!city_node || !fp) {
-        return STATUS_FAIL;
+int http_get_current(http_ctx_t* http_ctx, const char* url,
+                     city_list_t* list, const city_id_t* ids, size_t n) {
+    city_data_t rows[HTTP_BATCH_MAX];
+    int         status = http_get_rows(http_ctx, url, rows, n);
+    if (status == STATUS_EXIT) {
+        return http_get_current_json(http_ctx, url, list, ids, n);
     }
+    if (status == STATUS_OK) {
+        http_stream_apply(list, rows, ids, n);
+    }
+    return status;
+}
 
-    json_error_t error;
-    json_t*      root = json_load_file(fp, 0, &error);
-    if (!root) {
-        fprintf(stderr, "Failed to load JSON file %s: %s\n", fp, error.text);
+/*
+http_get_current_json() is the fallback of http_get_current(): the whole
+body is buffered and parsed by jansson.
+*/
+int http_get_current_json(http_ctx_t* http_ctx, const char* url,
+                          city_list_t* list, const city_id_t* ids, size_t n) {
+    city_data_t rows[HTTP_BATCH_MAX];
+    int         status = http_get_rows_json(http_ctx, url, rows, n);
+    if (status == STATUS_OK) {
+        http_stream_apply(list, rows, ids, n);
+    }
+    return status;
+}
+
+/*
+http_get_rows_json() is the fallback of http_get_rows(): the whole body
+is buffered and parsed into rows by jansson. The city list is not
+touched, so no lock is needed.
+*/
+int http_get_rows_json(http_ctx_t* http_ctx, const char* url,
+                       city_data_t* rows, size_t n) {
+    http_membuf_t body;
+    if (http_get_url(http_ctx, url, &body) != STATUS_OK) {
         return STATUS_FAIL;
     }
+    int status = http_json_rows(body.data, rows, n);
+    http_buf_put(http_ctx, &body);
+    return status;
+}
 
-    json_t* jtemp      = json_object_get(root, "temp");
-    json_t* jwind      = json_object_get(root, "windspeed");
-    json_t* jhum       = json_object_get(root, "rel_hum");
-    json_t* jcached_at = json_object_get(root, "cached_at");
+/* ----- BACKGROUND REFRESH ----- */
+/*
+The city list is shared with the refresh worker. Anything that reads or
+writes weather data or the cache while the worker may run holds this
+lock; the worker only takes it to store a result, never over a request.
+*/
+void http_list_lock(http_ctx_t* http_ctx) {
+    pthread_mutex_lock(&http_ctx->list_lock);
+}
 
-    if (jtemp && json_is_number(jtemp))
-        city_node->data->temp = json_number_value(jtemp);
-    if (jwind && json_is_number(jwind))
-        city_node->data->windspeed = json_number_value(jwind);
-    if (jhum && json_is_number(jhum))
-        city_node->data->rel_hum = json_number_value(jhum);
+void http_list_unlock(http_ctx_t* http_ctx) {
+    pthread_mutex_unlock(&http_ctx->list_lock);
+}
 
-    time_t cached              = (jcached_at && json_is_integer(jcached_at))
-                                     ? (time_t)json_integer_value(jcached_at)
-                                     : 0;
-    city_node->data->cached_at = cached;
+/*
+http_refresh_queue() asks the worker to refresh a city, starting the
+worker on first use. A city already queued or being refreshed is not
+queued again, and when the queue is full the request is dropped: the
+stale data is served again next time and queued then.
+*/
+void http_refresh_queue(http_ctx_t* http_ctx, city_list_t* list,
+                        city_id_t id) {
+    pthread_mutex_lock(&http_ctx->pool_lock);
+    http_ctx->stats.stale_served++;
+    for (unsigned i = 0; i < http_ctx->num_refresh; i++) {
+        if (http_ctx->refresh[i].list == list &&
+            http_ctx->refresh[i].id == id) {
+            pthread_mutex_unlock(&http_ctx->pool_lock);
+            return;
+        }
+    }
+    if (http_refresh_start(http_ctx) != STATUS_OK) {
+        pthread_mutex_unlock(&http_ctx->pool_lock);
+        return;
+    }
+    if (http_ctx->num_refresh < HTTP_REFRESH_QUEUE) {
+        http_refresh_t* job = &http_ctx->refresh[http_ctx->num_refresh++];
+        job->list           = list;
+        job->id             = id;
+        pthread_cond_signal(&http_ctx->refresh_cond);
+    }
+    pthread_mutex_unlock(&http_ctx->pool_lock);
+}
 
-    json_decref(root);
-    return STATUS_OK;
+/*
+http_refresh_touch() tells the scheduler a city was looked up, so it is
+kept warm from now on. Called with the list lock held, for cached_at.
+*/
+void http_refresh_touch(http_ctx_t* http_ctx, city_list_t* list,
+                        city_id_t id) {
+    pthread_mutex_lock(&http_ctx->pool_lock);
+    if (!http_ctx->schedule_list) {
+        http_ctx->schedule_list = list;
+    }
+    if (http_ctx->schedule_list == list && http_ctx->schedule->budget > 0 &&
+        http_refresh_start(http_ctx) == STATUS_OK) {
+        schedule_touch(http_ctx->schedule, id, list->cached_at[id],
+                       time(NULL));
+        pthread_cond_signal(&http_ctx->refresh_cond);
+    }
+    pthread_mutex_unlock(&http_ctx->pool_lock);
 }
 
 /*
-http_cache_age_seconds() fetches value from cached citys cached_at field and
-calculates the age of the data which it then returns to caller on success.
+http_refresh_start() starts the worker if it is not running yet. Called
+with the pool lock held.
 */
-int http_cache_age_seconds(char* filepath) {
-    if (!filepath) {
+int http_refresh_start(http_ctx_t* http_ctx) {
+    if (http_ctx->refresher_running) {
+        return STATUS_OK;
+    }
+    if (pthread_create(&http_ctx->refresher, NULL, http_refresh_worker,
+                       http_ctx) != 0) {
+        fprintf(stderr, "Failed to start refresh worker\n");
         return STATUS_FAIL;
     }
+    http_ctx->refresher_running = true;
+    return STATUS_OK;
+}
 
-    json_error_t error;
-    json_t*      root = json_load_file(filepath, 0, &error);
-    if (!root) {
+/*
+http_refresh_worker() refreshes queued cities one at a time, oldest first.
+A city stays at the front of the queue until it is done, so it is not
+queued twice meanwhile. When the queue is empty it refreshes what the
+scheduler says is due, and otherwise sleeps until the next city is due,
+or the queue or scheduler gets something new.
+*/
+void* http_refresh_worker(void* userp) {
+    http_ctx_t* http_ctx = userp;
+    pthread_mutex_lock(&http_ctx->pool_lock);
+    while (!http_ctx->refresher_quit) {
+        /*Lookups that were given stale data go first*/
+        if (http_ctx->num_refresh > 0) {
+            http_refresh_t job = http_ctx->refresh[0];
+            pthread_mutex_unlock(&http_ctx->pool_lock);
+
+            http_refresh(http_ctx, job.list, job.id);
+
+            pthread_mutex_lock(&http_ctx->pool_lock);
+            http_ctx->num_refresh--;
+            memmove(&http_ctx->refresh[0], &http_ctx->refresh[1],
+                    http_ctx->num_refresh * sizeof(http_refresh_t));
+            continue;
+        }
+
+        city_id_t id   = 0;
+        time_t    wait = 0;
+        int next = schedule_next(http_ctx->schedule, time(NULL), &id, &wait);
+        if (next == STATUS_OK) {
+            pthread_mutex_unlock(&http_ctx->pool_lock);
+            http_refresh(http_ctx, http_ctx->schedule_list, id);
+            pthread_mutex_lock(&http_ctx->pool_lock);
+        } else if (next == STATUS_EXIT) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += wait;
+            pthread_cond_timedwait(&http_ctx->refresh_cond,
+                                   &http_ctx->pool_lock, &until);
+        } else {
+            pthread_cond_wait(&http_ctx->refresh_cond, &http_ctx->pool_lock);
+        }
+    }
+    pthread_mutex_unlock(&http_ctx->pool_lock);
+    return NULL;
+}
+
+/*
+http_refresh() fetches one city without the list lock and stores the
+result with it, then has the scheduler plan the next refresh. Nothing is
+printed on success, the user may be typing.
+*/
+void http_refresh(http_ctx_t* http_ctx, city_list_t* list, city_id_t id) {
+    http_list_lock(http_ctx);
+    int    status    = http_flight(http_ctx, list, id);
+    time_t cached_at = list->cached_at[id];
+    http_list_unlock(http_ctx);
+
+    if (status != STATUS_OK) {
+        fprintf(stderr, "Background refresh failed for %s\n",
+                list->text[id].name);
+        return;
+    }
+    pthread_mutex_lock(&http_ctx->pool_lock);
+    http_ctx->stats.refreshed++;
+    if (list == http_ctx->schedule_list) {
+        schedule_done(http_ctx->schedule, id, cached_at, time(NULL));
+    }
+    pthread_mutex_unlock(&http_ctx->pool_lock);
+}
+
+/* ----- SINGLE FLIGHT ----- */
+/*
+http_flight() fetches a city and saves it to cache, unless its weather
+model cell is being fetched for another caller already; then it waits
+for that request and returns its result. Lookups, background refreshes,
+daemon clients and the fetch engine (through http_flight_claim()) all
+share the table, so a cell is never requested twice at once. The result
+is shared with every city of the cell.
+
+Called with the list lock held. The lock is released while the request
+runs, so lookups of other cities go on meanwhile. At most
+HTTP_FLIGHTS_MAX cities are fetched at once, further callers wait for a
+flight to finish.
+*/
+int http_flight(http_ctx_t* http_ctx, city_list_t* list, city_id_t id) {
+    http_flight_t* flight = NULL;
+    int            claim  = STATUS_FAIL;
+    while ((claim = http_flight_claim(http_ctx, list, id, &flight)) ==
+           STATUS_FAIL) {
+        pthread_cond_wait(&http_ctx->flight_cond, &http_ctx->list_lock);
+    }
+    if (claim == STATUS_EXIT) {
+        while (flight->busy) {
+            pthread_cond_wait(&flight->done, &http_ctx->list_lock);
+        }
+        return http_flight_leave(http_ctx, flight);
+    }
+
+    const char* url = list->text[id].url;
+    city_data_t row;
+    http_list_unlock(http_ctx);
+    int status = url ? http_get_rows(http_ctx, url, &row, 1) : STATUS_FAIL;
+    if (status == STATUS_EXIT) {
+        status = http_get_rows_json(http_ctx, url, &row, 1);
+    }
+    http_list_lock(http_ctx);
+
+    if (status == STATUS_OK) {
+        http_stream_apply(list, &row, &id, 1);
+        if (city_save_cache(list, id) != STATUS_OK) {
+            fprintf(stderr, "Failed to save cache for %s\n",
+                    list->text[id].name);
+        }
+        city_cell_share(list, id);
+    }
+    http_flight_finish(http_ctx, flight, status);
+    return status;
+}
+
+/*
+http_flight_claim() is the non-blocking half of http_flight(), for
+callers that run their own requests. STATUS_OK means the caller owns a
+new flight for the city's cell, fetches it and ends with
+http_flight_finish(). STATUS_EXIT means the cell is in flight for someone
+else already: the caller has joined that flight, waits until it is no
+longer busy and ends with http_flight_leave(). STATUS_FAIL means every
+flight is taken; flight_cond is signalled when one is freed. Called with
+the list lock held.
+*/
+int http_flight_claim(http_ctx_t* http_ctx, city_list_t* list, city_id_t id,
+                      http_flight_t** out_flight) {
+    city_id_t      cell = city_cell(list, id);
+    http_flight_t* idle = NULL;
+    for (unsigned i = 0; i < HTTP_FLIGHTS_MAX; i++) {
+        http_flight_t* f = &http_ctx->flights[i];
+        if (f->used && f->busy && f->list == list && f->id == cell) {
+            http_ctx->flights_shared++;
+            f->waiters++;
+            *out_flight = f; /* return through out-ptr */
+            return STATUS_EXIT;
+        }
+        if (!f->used && !idle) {
+            idle = f;
+        }
+    }
+    if (!idle) {
         return STATUS_FAIL;
     }
+    idle->list    = list;
+    idle->id      = cell;
+    idle->used    = true;
+    idle->busy    = true;
+    idle->waiters = 0;
+    http_ctx->flights_issued++;
+    *out_flight = idle; /* return through out-ptr */
+    return STATUS_OK;
+}
 
-    json_t* jat = json_object_get(root, "cached_at");
-    if (!json_is_integer(jat)) {
-        json_decref(root);
+/*
+http_flight_finish() ends a flight claimed with http_flight_claim() and
+wakes everyone who joined it. Called with the list lock held.
+*/
+void http_flight_finish(http_ctx_t* http_ctx, http_flight_t* flight,
+                        int status) {
+    flight->status = status;
+    flight->busy   = false;
+    if (flight->waiters > 0) {
+        pthread_cond_broadcast(&flight->done);
+    } else {
+        flight->used = false;
+        pthread_cond_signal(&http_ctx->flight_cond);
+    }
+}
+
+/*
+http_flight_leave() returns the result of a flight that was joined and
+is no longer busy. The last one out frees it. Leaving a flight that is
+still busy gives up on it, and STATUS_FAIL. Called with the list lock
+held.
+*/
+int http_flight_leave(http_ctx_t* http_ctx, http_flight_t* flight) {
+    int status = flight->busy ? STATUS_FAIL : flight->status;
+    if (--flight->waiters == 0 && !flight->busy) {
+        flight->used = false;
+        pthread_cond_signal(&http_ctx->flight_cond);
+    }
+    return status;
+}
+
+/* ----- CACHING LOGIC ----- */
+/*
+http_get_weather_data handles logic for dealing with cache.
+The priority is:
+    1) data in struct is fresh
+    2) cache files exist with fresh data
+    3) data in struct or cache is stale, but at most DATA_STALE_MAX_S old:
+       it is used as is, and the city is refreshed in the background
+    4) no data in struct, no usable cache data, fretch from network
+If data needs to be fetched it goes through http_flight(), which parses
+the response into the city and passes it to city_save_cache(), and which
+lets concurrent lookups of the city share one request. The list lock is
+held throughout, except while that request runs. Every city looked up is
+kept warm from then on by the refresh scheduler.
+*/
+int http_get_weather_data(http_ctx_t* http_ctx, city_list_t* list,
+                          city_id_t id) {
+    return http_lookup(http_ctx, list, id, NULL, NULL);
+}
+
+/*
+http_lookup() is http_get_weather_data() for callers that must not touch
+the list afterwards, e.g. when other threads look up cities too. The
+city's values are copied into out_row, and where they came from into
+out_source, before the list lock is released. Either may be NULL.
+*/
+int http_lookup(http_ctx_t* http_ctx, city_list_t* list, city_id_t id,
+                city_data_t* out_row, http_source_t* out_source) {
+    http_source_t source = HTTP_FROM_NETWORK;
+    http_list_lock(http_ctx);
+    int status = http_get_weather_locked(http_ctx, list, id, &source);
+    if (status == STATUS_OK) {
+        http_refresh_touch(http_ctx, list, city_cell(list, id));
+        if (out_row) {
+            city_row(list, id, out_row);
+        }
+        if (out_source) {
+            *out_source = source; /* return through out-ptr */
+        }
+    }
+    http_list_unlock(http_ctx);
+    return status;
+}
+
+int http_get_weather_locked(http_ctx_t* http_ctx, city_list_t* list,
+                            city_id_t id, http_source_t* out_source) {
+    const char* name = list->text[id].name;
+
+    /*Check memory and cache for fresh data, or stale but usable*/
+    http_source_t source = HTTP_FROM_MEMORY;
+    int           age    = 0;
+    if (http_get_cached(list, id, DATA_STALE_MAX_S, &source, &age) ==
+        STATUS_OK) {
+        *out_source = source; /* return through out-ptr */
+        const char* where =
+            source == HTTP_FROM_MEMORY ? "in-memory data" : "cached file";
+        if (age <= DATA_MAX_AGE_S) {
+            printf("Using fresh %s for %s (age %d seconds).\n", where, name,
+                   age);
+            return STATUS_OK;
+        }
+        printf("Using stale %s for %s (age %d seconds), "
+               "refreshing in the background.\n",
+               where, name, age);
+        http_refresh_queue(http_ctx, list, city_cell(list, id));
+        return STATUS_OK;
+    }
+
+    /*All checks done, fetch from network*/
+    printf("Data missing, old, or cache invalid. Fetching from Meteo...\n");
+    if (http_flight(http_ctx, list, id) != STATUS_OK) {
+        fprintf(stderr, "HTTP request failed.\n");
         return STATUS_FAIL;
     }
 
-    int age = (int)(time(NULL) - json_integer_value(jat));
-    json_decref(root);
+    *out_source = HTTP_FROM_NETWORK; /* return through out-ptr */
+    return STATUS_OK;
+}
 
-    return age;
+/*
+http_get_cached() finds weather data for a city without the network:
+first in memory, then in the cache. Data up to max_age seconds old is
+used, and STATUS_OK is returned with where it was found and its age.
+STATUS_EXIT means the city has to be fetched. Called with the list lock
+held if the refresh worker may run.
+*/
+int http_get_cached(city_list_t* list, city_id_t id, int max_age,
+                    http_source_t* out_source, int* out_age) {
+    /*Check if struct data is usable*/
+    if (list->temp[id] != INIT_VAL) {
+        double age = difftime(time(NULL), list->cached_at[id]);
+        if (age <= max_age) {
+            *out_source = HTTP_FROM_MEMORY; /* return through out-ptr */
+            *out_age    = (int)age;
+            return STATUS_OK;
+        }
+    }
+
+    /*Check if there is a file for city in cache and if the data is usable*/
+    int file_age = -1;
+    if (city_load_cache(list, id, max_age, &file_age) == 0) {
+        /*Check that data in fetched cache is not INIT_VAL*/
+        if (list->temp[id] != INIT_VAL) {
+            *out_source = HTTP_FROM_FILE; /* return through out-ptr */
+            *out_age    = file_age;
+            return STATUS_OK;
+        }
+        printf("Cache exist but has no weather data\n");
+    }
+    return STATUS_EXIT;
 }
 
-int http_is_old(city_node_t* city_node) {
+/* ----- CACHING ----- */
+int http_is_old(city_list_t* list, city_id_t id) {
     time_t now = time(NULL);
-    double age = difftime(now, (time_t)city_node->data->cached_at);
+    double age = difftime(now, list->cached_at[id]);
     return age > (DATA_MAX_AGE_S);
 }
 
@@ -219,7 +949,7 @@ int http_is_old(city_node_t* city_node) {
 http_json_parse() parses the JSON-string and adds the parsed values
 for temperatur, windspeed and relative humidity to a city data.
 */
-int http_json_parse(char* http_response, city_node_t* city_node) {
+int http_json_parse(char* http_response, city_list_t* list, city_id_t id) {
     json_error_t error;
     json_t*      root = json_loads(http_response, 0, &error);
 
@@ -228,9 +958,78 @@ int http_json_parse(char* http_response, city_node_t* city_node) {
         return STATUS_FAIL;
     }
 
+    int status = http_json_current(root, list, id);
+    json_decref(root);
+    return status;
+}
+
+/*
+http_json_parse_batch() parses the response of a multi-location request
+into the n cities in ids, through http_json_rows().
+*/
+int http_json_parse_batch(char* http_response, city_list_t* list,
+                          const city_id_t* ids, size_t n) {
+    city_data_t rows[HTTP_BATCH_MAX];
+    if (n > HTTP_BATCH_MAX) {
+        return STATUS_FAIL;
+    }
+    int status = http_json_rows(http_response, rows, n);
+    http_stream_apply(list, rows, ids, n);
+    return status;
+}
+
+/*
+http_json_rows() parses the response of a multi-location request into
+rows, leaving INIT_VAL where a value is missing. Open-Meteo answers with
+an array holding one object per city in request order, or with a plain
+object when only one location was asked for.
+*/
+int http_json_rows(char* http_response, city_data_t* rows, size_t n) {
+    http_rows_clear(rows, n);
+    json_error_t error;
+    json_t*      root = json_loads(http_response, 0, &error);
+
+    if (!root) {
+        fprintf(stderr, "JSON error at line %d: %s\n", error.line, error.text);
+        return STATUS_FAIL;
+    }
+
+    int status = STATUS_OK;
+    if (json_is_object(root) && n == 1) {
+        status = http_json_row(root, &rows[0]);
+    } else if (json_is_array(root) && json_array_size(root) == n) {
+        for (size_t i = 0; i < n; i++) {
+            if (http_json_row(json_array_get(root, i), &rows[i]) != STATUS_OK) {
+                status = STATUS_FAIL;
+            }
+        }
+    } else {
+        fprintf(stderr, "Unexpected batch response for %zu cities.\n", n);
+        status = STATUS_FAIL;
+    }
+
+    json_decref(root);
+    return status;
+}
+
+/*
+http_json_current() copies temperature, windspeed and relative humidity
+from the "current" object of one forecast result into a city.
+*/
+int http_json_current(json_t* root, city_list_t* list, city_id_t id) {
+    city_data_t row;
+    http_rows_clear(&row, 1);
+    int status = http_json_row(root, &row);
+    http_stream_apply(list, &row, &id, 1);
+    return status;
+}
+
+/*
+http_json_row() is http_json_current() into a row instead of a city.
+*/
+int http_json_row(json_t* root, city_data_t* row) {
     json_t* current_weather = json_object_get(root, "current");
     if (!json_is_object(current_weather)) {
-        json_decref(root);
         return STATUS_FAIL;
     }
 
@@ -240,12 +1039,11 @@ int http_json_parse(char* http_response, city_node_t* city_node) {
         json_object_get(current_weather, "relative_humidity_2m");
 
     if (json_is_number(temperature))
-        city_node->data->temp = json_number_value(temperature);
+        row->temp = json_number_value(temperature);
     if (json_is_number(windspeed))
-        city_node->data->windspeed = json_number_value(windspeed);
+        row->windspeed = json_number_value(windspeed);
     if (json_is_number(rel_humidity))
-        city_node->data->rel_hum = json_number_value(rel_humidity);
+        row->rel_hum = json_number_value(rel_humidity);
 
-    json_decref(root);
     return STATUS_OK;
 }
@@ -1,26 +1,169 @@
 /* HTTP.h */
 
 #define DATA_MAX_AGE_S 900
+#define DATA_STALE_MAX_S 3600 /* stale data is served up to this age */
+#define HTTP_BATCH_MAX 100 /* cities per multi-location request */
+#define HTTP_POOL_SIZE 16  /* idle easy handles kept for reuse */
+#define HTTP_BUF_MIN 4096  /* first size of a buffer without Content-Length */
+#define HTTP_BUF_KEEP_MAX (1024 * 1024) /* larger buffers are not pooled */
+#define HTTP_REFRESH_QUEUE 16             /* cities waiting for the worker */
+#define HTTP_FLIGHTS_MAX 32 /* cells fetched for callers at the same time */
+#define HTTP_REFRESH_BUDGET 30 /* refreshes ahead of expiry a minute, 0 off */
+#define HTTP_CA_ENV "ETHERSKIES_CA_FILE" /* extra CA bundle, see README */
 #ifndef __HTTP_H_
 #    define __HTTP_H_
 
 #    include "city.h"
+#    include "jstream.h"
 #    include "meteo.h"
+#    include "schedule.h"
 
+#    include <curl/curl.h>
+#    include <pthread.h>
+#    include <stdbool.h>
+#    include <stddef.h>
 #    include <stdio.h>
 
 /* ----- Struct for CURL callback ----- */
+/*
+A response body. Buffers come from the pool in the HTTP context and go
+back to it with http_buf_put(), so their memory is reused by the next
+request instead of freed.
+*/
 typedef struct http_membuf http_membuf_t;
 struct http_membuf {
-    char*  data;
-    size_t size;
+    char*         data;
+    size_t        size;
+    size_t        cap;
+    CURL*         curl;     /* transfer filling the buffer, for its headers */
+    unsigned long reallocs; /* times data was (re)allocated */
+};
+
+/* ----- Structs for HTTP context ----- */
+typedef struct http_stats http_stats_t;
+struct http_stats {
+    unsigned long requests;
+    unsigned long connects;     /* requests that opened a new connection */
+    unsigned long handshakes;   /* requests that did a TLS handshake */
+    double        total_time;   /* seconds, summed over all requests */
+    double        connect_time; /* seconds spent connecting, incl. TLS */
+    unsigned long buf_fetches;  /* requests read into a buffer */
+    unsigned long buf_reallocs; /* buffer reallocs done by those requests */
+    unsigned long buf_frees;    /* buffers freed instead of pooled */
+    unsigned long stale_served; /* stale answers given while refreshing */
+    unsigned long refreshed;    /* cities refreshed in the background */
+};
+
+/* ----- Where weather data was found ----- */
+typedef enum http_source {
+    HTTP_FROM_MEMORY,
+    HTTP_FROM_FILE,
+    HTTP_FROM_NETWORK,
+} http_source_t;
+
+/* ----- Struct for background refresh ----- */
+typedef struct http_refresh http_refresh_t;
+struct http_refresh {
+    city_list_t* list;
+    city_id_t    id;
+};
+
+/* ----- Struct for a fetch other callers can share ----- */
+/*
+A weather model cell fetched for a caller has a flight while the request
+runs. Callers that want any city of the cell meanwhile wait for it and
+share its result rather than fetching the cell again. Guarded by the list
+lock.
+*/
+typedef struct http_flight http_flight_t;
+struct http_flight {
+    city_list_t*   list;
+    city_id_t      id;      /* the cell, see city_cell() */
+    bool           used;    /* taken until the last waiter has left */
+    bool           busy;    /* the request is still running */
+    int            status;  /* result, once no longer busy */
+    unsigned       waiters;
+    pthread_cond_t done;
+};
+
+/*
+One context is created in main() and lives for the whole run. Easy handles
+are kept in a pool so their connections stay warm, and every handle is
+attached to the share so DNS, connections and TLS sessions are reused
+across handles as well. Stale cities are refreshed by a worker thread,
+started on first use, which also keeps looked up cities warm as told by
+the scheduler. pool_lock also guards the queue and the scheduler.
+*/
+typedef struct http_ctx http_ctx_t;
+struct http_ctx {
+    CURLSH*         share;
+    pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+    CURL*           pool[HTTP_POOL_SIZE];
+    unsigned        idle; /* number of handles waiting in pool */
+    http_membuf_t   bufs[HTTP_POOL_SIZE];
+    unsigned        idle_bufs; /* number of buffers waiting in bufs */
+    pthread_mutex_t pool_lock;
+    http_stats_t    stats;
+    pthread_mutex_t list_lock; /* see http_list_lock() */
+    http_flight_t   flights[HTTP_FLIGHTS_MAX];
+    pthread_cond_t  flight_cond;     /* signalled when a flight is freed */
+    unsigned long   flights_issued;  /* requests made for a flight */
+    unsigned long   flights_shared;  /* callers that joined one instead */
+    pthread_t       refresher;
+    bool            refresher_running;
+    bool            refresher_quit;
+    pthread_cond_t  refresh_cond;
+    http_refresh_t  refresh[HTTP_REFRESH_QUEUE]; /* front one is in flight */
+    unsigned        num_refresh;
+    schedule_t*     schedule;
+    city_list_t*    schedule_list; /* the first list looked up, the only one */
 };
 
 /* ----- Public functions ----- */
-int    http_get_weather_data(city_node_t* city_node);
-char*  http_get(city_node_t* city_node);
+int    http_init(http_ctx_t** http_ctx);
+int    http_dispose(http_ctx_t** http_ctx);
+CURL*  http_acquire(http_ctx_t* http_ctx);
+void   http_release(http_ctx_t* http_ctx, CURL* curl);
+void   http_stats_add(http_ctx_t* http_ctx, CURL* curl);
+void   http_list_lock(http_ctx_t* http_ctx);
+void   http_list_unlock(http_ctx_t* http_ctx);
+int    http_get_weather_data(http_ctx_t* http_ctx, city_list_t* city_list,
+                             city_id_t id);
+int    http_lookup(http_ctx_t* http_ctx, city_list_t* city_list, city_id_t id,
+                   city_data_t* out_row, http_source_t* out_source);
+int    http_get_cached(city_list_t* city_list, city_id_t id, int max_age,
+                       http_source_t* out_source, int* out_age);
+int    http_flight_claim(http_ctx_t* http_ctx, city_list_t* city_list,
+                         city_id_t id, http_flight_t** out_flight);
+void   http_flight_finish(http_ctx_t* http_ctx, http_flight_t* flight,
+                          int status);
+int    http_flight_leave(http_ctx_t* http_ctx, http_flight_t* flight);
+void   http_buf_get(http_ctx_t* http_ctx, http_membuf_t* buf);
+void   http_buf_put(http_ctx_t* http_ctx, http_membuf_t* buf);
+int    http_get(http_ctx_t* http_ctx, city_list_t* city_list, city_id_t id,
+                http_membuf_t* out_body);
+int    http_get_url(http_ctx_t* http_ctx, const char* url,
+                    http_membuf_t* out_body);
 size_t http_write_data(void* buffer, size_t size, size_t nmemb, void* userp);
-int    http_json_parse(char* http_response, city_node_t* city_node);
-int    http_is_old(city_node_t* city_node);
+size_t http_write_stream(void* buffer, size_t size, size_t nmemb,
+                         void* userp);
+void   http_stream_start(jstream_t* parser, city_data_t* rows, size_t n);
+void   http_stream_apply(city_list_t* city_list, const city_data_t* rows,
+                         const city_id_t* ids, size_t n);
+int    http_get_rows(http_ctx_t* http_ctx, const char* url, city_data_t* rows,
+                     size_t n);
+int    http_get_rows_json(http_ctx_t* http_ctx, const char* url,
+                          city_data_t* rows, size_t n);
+int    http_get_current(http_ctx_t* http_ctx, const char* url,
+                        city_list_t* city_list, const city_id_t* ids, size_t n);
+int    http_get_current_json(http_ctx_t* http_ctx, const char* url,
+                             city_list_t* city_list, const city_id_t* ids,
+                             size_t n);
+int    http_json_parse(char* http_response, city_list_t* city_list,
+                       city_id_t id);
+int    http_json_parse_batch(char* http_response, city_list_t* city_list,
+                             const city_id_t* ids, size_t n);
+int    http_json_rows(char* http_response, city_data_t* rows, size_t n);
+int    http_is_old(city_list_t* city_list, city_id_t id);
 
 #endif /* __HTTP_H_ */
\ No newline at end of file
@@ -0,0 +1,107 @@
+/*
+    arena.c contains the allocator that owns all memory of the city list:
+    - handles bump allocation out of large chunks (the city strings)
+    - handles releasing everything at once
+
+    Chunks double in size, so n allocations cost about log2(n) mallocs.
+*/
+
+#include "arena.h"
+
+#include "city.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* ----- PRIVATE FUNCTIONS ----- */
+void* arena_bump(arena_t* arena, size_t size);
+
+/* ----- CREATE & DISPOSE ----- */
+int arena_create(arena_t** out_arena) {
+    if (!out_arena) {
+        return STATUS_FAIL;
+    }
+    arena_t* arena = calloc(1, sizeof(arena_t));
+    if (!arena) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    pthread_mutex_init(&arena->lock, NULL);
+
+    *out_arena = arena; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+/*
+arena_dispose() frees every chunk, and with them everything that was ever
+allocated from the arena.
+*/
+int arena_dispose(arena_t** arena) {
+    if (!arena || !*arena) {
+        return STATUS_FAIL;
+    }
+    arena_chunk_t* chunk = (*arena)->chunks;
+    while (chunk) {
+        arena_chunk_t* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    pthread_mutex_destroy(&(*arena)->lock);
+    free(*arena);
+    *arena = NULL;
+    return STATUS_OK;
+}
+
+/* ----- ALLOCATION ----- */
+/*
+arena_alloc() returns size bytes aligned to ARENA_ALIGN, or NULL if a new
+chunk was needed and could not be allocated.
+*/
+void* arena_alloc(arena_t* arena, size_t size) {
+    if (!arena) {
+        return NULL;
+    }
+    pthread_mutex_lock(&arena->lock);
+    void* ptr = arena_bump(arena, size);
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+/*
+arena_bump() does the work of arena_alloc() with the lock held. When the
+newest chunk is full a new one is started, twice the size of the last (up
+to ARENA_CHUNK_MAX) or larger if the request needs it. The rest of the
+full chunk is left unused.
+*/
+void* arena_bump(arena_t* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    arena_chunk_t* chunk = arena->chunks;
+    if (!chunk || chunk->cap - chunk->used < size) {
+        size_t cap = chunk ? chunk->cap * 2 : ARENA_CHUNK_MIN;
+        if (cap > ARENA_CHUNK_MAX) {
+            cap = ARENA_CHUNK_MAX;
+        }
+        if (cap < size) {
+            cap = size;
+        }
+        /*The header is padded so the data after it stays aligned*/
+        size_t header = (sizeof(arena_chunk_t) + ARENA_ALIGN - 1) &
+                        ~(size_t)(ARENA_ALIGN - 1);
+        chunk = malloc(header + cap);
+        if (!chunk) {
+            printf("Malloc failed\n");
+            return NULL;
+        }
+        chunk->next   = arena->chunks;
+        chunk->used   = header;
+        chunk->cap    = header + cap;
+        arena->chunks = chunk;
+        arena->num_chunks++;
+    }
+
+    void* ptr = (char*)chunk + chunk->used;
+    chunk->used += size;
+    arena->bytes += size;
+    return ptr;
+}
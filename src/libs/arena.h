@@ -0,0 +1,38 @@
+/* arena.h */
+
+#ifndef __ARENA_H_
+#define __ARENA_H_
+#define ARENA_CHUNK_MIN (64 * 1024)       /* size of the first chunk */
+#define ARENA_CHUNK_MAX (4 * 1024 * 1024) /* chunks double up to this */
+#define ARENA_ALIGN 16
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* ----- Structs for bump allocation ----- */
+/*
+An arena hands out memory from large chunks by bumping an offset, and
+frees it all at once. Nothing is freed on its own. The lock makes it safe
+to allocate from several threads (the boot pool does).
+*/
+typedef struct arena_chunk arena_chunk_t;
+struct arena_chunk {
+    arena_chunk_t* next;
+    size_t         used;
+    size_t         cap; /* bytes following the header */
+};
+
+typedef struct arena arena_t;
+struct arena {
+    arena_chunk_t*  chunks; /* newest first, allocations come from it */
+    pthread_mutex_t lock;
+    size_t          num_chunks; /* mallocs done by the arena */
+    size_t          bytes;      /* bytes handed out */
+};
+
+/* ----- Public functions ----- */
+int   arena_create(arena_t** arena);
+int   arena_dispose(arena_t** arena);
+void* arena_alloc(arena_t* arena, size_t size);
+
+#endif /* __ARENA_H_ */
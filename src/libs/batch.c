@@ -0,0 +1,533 @@
+/*
+    batch.c contains the non-interactive bulk query mode:
+    - handles the command line (--cities, --format) and names on stdin
+    - handles resolving every city: memory and cache first, then all
+      misses at once through the fetch engine
+    - handles writing one NDJSON or CSV record per city as it resolves
+
+    Records go through a single buffered stream on the original stdout.
+    Everything the other modules print is sent to stderr meanwhile, so the
+    output can be piped straight into another program.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "batch.h"
+
+#include "fetch.h"
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* ----- PRIVATE FUNCTIONS ----- */
+void batch_usage(const char* prog);
+int  batch_add_name(char*** names, size_t* n, size_t* cap, const char* name,
+                    size_t len);
+int  batch_split(const char* cities, char*** out_names, size_t* out_n);
+int  batch_read(FILE* in, char*** out_names, size_t* out_n);
+int  batch_near(city_list_t* list, double lat, double lon, double km,
+                char*** out_names, size_t* out_n);
+void batch_free_names(char** names, size_t n);
+void batch_done(city_id_t id, int status, void* userp);
+void batch_json_str(FILE* out, const char* str);
+void batch_value(batch_t* batch, const char* sep, double value);
+void batch_csv_str(FILE* out, const char* str);
+
+static const char* batch_sources[] = {"memory", "file", "network"};
+
+/*
+batch_main() runs a whole bulk query from the command line:
+
+    etherskies --cities Stockholm,Lund --format csv
+    etherskies --format ndjson < names.txt
+    etherskies --near 59.33,18.07 --radius 50
+
+Without --cities (or with --cities -) the names are read from stdin, one
+per line. With --socket PATH the query is sent to the daemon listening
+there instead of being resolved by this process. --near LAT,LON asks for
+the city nearest to a point instead, or with --radius KM for every city
+within KM of it, nearest first. Returns 0 if every city
+was resolved, 1 if some were unknown or could not be fetched (the rest
+are still written), and BATCH_EXIT_USAGE for bad arguments.
+*/
+int batch_main(int argc, char** argv) {
+    const char*    cities = NULL;
+    const char*    sock   = NULL;
+    batch_format_t format = BATCH_NDJSON;
+    bool           near   = false;
+    double         lat    = 0.0;
+    double         lon    = 0.0;
+    double         radius = -1.0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cities") == 0 && i + 1 < argc) {
+            cities = argv[++i];
+        } else if (strcmp(argv[i], "--near") == 0 && i + 1 < argc) {
+            char extra = '\0';
+            near       = sscanf(argv[++i], "%lf , %lf %c", &lat, &lon,
+                                &extra) == 2 &&
+                   lat >= -90.0 && lat <= 90.0 && lon >= -180.0 &&
+                   lon <= 180.0;
+            if (!near) {
+                fprintf(stderr, "Bad coordinates: %s\n", argv[i]);
+                batch_usage(argv[0]);
+                return BATCH_EXIT_USAGE;
+            }
+        } else if (strcmp(argv[i], "--radius") == 0 && i + 1 < argc) {
+            char* end = NULL;
+            radius    = strtod(argv[++i], &end);
+            if (*end != '\0' || !(radius >= 0.0)) {
+                fprintf(stderr, "Bad radius: %s\n", argv[i]);
+                batch_usage(argv[0]);
+                return BATCH_EXIT_USAGE;
+            }
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            sock = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "ndjson") == 0) {
+                format = BATCH_NDJSON;
+            } else if (strcmp(argv[i], "csv") == 0) {
+                format = BATCH_CSV;
+            } else {
+                fprintf(stderr, "Unknown format: %s\n", argv[i]);
+                batch_usage(argv[0]);
+                return BATCH_EXIT_USAGE;
+            }
+        } else {
+            batch_usage(argv[0]);
+            return BATCH_EXIT_USAGE;
+        }
+    }
+
+    if ((near && (cities || sock)) || (radius >= 0.0 && !near)) {
+        fprintf(stderr, "--near takes no --cities or --socket, and --radius "
+                        "needs --near\n");
+        batch_usage(argv[0]);
+        return BATCH_EXIT_USAGE;
+    }
+
+    /*With --near the names are only known once the list is loaded*/
+    char** names = NULL;
+    size_t n     = 0;
+    int    read  = STATUS_OK;
+    if (!near) {
+        read = cities && strcmp(cities, "-") != 0
+                   ? batch_split(cities, &names, &n)
+                   : batch_read(stdin, &names, &n);
+    }
+    if (read != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+
+    /*The daemon does the work, this process only copies its records*/
+    if (sock) {
+        setvbuf(stdout, NULL, _IOFBF, BATCH_BUF_SIZE);
+        int status = server_query(sock, format, names, n, stdout);
+        batch_free_names(names, n);
+        if (fflush(stdout) != 0) {
+            perror("Failed to write output");
+            status = STATUS_FAIL;
+        }
+        return status == STATUS_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /*Keep stdout for the records and send all other output to stderr*/
+    fflush(stdout);
+    int   fd  = dup(STDOUT_FILENO);
+    FILE* out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        perror("Failed to set up output");
+        if (out) {
+            fclose(out);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        batch_free_names(names, n);
+        return STATUS_FAIL;
+    }
+    setvbuf(out, NULL, _IOFBF, BATCH_BUF_SIZE);
+
+    batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.out    = out;
+    batch.format = format;
+    int status   = STATUS_FAIL;
+    if (city_init(&batch.list) != STATUS_OK) {
+        fprintf(stderr, "Failed to init app.\n");
+    } else if (http_init(&batch.http) != STATUS_OK) {
+        fprintf(stderr, "Failed to init HTTP.\n");
+    } else if (near && batch_near(batch.list, lat, lon, radius, &names,
+                                  &n) != STATUS_OK) {
+        fprintf(stderr, "Failed to look up coordinates.\n");
+    } else {
+        status = batch_run(&batch, names, n);
+    }
+    if (batch.http) {
+        http_dispose(&batch.http);
+    }
+    if (batch.list) {
+        city_dispose(&batch.list);
+    }
+    batch_free_names(names, n);
+
+    if (fclose(out) != 0) {
+        perror("Failed to write output");
+        status = STATUS_FAIL;
+    }
+    return status == STATUS_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void batch_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [--cities NAME,NAME,...|-] [--format ndjson|csv] "
+            "[--socket PATH]\n"
+            "       %s --near LAT,LON [--radius KM] [--format ndjson|csv]\n"
+            "       %s --serve [--socket PATH]\n"
+            "       %s --import FILE|-\n"
+            "       %s --mock [--port N] [--latency MS] [--errors RATE] "
+            "...\n"
+            "Without --cities, city names are read from stdin, one per "
+            "line.\n",
+            prog, prog, prog, prog, prog);
+}
+
+/*
+batch_run() resolves the cities named in names and writes a record for
+each as soon as it is known. Cities with fresh data in memory or cache are
+written first, in one go. The rest are fetched concurrently and written as
+their transfers complete; a city that cannot be fetched falls back to
+stale data if there is any. Every city is written once, however often it
+is named. Returns STATUS_FAIL if any name got an error record, which
+every city the fetch engine gave up on without reporting also gets.
+*/
+int batch_run(batch_t* batch, char** names, size_t n) {
+    city_list_t* list    = batch->list;
+    city_id_t*   misses  = malloc((n ? n : 1) * sizeof(city_id_t));
+    bool*        seen    = calloc(list->size ? list->size : 1, sizeof(bool));
+    bool*        pending = calloc(list->size ? list->size : 1, sizeof(bool));
+    if (!misses || !seen || !pending) {
+        printf("Malloc failed\n");
+        free(misses);
+        free(seen);
+        free(pending);
+        return STATUS_FAIL;
+    }
+
+    batch_header(batch->format, batch->out);
+
+    /*Memory and cache first, everything else is collected for the network*/
+    size_t num_misses = 0;
+    http_list_lock(batch->http);
+    for (size_t i = 0; i < n; i++) {
+        city_id_t id = 0;
+        if (city_find(list, names[i], &id) != STATUS_OK) {
+            batch_write_error(batch, names[i], "unknown city");
+            continue;
+        }
+        if (seen[id]) {
+            continue;
+        }
+        seen[id] = true;
+
+        city_data_t   row;
+        http_source_t source = HTTP_FROM_MEMORY;
+        int           age    = 0;
+        if (http_get_cached(list, id, DATA_MAX_AGE_S, &source, &age) ==
+            STATUS_OK) {
+            city_row(list, id, &row);
+            batch_write(batch, &row, source, false);
+            continue;
+        }
+        misses[num_misses++] = id;
+        pending[id]          = true;
+    }
+    http_list_unlock(batch->http);
+    fflush(batch->out);
+
+    /*A broken multi handle leaves cities unreported, they failed too*/
+    batch->pending = pending;
+    if (fetch_run(batch->http, list, misses, num_misses, FETCH_MAX_INFLIGHT,
+                  batch_done, batch) != STATUS_OK) {
+        http_list_lock(batch->http);
+        for (size_t i = 0; i < num_misses; i++) {
+            if (pending[misses[i]]) {
+                batch_write_error(batch, list->text[misses[i]].name,
+                                  "fetch failed");
+            }
+        }
+        http_list_unlock(batch->http);
+    }
+    batch->pending = NULL;
+    fflush(batch->out);
+
+    free(misses);
+    free(seen);
+    free(pending);
+    return batch->failed ? STATUS_FAIL : STATUS_OK;
+}
+
+/*
+batch_done() is called by the fetch engine for each city it was given.
+The row, or the stale one a failed fetch falls back to, is copied out
+under the list lock; it is written and flushed after the lock is let go,
+so a slow consumer never holds up lookups. Each record is flushed right
+away: transfers complete milliseconds apart, so the consumer sees results
+as they come at no real cost.
+*/
+void batch_done(city_id_t id, int status, void* userp) {
+    batch_t*      batch  = userp;
+    city_data_t   row;
+    http_source_t source = HTTP_FROM_NETWORK;
+    bool          stale  = status != STATUS_OK;
+    int           age    = 0;
+
+    http_list_lock(batch->http);
+    const char* name = batch->list->text[id].name;
+    if (stale && http_get_cached(batch->list, id, DATA_STALE_MAX_S, &source,
+                                 &age) == STATUS_OK) {
+        status = STATUS_OK;
+    }
+    if (status == STATUS_OK) {
+        city_row(batch->list, id, &row);
+    }
+    http_list_unlock(batch->http);
+
+    if (batch->pending) {
+        batch->pending[id] = false;
+    }
+    if (status == STATUS_OK) {
+        batch_write(batch, &row, source, stale);
+    } else {
+        batch_write_error(batch, name, "fetch failed");
+    }
+    fflush(batch->out);
+}
+
+/* ----- NAMES ----- */
+/*
+batch_add_name() appends a copy of the first len bytes of name, without
+surrounding whitespace. Empty names are skipped.
+*/
+int batch_add_name(char*** names, size_t* n, size_t* cap, const char* name,
+                   size_t len) {
+    while (len > 0 && strchr(" \t\r\n", name[0])) {
+        name++;
+        len--;
+    }
+    while (len > 0 && strchr(" \t\r\n", name[len - 1])) {
+        len--;
+    }
+    if (len == 0) {
+        return STATUS_OK;
+    }
+
+    if (*n == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 16;
+        char** grown   = realloc(*names, new_cap * sizeof(char*));
+        if (!grown) {
+            printf("Malloc failed\n");
+            return STATUS_FAIL;
+        }
+        *names = grown;
+        *cap   = new_cap;
+    }
+    char* copy = malloc(len + 1);
+    if (!copy) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    memcpy(copy, name, len);
+    copy[len]    = '\0';
+    (*names)[*n] = copy;
+    (*n)++;
+    return STATUS_OK;
+}
+
+int batch_split(const char* cities, char*** out_names, size_t* out_n) {
+    char** names = NULL;
+    size_t n     = 0;
+    size_t cap   = 0;
+    for (const char* p = cities;; p++) {
+        size_t len = strcspn(p, ",");
+        if (batch_add_name(&names, &n, &cap, p, len) != STATUS_OK) {
+            batch_free_names(names, n);
+            return STATUS_FAIL;
+        }
+        p += len;
+        if (*p == '\0') {
+            break;
+        }
+    }
+
+    *out_names = names; /* return through out-ptr */
+    *out_n     = n;
+    return STATUS_OK;
+}
+
+int batch_read(FILE* in, char*** out_names, size_t* out_n) {
+    char**  names = NULL;
+    size_t  n     = 0;
+    size_t  cap   = 0;
+    char*   line  = NULL;
+    size_t  size  = 0;
+    ssize_t len   = 0;
+    while ((len = getline(&line, &size, in)) >= 0) {
+        if (batch_add_name(&names, &n, &cap, line, (size_t)len) !=
+            STATUS_OK) {
+            free(line);
+            batch_free_names(names, n);
+            return STATUS_FAIL;
+        }
+    }
+    free(line);
+
+    *out_names = names; /* return through out-ptr */
+    *out_n     = n;
+    return STATUS_OK;
+}
+
+/*
+batch_near() names the city nearest to a point, or with km >= 0 every
+city within km of it, nearest first.
+*/
+int batch_near(city_list_t* list, double lat, double lon, double km,
+               char*** out_names, size_t* out_n) {
+    city_id_t* ids = malloc((list->size ? list->size : 1) * sizeof(city_id_t));
+    if (!ids) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    size_t found = 0;
+    if (km >= 0.0) {
+        found = city_within(list, lat, lon, km, ids);
+    } else if (city_nearest(list, lat, lon, &ids[0]) == STATUS_OK) {
+        found = 1;
+    }
+
+    char** names = NULL;
+    size_t n     = 0;
+    size_t cap   = 0;
+    for (size_t i = 0; i < found; i++) {
+        const char* name = list->text[ids[i]].name;
+        if (batch_add_name(&names, &n, &cap, name, strlen(name)) !=
+            STATUS_OK) {
+            batch_free_names(names, n);
+            free(ids);
+            return STATUS_FAIL;
+        }
+    }
+    free(ids);
+
+    *out_names = names; /* return through out-ptr */
+    *out_n     = n;
+    return STATUS_OK;
+}
+
+void batch_free_names(char** names, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+/* ----- RECORDS ----- */
+void batch_header(batch_format_t format, FILE* out) {
+    if (format == BATCH_CSV) {
+        fputs("name,lat,lon,temp,windspeed,rel_hum,cached_at,source,stale,"
+              "error\n",
+              out);
+    }
+}
+
+/*
+batch_write() writes the record of one city. It only reads row, so it can
+be called after the list lock is released. A value the city has none of
+(INIT_VAL) is written as null, or as an empty field in CSV.
+*/
+void batch_write(batch_t* batch, const city_data_t* row,
+                 http_source_t source, bool stale) {
+    FILE* out = batch->out;
+    bool  csv = batch->format == BATCH_CSV;
+    if (csv) {
+        batch_csv_str(out, row->name);
+        fprintf(out, ",%.4f,%.4f", row->lat, row->lon);
+    } else {
+        fputs("{\"name\":", out);
+        batch_json_str(out, row->name);
+        fprintf(out, ",\"lat\":%.4f,\"lon\":%.4f", row->lat, row->lon);
+    }
+    batch_value(batch, csv ? "," : ",\"temp\":", row->temp);
+    batch_value(batch, csv ? "," : ",\"windspeed\":", row->windspeed);
+    batch_value(batch, csv ? "," : ",\"rel_hum\":", row->rel_hum);
+    if (csv) {
+        fprintf(out, ",%lld,%s,%s,\n", (long long)row->cached_at,
+                batch_sources[source], stale ? "true" : "false");
+    } else {
+        fprintf(out, ",\"cached_at\":%lld,\"source\":\"%s\",\"stale\":%s}\n",
+                (long long)row->cached_at, batch_sources[source],
+                stale ? "true" : "false");
+    }
+    batch->resolved++;
+}
+
+/*
+batch_value() writes sep and one weather value: null for INIT_VAL, or
+nothing at all in CSV.
+*/
+void batch_value(batch_t* batch, const char* sep, double value) {
+    fputs(sep, batch->out);
+    if (value != INIT_VAL) {
+        fprintf(batch->out, "%.2f", value);
+    } else if (batch->format != BATCH_CSV) {
+        fputs("null", batch->out);
+    }
+}
+
+void batch_write_error(batch_t* batch, const char* name, const char* error) {
+    FILE* out = batch->out;
+    if (batch->format == BATCH_CSV) {
+        batch_csv_str(out, name);
+        fprintf(out, ",,,,,,,,,%s\n", error);
+    } else {
+        fputs("{\"name\":", out);
+        batch_json_str(out, name);
+        fprintf(out, ",\"error\":\"%s\"}\n", error);
+    }
+    batch->failed++;
+}
+
+void batch_json_str(FILE* out, const char* str) {
+    fputc('"', out);
+    for (const unsigned char* p = (const unsigned char*)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', out);
+            fputc(*p, out);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+batch_csv_str() quotes a field only when it has to (RFC 4180).
+*/
+void batch_csv_str(FILE* out, const char* str) {
+    if (!str[strcspn(str, ",\"\r\n")]) {
+        fputs(str, out);
+        return;
+    }
+    fputc('"', out);
+    for (const char* p = str; *p; p++) {
+        if (*p == '"') {
+            fputc('"', out);
+        }
+        fputc(*p, out);
+    }
+    fputc('"', out);
+}
@@ -0,0 +1,46 @@
+/* batch.h */
+
+#ifndef __BATCH_H_
+#define __BATCH_H_
+#define BATCH_BUF_SIZE (64 * 1024) /* output buffer, flushed when full */
+#define BATCH_EXIT_USAGE 2         /* exit code for bad arguments */
+
+#include "HTTP.h"
+#include "city.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* ----- Output formats ----- */
+typedef enum batch_format {
+    BATCH_NDJSON,
+    BATCH_CSV,
+} batch_format_t;
+
+/* ----- Struct for one bulk query ----- */
+/*
+Records go to out, one per city, in the order the cities are resolved.
+Nothing else is written to out; the diagnostics of the other modules are
+sent to stderr while a batch runs.
+*/
+typedef struct batch batch_t;
+struct batch {
+    city_list_t*   list;
+    http_ctx_t*    http;
+    FILE*          out;
+    batch_format_t format;
+    unsigned       resolved;
+    unsigned       failed;  /* unknown or could not be resolved */
+    bool*          pending; /* by id, fetches not reported yet */
+};
+
+/* ----- Public functions ----- */
+int  batch_main(int argc, char** argv);
+int  batch_run(batch_t* batch, char** names, size_t n);
+void batch_header(batch_format_t format, FILE* out);
+void batch_write(batch_t* batch, const city_data_t* row,
+                 http_source_t source, bool stale);
+void batch_write_error(batch_t* batch, const char* name, const char* error);
+
+#endif /* __BATCH_H_ */
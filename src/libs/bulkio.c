@@ -0,0 +1,532 @@
+/*
+    bulkio.c contains functions that:
+    - handles reading and writing whole files in batches
+    - handles the io_uring ring, set up through the raw syscalls
+    - handles the POSIX fallback, one file at a time
+
+    A read opens a file, finds its size, reads all of it into a buffer of
+    its own and closes it. A write creates or truncates a file, writes it,
+    fsyncs and closes it. With io_uring a round of up to BULKIO_DEPTH files
+    takes two submissions: first every open (and for reads every statx),
+    then for every file its read or write linked to its fsync and close,
+    which the kernel runs in that order.
+*/
+
+#define _GNU_SOURCE
+
+#include "bulkio.h"
+
+#include "city.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if BULKIO_URING && defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define BULKIO_HAVE_URING 1
+#else
+#define BULKIO_HAVE_URING 0
+#endif
+
+/* ----- PRIVATE FUNCTIONS ----- */
+int bulkio_read_file(bulkio_file_t* file);
+int bulkio_write_file(bulkio_file_t* file);
+#if BULKIO_HAVE_URING
+int                  bulkio_setup(bulkio_t* io);
+int                  bulkio_probe(bulkio_t* io);
+void                 bulkio_unmap(bulkio_t* io);
+struct io_uring_sqe* bulkio_sqe(bulkio_t* io, int opcode, int fd,
+                                unsigned tag);
+int                  bulkio_run(bulkio_t* io, unsigned tags);
+void                 bulkio_read_round(bulkio_t* io, bulkio_file_t* files,
+                                       size_t n, struct statx* stats);
+void                 bulkio_write_round(bulkio_t* io, bulkio_file_t* files,
+                                        size_t n);
+#endif
+
+/* ----- CREATE & DISPOSE ----- */
+/*
+bulkio_create() sets up an io_uring ring if uring is true and the kernel
+lets us, and otherwise leaves the batch to plain POSIX calls. Only fails
+without memory.
+*/
+int bulkio_create(bulkio_t** out_io, bool uring) {
+    if (!out_io) {
+        return STATUS_FAIL;
+    }
+    bulkio_t* io = calloc(1, sizeof(bulkio_t));
+    if (!io) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    io->ring = -1;
+#if BULKIO_HAVE_URING
+    if (uring && bulkio_setup(io) != STATUS_OK) {
+        bulkio_unmap(io);
+    }
+#else
+    (void)uring;
+#endif
+    *out_io = io; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+int bulkio_dispose(bulkio_t** io) {
+    if (!io || !*io) {
+        return STATUS_FAIL;
+    }
+#if BULKIO_HAVE_URING
+    bulkio_unmap(*io);
+#endif
+    free(*io);
+    *io = NULL;
+    return STATUS_OK;
+}
+
+bool bulkio_uring(const bulkio_t* io) {
+    return io && io->ring >= 0;
+}
+
+/* ----- BATCHES ----- */
+/*
+bulkio_read() reads n whole files. Every file gets data and len, or error
+and no data. io may be NULL for POSIX calls. Returns STATUS_FAIL if any
+file could not be read.
+*/
+int bulkio_read(bulkio_t* io, bulkio_file_t* files, size_t n) {
+    size_t done = 0;
+#if BULKIO_HAVE_URING
+    if (bulkio_uring(io)) {
+        struct statx* stats = malloc(BULKIO_DEPTH * sizeof(struct statx));
+        if (!stats) {
+            printf("Malloc failed\n");
+            return STATUS_FAIL;
+        }
+        for (; done < n; done += BULKIO_DEPTH) {
+            size_t m = n - done < BULKIO_DEPTH ? n - done : BULKIO_DEPTH;
+            bulkio_read_round(io, files + done, m, stats);
+        }
+        free(stats);
+        done = n;
+    }
+#else
+    (void)io;
+#endif
+    for (; done < n; done++) {
+        bulkio_read_file(&files[done]);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (files[i].error) {
+            return STATUS_FAIL;
+        }
+    }
+    return STATUS_OK;
+}
+
+/*
+bulkio_write() writes data and len of n files and fsyncs every one of
+them. io may be NULL for POSIX calls. Returns STATUS_FAIL if any file
+could not be written; its error says why.
+*/
+int bulkio_write(bulkio_t* io, bulkio_file_t* files, size_t n) {
+    size_t done = 0;
+#if BULKIO_HAVE_URING
+    if (bulkio_uring(io)) {
+        for (; done < n; done += BULKIO_DEPTH) {
+            size_t m = n - done < BULKIO_DEPTH ? n - done : BULKIO_DEPTH;
+            bulkio_write_round(io, files + done, m);
+        }
+        done = n;
+    }
+#else
+    (void)io;
+#endif
+    for (; done < n; done++) {
+        bulkio_write_file(&files[done]);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (files[i].error) {
+            return STATUS_FAIL;
+        }
+    }
+    return STATUS_OK;
+}
+
+/* ----- POSIX ----- */
+int bulkio_read_file(bulkio_file_t* file) {
+    file->data  = NULL;
+    file->len   = 0;
+    file->error = 0;
+    struct stat st;
+    int         fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        file->error = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return STATUS_FAIL;
+    }
+    file->data = malloc((size_t)st.st_size + 1);
+    if (!file->data) {
+        printf("Malloc failed\n");
+        file->error = ENOMEM;
+        close(fd);
+        return STATUS_FAIL;
+    }
+    while (file->len < (size_t)st.st_size) {
+        ssize_t got =
+            read(fd, file->data + file->len, (size_t)st.st_size - file->len);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            file->error = got < 0 ? errno : 0;
+            break; /* cut short since fstat(), keep what is there */
+        }
+        file->len += (size_t)got;
+    }
+    close(fd);
+    if (file->error) {
+        free(file->data);
+        file->data = NULL;
+        file->len  = 0;
+        return STATUS_FAIL;
+    }
+    file->data[file->len] = '\0';
+    return STATUS_OK;
+}
+
+int bulkio_write_file(bulkio_file_t* file) {
+    file->error = 0;
+    int fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        file->error = errno;
+        return STATUS_FAIL;
+    }
+    size_t done = 0;
+    while (done < file->len) {
+        ssize_t put = write(fd, file->data + done, file->len - done);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put < 0) {
+            file->error = errno;
+            break;
+        }
+        done += (size_t)put;
+    }
+    if (!file->error && fsync(fd) != 0) {
+        file->error = errno;
+    }
+    if (close(fd) != 0 && !file->error) {
+        file->error = errno;
+    }
+    return file->error ? STATUS_FAIL : STATUS_OK;
+}
+
+#if BULKIO_HAVE_URING
+/* ----- IO_URING ----- */
+/*
+bulkio_setup() creates the ring and maps its queues. The ring is four
+times BULKIO_DEPTH, as a round queues up to three entries per file.
+Fails if the kernel has no io_uring or lacks one of the operations used.
+*/
+int bulkio_setup(bulkio_t* io) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    io->ring = (int)syscall(__NR_io_uring_setup, BULKIO_DEPTH * 4, &params);
+    if (io->ring < 0) {
+        return STATUS_FAIL;
+    }
+    io->entries    = params.sq_entries;
+    io->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_map_len =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    bool single  = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && io->cq_map_len > io->sq_map_len) {
+        io->sq_map_len = io->cq_map_len;
+    }
+
+    io->sq_map = mmap(NULL, io->sq_map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_SQ_RING);
+    if (io->sq_map == MAP_FAILED) {
+        io->sq_map = NULL;
+        return STATUS_FAIL;
+    }
+    if (single) {
+        io->cq_map = io->sq_map;
+    } else {
+        io->cq_map =
+            mmap(NULL, io->cq_map_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_CQ_RING);
+        if (io->cq_map == MAP_FAILED) {
+            io->cq_map = NULL;
+            return STATUS_FAIL;
+        }
+    }
+    io->sqes = mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) {
+        io->sqes = NULL;
+        return STATUS_FAIL;
+    }
+
+    char* sq     = io->sq_map;
+    char* cq     = io->cq_map;
+    io->sq_tail  = (unsigned*)(sq + params.sq_off.tail);
+    io->sq_mask  = (unsigned*)(sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned*)(sq + params.sq_off.array);
+    io->cq_head  = (unsigned*)(cq + params.cq_off.head);
+    io->cq_tail  = (unsigned*)(cq + params.cq_off.tail);
+    io->cq_mask  = (unsigned*)(cq + params.cq_off.ring_mask);
+    io->cqes     = cq + params.cq_off.cqes;
+    io->results  = malloc(io->entries * sizeof(int));
+    if (!io->results) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    return bulkio_probe(io);
+}
+
+int bulkio_probe(bulkio_t* io) {
+    static const int ops[] = {IORING_OP_OPENAT, IORING_OP_STATX,
+                              IORING_OP_READ,   IORING_OP_WRITE,
+                              IORING_OP_FSYNC,  IORING_OP_CLOSE};
+    size_t len = sizeof(struct io_uring_probe) +
+                 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, len);
+    if (!probe) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    int status = STATUS_OK;
+    if (syscall(__NR_io_uring_register, io->ring, IORING_REGISTER_PROBE,
+                probe, 256) < 0) {
+        status = STATUS_FAIL;
+    }
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op ||
+            !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            status = STATUS_FAIL;
+        }
+    }
+    free(probe);
+    return status;
+}
+
+/*
+bulkio_unmap() undoes what bulkio_setup() got to, leaving io on POSIX
+calls.
+*/
+void bulkio_unmap(bulkio_t* io) {
+    if (io->sqes) {
+        munmap(io->sqes, io->sqes_len);
+    }
+    if (io->cq_map && io->cq_map != io->sq_map) {
+        munmap(io->cq_map, io->cq_map_len);
+    }
+    if (io->sq_map) {
+        munmap(io->sq_map, io->sq_map_len);
+    }
+    if (io->ring >= 0) {
+        close(io->ring);
+    }
+    free(io->results);
+    io->sqes    = NULL;
+    io->cq_map  = NULL;
+    io->sq_map  = NULL;
+    io->results = NULL;
+    io->ring    = -1;
+}
+
+/*
+bulkio_sqe() fills in the next free submission entry. It only becomes
+visible to the kernel in bulkio_run(). tag comes back as the index of
+the entry's result.
+*/
+struct io_uring_sqe* bulkio_sqe(bulkio_t* io, int opcode, int fd,
+                                unsigned tag) {
+    unsigned             index = (*io->sq_tail + io->queued++) & *io->sq_mask;
+    struct io_uring_sqe* sqe   = (struct io_uring_sqe*)io->sqes + index;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode         = (uint8_t)opcode;
+    sqe->fd             = fd;
+    sqe->user_data      = tag;
+    io->sq_array[index] = index;
+    return sqe;
+}
+
+/*
+bulkio_run() submits every queued entry and waits for all of them,
+keeping the res of each in results[tag]. Tags below tags that never
+completed (the ring failed) are left at -EIO.
+*/
+int bulkio_run(bulkio_t* io, unsigned tags) {
+    for (unsigned i = 0; i < tags; i++) {
+        io->results[i] = -EIO;
+    }
+    unsigned submit  = io->queued;
+    unsigned pending = io->queued;
+    unsigned head    = *io->cq_head;
+    io->queued       = 0;
+    __atomic_store_n(io->sq_tail, *io->sq_tail + submit, __ATOMIC_RELEASE);
+
+    while (pending > 0) {
+        long put = syscall(__NR_io_uring_enter, io->ring, submit, pending,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        if (put < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            perror("io_uring_enter");
+            return STATUS_FAIL;
+        }
+        submit -= (unsigned)put;
+
+        unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, pending--) {
+            struct io_uring_cqe* cqe =
+                (struct io_uring_cqe*)io->cqes + (head & *io->cq_mask);
+            if (cqe->user_data < tags) {
+                io->results[cqe->user_data] = cqe->res;
+            }
+        }
+        __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return STATUS_OK;
+}
+
+/*
+bulkio_read_round() reads n files with two submissions. Tags are 2 * i
+for a file's open and then its read, 2 * i + 1 for its statx and then
+its close. A read that comes up short breaks the link, and the close is
+then done here.
+*/
+void bulkio_read_round(bulkio_t* io, bulkio_file_t* files, size_t n,
+                       struct statx* stats) {
+    int fds[BULKIO_DEPTH];
+    for (size_t i = 0; i < n; i++) {
+        files[i].data  = NULL;
+        files[i].len   = 0;
+        files[i].error = 0;
+        struct io_uring_sqe* sqe =
+            bulkio_sqe(io, IORING_OP_OPENAT, AT_FDCWD, 2 * i);
+        sqe->addr       = (uintptr_t)files[i].path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe             = bulkio_sqe(io, IORING_OP_STATX, AT_FDCWD, 2 * i + 1);
+        sqe->addr       = (uintptr_t)files[i].path;
+        sqe->len        = STATX_SIZE;
+        sqe->off        = (uintptr_t)&stats[i];
+    }
+    bulkio_run(io, 2 * n);
+
+    for (size_t i = 0; i < n; i++) {
+        fds[i] = io->results[2 * i];
+        if (fds[i] < 0) {
+            files[i].error = -fds[i];
+            continue;
+        }
+        if (io->results[2 * i + 1] < 0) {
+            files[i].error = -io->results[2 * i + 1];
+        } else if (!(files[i].data = malloc(stats[i].stx_size + 1))) {
+            printf("Malloc failed\n");
+            files[i].error = ENOMEM;
+        } else {
+            struct io_uring_sqe* sqe =
+                bulkio_sqe(io, IORING_OP_READ, fds[i], 2 * i);
+            sqe->addr  = (uintptr_t)files[i].data;
+            sqe->len   = (unsigned)stats[i].stx_size;
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        bulkio_sqe(io, IORING_OP_CLOSE, fds[i], 2 * i + 1);
+    }
+    bulkio_run(io, 2 * n);
+
+    for (size_t i = 0; i < n; i++) {
+        if (fds[i] < 0) {
+            continue;
+        }
+        if (io->results[2 * i + 1] == -ECANCELED) {
+            close(fds[i]);
+        }
+        if (!files[i].data) {
+            continue;
+        }
+        int got = io->results[2 * i];
+        if (got < 0) {
+            files[i].error = -got;
+            free(files[i].data);
+            files[i].data = NULL;
+        } else {
+            files[i].len       = (size_t)got;
+            files[i].data[got]       = '\0';
+        }
+    }
+}
+
+/*
+bulkio_write_round() writes n files with two submissions. The open has
+tag 3 * i, then the write, fsync and close of a file are linked and have
+tags 3 * i, 3 * i + 1 and 3 * i + 2. A write that fails or comes up
+short cancels the rest of its link.
+*/
+void bulkio_write_round(bulkio_t* io, bulkio_file_t* files, size_t n) {
+    int fds[BULKIO_DEPTH];
+    for (size_t i = 0; i < n; i++) {
+        files[i].error = 0;
+        struct io_uring_sqe* sqe =
+            bulkio_sqe(io, IORING_OP_OPENAT, AT_FDCWD, 3 * i);
+        sqe->addr       = (uintptr_t)files[i].path;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        sqe->len        = 0644;
+    }
+    bulkio_run(io, 3 * n);
+
+    for (size_t i = 0; i < n; i++) {
+        fds[i] = io->results[3 * i];
+        if (fds[i] < 0) {
+            files[i].error = -fds[i];
+            continue;
+        }
+        struct io_uring_sqe* sqe =
+            bulkio_sqe(io, IORING_OP_WRITE, fds[i], 3 * i);
+        sqe->addr  = (uintptr_t)files[i].data;
+        sqe->len   = (unsigned)files[i].len;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe        = bulkio_sqe(io, IORING_OP_FSYNC, fds[i], 3 * i + 1);
+        sqe->flags = IOSQE_IO_LINK;
+        bulkio_sqe(io, IORING_OP_CLOSE, fds[i], 3 * i + 2);
+    }
+    bulkio_run(io, 3 * n);
+
+    for (size_t i = 0; i < n; i++) {
+        if (fds[i] < 0) {
+            continue;
+        }
+        int put = io->results[3 * i];
+        if (put < 0) {
+            files[i].error = -put;
+        } else if ((size_t)put != files[i].len) {
+            files[i].error = EIO;
+        } else if (io->results[3 * i + 1] < 0) {
+            files[i].error = -io->results[3 * i + 1];
+        } else if (io->results[3 * i + 2] < 0) {
+            files[i].error = -io->results[3 * i + 2];
+        }
+        if (io->results[3 * i + 2] == -ECANCELED) {
+            close(fds[i]);
+        }
+    }
+}
+#endif
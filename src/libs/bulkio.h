@@ -0,0 +1,57 @@
+/* bulkio.h */
+
+#ifndef __BULKIO_H_
+#define __BULKIO_H_
+#define BULKIO_URING 1   /* 0 never tries io_uring, only POSIX calls */
+#define BULKIO_DEPTH 256 /* files handed to io_uring per round */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* ----- Struct for one file of a batch ----- */
+typedef struct bulkio_file bulkio_file_t;
+struct bulkio_file {
+    const char* path;
+    char*       data;  /* read: malloc'd and NUL-terminated, caller frees */
+    size_t      len;
+    int         error; /* errno of the step that failed, 0 if none */
+};
+
+/* ----- Struct for a batch of file I/O ----- */
+/*
+With io_uring every round of files is queued on the ring and handed to
+the kernel with a single io_uring_enter(), rather than a syscall per
+open, read, write and close. The pointers are into the rings the kernel
+shares with us (see io_uring_setup(2)); liburing is not needed. ring is
+-1 when io_uring cannot be used (old kernel, seccomp, io_uring_disabled)
+and every file then gets plain POSIX calls.
+*/
+typedef struct bulkio bulkio_t;
+struct bulkio {
+    int       ring;
+    unsigned  entries;
+    unsigned  queued;  /* SQEs filled in since the last bulkio_run() */
+    int*      results; /* res of every CQE of a round, by user_data */
+    void*     sq_map;
+    size_t    sq_map_len;
+    void*     cq_map;
+    size_t    cq_map_len;
+    void*     sqes;    /* struct io_uring_sqe[entries] */
+    size_t    sqes_len;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    void*     cqes;    /* struct io_uring_cqe[] */
+};
+
+/* ----- Public functions ----- */
+int  bulkio_create(bulkio_t** io, bool uring);
+int  bulkio_read(bulkio_t* io, bulkio_file_t* files, size_t n);
+int  bulkio_write(bulkio_t* io, bulkio_file_t* files, size_t n);
+bool bulkio_uring(const bulkio_t* io);
+int  bulkio_dispose(bulkio_t** io);
+
+#endif /* __BULKIO_H_ */
@@ -0,0 +1,595 @@
+/*
+    cachelog.c contains functions that:
+    - handles the append-only cache log (one file for all cities)
+    - handles framing and checking of records
+    - handles the in-memory offset index (latest record per key)
+    - handles compaction of shadowed records
+
+    A record is never changed once written. Saving a city appends a new
+    record and moves the index to it; the old one is dead until the next
+    compaction rewrites the log through a temp file and rename().
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "cachelog.h"
+
+#include "city.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* ----- PRIVATE FUNCTIONS ----- */
+uint32_t cachelog_crc(const char* buf, size_t len, uint32_t crc);
+uint32_t cachelog_hash(const char* key, size_t key_len);
+int      cachelog_scan(cachelog_t* log, const char* buf, int64_t len,
+                       int64_t base, int64_t* out_end);
+int      cachelog_index(cachelog_t* log, const char* key, size_t key_len,
+                        cachelog_rec_t* rec, int64_t off);
+int      cachelog_grow(cachelog_t* log);
+int      cachelog_sync(cachelog_t* log);
+int      cachelog_lock(cachelog_t* log, short type);
+char*    cachelog_slurp(int fd, int64_t off, int64_t len);
+void     cachelog_free_index(cachelog_t* log);
+
+static uint32_t crc_table[256];
+
+/* ----------------------- */
+/* ----- OPEN & CLOSE ----- */
+/*
+cachelog_open() opens (or creates) the log at path and indexes it with a
+single read of the whole file. When out_buf is given, that read is handed
+to the caller (who must free it) so the live records can be used through
+cachelog_payload() without reading the file again. A torn record at the
+end, left by a crash mid-append, is cut off. A log that is mostly dead
+records is compacted first, and out_buf then holds the compacted file,
+which the index points into.
+*/
+int cachelog_open(cachelog_t** out_log, const char* path, char** out_buf) {
+    if (!out_log || !path) {
+        return STATUS_FAIL;
+    }
+    if (crc_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            crc_table[i] = c;
+        }
+    }
+
+    cachelog_t* log = calloc(1, sizeof(cachelog_t));
+    if (!log) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    log->path = malloc(strlen(path) + 1);
+    if (!log->path) {
+        free(log);
+        return STATUS_FAIL;
+    }
+    strcpy(log->path, path);
+    log->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (log->fd < 0) {
+        perror("open");
+        free(log->path);
+        free(log);
+        return STATUS_FAIL;
+    }
+
+    cachelog_lock(log, F_WRLCK);
+    struct stat st;
+    char*       buf    = NULL;
+    size_t      hlen   = strlen(CACHELOG_HEADER);
+    int         status = STATUS_OK;
+    if (fstat(log->fd, &st) != 0) {
+        status = STATUS_FAIL;
+    } else if (st.st_size == 0) {
+        if (write(log->fd, CACHELOG_HEADER, hlen) != (ssize_t)hlen) {
+            status = STATUS_FAIL;
+        }
+        log->end = hlen;
+    } else {
+        buf = cachelog_slurp(log->fd, 0, st.st_size);
+        if (!buf || st.st_size < (off_t)hlen ||
+            memcmp(buf, CACHELOG_HEADER, hlen) != 0) {
+            fprintf(stderr, "%s is not a cache log\n", path);
+            status = STATUS_FAIL;
+        } else {
+            status = cachelog_scan(log, buf, st.st_size, 0, &log->end);
+        }
+        if (status == STATUS_OK && log->end < st.st_size) {
+            fprintf(stderr, "Dropping %lld torn bytes at end of %s\n",
+                    (long long)(st.st_size - log->end), path);
+            if (ftruncate(log->fd, log->end) != 0) {
+                perror("ftruncate");
+            }
+        }
+    }
+    cachelog_lock(log, F_UNLCK);
+
+    /*Compaction moves every record, so the old read is stale after it*/
+    if (status == STATUS_OK && log->dead >= CACHELOG_COMPACT_MIN &&
+        log->dead > log->size && cachelog_compact(log) == STATUS_OK &&
+        out_buf) {
+        free(buf);
+        buf = cachelog_slurp(log->fd, 0, log->end);
+        if (!buf) {
+            status = STATUS_FAIL;
+        }
+    }
+    if (status != STATUS_OK) {
+        free(buf);
+        cachelog_close(&log);
+        return STATUS_FAIL;
+    }
+    if (out_buf) {
+        *out_buf = buf;
+    } else {
+        free(buf);
+    }
+    *out_log = log; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+int cachelog_close(cachelog_t** log) {
+    if (!log || !*log) {
+        return STATUS_FAIL;
+    }
+    if ((*log)->fd >= 0) {
+        close((*log)->fd);
+    }
+    cachelog_free_index(*log);
+    free((*log)->path);
+    free(*log);
+    *log = NULL;
+    return STATUS_OK;
+}
+
+void cachelog_free_index(cachelog_t* log) {
+    for (unsigned i = 0; i < log->size; i++) {
+        free(log->entries[i].key);
+    }
+    free(log->entries);
+    free(log->slots);
+    log->entries  = NULL;
+    log->slots    = NULL;
+    log->size     = 0;
+    log->cap      = 0;
+    log->slot_cap = 0;
+    log->dead     = 0;
+}
+
+/* ----- RECORDS ----- */
+/*
+cachelog_append() writes one record with a single write() on an O_APPEND
+descriptor, under a write lock so other processes sharing the log cannot
+interleave and the offset put in the index is the real one.
+*/
+int cachelog_append(cachelog_t* log, const char* key, const char* payload,
+                    size_t len, int64_t cached_at) {
+    cachelog_item_t item = {key, payload, len, cached_at};
+    return cachelog_append_batch(log, &item, 1);
+}
+
+/*
+cachelog_append_batch() writes n records the same way, all with one
+write() and under one lock, which is what makes saving many cities at
+once cheap.
+*/
+int cachelog_append_batch(cachelog_t* log, const cachelog_item_t* items,
+                          size_t n) {
+    if (!log || !items) {
+        return STATUS_FAIL;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!items[i].key || !items[i].payload) {
+            return STATUS_FAIL;
+        }
+        total += sizeof(cachelog_rec_t) + strlen(items[i].key) + items[i].len;
+    }
+    char* buf = malloc(total ? total : 1);
+    if (!buf) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    char* at = buf;
+    for (size_t i = 0; i < n; i++) {
+        size_t         key_len = strlen(items[i].key);
+        cachelog_rec_t rec     = {CACHELOG_MAGIC, 0, (uint32_t)key_len,
+                                  (uint32_t)items[i].len, items[i].cached_at};
+        memcpy(at + sizeof(rec), items[i].key, key_len);
+        memcpy(at + sizeof(rec) + key_len, items[i].payload, items[i].len);
+        rec.crc = cachelog_crc(at + sizeof(rec), key_len + items[i].len, 0);
+        memcpy(at, &rec, sizeof(rec));
+        at += sizeof(rec) + key_len + items[i].len;
+    }
+
+    cachelog_lock(log, F_WRLCK);
+    int     status = cachelog_sync(log);
+    int64_t start  = log->end;
+    if (status == STATUS_OK) {
+        ssize_t written = write(log->fd, buf, total);
+        if (written == (ssize_t)total) {
+            for (size_t i = 0; i < n && status == STATUS_OK; i++) {
+                cachelog_rec_t rec;
+                memcpy(&rec, buf + (log->end - start), sizeof(rec));
+                status = cachelog_index(log, items[i].key, rec.key_len, &rec,
+                                        log->end);
+                log->end += sizeof(rec) + rec.key_len + rec.len;
+            }
+        } else {
+            perror("write");
+            status = STATUS_FAIL;
+        }
+    }
+    cachelog_lock(log, F_UNLCK);
+    free(buf);
+
+    if (status == STATUS_OK && log->dead >= CACHELOG_COMPACT_MIN &&
+        log->dead > log->size) {
+        cachelog_compact(log);
+    }
+    return status;
+}
+
+/*
+cachelog_fsync() makes every record appended so far durable.
+*/
+int cachelog_fsync(cachelog_t* log) {
+    if (!log || fsync(log->fd) != 0) {
+        perror("fsync");
+        return STATUS_FAIL;
+    }
+    return STATUS_OK;
+}
+
+/*
+cachelog_find() looks up the latest record for key. Records appended by
+other processes since the last look are indexed first.
+*/
+int cachelog_find(cachelog_t* log, const char* key, cachelog_entry_t** out) {
+    if (!log || !key || !out) {
+        return STATUS_FAIL;
+    }
+    cachelog_lock(log, F_RDLCK);
+    cachelog_sync(log);
+    cachelog_lock(log, F_UNLCK);
+    if (log->slot_cap == 0) {
+        return STATUS_FAIL;
+    }
+
+    uint32_t hash = cachelog_hash(key, strlen(key));
+    unsigned mask = log->slot_cap - 1;
+    for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+        unsigned slot = log->slots[i];
+        if (slot == 0) {
+            return STATUS_FAIL;
+        }
+        cachelog_entry_t* e = &log->entries[slot - 1];
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            *out = e;
+            return STATUS_OK;
+        }
+    }
+}
+
+/*
+cachelog_read() returns the payload of an entry as a NUL-terminated,
+dynamically allocated string. Caller must free!
+*/
+char* cachelog_read(cachelog_t* log, cachelog_entry_t* entry) {
+    if (!log || !entry) {
+        return NULL;
+    }
+    int64_t off = entry->off + sizeof(cachelog_rec_t) + strlen(entry->key);
+    return cachelog_slurp(log->fd, off, entry->len);
+}
+
+/*
+cachelog_payload() points at the payload of an entry inside the buffer
+returned by cachelog_open(). The payload is not NUL-terminated.
+*/
+const char* cachelog_payload(const char* buf, cachelog_entry_t* entry) {
+    return buf + entry->off + sizeof(cachelog_rec_t) + strlen(entry->key);
+}
+
+/*
+cachelog_compact() rewrites the log with only the latest record of every
+key, in order of first appearance. The new log is written to a temp file,
+synced and renamed over the old one, so a crash leaves either the old or
+the new log but never a mix.
+*/
+int cachelog_compact(cachelog_t* log) {
+    if (!log) {
+        return STATUS_FAIL;
+    }
+
+    size_t tmp_len = strlen(log->path) + 5;
+    char*  tmp     = malloc(tmp_len);
+    if (!tmp) {
+        return STATUS_FAIL;
+    }
+    snprintf(tmp, tmp_len, "%s.tmp", log->path);
+
+    cachelog_lock(log, F_WRLCK);
+    cachelog_sync(log);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("open");
+        cachelog_lock(log, F_UNLCK);
+        free(tmp);
+        return STATUS_FAIL;
+    }
+
+    int64_t* offs   = malloc((log->size + 1) * sizeof(int64_t));
+    size_t   hlen   = strlen(CACHELOG_HEADER);
+    int64_t  end    = hlen;
+    int      status = STATUS_OK;
+    if (!offs || write(fd, CACHELOG_HEADER, hlen) != (ssize_t)hlen) {
+        status = STATUS_FAIL;
+    }
+    for (unsigned i = 0; status == STATUS_OK && i < log->size; i++) {
+        cachelog_entry_t* e   = &log->entries[i];
+        int64_t           len = sizeof(cachelog_rec_t) + strlen(e->key);
+        len += e->len;
+
+        char* rec = cachelog_slurp(log->fd, e->off, len);
+        if (!rec || write(fd, rec, len) != len) {
+            status = STATUS_FAIL;
+        }
+        free(rec);
+        offs[i] = end;
+        end += len;
+    }
+    if (status == STATUS_OK && fsync(fd) != 0) {
+        status = STATUS_FAIL;
+    }
+    if (status == STATUS_OK && rename(tmp, log->path) != 0) {
+        perror("rename");
+        status = STATUS_FAIL;
+    }
+
+    if (status == STATUS_OK) {
+        for (unsigned i = 0; i < log->size; i++) {
+            log->entries[i].off = offs[i];
+        }
+        printf("Compacted %s, dropped %u dead records\n", log->path,
+               log->dead);
+        close(log->fd); /* also releases the lock on the old log */
+        log->fd   = fd;
+        log->end  = end;
+        log->dead = 0;
+    } else {
+        fprintf(stderr, "Failed to compact %s\n", log->path);
+        close(fd);
+        unlink(tmp);
+        cachelog_lock(log, F_UNLCK);
+    }
+    free(offs);
+    free(tmp);
+    return status;
+}
+
+/* ----- INDEXING ----- */
+/*
+cachelog_scan() walks the records in buf, which holds the file from
+offset base. It stops at the first record that is cut short or fails its
+crc and reports through out_end how far the log is valid.
+*/
+int cachelog_scan(cachelog_t* log, const char* buf, int64_t len, int64_t base,
+                  int64_t* out_end) {
+    int64_t pos = base == 0 ? (int64_t)strlen(CACHELOG_HEADER) : 0;
+    while (pos + (int64_t)sizeof(cachelog_rec_t) <= len) {
+        cachelog_rec_t rec;
+        memcpy(&rec, buf + pos, sizeof(rec));
+        int64_t body = (int64_t)rec.key_len + rec.len;
+        if (rec.magic != CACHELOG_MAGIC || rec.key_len == 0 ||
+            pos + (int64_t)sizeof(rec) + body > len) {
+            break;
+        }
+        const char* key = buf + pos + sizeof(rec);
+        if (cachelog_crc(key, body, 0) != rec.crc) {
+            break;
+        }
+        if (cachelog_index(log, key, rec.key_len, &rec, base + pos) !=
+            STATUS_OK) {
+            return STATUS_FAIL;
+        }
+        pos += sizeof(rec) + body;
+    }
+    *out_end = base + pos;
+    return STATUS_OK;
+}
+
+/*
+cachelog_index() points the entry for key at the record at off, adding
+the entry if the key is new. The index is open addressing with linear
+probing over positions in the entries array, and has twice as many slots
+as there is room for entries.
+*/
+int cachelog_index(cachelog_t* log, const char* key, size_t key_len,
+                   cachelog_rec_t* rec, int64_t off) {
+    if (log->size == log->cap) {
+        if (cachelog_grow(log) != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+    }
+
+    uint32_t hash = cachelog_hash(key, key_len);
+    unsigned mask = log->slot_cap - 1;
+    unsigned i    = hash & mask;
+    for (; log->slots[i]; i = (i + 1) & mask) {
+        cachelog_entry_t* e = &log->entries[log->slots[i] - 1];
+        if (e->hash == hash && strncmp(e->key, key, key_len) == 0 &&
+            e->key[key_len] == '\0') {
+            e->off       = off;
+            e->len       = rec->len;
+            e->cached_at = rec->cached_at;
+            log->dead++;
+            return STATUS_OK;
+        }
+    }
+
+    cachelog_entry_t* e = &log->entries[log->size];
+    e->key              = malloc(key_len + 1);
+    if (!e->key) {
+        return STATUS_FAIL;
+    }
+    memcpy(e->key, key, key_len);
+    e->key[key_len] = '\0';
+    e->hash         = hash;
+    e->off          = off;
+    e->len          = rec->len;
+    e->cached_at    = rec->cached_at;
+    log->slots[i]   = ++log->size;
+    return STATUS_OK;
+}
+
+/*
+cachelog_grow() doubles the entries array and the slot table. Slots are
+rebuilt from the stored hashes.
+*/
+int cachelog_grow(cachelog_t* log) {
+    unsigned          new_cap = log->cap ? log->cap * 2 : 64;
+    cachelog_entry_t* entries =
+        realloc(log->entries, new_cap * sizeof(cachelog_entry_t));
+    if (!entries) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    log->entries = entries;
+    log->cap     = new_cap;
+
+    unsigned  slot_cap = new_cap * 2;
+    unsigned* slots    = calloc(slot_cap, sizeof(unsigned));
+    if (!slots) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    unsigned mask = slot_cap - 1;
+    for (unsigned i = 0; i < log->size; i++) {
+        unsigned j = log->entries[i].hash & mask;
+        while (slots[j]) {
+            j = (j + 1) & mask;
+        }
+        slots[j] = i + 1;
+    }
+    free(log->slots);
+    log->slots    = slots;
+    log->slot_cap = slot_cap;
+    return STATUS_OK;
+}
+
+/*
+cachelog_sync() catches up with records appended by other processes, and
+rebuilds the index if another process compacted the log (the path then
+names a new file). Must be called with the log locked.
+*/
+int cachelog_sync(cachelog_t* log) {
+    struct stat fd_st;
+    struct stat path_st;
+    if (fstat(log->fd, &fd_st) != 0) {
+        return STATUS_FAIL;
+    }
+    if (stat(log->path, &path_st) == 0 && path_st.st_ino != fd_st.st_ino) {
+        int fd = open(log->path, O_RDWR | O_APPEND);
+        if (fd < 0) {
+            return STATUS_FAIL;
+        }
+        close(log->fd);
+        log->fd = fd;
+        cachelog_free_index(log);
+        log->end = 0;
+        if (fstat(log->fd, &fd_st) != 0) {
+            return STATUS_FAIL;
+        }
+    }
+    if (fd_st.st_size <= log->end) {
+        return STATUS_OK;
+    }
+
+    char* buf = cachelog_slurp(log->fd, log->end, fd_st.st_size - log->end);
+    if (!buf) {
+        return STATUS_FAIL;
+    }
+    int status =
+        cachelog_scan(log, buf, fd_st.st_size - log->end, log->end, &log->end);
+    free(buf);
+    return status;
+}
+
+/*
+cachelog_lock() takes (F_RDLCK, F_WRLCK) or drops (F_UNLCK) an advisory
+lock on the whole log, waiting for other processes if needed.
+*/
+int cachelog_lock(cachelog_t* log, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type   = type;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(log->fd, F_SETLKW, &fl) != 0) {
+        if (errno != EINTR) {
+            return STATUS_FAIL;
+        }
+    }
+    return STATUS_OK;
+}
+
+/* ----- HELPERS ----- */
+/*
+cachelog_slurp() reads len bytes at off into a dynamically allocated,
+NUL-terminated buffer. Caller must free!
+*/
+char* cachelog_slurp(int fd, int64_t off, int64_t len) {
+    char* buf = malloc(len + 1);
+    if (!buf) {
+        printf("Malloc failed\n");
+        return NULL;
+    }
+    int64_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, off + got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(buf);
+            return NULL;
+        }
+        got += n;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+/*
+cachelog_hash() is 32-bit FNV-1a, like city_hash(), but takes a length
+since keys inside the file are not NUL-terminated.
+*/
+uint32_t cachelog_hash(const char* key, size_t key_len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+cachelog_crc() is the standard CRC-32 (as used by zlib), table driven.
+*/
+uint32_t cachelog_crc(const char* buf, size_t len, uint32_t crc) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ (unsigned char)buf[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
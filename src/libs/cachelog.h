@@ -0,0 +1,73 @@
+/* cachelog.h */
+
+#ifndef __CACHELOG_H_
+#define __CACHELOG_H_
+#define CACHELOG_HEADER "ESKYLOG1" /* first 8 bytes of every log */
+#define CACHELOG_MAGIC 0x52594B45u
+#define CACHELOG_COMPACT_MIN 256 /* dead records before compaction */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ----- Struct for record framing (on disk) ----- */
+/*
+Every record is this header followed by key_len bytes of key and len bytes
+of payload. The crc covers key and payload, so a torn write at the end of
+the log is detected and cut off when the log is opened.
+*/
+typedef struct cachelog_rec cachelog_rec_t;
+struct cachelog_rec {
+    uint32_t magic;
+    uint32_t crc;
+    uint32_t key_len;
+    uint32_t len;
+    int64_t  cached_at;
+};
+
+/* ----- Struct for one record of a batch ----- */
+typedef struct cachelog_item cachelog_item_t;
+struct cachelog_item {
+    const char* key;
+    const char* payload;
+    size_t      len;
+    int64_t     cached_at;
+};
+
+/* ----- Structs for in-memory offset index ----- */
+typedef struct cachelog_entry cachelog_entry_t;
+struct cachelog_entry {
+    char*    key;
+    uint32_t hash;
+    uint32_t len;       /* payload bytes of the latest record */
+    int64_t  off;       /* file offset of the latest record */
+    int64_t  cached_at; /* copied from the record, no parsing needed */
+};
+
+typedef struct cachelog cachelog_t;
+struct cachelog {
+    int               fd;
+    char*             path;
+    int64_t           end;     /* bytes of the file that are indexed */
+    cachelog_entry_t* entries; /* in order of first appearance */
+    unsigned          size;
+    unsigned          cap;
+    unsigned*         slots; /* entry index + 1, 0 marks an empty slot */
+    unsigned          slot_cap;
+    unsigned          dead; /* records shadowed by a newer one */
+};
+
+/* ----- Public functions ----- */
+int         cachelog_open(cachelog_t** log, const char* path, char** out_buf);
+int         cachelog_close(cachelog_t** log);
+int         cachelog_append(cachelog_t* log, const char* key,
+                            const char* payload, size_t len, int64_t cached_at);
+int         cachelog_append_batch(cachelog_t* log, const cachelog_item_t* items,
+                                  size_t n);
+int         cachelog_fsync(cachelog_t* log);
+int         cachelog_find(cachelog_t* log, const char* key,
+                          cachelog_entry_t** out);
+char*       cachelog_read(cachelog_t* log, cachelog_entry_t* entry);
+const char* cachelog_payload(const char* buf, cachelog_entry_t* entry);
+int         cachelog_compact(cachelog_t* log);
+
+#endif /* __CACHELOG_H_ */
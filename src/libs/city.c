@@ -1,10 +1,17 @@
 /*
     Cities.c contains functions that:
-    - handles the linked list (init & dispose)
-    - handles creation of data struct
-    - handles creation and adding of nodes to linked list
-    - handles saving new nodes to cache
-    - handles reading cache (if any) at boot
+    - handles the city store (init & dispose)
+    - handles creation of data struct (from the list's arena)
+    - handles adding cities to the columns of the store
+    - handles saving cities to cache (cache log or JSON files), behind
+      the write-behind queue of persist.c
+    - handles reading cache (if any) at boot, from the snapshot when it
+      is up to date
+    - handles the hash index used for looking up cities by name
+    - handles scans over the columns (stale, below a temperature)
+    - handles lookups by coordinate through the spatial index (geo.c)
+    - handles sharing weather between the cities of a model cell (grid.c)
+    - handles suggestions for misspelt or partial names (search.c)
 
     It also contains the self-hosted bootstrap
     struct used only if there is no cache.
@@ -12,28 +19,82 @@
 
 #include "city.h"
 
+#include "bulkio.h"
+#include "cachelog.h"
 #include "jansson.h"
 #include "meteo.h"
+#include "persist.h"
+#include "pool.h"
+#include "snapshot.h"
 #include "tinydir.h"
 
 #include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+/* ----- Struct for loading the cache in parallel ----- */
+typedef struct {
+    city_list_t*      list;
+    bulkio_file_t*    files;   /* JSON files, or NULL when loading the log */
+    const char*       buf;     /* the whole log, from cachelog_open() */
+    cachelog_entry_t* entries; /* live records of the log */
+    city_data_t*      results; /* one row per item, name NULL if unusable */
+} city_load_t;
 
 /* ----- PRIVATE FUNCTIONS ----- */
 int          city_boot(city_list_t* city_list);
-int          city_data_free(city_data_t* city_data);
 int          city_free_list(city_list_t* city_list);
 city_list_t* city_make_list();
-city_node_t* city_make_node(city_data_t* city_data);
-city_data_t* city_make_data(char* city_name, char* fp, double lat, double lon,
-                            double temp, double windspeed, double rel_hum);
-void         city_add_tail(city_node_t* city_node, city_list_t* city_list);
+int          city_make_data(city_list_t* city_list, city_data_t* city_data);
+int          city_push(city_list_t* city_list, const city_data_t* city_data,
+                       city_id_t* out_id);
+int          city_grow(city_list_t* city_list, unsigned min_cap);
 int          city_read_cache(city_list_t* city_list);
+int          city_read_snapshot(city_list_t* city_list);
+int          city_open_log(city_list_t* city_list);
+int          city_read_dir(city_list_t* city_list);
+int          city_load_all(city_list_t* city_list, city_load_t* load, size_t n);
+void         city_load_item(size_t i, void* userp);
+int          city_migrate(city_list_t* city_list);
+int          city_from_json(city_list_t* city_list, json_t* root,
+                            city_data_t* out_data);
+int          city_write_rows(const persist_item_t* items, size_t n,
+                             void* userp);
+int          city_write_files(const persist_item_t* items, size_t n);
+json_t*      city_to_json(const city_data_t* row);
+uint32_t     city_hash(const char* name);
+int          city_index_insert(city_list_t* city_list, city_id_t id);
+int          city_index_grow(city_index_t* index);
+int          city_index_reserve(city_index_t* index, unsigned n);
+void         city_index_free(city_index_t* index);
+void         city_cells_spread(city_list_t* city_list);
+
+/*
+With CITY_CACHE_LOG all cities live in one append-only log, opened by
+city_read_cache() or on first use and closed by city_dispose(). Otherwise
+every city has its own JSON file in CITY_CACHE_DIR. Each list has its own
+handle, which is shared with its flusher thread and so only used under
+the list's log_lock.
+*/
+#define CITY_CACHE_SRC (CITY_CACHE_LOG ? CITY_CACHE_LOG_PATH : CITY_CACHE_DIR)
+
+/*
+Saves go through the list's write-behind queue once it is booted (see
+persist.h); until then, and if the flusher could not be started, they
+are written right away. Booted lists are chained from city_lists so that
+city_flush() can reach them from the signal thread; city_lists_lock
+keeps it from using a queue while city_dispose() takes it down.
+*/
+static city_list_t*    city_lists      = NULL;
+static pthread_mutex_t city_lists_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* ----- BOOTSTRAP CITIES ----- */
 typedef struct {
@@ -64,6 +125,20 @@ int city_init(city_list_t** city_list) {
         city_dispose(&new_list);
         return STATUS_FAIL;
     }
+    /*Without the spatial index the coordinate lookups scan instead*/
+    if (!new_list->geo.ready) {
+        geo_build(&new_list->geo, new_list->lat, new_list->lon,
+                  new_list->size);
+    }
+    city_cells_spread(new_list);
+    if (persist_create(&new_list->persist, city_write_rows, new_list) !=
+        STATUS_OK) {
+        fprintf(stderr, "Saving to cache without write-behind.\n");
+    }
+    pthread_mutex_lock(&city_lists_lock);
+    new_list->next_live = city_lists;
+    city_lists          = new_list;
+    pthread_mutex_unlock(&city_lists_lock);
     *city_list = new_list; /* return through out-ptr */
 
     return STATUS_OK;
@@ -75,35 +150,36 @@ city_list_t* city_make_list() {
         printf("Malloc failed\n");
         return NULL;
     }
-    list->head = NULL;
-    list->tail = NULL;
-    list->size = 0;
-    return list;
-}
-
-city_node_t* city_make_node(city_data_t* city_data) {
-    city_node_t* node = malloc(sizeof(city_node_t));
-    if (!node) {
-        printf("Malloc failed\n");
+    memset(list, 0, sizeof(city_list_t));
+    list->snap_dirty = true;
+    grid_init(&list->grid, GRID_CELL_DEG);
+    if (arena_create(&list->arena) != STATUS_OK) {
+        free(list);
         return NULL;
     }
-    node->data = city_data;
-    node->prev = NULL;
-    node->next = NULL;
-    return node;
+    pthread_mutex_init(&list->log_lock, NULL);
+    return list;
 }
 
 /*
-city_boot() will check if there is any files in the directory
-cities/ and load these if they exist. At first run the boot-
-strap struct array is used instead to give a minimum set of
-cities to choose from.
+city_boot() will first try the snapshot written at the last exit, and
+otherwise check if there is any cities in the cache and load these if
+they exist. At first run the boot-strap struct array is used instead to
+give a minimum set of cities to choose from.
 */
 int city_boot(city_list_t* city_list) {
     if (!city_list) {
         return STATUS_FAIL;
     }
 
+    unsigned read_snap = city_read_snapshot(city_list);
+    if (read_snap == STATUS_OK) {
+        printf("number %u cities from snapshot\n", city_list->size);
+        return STATUS_OK;
+    } else if (read_snap == STATUS_EXIT) {
+        return STATUS_FAIL;
+    }
+
     unsigned read_cache = city_read_cache(city_list);
     if (read_cache == STATUS_OK) {
         printf("number %u cities from cache\n", city_list->size);
@@ -118,38 +194,61 @@ int city_boot(city_list_t* city_list) {
     }
     for (unsigned i = 0; i < n; i++) {
         city_bootstrap_t* b    = &bootstrap_arr[i];
-        city_data_t*      data = city_make_data(b->name, b->fp, b->lat, b->lon,
-                                                INIT_VAL, INIT_VAL, INIT_VAL);
-        if (!data) {
-            continue;
-        }
-        city_node_t* node = city_make_node(data);
-        if (node) {
-            city_add_tail(node, city_list);
-            city_save_cache(data);
-        } else {
-            city_data_free(data);
+        city_data_t       data = {.name      = b->name,
+                                  .lat       = b->lat,
+                                  .lon       = b->lon,
+                                  .temp      = INIT_VAL,
+                                  .windspeed = INIT_VAL,
+                                  .rel_hum   = INIT_VAL};
+        city_id_t         id;
+        if (city_add(city_list, &data, &id) == STATUS_OK) {
+            city_save_cache(city_list, id);
         }
     }
     return STATUS_OK;
 }
 
 /*
-city_dispose() calls city_free_list which in turn calls
-city_free_data. This makes sure that the allocated strings
-within the city_data_t struct are freed first before the
-city_node is freed and lastly the list itself.
+city_dispose() writes every queued save and then, if the list changed,
+the snapshot for the next boot (in that order, as the snapshot records
+the state of the cache). Then it calls city_free_list which frees the
+columns and releases the arena, and with it every string, before freeing
+the list itself. The old snapshot is unmapped last, as mapped strings are
+used until then.
 */
 int city_dispose(city_list_t** city_list) {
     if (!city_list || !*city_list) {
         fprintf(stderr, "Pointer to list or list is NULL\n");
         return STATUS_FAIL;
     }
-    if (city_free_list(*city_list) != STATUS_OK) {
+    city_list_t* list = *city_list;
+    pthread_mutex_lock(&city_lists_lock);
+    for (city_list_t** link = &city_lists; *link; link = &(*link)->next_live) {
+        if (*link == list) {
+            *link = list->next_live;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&city_lists_lock);
+    if (list->persist) {
+        persist_dispose(&list->persist);
+    }
+    if (list->snap_dirty && list->size > 0) {
+        snapshot_write(list, SNAPSHOT_PATH, CITY_CACHE_SRC);
+    }
+    cachelog_t* log  = list->log;
+    snapshot_t* snap = list->snap;
+    if (city_free_list(list) != STATUS_OK) {
         printf("Failed to free list!\n");
         return STATUS_FAIL;
     }
     *city_list = NULL;
+    if (log) {
+        cachelog_close(&log);
+    }
+    if (snap) {
+        snapshot_close(&snap);
+    }
     return STATUS_OK;
 }
 
@@ -157,222 +256,739 @@ int city_free_list(city_list_t* list) {
     if (!list) {
         return STATUS_FAIL;
     }
-    city_node_t* current = list->head;
-    while (current) {
-        city_node_t* next = current->next;
-        if (current->data) {
-            city_data_free(current->data);
-        }
-
-        free(current);
-        current = next;
-    }
+    free(list->lat);
+    free(list->lon);
+    free(list->temp);
+    free(list->windspeed);
+    free(list->rel_hum);
+    free(list->cached_at);
+    free(list->hash);
+    free(list->text);
+    arena_dispose(&list->arena);
+    city_index_free(&list->index);
+    geo_free(&list->geo);
+    grid_free(&list->grid);
+    search_free(&list->search);
+    pthread_mutex_destroy(&list->log_lock);
     free(list);
     return STATUS_OK;
 }
 
-int city_data_free(city_data_t* data) {
-    if (!data) {
+/* ----- CACHING ----- */
+/*
+city_read_cache() handles reading the cache back into the store.
+In log mode the whole log is indexed and read with a single read, and an
+empty log is first filled from the JSON directory (one-time migration).
+*/
+int city_read_cache(city_list_t* list) {
+    if (!list) {
         return STATUS_FAIL;
     }
-    if (data->name)
-        free(data->name);
-    if (data->url)
-        free(data->url);
-    if (data->fp)
-        free(data->fp);
-    free(data);
-    return STATUS_OK;
+    if (!CITY_CACHE_LOG) {
+        return city_read_dir(list);
+    }
+
+    char* buf = NULL;
+    if (cachelog_open(&list->log, CITY_CACHE_LOG_PATH, &buf) != STATUS_OK) {
+        printf("Cache log %s could not be opened!\n", CITY_CACHE_LOG_PATH);
+        return STATUS_FAIL;
+    }
+    city_load_t load   = {list, NULL, buf, list->log->entries, NULL};
+    int         status = city_load_all(list, &load, list->log->size);
+    free(buf);
+    if (status != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+
+    if (list->log->size == 0) {
+        city_migrate(list);
+    }
+    return list->size > 0 ? STATUS_OK : STATUS_FAIL;
 }
 
-/* ----- CACHING ----- */
 /*
-city_read_cache() handles reading the cache back into city_data_t structs.
-Tinydir is used to read from the directory and for traversing the files
-(only json-files) are handled.
+city_read_snapshot() builds the store from the mapped snapshot without
+parsing anything: the columns are sized once and filled straight from
+the fixed-size records, with the strings and name hashes used as they
+are. The name index is sized up front, and the name trie and k-d tree
+are copied as they were written, or built again if they were not (or do
+not hold up). Returns STATUS_FAIL if there is no usable snapshot (nothing was
+added), and STATUS_EXIT if the store could not be built.
 */
-int city_read_cache(city_list_t* list) {
-    if (!list) {
+int city_read_snapshot(city_list_t* list) {
+    if (snapshot_open(&list->snap, SNAPSHOT_PATH, CITY_CACHE_SRC) !=
+        STATUS_OK) {
         return STATUS_FAIL;
     }
 
+    snapshot_t* snap  = list->snap;
+    uint64_t    count = snap->header->count;
+    if (count > UINT_MAX || city_grow(list, (unsigned)count) != STATUS_OK ||
+        city_index_reserve(&list->index, (unsigned)count) != STATUS_OK) {
+        list->snap_dirty = false; /* never save a partial list */
+        return STATUS_EXIT;
+    }
+    for (city_id_t id = 0; id < count; id++) {
+        const snapshot_rec_t* rec = &snap->recs[id];
+        list->lat[id]             = rec->lat;
+        list->lon[id]             = rec->lon;
+        list->temp[id]            = rec->temp;
+        list->windspeed[id]       = rec->windspeed;
+        list->rel_hum[id]         = rec->rel_hum;
+        list->cached_at[id]       = (time_t)rec->cached_at;
+        list->hash[id]            = rec->hash;
+        list->text[id].name       = (char*)snap->strtab + rec->name_off;
+        list->text[id].url        = (char*)snap->strtab + rec->url_off;
+        list->text[id].fp         = (char*)snap->strtab + rec->fp_off;
+        city_index_insert(list, id); /* cannot grow, so cannot fail */
+    }
+    list->size = (unsigned)count;
+
+    for (city_id_t id = 0; id < list->size; id++) {
+        grid_insert(&list->grid, id, list->lat[id], list->lon[id]);
+    }
+    if (!snap->trie ||
+        search_load(&list->search, snap->trie, snap->header->trie_nodes,
+                    snap->trie_same, list->size) != STATUS_OK) {
+        for (city_id_t id = 0; id < list->size; id++) {
+            search_insert(&list->search, id, list->text[id].name);
+        }
+    }
+    if (snap->geo) {
+        geo_load(&list->geo, snap->geo, list->size, snap->header->geo_root,
+                 list->size); /* else built by city_init() */
+    }
+    list->snap_dirty = false;
+    return STATUS_OK;
+}
+
+/*
+city_open_log() opens the log on first use, for lists that were booted
+from the snapshot without reading it. Called under the list's log_lock.
+*/
+int city_open_log(city_list_t* list) {
+    if (list->log) {
+        return STATUS_OK;
+    }
+    return cachelog_open(&list->log, CITY_CACHE_LOG_PATH, NULL);
+}
+
+/*
+city_read_dir() reads one JSON file per city. Tinydir is used to read from
+the directory and for traversing the files (only json-files) are handled.
+The paths are collected first so that with io_uring every file is read
+in batches before parsing (see bulkio.h); without it each file is read
+by whichever pool thread parses it.
+*/
+int city_read_dir(city_list_t* list) {
     tinydir_dir dir;
-    if (tinydir_open(&dir, "./cities") != 0) {
+    if (tinydir_open(&dir, CITY_CACHE_DIR) != 0) {
         printf("Directory: Cities could not be opened!\n");
         return STATUS_FAIL;
     }
 
-    int num_read_files = 0;
-    while (dir.has_next) {
+    bulkio_file_t* files     = NULL;
+    size_t         num_files = 0;
+    size_t         cap       = 0;
+    int            status    = STATUS_OK;
+    while (dir.has_next && status == STATUS_OK) {
         tinydir_file file;
         tinydir_readfile(&dir, &file);
         if (!file.is_dir && strstr(file.name, ".json")) {
-            json_error_t error;
-            json_t*      root = json_load_file(file.path, 0, &error);
-            if (!root) {
-                tinydir_next(&dir);
-                continue;
-            }
-
-            json_t* jname      = json_object_get(root, "name");
-            json_t* jfp        = json_object_get(root, "fp");
-            json_t* jlat       = json_object_get(root, "lat");
-            json_t* jlon       = json_object_get(root, "lon");
-            json_t* jtemp      = json_object_get(root, "temp");
-            json_t* jwind      = json_object_get(root, "windspeed");
-            json_t* jhum       = json_object_get(root, "rel_hum");
-            json_t* jcached_at = json_object_get(root, "cached_at");
-
-            if (!json_is_string(jname) || !json_is_string(jfp) ||
-                !json_is_number(jlat) || !json_is_number(jlon)) {
-                json_decref(root);
-                tinydir_next(&dir);
-                continue;
-            }
-
-            /*
-            Construct a city_data_t struct from JSON values. Using INIT_VAL
-            for any missing values.
-            */
-            city_data_t* data = city_make_data(
-                (char*)json_string_value(jname), (char*)json_string_value(jfp),
-                json_number_value(jlat), json_number_value(jlon),
-                jtemp ? json_number_value(jtemp) : INIT_VAL,
-                jwind ? json_number_value(jwind) : INIT_VAL,
-                jhum ? json_number_value(jhum) : INIT_VAL);
-
-            /*
-            cached_at is optional metadata: if missing/invalid,
-            set to 0 instead of rejecting the city
-            */
-            time_t cached   = (jcached_at && json_is_integer(jcached_at))
-                                  ? (time_t)json_integer_value(jcached_at)
-                                  : 0;
-            data->cached_at = cached;
-
-            if (data) {
-                city_node_t* node = city_make_node(data);
-                if (node) {
-                    city_add_tail(node, list);
-                    num_read_files++;
-                } else {
-                    city_data_free(data);
+            if (num_files == cap) {
+                cap = cap ? cap * 2 : 64;
+                bulkio_file_t* grown =
+                    realloc(files, cap * sizeof(bulkio_file_t));
+                if (!grown) {
+                    status = STATUS_FAIL;
+                    break;
                 }
+                files = grown;
+            }
+            char* path = malloc(strlen(file.path) + 1);
+            if (!path) {
+                status = STATUS_FAIL;
+                break;
             }
-            json_decref(root);
+            strcpy(path, file.path);
+            memset(&files[num_files], 0, sizeof(bulkio_file_t));
+            files[num_files++].path = path;
         }
         tinydir_next(&dir);
     }
     tinydir_close(&dir);
-    list->size = num_read_files;
+
+    bulkio_t* io = NULL;
+    if (status == STATUS_OK && bulkio_create(&io, BULKIO_URING) == STATUS_OK) {
+        if (bulkio_uring(io)) {
+            bulkio_read(io, files, num_files); /* failures are skipped */
+        }
+        bulkio_dispose(&io);
+    }
+    if (status == STATUS_OK) {
+        city_load_t load = {list, files, NULL, NULL, NULL};
+        status           = city_load_all(list, &load, num_files);
+    }
+    for (size_t i = 0; i < num_files; i++) {
+        free((char*)files[i].path);
+        free(files[i].data); /* only left if city_load_all() did not run */
+    }
+    free(files);
+    return status;
+}
+
+/*
+city_load_all() adds n cached cities (files or log records) to the store.
+Reading and parsing is the expensive part and is spread over a thread
+pool; every item writes only its own row in results, and the rows are
+then added on this thread in item order, so the list comes out the same
+as with a single thread and no locking is needed.
+*/
+int city_load_all(city_list_t* list, city_load_t* load, size_t n) {
+    if (n == 0) {
+        return STATUS_OK;
+    }
+    load->results = calloc(n, sizeof(city_data_t));
+    if (!load->results) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+
+    pool_t* pool = NULL;
+    if (n >= CITY_BOOT_PARALLEL_MIN &&
+        pool_create(&pool, CITY_BOOT_THREADS) == STATUS_OK) {
+        pool_run(pool, n, city_load_item, load);
+        pool_dispose(&pool);
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            city_load_item(i, load);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (load->results[i].name) {
+            city_push(list, &load->results[i], NULL);
+        }
+    }
+    free(load->results);
+    load->results = NULL;
     return STATUS_OK;
 }
 
 /*
-city_save_cache() handles serializing a city_data_t struct into a JSON file.
-It also ensures that the cache folder exists and sets the cached_at field
-to the current system time.
+city_load_item() reads and parses item i of a load. Runs on any thread
+of the pool.
+*/
+void city_load_item(size_t i, void* userp) {
+    city_load_t* load = userp;
+    json_error_t error;
+    json_t*      root = NULL;
+    if (load->files) {
+        bulkio_file_t* file = &load->files[i];
+        if (!file->data && !file->error) {
+            bulkio_read(NULL, file, 1);
+        }
+        if (file->data) {
+            root = json_loadb(file->data, file->len, 0, &error);
+            free(file->data);
+            file->data = NULL;
+        }
+    } else {
+        cachelog_entry_t* entry = &load->entries[i];
+        root = json_loadb(cachelog_payload(load->buf, entry), entry->len, 0,
+                          &error);
+        if (!root) {
+            fprintf(stderr, "Bad record for %s in cache log\n", entry->key);
+        }
+    }
+    if (root) {
+        city_from_json(load->list, root, &load->results[i]);
+        json_decref(root);
+    }
+}
+
+/*
+city_migrate() copies every city found in the JSON directory into the
+log, keeping their cached_at. The directory is left as it was.
 */
-int city_save_cache(city_data_t* data) {
-    if (!data) {
+int city_migrate(city_list_t* list) {
+    if (city_read_dir(list) != STATUS_OK) {
         return STATUS_FAIL;
     }
+    city_id_t* ids = malloc(list->size * sizeof(city_id_t));
+    if (!ids) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    for (city_id_t id = 0; id < list->size; id++) {
+        ids[id] = id;
+    }
+    int status = city_save_batch(list, ids, list->size);
+    free(ids);
+    if (status == STATUS_OK) {
+        printf("Migrated %u cities from %s to %s\n", list->size,
+               CITY_CACHE_DIR, CITY_CACHE_LOG_PATH);
+    }
+    return status;
+}
 
-    /*tinydir_dir dir;
-    if (tinydir_open(&dir, "./cities") != 0) {
-        printf("Directory: Cities could not be opened!\n");
+/*
+city_from_json() fills in a city_data_t row from a cached JSON object,
+with its strings in the list's arena. Returns STATUS_FAIL (and leaves the
+row alone) if the object is not a usable city.
+*/
+int city_from_json(city_list_t* list, json_t* root, city_data_t* out_data) {
+    json_t* jname      = json_object_get(root, "name");
+    json_t* jfp        = json_object_get(root, "fp");
+    json_t* jlat       = json_object_get(root, "lat");
+    json_t* jlon       = json_object_get(root, "lon");
+    json_t* jtemp      = json_object_get(root, "temp");
+    json_t* jwind      = json_object_get(root, "windspeed");
+    json_t* jhum       = json_object_get(root, "rel_hum");
+    json_t* jcached_at = json_object_get(root, "cached_at");
+
+    if (!json_is_string(jname) || !json_is_string(jfp) ||
+        !json_is_number(jlat) || !json_is_number(jlon)) {
+        return STATUS_FAIL;
+    }
+
+    /*
+    Construct a city_data_t row from JSON values. Using INIT_VAL
+    for any missing values.
+    */
+    city_data_t data = {
+        .name      = (char*)json_string_value(jname),
+        .lat       = json_number_value(jlat),
+        .lon       = json_number_value(jlon),
+        .temp      = jtemp ? json_number_value(jtemp) : INIT_VAL,
+        .windspeed = jwind ? json_number_value(jwind) : INIT_VAL,
+        .rel_hum   = jhum ? json_number_value(jhum) : INIT_VAL,
+    };
+
+    /*
+    cached_at is optional metadata: if missing/invalid,
+    set to 0 instead of rejecting the city
+    */
+    data.cached_at = (jcached_at && json_is_integer(jcached_at))
+                         ? (time_t)json_integer_value(jcached_at)
+                         : 0;
+    if (city_make_data(list, &data) != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+    *out_data = data; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+/*
+city_save_cache() stamps a city with the current time and queues it to be
+saved, either as a new record in the log or into its JSON file. Only the
+row is copied; the write happens later, in a batch, on the flusher thread
+(see persist.h), so saving never waits for the disk.
+*/
+int city_save_cache(city_list_t* list, city_id_t id) {
+    if (!list || id >= list->size) {
         return STATUS_FAIL;
     }
-    tinydir_close(&dir);*/
-    if (mkdir("./cities", 0755) != 0 && errno != EEXIST) {
+    list->cached_at[id] = time(NULL);
+    return city_save_batch(list, &id, 1);
+}
+
+/*
+city_save_batch() queues n cities as they are, cached_at included, which
+is how new cities without weather are saved. A batch of more than one is
+waited for, as it comes from an import or a migration, not a lookup.
+*/
+int city_save_batch(city_list_t* list, const city_id_t* ids, size_t n) {
+    if (!list || !ids) {
+        return STATUS_FAIL;
+    }
+    list->snap_dirty = true;
+    if (!list->persist) {
+        persist_item_t* items = malloc((n ? n : 1) * sizeof(persist_item_t));
+        if (!items) {
+            printf("Malloc failed\n");
+            return STATUS_FAIL;
+        }
+        for (size_t i = 0; i < n; i++) {
+            items[i].id = ids[i];
+            city_row(list, ids[i], &items[i].row);
+        }
+        int status = city_write_rows(items, n, list);
+        free(items);
+        return status;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        city_data_t row;
+        city_row(list, ids[i], &row);
+        if (persist_push(list->persist, ids[i], &row) != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+    }
+    return n > 1 ? persist_flush(list->persist) : STATUS_OK;
+}
+
+/*
+city_flush() writes every save still queued, in every booted list, and
+waits for it. Called on exit, and from the signal thread on SIGINT and
+SIGTERM.
+*/
+int city_flush(void) {
+    int status = STATUS_OK;
+    pthread_mutex_lock(&city_lists_lock);
+    for (city_list_t* list = city_lists; list; list = list->next_live) {
+        if (list->persist && persist_flush(list->persist) != STATUS_OK) {
+            status = STATUS_FAIL;
+        }
+    }
+    pthread_mutex_unlock(&city_lists_lock);
+    return status;
+}
+
+/*
+city_write_rows() writes a batch of saves. In log mode all records go out
+with a single write() and are made durable with a single fsync(); a torn
+batch is cut off at the first bad record when the log is next opened.
+userp is the list the rows were saved from.
+*/
+int city_write_rows(const persist_item_t* items, size_t n, void* userp) {
+    city_list_t* list = userp;
+    if (!CITY_CACHE_LOG) {
+        return city_write_files(items, n);
+    }
+
+    cachelog_item_t* records = calloc(n ? n : 1, sizeof(cachelog_item_t));
+    if (!records) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    int status = STATUS_OK;
+    for (size_t i = 0; i < n && status == STATUS_OK; i++) {
+        json_t* root    = city_to_json(&items[i].row);
+        char*   payload = json_dumps(root, JSON_COMPACT);
+        json_decref(root);
+        if (!payload) {
+            status = STATUS_FAIL;
+            break;
+        }
+        records[i].key       = items[i].row.fp;
+        records[i].payload   = payload;
+        records[i].len       = strlen(payload);
+        records[i].cached_at = (int64_t)items[i].row.cached_at;
+    }
+    if (status == STATUS_OK) {
+        pthread_mutex_lock(&list->log_lock);
+        status = city_open_log(list);
+        if (status == STATUS_OK) {
+            status = cachelog_append_batch(list->log, records, n);
+        }
+        if (status == STATUS_OK) {
+            status = cachelog_fsync(list->log);
+        }
+        pthread_mutex_unlock(&list->log_lock);
+    }
+    for (size_t i = 0; i < n; i++) {
+        free((char*)records[i].payload);
+    }
+    free(records);
+    return status;
+}
+
+/*
+city_write_files() writes a batch of saves to their JSON files without
+ever leaving a file half written: every city goes to a temp file first,
+all of them written and fsync'd as one batch (see bulkio.h), then each is
+renamed over the old file and the directory is fsync'd once so the
+renames last.
+*/
+int city_write_files(const persist_item_t* items, size_t n) {
+    if (mkdir(CITY_CACHE_DIR, 0755) != 0 && errno != EEXIST) {
         perror("mkdir");
         return STATUS_FAIL;
     }
+    bulkio_file_t* files = calloc(n ? n : 1, sizeof(bulkio_file_t));
+    if (!files) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+
+    int status = STATUS_OK;
+    for (size_t i = 0; i < n && status == STATUS_OK; i++) {
+        json_t* root = city_to_json(&items[i].row);
+        char*   text = json_dumps(root, JSON_INDENT(4));
+        char*   path = malloc(strlen(items[i].row.fp) + sizeof(".tmp"));
+        json_decref(root);
+        files[i].data = text;
+        if (!text || !path) {
+            printf("Malloc failed\n");
+            free(path);
+            status = STATUS_FAIL;
+            break;
+        }
+        sprintf(path, "%s.tmp", items[i].row.fp);
+        files[i].path = path;
+        files[i].len  = strlen(files[i].data);
+    }
+
+    bulkio_t* io = NULL;
+    if (status == STATUS_OK && bulkio_create(&io, BULKIO_URING) == STATUS_OK) {
+        status = bulkio_write(io, files, n);
+        bulkio_dispose(&io);
+    } else {
+        status = STATUS_FAIL;
+    }
+    for (size_t i = 0; i < n && files[i].path; i++) {
+        if (files[i].error) {
+            fprintf(stderr, "%s: %s\n", files[i].path,
+                    strerror(files[i].error));
+        }
+        if (status != STATUS_OK) {
+            unlink(files[i].path); /* the old files are left as they were */
+        } else if (rename(files[i].path, items[i].row.fp) != 0) {
+            perror("rename");
+            status = STATUS_FAIL;
+        }
+    }
+    int dir = open(CITY_CACHE_DIR, O_RDONLY);
+    if (dir < 0 || fsync(dir) != 0) {
+        status = STATUS_FAIL;
+    }
+    if (dir >= 0) {
+        close(dir);
+    }
+    for (size_t i = 0; i < n; i++) {
+        free((char*)files[i].path);
+        free(files[i].data);
+    }
+    free(files);
+    return status;
+}
 
+json_t* city_to_json(const city_data_t* row) {
     json_t* root = json_object();
-    json_object_set_new(root, "name", json_string(data->name));
-    json_object_set_new(root, "fp", json_string(data->fp));
-    json_object_set_new(root, "lat", json_real(data->lat));
-    json_object_set_new(root, "lon", json_real(data->lon));
-    json_object_set_new(root, "temp", json_real(data->temp));
-    json_object_set_new(root, "windspeed", json_real(data->windspeed));
-    json_object_set_new(root, "rel_hum", json_real(data->rel_hum));
-    json_object_set_new(root, "cached_at", json_integer(time(NULL)));
-
-    time_t now      = time(NULL);
-    data->cached_at = now;
-    json_object_set_new(root, "cached_at", json_integer(now));
-
-    if (json_dump_file(root, data->fp, JSON_INDENT(4)) != 0) {
+    json_object_set_new(root, "name", json_string(row->name));
+    json_object_set_new(root, "fp", json_string(row->fp));
+    json_object_set_new(root, "lat", json_real(row->lat));
+    json_object_set_new(root, "lon", json_real(row->lon));
+    json_object_set_new(root, "temp", json_real(row->temp));
+    json_object_set_new(root, "windspeed", json_real(row->windspeed));
+    json_object_set_new(root, "rel_hum", json_real(row->rel_hum));
+    json_object_set_new(root, "cached_at",
+                        json_integer((json_int_t)row->cached_at));
+    return root;
+}
+
+/*
+city_load_cache() loads weather/cache data for a city from the cache if,
+and only if, it is at most max_age seconds old. Freshness is decided
+without parsing: in log mode from the cached_at kept in the log index,
+otherwise from the file's mtime (cached_at is set right before a file is
+written, so a file modified too long ago cannot hold fresh data). Only
+then is the record parsed, once, for temp, windspeed, rel_hum and
+cached_at. The age is returned through out_age.
+*/
+int city_load_cache(city_list_t* list, city_id_t id, int max_age,
+                    int* out_age) {
+    if (!list || id >= list->size || !out_age) {
+        return STATUS_FAIL;
+    }
+
+    json_error_t error;
+    json_t*      root = NULL;
+    time_t       now  = time(NULL);
+    if (CITY_CACHE_LOG) {
+        cachelog_entry_t* entry   = NULL;
+        char*             payload = NULL;
+        bool              fresh   = false;
+        pthread_mutex_lock(&list->log_lock);
+        if (city_open_log(list) == STATUS_OK &&
+            cachelog_find(list->log, list->text[id].fp, &entry) == STATUS_OK &&
+            difftime(now, (time_t)entry->cached_at) <= max_age) {
+            fresh   = true;
+            payload = cachelog_read(list->log, entry);
+        }
+        pthread_mutex_unlock(&list->log_lock);
+        if (!fresh) {
+            return STATUS_FAIL;
+        }
+        if (payload) {
+            root = json_loads(payload, 0, &error);
+            free(payload);
+        }
+    } else {
+        struct stat st;
+        if (stat(list->text[id].fp, &st) != 0 ||
+            difftime(now, st.st_mtime) > max_age) {
+            return STATUS_FAIL;
+        }
+        root = json_load_file(list->text[id].fp, 0, &error);
+    }
+    if (!root) {
+        fprintf(stderr, "Failed to load cache for %s\n", list->text[id].name);
+        return STATUS_FAIL;
+    }
+
+    json_t* jcached_at = json_object_get(root, "cached_at");
+    if (!json_is_integer(jcached_at)) {
+        json_decref(root);
+        return STATUS_FAIL;
+    }
+    time_t cached = (time_t)json_integer_value(jcached_at);
+    double age    = difftime(now, cached);
+    if (age < 0 || age > max_age) {
         json_decref(root);
-        return -1;
+        return STATUS_FAIL;
     }
 
+    json_t* jtemp = json_object_get(root, "temp");
+    json_t* jwind = json_object_get(root, "windspeed");
+    json_t* jhum  = json_object_get(root, "rel_hum");
+
+    if (jtemp && json_is_number(jtemp))
+        list->temp[id] = json_number_value(jtemp);
+    if (jwind && json_is_number(jwind))
+        list->windspeed[id] = json_number_value(jwind);
+    if (jhum && json_is_number(jhum))
+        list->rel_hum[id] = json_number_value(jhum);
+    list->cached_at[id] = cached;
+    *out_age            = (int)age;
+
     json_decref(root);
-    return 0;
+    return STATUS_OK;
 }
 
-/* ----- LIST FUNCTIONS ----- */
+/* ----- STORE FUNCTIONS ----- */
 /*
-city_make_data() handles creating a city_data_t struct. This includes
-dynamically allocating memory for strings and calling meteo_url which
-returns the URL for the specific city.
+city_make_data() fills in the strings of a city_data_t row: the name is
+copied and the cache path and URL (built by meteo_url_write, for the
+city's grid cell) are derived from it and the coordinates. All three
+share a single allocation from the list's arena. Safe to call from
+several threads.
 */
-city_data_t* city_make_data(char* city_name, char* fp, double lat, double lon,
-                            double temp, double windspeed, double rel_hum) {
-    (void)fp;
-    city_data_t* data = malloc(sizeof(city_data_t));
-    if (!data) {
-        printf("Malloc failed\n");
-        return NULL;
+int city_make_data(city_list_t* list, city_data_t* data) {
+    size_t name_len = strlen(data->name) + 1;
+    size_t fp_len   = snprintf(NULL, 0, "./cities/%s_%.2f_%.2f.json",
+                               data->name, data->lat, data->lon) +
+                    1;
+    size_t url_len = meteo_url_write(NULL, 0, data->lat, data->lon) + 1;
+    char*  strings = arena_alloc(list->arena, name_len + fp_len + url_len);
+    if (!strings) {
+        return STATUS_FAIL;
     }
+    /*Formatted from the caller's name, not the copy next to data->fp*/
+    const char* name = data->name;
+    memcpy(strings, name, name_len);
+    data->name = strings;
+    data->fp   = strings + name_len;
+    data->url  = data->fp + fp_len;
+    snprintf(data->fp, fp_len, "./cities/%s_%.2f_%.2f.json", name, data->lat,
+             data->lon);
+    meteo_url_write(data->url, url_len, data->lat, data->lon);
+    return STATUS_OK;
+}
 
-    data->lat       = lat;
-    data->lon       = lon;
-    data->temp      = temp;
-    data->windspeed = windspeed;
-    data->rel_hum   = rel_hum;
-    data->name      = malloc(strlen(city_name) + 1);
-    if (!data->name) {
-        free(data);
-        return NULL;
+/*
+city_add() adds a copy of a city to the store. Only name, lat, lon and the
+weather fields of city_data are used; the strings are made by
+city_make_data(). The new ID is returned through out_id if it is not NULL.
+*/
+int city_add(city_list_t* list, const city_data_t* city_data,
+             city_id_t* out_id) {
+    if (!list || !city_data || !city_data->name) {
+        return STATUS_FAIL;
     }
-    strcpy(data->name, city_name);
+    city_data_t data = *city_data;
+    if (city_make_data(list, &data) != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+    return city_push(list, &data, out_id);
+}
 
-    size_t fp_len =
-        snprintf(NULL, 0, "./cities/%s_%.2f_%.2f.json", city_name, lat, lon) +
-        1;
-    data->fp = malloc(fp_len);
-    if (!data->fp) {
-        free(data->name);
-        free(data);
-        return NULL;
+/*
+city_push() appends a row whose strings are already owned by the store
+(arena or snapshot) and registers it in the name, spatial and search
+indexes and in its grid cell. The new city's ID is its index in the
+columns. If the name index cannot take the city the store is left as it
+was.
+*/
+int city_push(city_list_t* list, const city_data_t* data, city_id_t* out_id) {
+    if (list->size == list->cap &&
+        city_grow(list, list->size + 1) != STATUS_OK) {
+        return STATUS_FAIL;
     }
-    snprintf(data->fp, fp_len, "./cities/%s_%.2f_%.2f.json", city_name, lat,
-             lon);
-    data->url = meteo_url(lat, lon);
 
-    return data;
+    city_id_t id        = list->size;
+    list->lat[id]       = data->lat;
+    list->lon[id]       = data->lon;
+    list->temp[id]      = data->temp;
+    list->windspeed[id] = data->windspeed;
+    list->rel_hum[id]   = data->rel_hum;
+    list->cached_at[id] = data->cached_at;
+    list->hash[id]      = city_hash(data->name);
+    list->text[id].name = data->name;
+    list->text[id].url  = data->url;
+    list->text[id].fp   = data->fp;
+    if (city_index_insert(list, id) != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+    list->size++;
+    geo_insert(&list->geo, id, data->lat, data->lon);
+    grid_insert(&list->grid, id, data->lat, data->lon);
+    search_insert(&list->search, id, data->name);
+    if (out_id) {
+        *out_id = id; /* return through out-ptr */
+    }
+    return STATUS_OK;
 }
 
-void city_add_tail(city_node_t* node, city_list_t* list) {
-    if (!node || !list) {
-        return;
+/*
+city_grow() makes room for at least min_cap cities, doubling the capacity.
+Each column is reallocated on its own; if one fails the columns already
+grown are just larger than the capacity says, which is harmless.
+*/
+int city_grow(city_list_t* list, unsigned min_cap) {
+    if (min_cap <= list->cap) {
+        return STATUS_OK;
     }
-    if (!list->tail) {
-        list->head = list->tail = node;
-    } else {
-        node->prev       = list->tail;
-        list->tail->next = node;
-        list->tail       = node;
+    unsigned cap = list->cap ? list->cap : CITY_STORE_MIN;
+    while (cap < min_cap) {
+        cap = cap > UINT_MAX / 2 ? min_cap : cap * 2;
     }
-    list->size++;
+
+#define CITY_GROW_COLUMN(column)                                               \
+    do {                                                                       \
+        void* grown = realloc(list->column, cap * sizeof(*list->column));      \
+        if (!grown) {                                                          \
+            printf("Malloc failed\n");                                         \
+            return STATUS_FAIL;                                                \
+        }                                                                      \
+        list->column = grown;                                                  \
+    } while (0)
+
+    CITY_GROW_COLUMN(lat);
+    CITY_GROW_COLUMN(lon);
+    CITY_GROW_COLUMN(temp);
+    CITY_GROW_COLUMN(windspeed);
+    CITY_GROW_COLUMN(rel_hum);
+    CITY_GROW_COLUMN(cached_at);
+    CITY_GROW_COLUMN(hash);
+    CITY_GROW_COLUMN(text);
+#undef CITY_GROW_COLUMN
+
+    list->cap = cap;
+    return STATUS_OK;
 }
 
-int city_get(city_list_t* city_list, city_node_t** out_city) {
+/*
+city_get() reads the user's choice: a city name, or "lat,lon" for the
+city nearest to that point. A name that is not found exactly is looked up
+folded and with typos allowed: one clear match is taken, several are
+listed for the user to pick from.
+*/
+int city_get(city_list_t* city_list, city_id_t* out_id) {
 
-    if (!city_list || !out_city) {
-        fprintf(stderr, "List or ptr to ptr is NULL\n");
+    if (!city_list || !out_id) {
+        fprintf(stderr, "List or ptr to ID is NULL\n");
         return STATUS_FAIL;
     }
 
@@ -386,16 +1002,85 @@ int city_get(city_list_t* city_list, city_node_t** out_city) {
         return STATUS_EXIT;
     }
 
-    city_node_t* current = city_list->head;
-    while (current) {
-        if (strcmp(current->data->name, buf) == 0) {
-            *out_city = current;
+    /*Coordinates pick the nearest city*/
+    double lat   = 0.0;
+    double lon   = 0.0;
+    char   extra = '\0';
+    if (sscanf(buf, "%lf , %lf %c", &lat, &lon, &extra) == 2 &&
+        lat >= -90.0 && lat <= 90.0 && lon >= -180.0 && lon <= 180.0) {
+        return city_nearest(city_list, lat, lon, out_id);
+    }
+
+    if (city_find(city_list, buf, out_id) == STATUS_OK) {
+        return STATUS_OK;
+    }
+
+    search_hit_t hits[SEARCH_HITS_MAX];
+    uint32_t     key[SEARCH_KEY_MAX];
+    size_t       n   = city_suggest(city_list, buf, hits, SEARCH_HITS_MAX);
+    size_t       len = search_fold(buf, key, SEARCH_KEY_MAX);
+    if (n == 1 || (n > 0 && hits[0].dist == 0 && hits[0].len == len)) {
+        *out_id = hits[0].id; /* return through out-ptr */
+        return STATUS_OK;
+    }
+    if (n > 0) {
+        printf("\nDid you mean: ");
+        for (size_t i = 0; i < n; i++) {
+            printf("%s%s", i ? ", " : "", city_list->text[hits[i].id].name);
+        }
+        printf("?\n");
+    }
+    return STATUS_FAIL;
+}
+
+/*
+city_find() looks up a city by its exact name through the hash index.
+Only the slots sharing the probe sequence are visited and strcmp is only
+run when the stored hashes match.
+*/
+int city_find(city_list_t* city_list, const char* name, city_id_t* out_id) {
+    if (!city_list || !name || !out_id) {
+        return STATUS_FAIL;
+    }
+
+    city_index_t* index = &city_list->index;
+    if (index->cap == 0) {
+        return STATUS_FAIL;
+    }
+
+    uint32_t hash = city_hash(name);
+    unsigned mask = index->cap - 1;
+    for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+        city_slot_t* slot = &index->slots[i];
+        if (!slot->id) {
+            return STATUS_FAIL;
+        }
+        if (slot->hash == hash &&
+            strcmp(city_list->text[slot->id - 1].name, name) == 0) {
+            *out_id = slot->id - 1; /* return through out-ptr */
             return STATUS_OK;
         }
-        current = current->next;
     }
+}
 
-    return STATUS_FAIL;
+/*
+city_row() copies one city out of the columns, e.g. to use it after a
+lock on the list is released. The strings are not copied.
+*/
+int city_row(city_list_t* city_list, city_id_t id, city_data_t* out_row) {
+    if (!city_list || id >= city_list->size || !out_row) {
+        return STATUS_FAIL;
+    }
+    out_row->name      = city_list->text[id].name;
+    out_row->url       = city_list->text[id].url;
+    out_row->fp        = city_list->text[id].fp;
+    out_row->lat       = city_list->lat[id];
+    out_row->lon       = city_list->lon[id];
+    out_row->temp      = city_list->temp[id];
+    out_row->windspeed = city_list->windspeed[id];
+    out_row->rel_hum   = city_list->rel_hum[id];
+    out_row->cached_at = city_list->cached_at[id];
+    return STATUS_OK;
 }
 
 int city_print_list(city_list_t** city_list) {
@@ -406,11 +1091,278 @@ int city_print_list(city_list_t** city_list) {
     }
 
     printf("\n");
-    city_node_t* current = (*city_list)->head;
-    while (current != NULL) {
-        printf("%s\n", current->data->name);
-        current = current->next;
+    city_list_t* list = *city_list;
+    for (city_id_t id = 0; id < list->size; id++) {
+        printf("%s\n", list->text[id].name);
     }
 
     return STATUS_OK;
 }
+
+/* ----- SCANS ----- */
+/*
+The scans below read one or two columns from start to end. The loop
+bodies have no branches: every ID is stored and the output position only
+advances when the city matches, so the loops stream through memory at
+the same speed whatever the data looks like. IDs are written to out_ids,
+which must have room for list->size IDs, and the number written is
+returned.
+*/
+
+/*
+city_scan_stale() finds the cities whose data is more than max_age
+seconds old at now.
+*/
+size_t city_scan_stale(city_list_t* list, time_t now, int max_age,
+                       city_id_t* out_ids) {
+    if (!list || !out_ids) {
+        return 0;
+    }
+    const time_t* restrict cached_at = list->cached_at;
+    city_id_t              size      = list->size;
+    time_t                 limit     = now - max_age;
+    size_t                 n         = 0;
+    for (city_id_t id = 0; id < size; id++) {
+        out_ids[n] = id;
+        n += cached_at[id] < limit;
+    }
+    return n;
+}
+
+/*
+city_scan_below() finds the cities with a known temperature below temp.
+*/
+size_t city_scan_below(city_list_t* list, double temp, city_id_t* out_ids) {
+    if (!list || !out_ids) {
+        return 0;
+    }
+    const double* restrict col  = list->temp;
+    city_id_t              size = list->size;
+    size_t                 n    = 0;
+    for (city_id_t id = 0; id < size; id++) {
+        out_ids[n] = id;
+        n += (col[id] < temp) & (col[id] != INIT_VAL);
+    }
+    return n;
+}
+
+/*
+city_nearest() finds the city closest to a point, by great-circle
+distance, through the spatial index. Ties go to the lowest ID.
+
+If the index could not be built the columns are scanned instead, comparing
+distances on an equirectangular projection around the point (longitude
+scaled by cos(lat), wrapping at the antimeridian). That ranks cities the
+same way except over very long distances.
+*/
+int city_nearest(city_list_t* list, double lat, double lon,
+                 city_id_t* out_id) {
+    if (!list || !out_id || list->size == 0) {
+        return STATUS_FAIL;
+    }
+    if (geo_nearest(&list->geo, lat, lon, out_id) == STATUS_OK) {
+        return STATUS_OK;
+    }
+
+    const double* restrict lats  = list->lat;
+    const double* restrict lons  = list->lon;
+    city_id_t              size  = list->size;
+    double                 scale = cos(lat * 3.14159265358979323846 / 180.0);
+    double                 best  = HUGE_VAL;
+    city_id_t              found = 0;
+    for (city_id_t id = 0; id < size; id++) {
+        double dy = lats[id] - lat;
+        double dx = fabs(lons[id] - lon);
+        dx        = (dx > 180.0 ? 360.0 - dx : dx) * scale;
+        double d  = dx * dx + dy * dy;
+        found     = d < best ? id : found;
+        best      = d < best ? d : best;
+    }
+    *out_id = found; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+/*
+city_within() writes the ID of every city at most km from a point to
+out_ids, nearest first, and returns how many there are. out_ids must have
+room for list->size IDs. Without the spatial index it scans instead.
+*/
+size_t city_within(city_list_t* list, double lat, double lon, double km,
+                   city_id_t* out_ids) {
+    if (!list || !out_ids || km < 0) {
+        return 0;
+    }
+    size_t n = 0;
+    if (list->geo.ready) {
+        n = geo_within(&list->geo, lat, lon, km, out_ids);
+    } else {
+        for (city_id_t id = 0; id < list->size; id++) {
+            if (geo_distance_km(lat, lon, list->lat[id], list->lon[id]) <=
+                km) {
+                out_ids[n++] = id;
+            }
+        }
+    }
+    geo_sort(out_ids, n, list->lat, list->lon, lat, lon);
+    return n;
+}
+
+/* ----- WEATHER CELLS ----- */
+/*
+city_cell() gives the city that stands for the weather model cell a city
+is in (see grid.h). All cities of a cell get the same forecast, so a cell
+is fetched, cached and refreshed once, as its first city, and the result
+is shared with the rest by city_cell_share().
+*/
+city_id_t city_cell(city_list_t* list, city_id_t id) {
+    return grid_first(&list->grid, id);
+}
+
+/*
+city_cell_share() copies a city's weather, and when it was fetched, to
+every other city of its cell.
+*/
+void city_cell_share(city_list_t* list, city_id_t id) {
+    city_id_t other = grid_first(&list->grid, id);
+    for (; other != GRID_NONE; other = grid_next(&list->grid, other)) {
+        if (other == id) {
+            continue;
+        }
+        list->temp[other]      = list->temp[id];
+        list->windspeed[other] = list->windspeed[id];
+        list->rel_hum[other]   = list->rel_hum[id];
+        list->cached_at[other] = list->cached_at[id];
+    }
+}
+
+/*
+city_cells_spread() gives every cell the newest weather any of its cities
+has. Only the city a cell was fetched as is saved to cache, so at boot the
+other cities of the cell hold whatever they had before.
+*/
+void city_cells_spread(city_list_t* list) {
+    for (city_id_t id = 0; id < list->size; id++) {
+        if (grid_first(&list->grid, id) != id) {
+            continue;
+        }
+        city_id_t newest = id;
+        city_id_t other  = grid_next(&list->grid, id);
+        for (; other != GRID_NONE; other = grid_next(&list->grid, other)) {
+            if (list->temp[other] != INIT_VAL &&
+                (list->temp[newest] == INIT_VAL ||
+                 list->cached_at[other] > list->cached_at[newest])) {
+                newest = other;
+            }
+        }
+        if (list->temp[newest] != INIT_VAL) {
+            city_cell_share(list, newest);
+        }
+    }
+}
+
+/* ----- SEARCH ----- */
+/*
+city_suggest() gives up to max cities whose names start with, or are a
+typo or two away from, query (see search.h), best first.
+*/
+size_t city_suggest(city_list_t* list, const char* query,
+                    search_hit_t* out_hits, size_t max) {
+    return search_suggest(&list->search, query, out_hits, max);
+}
+
+/* ----- HASH INDEX ----- */
+/*
+city_hash() is 32-bit FNV-1a over the bytes of the name. City names are
+UTF-8, but since lookups are exact byte matches there is no need to decode.
+*/
+uint32_t city_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+city_index_insert() adds a city to the open addressing table using linear
+probing. The table is kept at most 70% full. If a city with the same name
+is already indexed the first one is kept, which matches the order a scan
+of the store would have found.
+*/
+int city_index_insert(city_list_t* list, city_id_t id) {
+    city_index_t* index = &list->index;
+    if ((index->used + 1) * 10 > index->cap * 7) {
+        if (city_index_grow(index) != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+    }
+
+    uint32_t    hash = list->hash[id];
+    const char* name = list->text[id].name;
+    unsigned    mask = index->cap - 1;
+    for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+        city_slot_t* slot = &index->slots[i];
+        if (!slot->id) {
+            slot->hash = hash;
+            slot->id   = id + 1;
+            index->used++;
+            return STATUS_OK;
+        }
+        if (slot->hash == hash &&
+            strcmp(list->text[slot->id - 1].name, name) == 0) {
+            return STATUS_OK;
+        }
+    }
+}
+
+/*
+city_index_reserve() grows the table until n cities fit, so that
+inserting them does not grow it on the way.
+*/
+int city_index_reserve(city_index_t* index, unsigned n) {
+    while ((uint64_t)n * 10 > (uint64_t)index->cap * 7) {
+        if (city_index_grow(index) != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+    }
+    return STATUS_OK;
+}
+
+/*
+city_index_grow() doubles the table. Entries are moved using their stored
+hashes, so no name is hashed twice.
+*/
+int city_index_grow(city_index_t* index) {
+    unsigned     new_cap = index->cap ? index->cap * 2 : 16;
+    city_slot_t* slots   = calloc(new_cap, sizeof(city_slot_t));
+    if (!slots) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+
+    unsigned mask = new_cap - 1;
+    for (unsigned i = 0; i < index->cap; i++) {
+        city_slot_t* old = &index->slots[i];
+        if (!old->id) {
+            continue;
+        }
+        unsigned j = old->hash & mask;
+        while (slots[j].id) {
+            j = (j + 1) & mask;
+        }
+        slots[j] = *old;
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->cap   = new_cap;
+    return STATUS_OK;
+}
+
+void city_index_free(city_index_t* index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->cap   = 0;
+    index->used  = 0;
+}
@@ -3,8 +3,22 @@
 #ifndef __CITY_H_
 #define __CITY_H_
 #define INIT_VAL -1000.0
+#define CITY_CACHE_DIR "./cities"
+#define CITY_CACHE_LOG_PATH "./cities.log"
+#define CITY_CACHE_LOG 1           /* 0 keeps one JSON file per city instead */
+#define CITY_BOOT_THREADS 0        /* threads parsing the cache, 0 = per core */
+#define CITY_BOOT_PARALLEL_MIN 512 /* smaller caches use only one thread */
+#define CITY_STORE_MIN 64          /* first capacity of the columns */
 
+#include "arena.h"
+#include "geo.h"
+#include "grid.h"
+#include "search.h"
+
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 
@@ -15,7 +29,19 @@ typedef enum status_code {
     STATUS_EXIT,
 } status_code_t;
 
-/* ----- Struct for keeping city data ----- */
+/* ----- Stable city IDs ----- */
+/*
+A city is known by its index in the store. Cities are never removed, so
+an ID stays valid for the life of the list, while pointers into the
+columns do not (they move when the store grows).
+*/
+typedef uint32_t city_id_t;
+
+/* ----- Struct for one city record ----- */
+/*
+Used to pass a whole city around, e.g. when adding it to the store. The
+store itself keeps the fields in columns.
+*/
 typedef struct city_data city_data_t;
 struct city_data {
     char*  name;
@@ -28,26 +54,89 @@ struct city_data {
     double rel_hum;
     time_t cached_at;
 };
-/* ----- Structs for linked list ----- */
-typedef struct city_node city_node_t;
-struct city_node {
-    city_data_t* data;
-    city_node_t* prev;
-    city_node_t* next;
+
+/* ----- Struct for the cold columns ----- */
+typedef struct city_text city_text_t;
+struct city_text {
+    char* name;
+    char* url;
+    char* fp;
+};
+
+/* ----- Structs for name index (open addressing) ----- */
+typedef struct city_slot city_slot_t;
+struct city_slot {
+    uint32_t hash;
+    uint32_t id; /* city ID + 1, 0 marks an empty slot */
+};
+
+typedef struct city_index city_index_t;
+struct city_index {
+    city_slot_t* slots;
+    unsigned     cap; /* always zero or a power of two */
+    unsigned     used;
 };
 
+/* ----- Struct for the city store ----- */
+/*
+The cities are kept as a struct of arrays: each hot numeric field has a
+contiguous column indexed by city ID, so a scan over one field touches
+only that field's memory. The strings are in a separate cold column and,
+like everything else allocated per city, live in the list's arena (or in
+the boot snapshot's mapping). city_dispose() releases it all.
+*/
 typedef struct city_list city_list_t;
 struct city_list {
-    city_node_t* head;
-    city_node_t* tail;
-    unsigned     size;
+    unsigned         size;
+    unsigned         cap;
+    double*          lat;
+    double*          lon;
+    double*          temp;
+    double*          windspeed;
+    double*          rel_hum;
+    time_t*          cached_at;
+    uint32_t*        hash;   /* hash of the name, precomputed for the index */
+    city_text_t*     text;
+    city_index_t     index;
+    geo_t            geo;    /* spatial index over lat and lon */
+    grid_t           grid;   /* weather model cells, see city_cell() */
+    search_t         search; /* folded names, see city_suggest() */
+    arena_t*         arena;
+    struct persist*  persist;    /* write-behind queue, see persist.h */
+    struct cachelog* log;        /* see city_open_log() */
+    pthread_mutex_t  log_lock;   /* the log is shared with the flusher */
+    struct snapshot* snap;       /* booted from, see city_read_snapshot() */
+    bool             snap_dirty; /* city_dispose() writes a new snapshot */
+    city_list_t*     next_live;  /* see city_flush() */
 };
 
 /* ----- Public Functions ----- */
-int city_init(city_list_t** city_list);
-int city_print_list(city_list_t** city_list);
-int city_get(city_list_t* city_list, city_node_t** out_city);
-int city_save_cache(city_data_t* city_data);
-int city_dispose(city_list_t** city_list);
+int       city_init(city_list_t** city_list);
+int       city_print_list(city_list_t** city_list);
+int       city_get(city_list_t* city_list, city_id_t* out_id);
+int       city_find(city_list_t* city_list, const char* name,
+                    city_id_t* out_id);
+int       city_row(city_list_t* city_list, city_id_t id, city_data_t* out_row);
+int       city_add(city_list_t* city_list, const city_data_t* city_data,
+                   city_id_t* out_id);
+int       city_save_cache(city_list_t* city_list, city_id_t id);
+int       city_save_batch(city_list_t* city_list, const city_id_t* ids,
+                          size_t n);
+int       city_flush(void);
+int       city_load_cache(city_list_t* city_list, city_id_t id, int max_age,
+                          int* out_age);
+size_t    city_scan_stale(city_list_t* city_list, time_t now, int max_age,
+                          city_id_t* out_ids);
+size_t    city_scan_below(city_list_t* city_list, double temp,
+                          city_id_t* out_ids);
+int       city_nearest(city_list_t* city_list, double lat, double lon,
+                       city_id_t* out_id);
+size_t    city_within(city_list_t* city_list, double lat, double lon, double km,
+                      city_id_t* out_ids);
+city_id_t city_cell(city_list_t* city_list, city_id_t id);
+void      city_cell_share(city_list_t* city_list, city_id_t id);
+size_t    city_suggest(city_list_t* city_list, const char* query,
+                       search_hit_t* out_hits, size_t max);
+int       city_dispose(city_list_t** city_list);
 
 #endif /* __CITY_H_ */
\ No newline at end of file
@@ -0,0 +1,398 @@
+/*
+    fetch.c contains the concurrent fetch engine:
+    - runs one transfer per city on a curl multi handle, using
+      handles from the HTTP context pool
+    - keeps at most max_inflight transfers running at once
+    - fetches every weather model cell once, however many of its cities
+      are asked for
+    - parses every body while it streams in, and caches the city as soon
+      as its transfer completes; a body the parser cannot follow is
+      fetched again into a buffer for jansson
+    - goes through the single-flight table of the HTTP context, so a cell
+      fetched by a lookup, the refresh worker or another run meanwhile is
+      waited for instead of fetched again
+*/
+
+#include "fetch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ----- Struct for grouping jobs by cell ----- */
+typedef struct {
+    city_id_t cell;
+    size_t    job;
+} fetch_cell_t;
+
+/* ----- PRIVATE FUNCTIONS ----- */
+void fetch_group(fetch_job_t* jobs, size_t n);
+int  fetch_cell_cmp(const void* a, const void* b);
+int  fetch_add(http_ctx_t* http_ctx, CURLM* multi, fetch_job_t* job);
+int  fetch_done(http_ctx_t* http_ctx, CURLM* multi, CURL* curl,
+                CURLcode result);
+int  fetch_requeue(http_ctx_t* http_ctx, CURLM* multi, fetch_job_t* job);
+void fetch_notify(fetch_job_t* job, int status);
+int  fetch_reap(http_ctx_t* http_ctx, fetch_job_t** waiting,
+                unsigned* num_waiting);
+void fetch_job_release(http_ctx_t* http_ctx, CURLM* multi, fetch_job_t* job);
+
+/*
+fetch_run() refreshes every city in ids concurrently. Transfers are
+started in order until max_inflight are running, and a new one is added
+each time one completes. Bodies are parsed as they arrive, like the
+sequential path, and every updated city goes through city_save_cache().
+Cities of one weather model cell are fetched once, by the first of them
+in ids, and share the result; a cell some other caller is fetching
+already is not fetched again, its result is waited for. Returns
+STATUS_FAIL if any city could not be refreshed; the others are still
+updated. If on_done is given it is told about every city as soon as it
+is done, so results can be used while the rest are still in flight.
+*/
+int fetch_run(http_ctx_t* http_ctx, city_list_t* list, const city_id_t* ids,
+              size_t n, unsigned max_inflight, fetch_fn on_done,
+              void* userp) {
+    if (!list || !ids) {
+        return STATUS_FAIL;
+    }
+    if (max_inflight == 0) {
+        max_inflight = FETCH_MAX_INFLIGHT;
+    }
+
+    if (n == 0) {
+        return STATUS_OK;
+    }
+
+    fetch_job_t* jobs = calloc(n, sizeof(fetch_job_t));
+    if (!jobs) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    CURLM* multi = curl_multi_init();
+    if (!multi) {
+        fprintf(stderr, "Curl multi returned NULL\n");
+        free(jobs);
+        return STATUS_FAIL;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        jobs[i].list    = list;
+        jobs[i].id      = ids[i];
+        jobs[i].on_done = on_done;
+        jobs[i].userp   = userp;
+    }
+    fetch_group(jobs, n);
+
+    /*Jobs that joined a flight; more wait until one of them is done*/
+    fetch_job_t* waiting[HTTP_FLIGHTS_MAX];
+    unsigned     num_waiting = 0;
+    int          status      = STATUS_OK;
+    size_t       next        = 0;
+    unsigned     in_flight   = 0;
+    while (next < n || in_flight > 0 || num_waiting > 0) {
+
+        /*Top up the number of running transfers*/
+        bool blocked = num_waiting == HTTP_FLIGHTS_MAX;
+        while (next < n && in_flight < max_inflight && !blocked) {
+            fetch_job_t* job = &jobs[next];
+            if (job->follows) {
+                next++;
+                continue;
+            }
+            http_list_lock(http_ctx);
+            int claim = http_flight_claim(http_ctx, list, job->id,
+                                          &job->flight);
+            http_list_unlock(http_ctx);
+            if (claim == STATUS_FAIL) {
+                blocked = true; /* every flight is taken, try again later */
+                continue;
+            }
+            next++;
+            if (claim == STATUS_EXIT) {
+                job->joined            = true;
+                waiting[num_waiting++] = job;
+                blocked                = num_waiting == HTTP_FLIGHTS_MAX;
+                continue;
+            }
+            if (fetch_add(http_ctx, multi, job) != STATUS_OK) {
+                http_list_lock(http_ctx);
+                http_flight_finish(http_ctx, job->flight, STATUS_FAIL);
+                job->flight = NULL;
+                http_list_unlock(http_ctx);
+                fetch_notify(job, STATUS_FAIL);
+                status = STATUS_FAIL;
+                continue;
+            }
+            in_flight++;
+        }
+
+        /*Nothing of our own running: sleep until a flight ends*/
+        if (in_flight == 0 && (num_waiting > 0 || blocked)) {
+            http_list_lock(http_ctx);
+            if (num_waiting > 0 && waiting[0]->flight->busy) {
+                pthread_cond_wait(&waiting[0]->flight->done,
+                                  &http_ctx->list_lock);
+            } else if (num_waiting == 0) {
+                pthread_cond_wait(&http_ctx->flight_cond,
+                                  &http_ctx->list_lock);
+            }
+            http_list_unlock(http_ctx);
+        }
+
+        int       running = 0;
+        CURLMcode mc      = CURLM_OK;
+        if (in_flight > 0) {
+            mc = curl_multi_perform(multi, &running);
+        }
+        if (mc == CURLM_OK && running > 0) {
+            mc = curl_multi_poll(multi, NULL, 0,
+                                 num_waiting > 0 ? FETCH_POLL_MS : 1000, NULL);
+        }
+        if (mc != CURLM_OK) {
+            fprintf(stderr, "Curl multi failed: %s\n", curl_multi_strerror(mc));
+            status = STATUS_FAIL;
+            break;
+        }
+
+        /*Hand every finished transfer over to the parser*/
+        CURLMsg* msg  = NULL;
+        int      left = 0;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            int done = fetch_done(http_ctx, multi, msg->easy_handle,
+                                  msg->data.result);
+            if (done == STATUS_EXIT) {
+                continue; /* requeued, still in flight */
+            }
+            if (done != STATUS_OK) {
+                status = STATUS_FAIL;
+            }
+            in_flight--;
+        }
+        if (num_waiting > 0 &&
+            fetch_reap(http_ctx, waiting, &num_waiting) != STATUS_OK) {
+            status = STATUS_FAIL;
+        }
+    }
+
+    /*Only finds transfers or flights left if the multi handle broke*/
+    for (size_t i = 0; i < next; i++) {
+        fetch_job_release(http_ctx, multi, &jobs[i]);
+        if (jobs[i].flight) {
+            http_list_lock(http_ctx);
+            if (jobs[i].joined) {
+                http_flight_leave(http_ctx, jobs[i].flight);
+            } else {
+                http_flight_finish(http_ctx, jobs[i].flight, STATUS_FAIL);
+            }
+            http_list_unlock(http_ctx);
+            jobs[i].flight = NULL;
+        }
+    }
+    curl_multi_cleanup(multi);
+    free(jobs);
+    return status;
+}
+
+/*
+fetch_group() makes every job follow the first job for the same cell.
+The jobs are sorted by cell on the side, so this is not quadratic in n.
+Without memory every job just fetches its own city.
+*/
+void fetch_group(fetch_job_t* jobs, size_t n) {
+    fetch_cell_t* cells = malloc(n * sizeof(fetch_cell_t));
+    if (!cells) {
+        printf("Malloc failed\n");
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        cells[i].cell = city_cell(jobs[i].list, jobs[i].id);
+        cells[i].job  = i;
+    }
+    qsort(cells, n, sizeof(fetch_cell_t), fetch_cell_cmp);
+
+    /*Equal cells are now together, each run in order of job*/
+    fetch_job_t* last = NULL;
+    for (size_t i = 0; i < n; i++) {
+        fetch_job_t* job = &jobs[cells[i].job];
+        if (last && cells[i].cell == cells[i - 1].cell) {
+            job->follows   = true;
+            last->follower = job;
+        }
+        last = job;
+    }
+    free(cells);
+}
+
+int fetch_cell_cmp(const void* a, const void* b) {
+    const fetch_cell_t* x = a;
+    const fetch_cell_t* y = b;
+    if (x->cell != y->cell) {
+        return x->cell < y->cell ? -1 : 1;
+    }
+    return (x->job > y->job) - (x->job < y->job);
+}
+
+/*
+fetch_add() takes a pooled handle for one city and adds it to the multi
+handle. The job rides along as CURLOPT_PRIVATE so fetch_done() can find
+the city again, and its parser is the target of http_write_stream().
+*/
+int fetch_add(http_ctx_t* http_ctx, CURLM* multi, fetch_job_t* job) {
+    CURL* curl = http_acquire(http_ctx);
+    if (!curl) {
+        return STATUS_FAIL;
+    }
+
+    http_stream_start(&job->parser, &job->row, 1);
+    curl_easy_setopt(curl, CURLOPT_URL, job->list->text[job->id].url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, http_write_stream);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&job->parser);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, (void*)job);
+
+    if (curl_multi_add_handle(multi, curl) != CURLM_OK) {
+        http_release(http_ctx, curl);
+        return STATUS_FAIL;
+    }
+    job->curl = curl;
+    return STATUS_OK;
+}
+
+/*
+fetch_done() finishes one transfer: the parsed values go into the city,
+it is saved to cache and shared with its cell, then the handle goes back
+to the pool. A body the streaming parser could not follow is requeued
+with fetch_requeue() instead, and STATUS_EXIT returned; the job is done
+when that transfer is. The list lock is held while the city is updated,
+never over parsing or on_done.
+*/
+int fetch_done(http_ctx_t* http_ctx, CURLM* multi, CURL* curl,
+               CURLcode result) {
+    fetch_job_t* job = NULL;
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**)&job);
+    http_stats_add(http_ctx, curl);
+
+    const char* name   = job->list->text[job->id].name;
+    int         status = STATUS_FAIL;
+    int         parsed = STATUS_FAIL;
+    bool        failed = result != CURLE_OK;
+    if (job->buffered) {
+        pthread_mutex_lock(&http_ctx->pool_lock);
+        http_ctx->stats.buf_fetches++;
+        http_ctx->stats.buf_reallocs += job->body.reallocs;
+        pthread_mutex_unlock(&http_ctx->pool_lock);
+        if (!failed && job->body.data) {
+            parsed = http_json_rows(job->body.data, &job->row, 1);
+        }
+        http_buf_put(http_ctx, &job->body);
+    } else if (result == CURLE_OK || result == CURLE_WRITE_ERROR) {
+        /*A write error means the parser stopped the transfer*/
+        failed = false;
+        parsed = jstream_finish(&job->parser);
+    }
+    if (parsed == STATUS_EXIT &&
+        fetch_requeue(http_ctx, multi, job) == STATUS_OK) {
+        return STATUS_EXIT;
+    }
+
+    http_list_lock(http_ctx);
+    if (parsed == STATUS_OK) {
+        http_stream_apply(job->list, &job->row, &job->id, 1);
+    }
+    if (failed) {
+        fprintf(stderr, "Curl performed bad for %s: %s\n", name,
+                curl_easy_strerror(result));
+    } else if (parsed != STATUS_OK) {
+        fprintf(stderr, "Failed to parse HTTP response for %s.\n", name);
+    } else {
+        if (city_save_cache(job->list, job->id) != 0)
+            fprintf(stderr, "Failed to save cache for %s\n", name);
+        city_cell_share(job->list, job->id);
+        status = STATUS_OK;
+    }
+    http_flight_finish(http_ctx, job->flight, status);
+    job->flight = NULL;
+    http_list_unlock(http_ctx);
+    fetch_notify(job, status);
+
+    fetch_job_release(http_ctx, multi, job);
+    return status;
+}
+
+/*
+fetch_requeue() puts a job whose body was beyond the streaming parser
+back on the multi handle, on the same handle, this time reading the body
+into a pooled buffer for jansson.
+*/
+int fetch_requeue(http_ctx_t* http_ctx, CURLM* multi, fetch_job_t* job) {
+    curl_multi_remove_handle(multi, job->curl);
+    http_buf_get(http_ctx, &job->body);
+    job->body.curl = job->curl;
+    job->buffered  = true;
+    curl_easy_setopt(job->curl, CURLOPT_WRITEFUNCTION, http_write_data);
+    curl_easy_setopt(job->curl, CURLOPT_WRITEDATA, (void*)&job->body);
+    if (curl_multi_add_handle(multi, job->curl) != CURLM_OK) {
+        return STATUS_FAIL;
+    }
+    return STATUS_OK;
+}
+
+/*
+fetch_notify() tells on_done about a job and the jobs following it.
+Called without the list lock.
+*/
+void fetch_notify(fetch_job_t* job, int status) {
+    for (; job; job = job->follower) {
+        if (job->on_done) {
+            job->on_done(job->id, status, job->userp);
+        }
+    }
+}
+
+/*
+fetch_reap() finishes every waiting job whose joined flight is over. The
+city was updated and saved by whoever ran the flight, so it is only told
+about, once the list lock is released. Returns STATUS_FAIL if any of
+those flights failed.
+*/
+int fetch_reap(http_ctx_t* http_ctx, fetch_job_t** waiting,
+               unsigned* num_waiting) {
+    fetch_job_t* over[HTTP_FLIGHTS_MAX];
+    int          got[HTTP_FLIGHTS_MAX];
+    unsigned     num_over = 0;
+    unsigned     kept     = 0;
+    http_list_lock(http_ctx);
+    for (unsigned i = 0; i < *num_waiting; i++) {
+        fetch_job_t* job = waiting[i];
+        if (job->flight->busy) {
+            waiting[kept++] = job;
+            continue;
+        }
+        got[num_over]    = http_flight_leave(http_ctx, job->flight);
+        over[num_over++] = job;
+        job->flight      = NULL;
+    }
+    http_list_unlock(http_ctx);
+    *num_waiting = kept; /* return through out-ptr */
+
+    int status = STATUS_OK;
+    for (unsigned i = 0; i < num_over; i++) {
+        if (got[i] != STATUS_OK) {
+            status = STATUS_FAIL;
+        }
+        fetch_notify(over[i], got[i]);
+    }
+    return status;
+}
+
+void fetch_job_release(http_ctx_t* http_ctx, CURLM* multi, fetch_job_t* job) {
+    http_buf_put(http_ctx, &job->body);
+    if (job->curl) {
+        curl_multi_remove_handle(multi, job->curl);
+        curl_easy_setopt(job->curl, CURLOPT_PRIVATE, NULL);
+        http_release(http_ctx, job->curl);
+        job->curl = NULL;
+    }
+}
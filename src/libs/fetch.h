@@ -0,0 +1,56 @@
+/* fetch.h */
+
+#ifndef __FETCH_H_
+#define __FETCH_H_
+#define FETCH_MAX_INFLIGHT 8 /* default number of parallel transfers */
+#define FETCH_POLL_MS 50     /* poll timeout while a joined flight runs */
+
+#include "HTTP.h"
+#include "city.h"
+#include "jstream.h"
+
+#include <curl/curl.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+Called once for every city when its transfer is done, and status
+STATUS_OK if the city was updated. The list lock is not held, so a
+callback that reads the city takes it, and can write its output after
+letting go of it.
+*/
+typedef void (*fetch_fn)(city_id_t id, int status, void* userp);
+
+/* ----- Struct for one transfer ----- */
+/*
+The body is parsed into row while it arrives, so a job holds no buffer.
+Only a body the streaming parser could not follow is fetched again into
+body, and parsed by jansson once it is complete.
+Of several jobs for one weather model cell only the first one fetches;
+the others follow it and are done when it is. The first one holds the
+cell's flight (see http_flight_claim()), or has joined it when another
+caller is fetching the cell already and then waits for that request.
+*/
+typedef struct fetch_job fetch_job_t;
+struct fetch_job {
+    city_list_t*   list;
+    city_id_t      id;
+    CURL*          curl; /* non-NULL while the transfer is in flight */
+    jstream_t      parser;
+    city_data_t    row;
+    http_membuf_t  body;     /* used once buffered */
+    bool           buffered; /* refetched for jansson, see fetch_requeue() */
+    fetch_fn       on_done;
+    void*          userp;
+    bool           follows;  /* another job fetches this one's cell */
+    fetch_job_t*   follower; /* next job of the cell, done along with this */
+    http_flight_t* flight;   /* claimed or joined, NULL once it is over */
+    bool           joined;   /* flight is another caller's */
+};
+
+/* ----- Public functions ----- */
+int fetch_run(http_ctx_t* http_ctx, city_list_t* city_list,
+              const city_id_t* ids, size_t n, unsigned max_inflight,
+              fetch_fn on_done, void* userp);
+
+#endif /* __FETCH_H_ */
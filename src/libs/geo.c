@@ -0,0 +1,395 @@
+/*
+    geo.c contains the spatial index of the city list:
+    - handles building a balanced k-d tree over every city at boot
+    - handles adding cities as leaves, rebuilding when the tree gets deep
+    - handles nearest city and all cities within a radius
+    - handles great-circle distances (haversine)
+
+    Searches visit the side of a split the point is on first, and the
+    other side only if it could still hold a closer city, so a lookup
+    touches about log2(n) nodes instead of every city.
+*/
+
+#include "geo.h"
+
+#include "city.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GEO_DEG (3.14159265358979323846 / 180.0)
+
+/* ----- Struct for sorting by distance ----- */
+typedef struct {
+    double   d;
+    uint32_t id;
+} geo_hit_t;
+
+/* ----- PRIVATE FUNCTIONS ----- */
+void     geo_point(double lat, double lon, double out_p[3]);
+double   geo_dist2(const double a[3], const double b[3]);
+int      geo_reserve(geo_t* geo, uint32_t n);
+uint32_t geo_balance(geo_node_t* nodes, uint32_t lo, uint32_t hi,
+                     unsigned depth);
+void     geo_select(geo_node_t* nodes, uint32_t lo, uint32_t hi, uint32_t k,
+                    unsigned axis);
+void     geo_search(const geo_node_t* nodes, uint32_t node, unsigned depth,
+                    const double q[3], uint32_t* best, double* best_d);
+size_t   geo_collect(const geo_node_t* nodes, uint32_t node, unsigned depth,
+                     const double q[3], double r2, uint32_t* out_ids,
+                     size_t n);
+int      geo_hit_cmp(const void* a, const void* b);
+
+/* ----- BUILD ----- */
+/*
+geo_build() indexes the first n cities of the columns, replacing whatever
+the tree held. The tree is balanced: each split is on the median.
+*/
+int geo_build(geo_t* geo, const double* lat, const double* lon, uint32_t n) {
+    geo->size  = 0;
+    geo->root  = GEO_NONE;
+    geo->ready = false;
+    if (geo_reserve(geo, n) != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+    for (uint32_t id = 0; id < n; id++) {
+        geo_node_t* node = &geo->nodes[id];
+        geo_point(lat[id], lon[id], node->p);
+        node->id = id;
+    }
+    geo->size  = n;
+    geo->root  = geo_balance(geo->nodes, 0, n, 0);
+    geo->ready = true;
+    return STATUS_OK;
+}
+
+/*
+geo_insert() adds a city as a leaf. Adding cities in an unlucky order (say
+sorted by latitude) grows one branch; once a leaf lands deeper than
+GEO_DEPTH_MAX the whole tree is rebuilt balanced. Does nothing before the
+first geo_build(). If the tree cannot grow it is dropped (ready is
+cleared), and the caller is expected to fall back to a scan.
+*/
+int geo_insert(geo_t* geo, uint32_t id, double lat, double lon) {
+    if (!geo->ready) {
+        return STATUS_OK;
+    }
+    if (geo_reserve(geo, geo->size + 1) != STATUS_OK) {
+        geo->ready = false;
+        return STATUS_FAIL;
+    }
+    uint32_t    self = geo->size++;
+    geo_node_t* node = &geo->nodes[self];
+    geo_point(lat, lon, node->p);
+    node->id    = id;
+    node->left  = GEO_NONE;
+    node->right = GEO_NONE;
+    if (geo->root == GEO_NONE) {
+        geo->root = self;
+        return STATUS_OK;
+    }
+
+    uint32_t at    = geo->root;
+    unsigned depth = 0;
+    while (1) {
+        geo_node_t* parent = &geo->nodes[at];
+        unsigned    axis   = depth++ % 3;
+        uint32_t*   child =
+            node->p[axis] < parent->p[axis] ? &parent->left : &parent->right;
+        if (*child == GEO_NONE) {
+            *child = self;
+            break;
+        }
+        at = *child;
+    }
+    if (depth > GEO_DEPTH_MAX) {
+        geo->root = geo_balance(geo->nodes, 0, geo->size, 0);
+    }
+    return STATUS_OK;
+}
+
+/*
+geo_load() replaces the tree with a copy of one built earlier (see
+snapshot_write()) over cities below ids. The copy comes from a file, so
+it is checked before it is used: every link points inside it, no node is
+pointed to twice and the root not at all, and no leaf is deeper than
+geo_insert() lets one get, so the searches (which recurse) end. Returns
+STATUS_FAIL, leaving the tree empty and not ready, if it does not hold.
+*/
+int geo_load(geo_t* geo, const geo_node_t* nodes, uint32_t n, uint32_t root,
+             uint32_t ids) {
+    geo_free(geo);
+    if (n == 0 || root >= n || geo_reserve(geo, n) != STATUS_OK) {
+        geo_free(geo);
+        return STATUS_FAIL;
+    }
+    memcpy(geo->nodes, nodes, n * sizeof(geo_node_t));
+
+    uint8_t*  seen   = calloc(n, 1);
+    uint32_t* queue  = malloc(n * sizeof(uint32_t));
+    bool      intact = seen && queue;
+    for (uint32_t i = 0; intact && i < n; i++) {
+        const geo_node_t* at    = &geo->nodes[i];
+        uint32_t          to[2] = {at->left, at->right};
+        intact                  = at->id < ids;
+        for (int k = 0; k < 2 && intact; k++) {
+            if (to[k] == GEO_NONE) {
+                continue;
+            }
+            intact = to[k] < n && !seen[to[k]];
+            if (intact) {
+                seen[to[k]] = 1;
+            }
+        }
+    }
+    intact = intact && !seen[root];
+
+    /*Breadth first, one depth at a time*/
+    size_t start = 0;
+    size_t end   = 0;
+    if (intact) {
+        queue[end++] = root;
+    }
+    for (unsigned depth = 0; intact && start < end; depth++) {
+        size_t level_end = end;
+        intact           = depth <= GEO_DEPTH_MAX;
+        for (size_t i = start; i < level_end; i++) {
+            const geo_node_t* at = &geo->nodes[queue[i]];
+            if (at->left != GEO_NONE) {
+                queue[end++] = at->left;
+            }
+            if (at->right != GEO_NONE) {
+                queue[end++] = at->right;
+            }
+        }
+        start = level_end;
+    }
+    free(seen);
+    free(queue);
+    if (!intact) {
+        geo_free(geo);
+        return STATUS_FAIL;
+    }
+    geo->size  = n;
+    geo->root  = root;
+    geo->ready = true;
+    return STATUS_OK;
+}
+
+int geo_reserve(geo_t* geo, uint32_t n) {
+    if (n <= geo->cap) {
+        return STATUS_OK;
+    }
+    uint32_t cap = geo->cap ? geo->cap : CITY_STORE_MIN;
+    while (cap < n) {
+        cap = cap > UINT32_MAX / 2 ? n : cap * 2;
+    }
+    geo_node_t* nodes = realloc(geo->nodes, cap * sizeof(geo_node_t));
+    if (!nodes) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    geo->nodes = nodes;
+    geo->cap   = cap;
+    return STATUS_OK;
+}
+
+/*
+geo_balance() arranges nodes[lo, hi) into a subtree and returns its root.
+The median on the axis of this depth is moved to the middle and becomes
+the root; the halves on either side become its children.
+*/
+uint32_t geo_balance(geo_node_t* nodes, uint32_t lo, uint32_t hi,
+                     unsigned depth) {
+    if (lo >= hi) {
+        return GEO_NONE;
+    }
+    uint32_t mid = lo + (hi - lo) / 2;
+    geo_select(nodes, lo, hi, mid, depth % 3);
+    nodes[mid].left  = geo_balance(nodes, lo, mid, depth + 1);
+    nodes[mid].right = geo_balance(nodes, mid + 1, hi, depth + 1);
+    return mid;
+}
+
+/*
+geo_select() is quickselect (Hoare's FIND): afterwards nodes[k] is where
+it would be if nodes[lo, hi) were sorted on axis, with nothing larger
+before it and nothing smaller after it.
+*/
+void geo_select(geo_node_t* nodes, uint32_t lo, uint32_t hi, uint32_t k,
+                unsigned axis) {
+    long l = lo;
+    long r = (long)hi - 1;
+    while (l < r) {
+        double pivot = nodes[k].p[axis];
+        long   i     = l;
+        long   j     = r;
+        do {
+            while (nodes[i].p[axis] < pivot) {
+                i++;
+            }
+            while (pivot < nodes[j].p[axis]) {
+                j--;
+            }
+            if (i <= j) {
+                geo_node_t tmp = nodes[i];
+                nodes[i]       = nodes[j];
+                nodes[j]       = tmp;
+                i++;
+                j--;
+            }
+        } while (i <= j);
+        if (j < (long)k) {
+            l = i;
+        }
+        if ((long)k < i) {
+            r = j;
+        }
+    }
+}
+
+/* ----- QUERIES ----- */
+/*
+geo_nearest() finds the city closest to a point. Ties go to the lowest
+city ID.
+*/
+int geo_nearest(const geo_t* geo, double lat, double lon, uint32_t* out_id) {
+    if (!geo->ready || geo->root == GEO_NONE) {
+        return STATUS_FAIL;
+    }
+    double q[3];
+    geo_point(lat, lon, q);
+    uint32_t best   = GEO_NONE;
+    double   best_d = HUGE_VAL;
+    geo_search(geo->nodes, geo->root, 0, q, &best, &best_d);
+
+    *out_id = geo->nodes[best].id; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+void geo_search(const geo_node_t* nodes, uint32_t node, unsigned depth,
+                const double q[3], uint32_t* best, double* best_d) {
+    while (node != GEO_NONE) {
+        const geo_node_t* n = &nodes[node];
+        double            d = geo_dist2(n->p, q);
+        if (d < *best_d || (d == *best_d && n->id < nodes[*best].id)) {
+            *best   = node;
+            *best_d = d;
+        }
+        unsigned axis = depth++ % 3;
+        double   diff = q[axis] - n->p[axis];
+        uint32_t near = diff < 0 ? n->left : n->right;
+        uint32_t far  = diff < 0 ? n->right : n->left;
+        geo_search(nodes, near, depth, q, best, best_d);
+        if (diff * diff > *best_d) {
+            return;
+        }
+        node = far; /* the far side last, as a loop */
+    }
+}
+
+/*
+geo_within() writes the ID of every city at most km from a point to
+out_ids, which must have room for every city, and returns how many there
+are. They are in no particular order; see geo_sort().
+*/
+size_t geo_within(const geo_t* geo, double lat, double lon, double km,
+                  uint32_t* out_ids) {
+    if (!geo->ready || km < 0) {
+        return 0;
+    }
+    /*The chord under an arc of km, at most the diameter*/
+    double angle = km / GEO_EARTH_RADIUS_KM;
+    double chord = angle >= 180.0 * GEO_DEG ? 2.0 : 2.0 * sin(angle / 2);
+    double q[3];
+    geo_point(lat, lon, q);
+    return geo_collect(geo->nodes, geo->root, 0, q, chord * chord, out_ids,
+                       0);
+}
+
+size_t geo_collect(const geo_node_t* nodes, uint32_t node, unsigned depth,
+                   const double q[3], double r2, uint32_t* out_ids,
+                   size_t n) {
+    while (node != GEO_NONE) {
+        const geo_node_t* nd = &nodes[node];
+        if (geo_dist2(nd->p, q) <= r2) {
+            out_ids[n++] = nd->id;
+        }
+        unsigned axis = depth++ % 3;
+        double   diff = q[axis] - nd->p[axis];
+        uint32_t near = diff < 0 ? nd->left : nd->right;
+        uint32_t far  = diff < 0 ? nd->right : nd->left;
+        n             = geo_collect(nodes, near, depth, q, r2, out_ids, n);
+        if (diff * diff > r2) {
+            return n;
+        }
+        node = far;
+    }
+    return n;
+}
+
+/*
+geo_sort() orders ids by distance from a point, nearest first (ties by
+ID). Left as it is if there is no memory for the distances.
+*/
+void geo_sort(uint32_t* ids, size_t n, const double* lat, const double* lon,
+              double from_lat, double from_lon) {
+    geo_hit_t* hits = malloc((n ? n : 1) * sizeof(geo_hit_t));
+    if (!hits) {
+        printf("Malloc failed\n");
+        return;
+    }
+    double q[3];
+    geo_point(from_lat, from_lon, q);
+    for (size_t i = 0; i < n; i++) {
+        double p[3];
+        geo_point(lat[ids[i]], lon[ids[i]], p);
+        hits[i].d  = geo_dist2(p, q);
+        hits[i].id = ids[i];
+    }
+    qsort(hits, n, sizeof(geo_hit_t), geo_hit_cmp);
+    for (size_t i = 0; i < n; i++) {
+        ids[i] = hits[i].id;
+    }
+    free(hits);
+}
+
+int geo_hit_cmp(const void* a, const void* b) {
+    const geo_hit_t* x = a;
+    const geo_hit_t* y = b;
+    if (x->d != y->d) {
+        return x->d < y->d ? -1 : 1;
+    }
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+/* ----- DISTANCE ----- */
+double geo_distance_km(double lat1, double lon1, double lat2, double lon2) {
+    double dlat = sin((lat2 - lat1) * GEO_DEG / 2);
+    double dlon = sin((lon2 - lon1) * GEO_DEG / 2);
+    double h    = dlat * dlat +
+               cos(lat1 * GEO_DEG) * cos(lat2 * GEO_DEG) * dlon * dlon;
+    return 2.0 * GEO_EARTH_RADIUS_KM * asin(sqrt(h > 1.0 ? 1.0 : h));
+}
+
+void geo_point(double lat, double lon, double out_p[3]) {
+    double phi    = lat * GEO_DEG;
+    double lambda = lon * GEO_DEG;
+    out_p[0]      = cos(phi) * cos(lambda);
+    out_p[1]      = cos(phi) * sin(lambda);
+    out_p[2]      = sin(phi);
+}
+
+double geo_dist2(const double a[3], const double b[3]) {
+    double dx = a[0] - b[0];
+    double dy = a[1] - b[1];
+    double dz = a[2] - b[2];
+    return dx * dx + dy * dy + dz * dz;
+}
+
+void geo_free(geo_t* geo) {
+    free(geo->nodes);
+    memset(geo, 0, sizeof(geo_t));
+}
@@ -0,0 +1,53 @@
+/* geo.h */
+
+#ifndef __GEO_H_
+#define __GEO_H_
+#define GEO_EARTH_RADIUS_KM 6371.0
+#define GEO_DEPTH_MAX 96     /* a deeper tree is rebuilt on insert */
+#define GEO_NONE UINT32_MAX  /* no node */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* ----- Structs for spatial index (k-d tree) ----- */
+/*
+Every city is a point on the unit sphere (x, y, z), so straight-line
+distance between points ranks them exactly like great-circle distance,
+with no trouble at the poles or the antimeridian. Node i splits on axis
+(depth % 3). Nodes are kept in one array and point to their children by
+index.
+*/
+typedef struct geo_node geo_node_t;
+struct geo_node {
+    double   p[3];
+    uint32_t id; /* city ID */
+    uint32_t left;
+    uint32_t right;
+};
+
+typedef struct geo geo_t;
+struct geo {
+    geo_node_t* nodes;
+    uint32_t    size;
+    uint32_t    cap;
+    uint32_t    root;
+    bool        ready; /* built, and kept up to date by geo_insert() */
+};
+
+/* ----- Public functions ----- */
+int    geo_build(geo_t* geo, const double* lat, const double* lon,
+                 uint32_t n);
+int    geo_insert(geo_t* geo, uint32_t id, double lat, double lon);
+int    geo_load(geo_t* geo, const geo_node_t* nodes, uint32_t n,
+                uint32_t root, uint32_t ids);
+int    geo_nearest(const geo_t* geo, double lat, double lon,
+                   uint32_t* out_id);
+size_t geo_within(const geo_t* geo, double lat, double lon, double km,
+                  uint32_t* out_ids);
+void   geo_sort(uint32_t* ids, size_t n, const double* lat,
+                const double* lon, double from_lat, double from_lon);
+double geo_distance_km(double lat1, double lon1, double lat2, double lon2);
+void   geo_free(geo_t* geo);
+
+#endif /* __GEO_H_ */
@@ -0,0 +1,194 @@
+/*
+    grid.c contains the weather model cells of the city list:
+    - handles snapping coordinates to the model grid
+    - handles grouping the cities on one grid point into a cell
+    - handles finding the other cities of a city's cell
+
+    Request urls are built from the snapped coordinates, so every city of
+    a cell asks for the very same forecast.
+*/
+
+#include "grid.h"
+
+#include "city.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GRID_DEG_MIN 1e-6 /* finer grids are taken as 0, a cell per city */
+
+/* ----- PRIVATE FUNCTIONS ----- */
+uint64_t grid_key(double deg, double lat, double lon);
+uint32_t grid_hash(uint64_t key);
+int      grid_reserve(grid_t* grid, uint32_t n);
+int      grid_index_grow(grid_t* grid);
+
+void grid_init(grid_t* grid, double deg) {
+    memset(grid, 0, sizeof(grid_t));
+    grid->deg = deg < GRID_DEG_MIN ? 0.0 : deg;
+}
+
+/*
+grid_snap() moves a point to the nearest grid point of a grid of deg
+degrees. Longitudes wrap, so 180 becomes -180. A deg of 0 leaves the
+point as it is.
+*/
+void grid_snap(double deg, double* lat, double* lon) {
+    if (deg < GRID_DEG_MIN) {
+        return;
+    }
+    *lat = round(*lat / deg) * deg;
+    *lon = round(*lon / deg) * deg;
+    if (*lon >= 180.0) {
+        *lon -= 360.0;
+    }
+}
+
+/*
+grid_insert() puts a city into the cell of its grid point, opening the
+cell if the city is the first one there. Cities are inserted in order of
+ID, from 0. Without memory the grid gives up (broken is set) and every
+city is its own cell from then on, which only costs requests.
+*/
+int grid_insert(grid_t* grid, uint32_t id, double lat, double lon) {
+    if (grid->broken) {
+        return STATUS_OK;
+    }
+    if (id != grid->size || grid_reserve(grid, id + 1) != STATUS_OK) {
+        grid->broken = true;
+        return STATUS_FAIL;
+    }
+    grid->first[id] = id;
+    grid->next[id]  = GRID_NONE;
+    grid->size++;
+    if (grid->deg == 0.0) {
+        return STATUS_OK;
+    }
+    if ((grid->used + 1) * 10 > grid->cap * 7 &&
+        grid_index_grow(grid) != STATUS_OK) {
+        grid->broken = true;
+        return STATUS_FAIL;
+    }
+
+    uint64_t key  = grid_key(grid->deg, lat, lon);
+    unsigned mask = grid->cap - 1;
+    for (unsigned i = grid_hash(key) & mask;; i = (i + 1) & mask) {
+        grid_slot_t* slot = &grid->slots[i];
+        if (!slot->id) {
+            slot->key = key;
+            slot->id  = id + 1;
+            grid->used++;
+            return STATUS_OK;
+        }
+        if (slot->key == key) {
+            /*Join the cell right after its first city*/
+            uint32_t head    = slot->id - 1;
+            grid->first[id]  = head;
+            grid->next[id]   = grid->next[head];
+            grid->next[head] = id;
+            return STATUS_OK;
+        }
+    }
+}
+
+/*
+grid_first() gives the first city of a city's cell, which stands for the
+whole cell. grid_next() walks the rest of the cell from there:
+
+    for (id = grid_first(grid, id); id != GRID_NONE; id = grid_next(grid, id))
+*/
+uint32_t grid_first(const grid_t* grid, uint32_t id) {
+    if (grid->broken || id >= grid->size) {
+        return id;
+    }
+    return grid->first[id];
+}
+
+uint32_t grid_next(const grid_t* grid, uint32_t id) {
+    if (grid->broken || id >= grid->size) {
+        return GRID_NONE;
+    }
+    return grid->next[id];
+}
+
+/*
+grid_key() packs the row and column of the grid point nearest to a point
+into one key.
+*/
+uint64_t grid_key(double deg, double lat, double lon) {
+    grid_snap(deg, &lat, &lon);
+    uint32_t row = (uint32_t)(int32_t)lround(lat / deg);
+    uint32_t col = (uint32_t)(int32_t)lround(lon / deg);
+    return (uint64_t)row << 32 | col;
+}
+
+/*
+grid_hash() is Fibonacci hashing: neighbouring grid points have keys that
+differ only in their last bits, the multiply spreads them over the table.
+*/
+uint32_t grid_hash(uint64_t key) {
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+int grid_reserve(grid_t* grid, uint32_t n) {
+    if (n <= grid->size_cap) {
+        return STATUS_OK;
+    }
+    uint32_t cap = grid->size_cap ? grid->size_cap : CITY_STORE_MIN;
+    while (cap < n) {
+        cap = cap > UINT32_MAX / 2 ? n : cap * 2;
+    }
+    uint32_t* first = realloc(grid->first, cap * sizeof(uint32_t));
+    if (!first) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    grid->first    = first;
+    uint32_t* next = realloc(grid->next, cap * sizeof(uint32_t));
+    if (!next) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    grid->next     = next;
+    grid->size_cap = cap;
+    return STATUS_OK;
+}
+
+/*
+grid_index_grow() doubles the table of cells.
+*/
+int grid_index_grow(grid_t* grid) {
+    unsigned     new_cap = grid->cap ? grid->cap * 2 : 16;
+    grid_slot_t* slots   = calloc(new_cap, sizeof(grid_slot_t));
+    if (!slots) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+
+    unsigned mask = new_cap - 1;
+    for (unsigned i = 0; i < grid->cap; i++) {
+        grid_slot_t* old = &grid->slots[i];
+        if (!old->id) {
+            continue;
+        }
+        unsigned j = grid_hash(old->key) & mask;
+        while (slots[j].id) {
+            j = (j + 1) & mask;
+        }
+        slots[j] = *old;
+    }
+
+    free(grid->slots);
+    grid->slots = slots;
+    grid->cap   = new_cap;
+    return STATUS_OK;
+}
+
+void grid_free(grid_t* grid) {
+    free(grid->slots);
+    free(grid->first);
+    free(grid->next);
+    grid_init(grid, grid->deg);
+}
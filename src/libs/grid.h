@@ -0,0 +1,50 @@
+/* grid.h */
+
+#ifndef __GRID_H_
+#define __GRID_H_
+#define GRID_CELL_DEG 0.1    /* cell size in degrees, 0 = a cell per city */
+#define GRID_NONE UINT32_MAX /* no city */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* ----- Structs for weather model cells ----- */
+/*
+A weather model only knows the weather at its grid points, so cities
+closer together than the grid spacing get the same forecast. Coordinates
+are snapped to a grid of deg degrees and cities on the same grid point
+share a cell: it is fetched and cached once for all of them.
+
+Cells are found by their grid point in an open addressing table. The
+cities of a cell are chained through next, starting at the first city
+that was added to it.
+*/
+typedef struct grid_slot grid_slot_t;
+struct grid_slot {
+    uint64_t key; /* grid point, row and column */
+    uint32_t id;  /* first city of the cell + 1, 0 marks an empty slot */
+};
+
+typedef struct grid grid_t;
+struct grid {
+    double       deg;
+    grid_slot_t* slots;
+    unsigned     cap; /* always zero or a power of two */
+    unsigned     used;
+    uint32_t*    first; /* per city: first city of its cell */
+    uint32_t*    next;  /* per city: next city of its cell, or GRID_NONE */
+    uint32_t     size;
+    uint32_t     size_cap;
+    bool         broken; /* out of memory, every city is its own cell */
+};
+
+/* ----- Public functions ----- */
+void     grid_init(grid_t* grid, double deg);
+void     grid_snap(double deg, double* lat, double* lon);
+int      grid_insert(grid_t* grid, uint32_t id, double lat, double lon);
+uint32_t grid_first(const grid_t* grid, uint32_t id);
+uint32_t grid_next(const grid_t* grid, uint32_t id);
+void     grid_free(grid_t* grid);
+
+#endif /* __GRID_H_ */
@@ -0,0 +1,423 @@
+/*
+    import.c contains the gazetteer import:
+    - handles the command line (--import FILE)
+    - handles reading GeoNames-style TSV dumps in fixed-size blocks
+    - handles skipping places that are already in the store
+    - handles saving the new cities to cache in batches
+
+    Memory use depends neither on the size of the dump nor on the length
+    of its lines (the alternate names of a big city run to kilobytes):
+    only the columns that are used are kept, the rest are skipped as they
+    stream past. The store itself grows with every new city, of course.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "import.h"
+
+#include "batch.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ----- Struct for the row being read ----- */
+typedef struct {
+    unsigned col;
+    bool     started;
+    bool     comment;
+    bool     name_cut; /* the name did not fit and is cut */
+    bool     too_long; /* a coordinate did not fit, the row is bad */
+    char     name[IMPORT_NAME_MAX];
+    char     lat[IMPORT_NUM_MAX];
+    char     lon[IMPORT_NUM_MAX];
+    size_t   name_len;
+    size_t   lat_len;
+    size_t   lon_len;
+} import_row_t;
+
+/* ----- Struct for one import ----- */
+/*
+seen holds every city of the store (the ones there before and the ones
+added), keyed on the name and on the coordinates rounded to 0.01 degrees,
+the precision of the cache keys. Two rows that agree on both would be
+saved as the same city anyway.
+*/
+typedef struct {
+    city_list_t*   list;
+    city_index_t   seen;
+    city_id_t*     pending; /* added but not saved yet */
+    size_t         n_pending;
+    import_stats_t stats;
+} import_t;
+
+/* ----- PRIVATE FUNCTIONS ----- */
+void     import_usage(const char* prog);
+void     import_char(import_row_t* row, char c);
+void     import_cut(import_row_t* row);
+int      import_row(import_t* import, import_row_t* row);
+int      import_coord(const char* text, double max, double* out);
+int      import_flush(import_t* import);
+uint32_t import_hash(const char* name, double lat, double lon);
+bool     import_same(city_list_t* list, city_id_t id, const char* name,
+                     double lat, double lon);
+int      import_seen_find(import_t* import, const char* name, double lat,
+                          double lon);
+int      import_seen_insert(import_t* import, city_id_t id);
+int      import_seen_grow(city_index_t* seen);
+double   import_now(void);
+
+/*
+import_main() imports a dump into the store and the cache:
+
+    etherskies --import cities500.txt
+    unzip -p cities500.zip | etherskies --import -
+
+Returns 0 if the whole dump was read, 1 if it could not be (the cities
+added until then are kept) and BATCH_EXIT_USAGE for bad arguments.
+*/
+int import_main(int argc, char** argv) {
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--import") == 0 && i + 1 < argc && !path) {
+            path = argv[++i];
+        } else {
+            import_usage(argv[0]);
+            return BATCH_EXIT_USAGE;
+        }
+    }
+    if (!path) {
+        import_usage(argv[0]);
+        return BATCH_EXIT_USAGE;
+    }
+
+    FILE* in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    city_list_t* list = NULL;
+    if (city_init(&list) != STATUS_OK) {
+        fprintf(stderr, "Failed to init app.\n");
+        if (in != stdin) {
+            fclose(in);
+        }
+        return EXIT_FAILURE;
+    }
+
+    import_stats_t stats  = {0};
+    int            status = import_tsv(list, in, &stats);
+    printf("Imported %zu cities from %s: %zu rows, %zu duplicates, %zu bad, "
+           "%.2f s (%.0f rows/s)\n",
+           stats.added, path, stats.rows, stats.duplicates, stats.bad,
+           stats.seconds, stats.seconds > 0 ? stats.rows / stats.seconds : 0);
+    if (status != STATUS_OK) {
+        fprintf(stderr, "Import stopped early.\n");
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    city_dispose(&list);
+    return status == STATUS_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void import_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s --import FILE|-\n"
+            "FILE is a GeoNames dump (tab-separated), - reads it from "
+            "stdin.\n",
+            prog);
+}
+
+/*
+import_tsv() adds every place in the dump read from in that is not in the
+store yet, and saves the new cities to cache as it goes, IMPORT_BATCH at
+a time. The stats are returned through out_stats even if the import
+stops early, which only happens when memory or the cache fails.
+*/
+int import_tsv(city_list_t* list, FILE* in, import_stats_t* out_stats) {
+    if (!list || !in || !out_stats) {
+        return STATUS_FAIL;
+    }
+    memset(out_stats, 0, sizeof(import_stats_t));
+
+    import_t import;
+    memset(&import, 0, sizeof(import));
+    import.list    = list;
+    import.pending = malloc(IMPORT_BATCH * sizeof(city_id_t));
+    char*  buf     = malloc(IMPORT_BUF_SIZE);
+    int    status  = import.pending && buf ? STATUS_OK : STATUS_FAIL;
+    double start   = import_now();
+    if (status != STATUS_OK) {
+        printf("Malloc failed\n");
+    }
+    for (city_id_t id = 0; id < list->size && status == STATUS_OK; id++) {
+        status = import_seen_insert(&import, id);
+    }
+
+    import_row_t row;
+    memset(&row, 0, sizeof(row));
+    size_t got = 0;
+    while (status == STATUS_OK &&
+           (got = fread(buf, 1, IMPORT_BUF_SIZE, in)) > 0) {
+        for (size_t i = 0; i < got && status == STATUS_OK; i++) {
+            if (buf[i] == '\n') {
+                status = import_row(&import, &row);
+                memset(&row, 0, sizeof(row));
+            } else if (buf[i] == '\t') {
+                row.col++;
+            } else if (buf[i] != '\r') {
+                import_char(&row, buf[i]);
+            }
+        }
+    }
+    if (status == STATUS_OK && ferror(in)) {
+        perror("Failed to read dump");
+        status = STATUS_FAIL;
+    }
+    if (status == STATUS_OK) {
+        status = import_row(&import, &row); /* no newline at the end */
+    }
+    if (import_flush(&import) != STATUS_OK) {
+        status = STATUS_FAIL;
+    }
+
+    import.stats.seconds = import_now() - start;
+    *out_stats           = import.stats; /* return through out-ptr */
+    free(import.seen.slots);
+    free(import.pending);
+    free(buf);
+    return status;
+}
+
+/*
+import_char() keeps a byte of the row if its column is used.
+*/
+void import_char(import_row_t* row, char c) {
+    if (!row->started) {
+        row->started = true;
+        row->comment = row->col == 0 && c == '#';
+    }
+    if (row->col == IMPORT_COL_NAME && row->name_len + 1 < IMPORT_NAME_MAX) {
+        row->name[row->name_len++] = c;
+    } else if (row->col == IMPORT_COL_NAME) {
+        row->name_cut = true;
+    } else if (row->col == IMPORT_COL_LAT || row->col == IMPORT_COL_LON) {
+        char*   text = row->col == IMPORT_COL_LAT ? row->lat : row->lon;
+        size_t* len  = row->col == IMPORT_COL_LAT ? &row->lat_len
+                                                  : &row->lon_len;
+        if (*len + 1 < IMPORT_NUM_MAX) {
+            text[(*len)++] = c;
+        } else {
+            row->too_long = true;
+        }
+    }
+}
+
+/*
+import_row() adds the city of a finished row unless it is already in the
+store. Empty lines and comments are passed over. Only running out of
+memory or failing to save is an error; bad rows are just counted.
+*/
+int import_row(import_t* import, import_row_t* row) {
+    if (!row->started || row->comment) {
+        return STATUS_OK;
+    }
+    import->stats.rows++;
+    if (row->name_cut) {
+        import_cut(row);
+    }
+    row->name[row->name_len] = '\0';
+    row->lat[row->lat_len]   = '\0';
+    row->lon[row->lon_len]   = '\0';
+
+    double lat = 0.0;
+    double lon = 0.0;
+    if (row->col < IMPORT_COL_LON || row->name_len == 0 || row->too_long ||
+        import_coord(row->lat, 90.0, &lat) != STATUS_OK ||
+        import_coord(row->lon, 180.0, &lon) != STATUS_OK) {
+        import->stats.bad++;
+        return STATUS_OK;
+    }
+    if (import_seen_find(import, row->name, lat, lon) == STATUS_OK) {
+        import->stats.duplicates++;
+        return STATUS_OK;
+    }
+
+    city_data_t data = {.name      = row->name,
+                        .lat       = lat,
+                        .lon       = lon,
+                        .temp      = INIT_VAL,
+                        .windspeed = INIT_VAL,
+                        .rel_hum   = INIT_VAL};
+    city_id_t   id;
+    if (city_add(import->list, &data, &id) != STATUS_OK ||
+        import_seen_insert(import, id) != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+    import->stats.added++;
+    import->pending[import->n_pending++] = id;
+    if (import->n_pending == IMPORT_BATCH) {
+        return import_flush(import);
+    }
+    return STATUS_OK;
+}
+
+/*
+import_cut() drops what is left of a UTF-8 character split by cutting a
+name short.
+*/
+void import_cut(import_row_t* row) {
+    size_t start = row->name_len;
+    while (start > 0 && (row->name[start - 1] & 0xC0) == 0x80) {
+        start--;
+    }
+    if (start == 0) {
+        return;
+    }
+    unsigned char lead = (unsigned char)row->name[start - 1];
+    size_t        need = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0;
+    if (need > 1 && row->name_len - (start - 1) < need) {
+        row->name_len = start - 1;
+    }
+}
+
+/*
+import_coord() parses a coordinate that must be the whole of text and
+within -max and max degrees.
+*/
+int import_coord(const char* text, double max, double* out) {
+    char*  end   = NULL;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !isfinite(value) || value < -max ||
+        value > max) {
+        return STATUS_FAIL;
+    }
+    *out = value; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+/*
+import_flush() saves the cities added since the last flush. They have no
+weather yet, so they are saved with a cached_at of 0 and fetched on first
+use like any other city without data.
+*/
+int import_flush(import_t* import) {
+    if (import->n_pending == 0) {
+        return STATUS_OK;
+    }
+    int status = city_save_batch(import->list, import->pending,
+                                 import->n_pending);
+    import->n_pending = 0;
+    if (status != STATUS_OK) {
+        fprintf(stderr, "Failed to save imported cities to cache.\n");
+    }
+    return status;
+}
+
+/* ----- SEEN CITIES ----- */
+/*
+import_hash() is FNV-1a over the name, with the rounded coordinates mixed
+in after it.
+*/
+uint32_t import_hash(const char* name, double lat, double lon) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    hash ^= (uint32_t)lround(lat * 100.0);
+    hash *= 16777619u;
+    hash ^= (uint32_t)lround(lon * 100.0);
+    hash *= 16777619u;
+    return hash;
+}
+
+bool import_same(city_list_t* list, city_id_t id, const char* name,
+                 double lat, double lon) {
+    return lround(list->lat[id] * 100.0) == lround(lat * 100.0) &&
+           lround(list->lon[id] * 100.0) == lround(lon * 100.0) &&
+           strcmp(list->text[id].name, name) == 0;
+}
+
+int import_seen_find(import_t* import, const char* name, double lat,
+                     double lon) {
+    city_index_t* seen = &import->seen;
+    if (seen->cap == 0) {
+        return STATUS_FAIL;
+    }
+    uint32_t hash = import_hash(name, lat, lon);
+    unsigned mask = seen->cap - 1;
+    for (unsigned i = hash & mask; seen->slots[i].id; i = (i + 1) & mask) {
+        city_slot_t* slot = &seen->slots[i];
+        if (slot->hash == hash &&
+            import_same(import->list, slot->id - 1, name, lat, lon)) {
+            return STATUS_OK;
+        }
+    }
+    return STATUS_FAIL;
+}
+
+/*
+import_seen_insert() adds a city of the store to seen. Cities already in
+the store twice are kept twice, which does no harm.
+*/
+int import_seen_insert(import_t* import, city_id_t id) {
+    city_index_t* seen = &import->seen;
+    if ((seen->used + 1) * 10 > seen->cap * 7 &&
+        import_seen_grow(seen) != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+    city_list_t* list = import->list;
+    uint32_t     hash = import_hash(list->text[id].name, list->lat[id],
+                                    list->lon[id]);
+    unsigned     mask = seen->cap - 1;
+    unsigned     i    = hash & mask;
+    while (seen->slots[i].id) {
+        i = (i + 1) & mask;
+    }
+    seen->slots[i].hash = hash;
+    seen->slots[i].id   = id + 1;
+    seen->used++;
+    return STATUS_OK;
+}
+
+/*
+import_seen_grow() doubles the table, moving the entries by their stored
+hashes.
+*/
+int import_seen_grow(city_index_t* seen) {
+    unsigned     new_cap = seen->cap ? seen->cap * 2 : 1024;
+    city_slot_t* slots   = calloc(new_cap, sizeof(city_slot_t));
+    if (!slots) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+
+    unsigned mask = new_cap - 1;
+    for (unsigned i = 0; i < seen->cap; i++) {
+        city_slot_t* old = &seen->slots[i];
+        if (!old->id) {
+            continue;
+        }
+        unsigned j = old->hash & mask;
+        while (slots[j].id) {
+            j = (j + 1) & mask;
+        }
+        slots[j] = *old;
+    }
+
+    free(seen->slots);
+    seen->slots = slots;
+    seen->cap   = new_cap;
+    return STATUS_OK;
+}
+
+double import_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
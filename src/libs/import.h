@@ -0,0 +1,39 @@
+/* import.h */
+
+#ifndef __IMPORT_H_
+#define __IMPORT_H_
+#define IMPORT_BUF_SIZE (64 * 1024) /* bytes read from the dump at a time */
+#define IMPORT_BATCH 4096           /* new cities saved to cache at once */
+#define IMPORT_NAME_MAX 201         /* GeoNames names are at most 200 bytes */
+#define IMPORT_NUM_MAX 32           /* longest coordinate field */
+
+#include "city.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* ----- Dump layout ----- */
+/*
+GeoNames dumps (cities500.txt, allCountries.txt, ...) have one place per
+line and 19 tab-separated columns. Only these are used; rows with fewer
+columns are skipped, as are lines starting with '#'.
+*/
+#define IMPORT_COL_NAME 1 /* UTF-8 name */
+#define IMPORT_COL_LAT 4  /* decimal degrees */
+#define IMPORT_COL_LON 5
+
+/* ----- Struct for the outcome of an import ----- */
+typedef struct import_stats import_stats_t;
+struct import_stats {
+    size_t rows;       /* non-empty lines read */
+    size_t added;      /* new cities in the store */
+    size_t duplicates; /* same name and place as a city already there */
+    size_t bad;        /* missing columns or unusable coordinates */
+    double seconds;
+};
+
+/* ----- Public functions ----- */
+int import_main(int argc, char** argv);
+int import_tsv(city_list_t* city_list, FILE* in, import_stats_t* out_stats);
+
+#endif /* __IMPORT_H_ */
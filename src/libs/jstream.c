@@ -0,0 +1,360 @@
+/*
+    jstream.c contains the streaming parser for forecast responses:
+    - handles reading the JSON a byte at a time, across chunk borders
+    - handles keeping track of where in the response it is
+    - handles copying the "current" values of every location into a row
+
+    The parser only follows what a forecast response looks like. Anything
+    it cannot follow is reported, so the caller can fall back to jansson.
+*/
+
+#include "jstream.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* ----- Parser states ----- */
+enum {
+    JS_VALUE,        /* a value must follow */
+    JS_VALUE_OR_END, /* just after '[' */
+    JS_KEY_OR_END,   /* just after '{' */
+    JS_KEY,          /* after ',' in an object */
+    JS_COLON,
+    JS_AFTER, /* after a value: ',' or a closing bracket */
+    JS_STRING,
+    JS_ESCAPE,
+    JS_NUMBER,
+    JS_LITERAL,
+    JS_DONE,
+};
+
+/* ----- Keys the parser looks for ----- */
+enum {
+    JS_KEY_OTHER,
+    JS_KEY_CURRENT,
+    JS_KEY_TEMP,
+    JS_KEY_WIND,
+    JS_KEY_HUM,
+};
+
+/* ----- PRIVATE FUNCTIONS ----- */
+int  jstream_byte(jstream_t* parser, unsigned char c);
+int  jstream_value(jstream_t* parser, unsigned char c);
+int  jstream_open(jstream_t* parser, unsigned char c);
+int  jstream_close(jstream_t* parser, unsigned char c);
+int  jstream_end_string(jstream_t* parser);
+int  jstream_end_number(jstream_t* parser);
+int  jstream_end_literal(jstream_t* parser);
+void jstream_tok_start(jstream_t* parser);
+void jstream_tok_add(jstream_t* parser, unsigned char c);
+
+/*
+jstream_init() prepares a parser for a response with n locations. The
+rows are only written to, as their "current" values are read.
+*/
+void jstream_init(jstream_t* parser, city_data_t* rows, size_t n) {
+    memset(parser, 0, sizeof(jstream_t));
+    parser->rows  = rows;
+    parser->n     = n;
+    parser->state = JS_VALUE;
+}
+
+/*
+jstream_feed() parses the next len bytes of the response. Once it has
+failed it stays failed. String values are skipped in a tight loop, since
+nothing in them is needed.
+*/
+int jstream_feed(jstream_t* parser, const char* buf, size_t len) {
+    if (parser->failed) {
+        return STATUS_FAIL;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (parser->state == JS_STRING && !parser->in_key) {
+            while (i < len && buf[i] != '"' && buf[i] != '\\') {
+                i++;
+            }
+            if (i == len) {
+                break;
+            }
+        }
+        if (jstream_byte(parser, (unsigned char)buf[i]) != STATUS_OK) {
+            parser->failed = true;
+            return STATUS_FAIL;
+        }
+    }
+    return STATUS_OK;
+}
+
+/*
+jstream_finish() is called after the last chunk. Returns STATUS_OK if the
+response was complete and held a "current" object for every location,
+STATUS_EXIT if it was beyond what the parser follows (too deep, or a
+needed number too long), and STATUS_FAIL otherwise.
+*/
+int jstream_finish(jstream_t* parser) {
+    if (parser->unsupported) {
+        return STATUS_EXIT;
+    }
+    if (parser->failed || parser->state != JS_DONE) {
+        return STATUS_FAIL;
+    }
+    if (parser->item != parser->n || parser->found != parser->n) {
+        return STATUS_FAIL;
+    }
+    return STATUS_OK;
+}
+
+/* ----- BYTES ----- */
+int jstream_byte(jstream_t* parser, unsigned char c) {
+    /*Inside a token every byte counts*/
+    switch (parser->state) {
+    case JS_STRING:
+        if (c == '"') {
+            return jstream_end_string(parser);
+        }
+        if (c == '\\' && parser->in_key) {
+            parser->unsupported = true; /* escaped keys are not matched */
+            return STATUS_FAIL;
+        }
+        if (c == '\\') {
+            parser->state = JS_ESCAPE;
+        } else if (c < 0x20) {
+            return STATUS_FAIL;
+        } else {
+            jstream_tok_add(parser, c);
+        }
+        return STATUS_OK;
+    case JS_ESCAPE:
+        jstream_tok_add(parser, c);
+        parser->state = JS_STRING;
+        return STATUS_OK;
+    case JS_NUMBER:
+        if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+            c == 'e' || c == 'E') {
+            jstream_tok_add(parser, c);
+            return STATUS_OK;
+        }
+        if (jstream_end_number(parser) != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+        return jstream_byte(parser, c);
+    case JS_LITERAL:
+        if (c >= 'a' && c <= 'z') {
+            jstream_tok_add(parser, c);
+            return STATUS_OK;
+        }
+        if (jstream_end_literal(parser) != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+        return jstream_byte(parser, c);
+    }
+
+    /*Between tokens whitespace is skipped*/
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        return STATUS_OK;
+    }
+    switch (parser->state) {
+    case JS_VALUE_OR_END:
+        if (c == ']') {
+            return jstream_close(parser, c);
+        }
+        return jstream_value(parser, c);
+    case JS_VALUE:
+        return jstream_value(parser, c);
+    case JS_KEY_OR_END:
+        if (c == '}') {
+            return jstream_close(parser, c);
+        }
+        /* fall through */
+    case JS_KEY:
+        if (c != '"') {
+            return STATUS_FAIL;
+        }
+        jstream_tok_start(parser);
+        parser->in_key = true;
+        parser->state  = JS_STRING;
+        return STATUS_OK;
+    case JS_COLON:
+        if (c != ':') {
+            return STATUS_FAIL;
+        }
+        parser->state = JS_VALUE;
+        return STATUS_OK;
+    case JS_AFTER:
+        if (c == ',') {
+            parser->state = parser->stack[parser->depth - 1] == '{'
+                                ? JS_KEY
+                                : JS_VALUE;
+            return STATUS_OK;
+        }
+        if (c == '}' || c == ']') {
+            return jstream_close(parser, c);
+        }
+        return STATUS_FAIL;
+    default: /* JS_DONE, only whitespace may follow */
+        return STATUS_FAIL;
+    }
+}
+
+/*
+jstream_value() starts whatever value begins with c.
+*/
+int jstream_value(jstream_t* parser, unsigned char c) {
+    if (c == '{' || c == '[') {
+        return jstream_open(parser, c);
+    }
+    jstream_tok_start(parser);
+    if (c == '"') {
+        parser->in_key = false;
+        parser->state  = JS_STRING;
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+        jstream_tok_add(parser, c);
+        parser->state = JS_NUMBER;
+    } else if (c == 't' || c == 'f' || c == 'n') {
+        jstream_tok_add(parser, c);
+        parser->state = JS_LITERAL;
+    } else {
+        return STATUS_FAIL;
+    }
+    return STATUS_OK;
+}
+
+/* ----- CONTAINERS ----- */
+/*
+jstream_open() enters an object or array. The outermost container decides
+where the locations are: the object itself, or each object in the array.
+An object opened as the value of "current" in a location is where the
+values are read from.
+*/
+int jstream_open(jstream_t* parser, unsigned char c) {
+    if (parser->depth == JSTREAM_DEPTH) {
+        parser->unsupported = true;
+        return STATUS_FAIL;
+    }
+    if (parser->depth == 0) {
+        parser->loc_depth = c == '[' ? 2 : 1;
+    }
+    parser->stack[parser->depth++] = c;
+
+    if (c == '{' && parser->depth == parser->loc_depth &&
+        parser->item >= parser->n) {
+        return STATUS_FAIL; /* more locations than asked for */
+    }
+    if (c == '{' && parser->depth == parser->loc_depth + 1 &&
+        parser->stack[parser->depth - 2] == '{' &&
+        parser->key == JS_KEY_CURRENT && parser->current_depth == 0) {
+        parser->current_depth = parser->depth;
+        parser->found++;
+    }
+    parser->state = c == '{' ? JS_KEY_OR_END : JS_VALUE_OR_END;
+    return STATUS_OK;
+}
+
+int jstream_close(jstream_t* parser, unsigned char c) {
+    unsigned char open = c == '}' ? '{' : '[';
+    if (parser->depth == 0 || parser->stack[parser->depth - 1] != open) {
+        return STATUS_FAIL;
+    }
+    if (parser->depth == parser->current_depth) {
+        parser->current_depth = 0;
+    }
+    if (c == '}' && parser->depth == parser->loc_depth) {
+        parser->item++;
+    }
+    parser->depth--;
+    parser->key   = JS_KEY_OTHER;
+    parser->state = parser->depth == 0 ? JS_DONE : JS_AFTER;
+    return STATUS_OK;
+}
+
+/* ----- TOKENS ----- */
+/*
+jstream_end_string() finishes a string. A key is matched against the
+names the parser looks for, but only at the level they matter on.
+*/
+int jstream_end_string(jstream_t* parser) {
+    if (!parser->in_key) {
+        parser->state = JS_AFTER;
+        return STATUS_OK;
+    }
+
+    const char* tok = parser->tok;
+    int         key = JS_KEY_OTHER;
+    if (parser->tok_long) {
+        key = JS_KEY_OTHER;
+    } else if (parser->depth == parser->loc_depth) {
+        if (strcmp(tok, "current") == 0) {
+            key = JS_KEY_CURRENT;
+        }
+    } else if (parser->depth == parser->current_depth) {
+        if (strcmp(tok, "temperature_2m") == 0) {
+            key = JS_KEY_TEMP;
+        } else if (strcmp(tok, "wind_speed_10m") == 0) {
+            key = JS_KEY_WIND;
+        } else if (strcmp(tok, "relative_humidity_2m") == 0) {
+            key = JS_KEY_HUM;
+        }
+    }
+    parser->key    = key;
+    parser->in_key = false;
+    parser->state  = JS_COLON;
+    return STATUS_OK;
+}
+
+/*
+jstream_end_number() finishes a number. Only the numbers that are wanted
+are converted; a wanted number that did not fit in tok is unsupported
+rather than bad.
+*/
+int jstream_end_number(jstream_t* parser) {
+    parser->state = JS_AFTER;
+    if (parser->current_depth == 0 ||
+        parser->depth != parser->current_depth ||
+        parser->key == JS_KEY_OTHER) {
+        return STATUS_OK;
+    }
+    if (parser->tok_long) {
+        parser->unsupported = true;
+        return STATUS_FAIL;
+    }
+
+    char*  end   = NULL;
+    double value = strtod(parser->tok, &end);
+    if (end != parser->tok + parser->tok_len) {
+        return STATUS_FAIL;
+    }
+    city_data_t* row = &parser->rows[parser->item];
+    if (parser->key == JS_KEY_TEMP) {
+        row->temp = value;
+    } else if (parser->key == JS_KEY_WIND) {
+        row->windspeed = value;
+    } else {
+        row->rel_hum = value;
+    }
+    return STATUS_OK;
+}
+
+int jstream_end_literal(jstream_t* parser) {
+    parser->state = JS_AFTER;
+    if (parser->tok_long || (strcmp(parser->tok, "true") != 0 &&
+                             strcmp(parser->tok, "false") != 0 &&
+                             strcmp(parser->tok, "null") != 0)) {
+        return STATUS_FAIL;
+    }
+    return STATUS_OK;
+}
+
+void jstream_tok_start(jstream_t* parser) {
+    parser->tok[0]   = '\0';
+    parser->tok_len  = 0;
+    parser->tok_long = false;
+}
+
+void jstream_tok_add(jstream_t* parser, unsigned char c) {
+    if (parser->tok_len == JSTREAM_TOKEN_MAX) {
+        parser->tok_long = true;
+        return;
+    }
+    parser->tok[parser->tok_len++] = (char)c;
+    parser->tok[parser->tok_len]   = '\0';
+}
@@ -0,0 +1,50 @@
+/* jstream.h */
+
+#ifndef __JSTREAM_H_
+#define __JSTREAM_H_
+#define JSTREAM_DEPTH 8      /* deepest nesting the parser follows */
+#define JSTREAM_TOKEN_MAX 32 /* longest key or number it keeps */
+
+#include "city.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* ----- Struct for streaming parser state ----- */
+/*
+The parser reads an Open-Meteo forecast response a chunk at a time, as it
+arrives, and copies temperature_2m, wind_speed_10m and
+relative_humidity_2m from every "current" object into the temp, windspeed
+and rel_hum of rows[i]. i is the location's position in the response. It
+keeps no copy of the body and allocates nothing. Only the last key or
+number is held, in tok, and it can span chunk borders.
+
+A response is either one forecast object (n == 1) or an array of n of
+them. Fields that are missing keep the value the row had before.
+*/
+typedef struct jstream jstream_t;
+struct jstream {
+    city_data_t*  rows;
+    size_t        n;
+    size_t        item;    /* location being read */
+    size_t        found;   /* locations that had a "current" object */
+    int           state;   /* what the next byte may be, see jstream.c */
+    unsigned      depth;   /* containers open */
+    unsigned char stack[JSTREAM_DEPTH]; /* '{' or '[' for every open one */
+    unsigned      loc_depth;     /* depth of the location objects */
+    unsigned      current_depth; /* depth of "current" while inside, or 0 */
+    int           key;           /* JS_KEY_* of the last key read */
+    bool          in_key;        /* the string being read is a key */
+    char          tok[JSTREAM_TOKEN_MAX + 1];
+    unsigned      tok_len;
+    bool          tok_long; /* tok overflowed, the key matches nothing */
+    bool          failed;
+    bool          unsupported; /* valid JSON, but beyond the parser */
+};
+
+/* ----- Public functions ----- */
+void jstream_init(jstream_t* parser, city_data_t* rows, size_t n);
+int  jstream_feed(jstream_t* parser, const char* buf, size_t len);
+int  jstream_finish(jstream_t* parser);
+
+#endif /* __JSTREAM_H_ */
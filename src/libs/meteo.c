@@ -1,5 +1,9 @@
 /*
-    meteo.c contains a function that builds the city url.
+    meteo.c contains functions that build the request urls,
+    either for a single city or for a batch of cities.
+
+    Coordinates are snapped to the weather model grid (GRID_CELL_DEG)
+    first, so every city of a cell has the same url.
 */
 
 #include "meteo.h"
@@ -8,26 +12,94 @@
 #include <stdlib.h>
 #include <string.h>
 
-char* meteo_url(double lat, double lon) {
+static const char* meteo_base = METEO_BASE_URL;
 
-    char* base_url = "https://api.open-meteo.com/v1/forecast";
+/*
+meteo_set_base() makes every url built from now on start with base
+instead of METEO_BASE_URL, e.g. the stand-in of etherskies --mock; NULL
+or "" goes back to the default. base is not copied. Urls already built
+for cities are not changed, so it is set before the list is booted.
+*/
+void meteo_set_base(const char* base) {
+    meteo_base = base && *base ? base : METEO_BASE_URL;
+}
+
+const char* meteo_get_base(void) {
+    return meteo_base;
+}
+
+char* meteo_url(double lat, double lon) {
 
     /*We allocate space by figuring out how long the url is*/
-    size_t size = snprintf(NULL, 0,
-                           "%s?latitude=%.2f&longitude=%.2f&current="
-                           "temperature_2m,relative_humidity_2m,wind_speed_10m",
-                           base_url, lat, lon) +
-                  1;
-    char* url = (char*)malloc(size);
+    size_t size = meteo_url_write(NULL, 0, lat, lon) + 1;
+    char*  url  = (char*)malloc(size);
     if (!url) {
         /*Caller must free!*/
         printf("malloc failed in meteo_url\n");
         return NULL;
     }
-    snprintf(url, size,
-             "%s?latitude=%.2f&longitude=%.2f&current=temperature_2m,relative_"
-             "humidity_2m,wind_speed_10m",
-             base_url, lat, lon);
+    meteo_url_write(url, size, lat, lon);
+
+    return url;
+}
+
+/*
+meteo_url_write() writes the url for one city into buf, like snprintf:
+the length is returned even when size is too small (or buf NULL), so
+callers with their own memory can measure first.
+*/
+size_t meteo_url_write(char* buf, size_t size, double lat, double lon) {
+    grid_snap(GRID_CELL_DEG, &lat, &lon);
+    return snprintf(buf, size,
+                    "%s?latitude=%.2f&longitude=%.2f&current=" METEO_CURRENT,
+                    meteo_base, lat, lon);
+}
+
+/*
+meteo_url_batch() builds one url for several cities. Open-Meteo takes
+comma-separated latitude and longitude lists and answers with an array
+holding one result per coordinate pair, in the same order.
+*/
+char* meteo_url_batch(city_list_t* list, const city_id_t* ids, size_t n) {
+    if (!list || !ids || n == 0) {
+        return NULL;
+    }
+
+    /*Snap and measure both coordinate lists before allocating*/
+    double* lats = malloc(2 * n * sizeof(double));
+    if (!lats) {
+        printf("malloc failed in meteo_url_batch\n");
+        return NULL;
+    }
+    double* lons = lats + n;
+    size_t  size = strlen(meteo_base) + strlen("?latitude=&longitude=") +
+                   strlen("&current=" METEO_CURRENT) + 1;
+    for (size_t i = 0; i < n; i++) {
+        lats[i] = list->lat[ids[i]];
+        lons[i] = list->lon[ids[i]];
+        grid_snap(GRID_CELL_DEG, &lats[i], &lons[i]);
+        size += snprintf(NULL, 0, "%.2f,", lats[i]);
+        size += snprintf(NULL, 0, "%.2f,", lons[i]);
+    }
+
+    char* url = (char*)malloc(size);
+    if (!url) {
+        /*Caller must free!*/
+        printf("malloc failed in meteo_url_batch\n");
+        free(lats);
+        return NULL;
+    }
+
+    size_t len = snprintf(url, size, "%s?latitude=", meteo_base);
+    for (size_t i = 0; i < n; i++) {
+        len += snprintf(url + len, size - len, i ? ",%.2f" : "%.2f", lats[i]);
+    }
+    len += snprintf(url + len, size - len, "&longitude=");
+    for (size_t i = 0; i < n; i++) {
+        len += snprintf(url + len, size - len, i ? ",%.2f" : "%.2f", lons[i]);
+    }
+    snprintf(url + len, size - len, "&current=" METEO_CURRENT);
 
+    free(lats);
     return url;
 }
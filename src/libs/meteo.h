@@ -4,7 +4,18 @@
 #define __METEO_H_
 #include "city.h"
 
+#include <stddef.h>
+
+#define METEO_BASE_URL "https://api.open-meteo.com/v1/forecast"
+#define METEO_BASE_ENV "ETHERSKIES_API_URL" /* overrides METEO_BASE_URL */
+#define METEO_CURRENT "temperature_2m,relative_humidity_2m,wind_speed_10m"
+
 /* ----- Public Functions ----- */
-char* meteo_url(double lat, double lon);
+void        meteo_set_base(const char* base);
+const char* meteo_get_base(void);
+char*       meteo_url(double lat, double lon);
+size_t      meteo_url_write(char* buf, size_t size, double lat, double lon);
+char*       meteo_url_batch(city_list_t* city_list, const city_id_t* ids,
+                            size_t n);
 
 #endif /* __METEO_H_ */
@@ -0,0 +1,981 @@
+/*
+    mock.c contains a local stand-in for api.open-meteo.com:
+    - handles listening on 127.0.0.1 and a thread per client
+    - handles /v1/forecast queries, current and hourly, for one
+      location or many (answered with an array, as Open-Meteo does)
+    - handles injecting latency, bandwidth caps, errors and resets
+    - handles the --mock mode of the command line
+
+    Point every fetch path at it with ETHERSKIES_API_URL (see
+    meteo_set_base()) to load-test without a network. Faults are drawn
+    from a seeded generator per client, so a run with the same seed and
+    the same traffic sees the same faults.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "mock.h"
+
+#include "batch.h"
+#include "city.h"
+#include "meteo.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+enum {
+    MOCK_TEMP,
+    MOCK_HUMIDITY,
+    MOCK_WIND,
+    MOCK_PRECIP,
+    MOCK_CODE,
+    MOCK_CLOUD,
+    MOCK_PRESSURE,
+    MOCK_VARS,
+};
+
+static const char* mock_var_names[] = {
+    "temperature_2m", "relative_humidity_2m", "wind_speed_10m",
+    "precipitation",  "weather_code",         "cloud_cover",
+    "surface_pressure"};
+static const char* mock_var_units[] = {"°C", "%",  "km/h", "mm",
+                                       "wmo code", "%", "hPa"};
+static const int   mock_var_decimals[] = {1, 0, 1, 1, 0, 0, 1};
+static const char* mock_dists[] = {"fixed", "uniform", "normal", "exp",
+                                   "lognormal"};
+static const int   mock_errors[] = {500, 503, 429}; /* taken in turn */
+
+/* ----- PRIVATE FUNCTIONS ----- */
+void        mock_usage(const char* prog);
+int         mock_number(const char* text, double min, double max,
+                        double* out);
+void*       mock_accept(void* userp);
+void        mock_spawn(mock_t* mock, int fd);
+void*       mock_conn_run(void* userp);
+void        mock_conn_close(mock_conn_t* conn, bool reset);
+int         mock_handle(mock_conn_t* conn, char* head);
+const char* mock_status(int code);
+int         mock_forecast(mock_buf_t* body, char* query, char* reason,
+                          size_t max);
+int         mock_coords(char* list, double limit, double* out,
+                        size_t* out_n);
+int         mock_vars(char* list, int* out, size_t* out_n, char* reason,
+                      size_t max);
+int         mock_location(mock_buf_t* body, const mock_query_t* q,
+                          size_t i);
+double      mock_value(int var, double lat, double lon, time_t t);
+void        mock_time(char* buf, size_t max, time_t t);
+void        mock_decode(char* str);
+double      mock_delay(mock_conn_t* conn);
+double      mock_rand(uint64_t* state);
+double      mock_gauss(uint64_t* state);
+bool        mock_sleep(mock_t* mock, double seconds);
+double      mock_now(void);
+int         mock_send(mock_conn_t* conn, const char* data, size_t len);
+int         mock_buf_printf(mock_buf_t* buf, const char* fmt, ...);
+
+/*
+mock_main() runs the stand-in until SIGINT or SIGTERM:
+
+    etherskies --mock [--port N] [--latency MS] [--jitter MS]
+                      [--dist fixed|uniform|normal|exp|lognormal]
+                      [--bandwidth BYTES/S] [--errors RATE]
+                      [--resets RATE] [--seed N]
+
+Returns 0 after a clean shutdown, 1 if it could not start and
+BATCH_EXIT_USAGE for bad arguments.
+*/
+int mock_main(int argc, char** argv) {
+    mock_config_t config;
+    mock_defaults(&config);
+    for (int i = 1; i < argc; i++) {
+        const char* opt  = argv[i];
+        const char* arg  = i + 1 < argc ? argv[i + 1] : NULL;
+        double      port = 0.0;
+        double      seed = 0.0;
+        int         ok   = STATUS_FAIL;
+        if (strcmp(opt, "--mock") == 0) {
+            continue;
+        } else if (!arg) {
+            ok = STATUS_FAIL;
+        } else if (strcmp(opt, "--port") == 0) {
+            ok          = mock_number(arg, 0.0, 65535.0, &port);
+            config.port = (int)port;
+        } else if (strcmp(opt, "--latency") == 0) {
+            ok = mock_number(arg, 0.0, 3600e3, &config.latency_ms);
+        } else if (strcmp(opt, "--jitter") == 0) {
+            ok = mock_number(arg, 0.0, 3600e3, &config.jitter_ms);
+        } else if (strcmp(opt, "--dist") == 0) {
+            ok = mock_parse_dist(arg, &config.dist);
+        } else if (strcmp(opt, "--bandwidth") == 0) {
+            ok = mock_number(arg, 0.0, 1e12, &config.bandwidth);
+        } else if (strcmp(opt, "--errors") == 0) {
+            ok = mock_number(arg, 0.0, 1.0, &config.error_rate);
+        } else if (strcmp(opt, "--resets") == 0) {
+            ok = mock_number(arg, 0.0, 1.0, &config.reset_rate);
+        } else if (strcmp(opt, "--seed") == 0) {
+            ok          = mock_number(arg, 0.0, 1e15, &seed);
+            config.seed = (uint64_t)seed;
+        }
+        if (ok != STATUS_OK) {
+            mock_usage(argv[0]);
+            return BATCH_EXIT_USAGE;
+        }
+        i++;
+    }
+
+    /*Blocked before any thread starts, so only sigwait() sees them*/
+    sigset_t set;
+    int      sig = 0;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    mock_t* mock = NULL;
+    if (mock_start(&mock, &config) != STATUS_OK) {
+        return EXIT_FAILURE;
+    }
+    printf("Serving a stand-in for Open-Meteo, use it with:\n"
+           "    %s=http://127.0.0.1:%d/v1/forecast %s ...\n",
+           METEO_BASE_ENV, mock->port, argv[0]);
+    fflush(stdout);
+    sigwait(&set, &sig);
+
+    pthread_mutex_lock(&mock->lock);
+    unsigned long requests = mock->requests;
+    unsigned long accepted = mock->accepted;
+    unsigned long errors   = mock->errors;
+    unsigned long resets   = mock->resets;
+    unsigned long bytes    = mock->bytes;
+    pthread_mutex_unlock(&mock->lock);
+    mock_stop(&mock);
+    printf("Served %lu requests over %lu connections, injected %lu errors "
+           "and %lu resets, sent %lu bytes.\n",
+           requests, accepted, errors, resets, bytes);
+    return EXIT_SUCCESS;
+}
+
+void mock_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s --mock [--port N] [--latency MS] [--jitter MS]\n"
+            "       [--dist fixed|uniform|normal|exp|lognormal] "
+            "[--bandwidth BYTES/S]\n"
+            "       [--errors RATE] [--resets RATE] [--seed N]\n"
+            "RATE is a share of requests, from 0 to 1. --port 0 picks a "
+            "free port.\n",
+            prog);
+}
+
+/*
+mock_number() parses all of text as a number from min to max.
+*/
+int mock_number(const char* text, double min, double max, double* out) {
+    char*  end   = NULL;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !(value >= min && value <= max)) {
+        return STATUS_FAIL;
+    }
+    *out = value; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+/*
+mock_defaults() fills config with a stand-in that injects nothing, on
+MOCK_PORT.
+*/
+void mock_defaults(mock_config_t* config) {
+    memset(config, 0, sizeof(mock_config_t));
+    config->port = MOCK_PORT;
+    config->dist = MOCK_DIST_FIXED;
+    config->seed = 1;
+}
+
+int mock_parse_dist(const char* name, mock_dist_t* out_dist) {
+    for (size_t i = 0; i < sizeof(mock_dists) / sizeof(mock_dists[0]); i++) {
+        if (strcmp(name, mock_dists[i]) == 0) {
+            *out_dist = (mock_dist_t)i; /* return through out-ptr */
+            return STATUS_OK;
+        }
+    }
+    return STATUS_FAIL;
+}
+
+/*
+mock_start() binds 127.0.0.1 on config->port and serves it on threads of
+its own until mock_stop(). The port it got is in (*mock)->port. Threads
+started here take the signal mask of the caller.
+*/
+int mock_start(mock_t** mock, const mock_config_t* config) {
+    mock_t* m = calloc(1, sizeof(mock_t));
+    if (!m) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    m->config = *config;
+    for (unsigned i = 0; i < MOCK_MAX_CONNS; i++) {
+        m->conns[i] = -1;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t          len = sizeof(addr);
+    int                one = 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons((uint16_t)config->port);
+    m->listen_fd         = socket(AF_INET, SOCK_STREAM, 0);
+    if (m->listen_fd < 0 ||
+        setsockopt(m->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one,
+                   sizeof(one)) != 0 ||
+        bind(m->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(m->listen_fd, MOCK_BACKLOG) != 0 ||
+        getsockname(m->listen_fd, (struct sockaddr*)&addr, &len) != 0) {
+        perror("Mock server");
+        if (m->listen_fd >= 0) {
+            close(m->listen_fd);
+        }
+        free(m);
+        return STATUS_FAIL;
+    }
+    m->port = ntohs(addr.sin_port);
+
+    /*Timed waits use the monotonic clock, so clock changes do not matter*/
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&m->lock, NULL);
+    if (pthread_create(&m->thread, NULL, mock_accept, m) != 0) {
+        fprintf(stderr, "Failed to start mock server thread\n");
+        close(m->listen_fd);
+        pthread_cond_destroy(&m->wake);
+        pthread_mutex_destroy(&m->lock);
+        free(m);
+        return STATUS_FAIL;
+    }
+    *mock = m; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+/*
+mock_stop() stops accepting, wakes every client thread up (sleeping or
+reading) and waits for them to finish before freeing the stand-in.
+*/
+int mock_stop(mock_t** mock) {
+    if (!mock || !*mock) {
+        return STATUS_FAIL;
+    }
+    mock_t* m = *mock;
+    pthread_mutex_lock(&m->lock);
+    m->quit = true;
+    pthread_mutex_unlock(&m->lock);
+    shutdown(m->listen_fd, SHUT_RDWR);
+    pthread_join(m->thread, NULL);
+    close(m->listen_fd);
+
+    pthread_mutex_lock(&m->lock);
+    for (unsigned i = 0; i < MOCK_MAX_CONNS; i++) {
+        if (m->conns[i] >= 0) {
+            shutdown(m->conns[i], SHUT_RDWR);
+        }
+    }
+    pthread_cond_broadcast(&m->wake);
+    while (m->num_conns > 0) {
+        pthread_cond_wait(&m->wake, &m->lock);
+    }
+    pthread_mutex_unlock(&m->lock);
+
+    pthread_cond_destroy(&m->wake);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+    *mock = NULL;
+    return STATUS_OK;
+}
+
+/* ----- CONNECTIONS ----- */
+void* mock_accept(void* userp) {
+    mock_t* mock = userp;
+    while (1) {
+        int fd = accept(mock->listen_fd, NULL, NULL);
+        pthread_mutex_lock(&mock->lock);
+        bool quit = mock->quit;
+        pthread_mutex_unlock(&mock->lock);
+        if (quit) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Accept failed");
+                break;
+            }
+            continue;
+        }
+        mock_spawn(mock, fd);
+    }
+    return NULL;
+}
+
+/*
+mock_spawn() starts a thread for a new client. Every client gets its own
+generator, seeded from the config and how many came before it.
+*/
+void mock_spawn(mock_t* mock, int fd) {
+    pthread_mutex_lock(&mock->lock);
+    unsigned slot = 0;
+    while (slot < MOCK_MAX_CONNS && mock->conns[slot] >= 0) {
+        slot++;
+    }
+    if (slot == MOCK_MAX_CONNS) {
+        pthread_mutex_unlock(&mock->lock);
+        close(fd);
+        return;
+    }
+    mock->conns[slot] = fd;
+    mock->num_conns++;
+    mock->accepted++;
+    uint64_t rng = mock->config.seed * 0x9E3779B97F4A7C15ULL + mock->accepted;
+    pthread_mutex_unlock(&mock->lock);
+
+    mock_conn_t* conn = malloc(sizeof(mock_conn_t));
+    if (!conn) {
+        printf("Malloc failed\n");
+        mock_conn_t tmp = {mock, fd, slot, 1};
+        mock_conn_close(&tmp, true);
+        return;
+    }
+    conn->mock = mock;
+    conn->fd   = fd;
+    conn->slot = slot;
+    conn->rng  = rng ? rng : 1;
+    mock_rand(&conn->rng); /* nearby seeds give unrelated first draws */
+
+    pthread_t      thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, mock_conn_run, conn) != 0) {
+        fprintf(stderr, "Failed to start client thread\n");
+        mock_conn_close(conn, true);
+        free(conn);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+mock_conn_run() answers requests on one connection until the client
+closes it, asks for Connection: close, a reset is injected or the
+stand-in stops.
+*/
+void* mock_conn_run(void* userp) {
+    mock_conn_t* conn   = userp;
+    char*        req    = malloc(MOCK_REQUEST_MAX);
+    size_t       len    = 0;
+    int          status = STATUS_OK;
+    if (!req) {
+        printf("Malloc failed\n");
+        mock_conn_close(conn, true);
+        free(conn);
+        return NULL;
+    }
+    req[0] = '\0';
+    while (status == STATUS_OK) {
+        char* end = NULL;
+        while (!(end = strstr(req, "\r\n\r\n"))) {
+            ssize_t got = len + 1 < MOCK_REQUEST_MAX
+                              ? read(conn->fd, req + len,
+                                     MOCK_REQUEST_MAX - len - 1)
+                              : -1;
+            if (got <= 0) {
+                break;
+            }
+            len += (size_t)got;
+            req[len] = '\0';
+        }
+        if (!end) {
+            status = STATUS_EXIT;
+            break;
+        }
+
+        /*Keep what came after this request for the next one*/
+        size_t used = (size_t)(end + 4 - req);
+        *end        = '\0';
+        status      = mock_handle(conn, req);
+        memmove(req, req + used, len - used + 1);
+        len -= used;
+    }
+    mock_conn_close(conn, status == STATUS_FAIL);
+    free(req);
+    free(conn);
+    return NULL;
+}
+
+/*
+mock_conn_close() closes the client's socket, with an RST instead of a
+FIN if reset, and frees its slot.
+*/
+void mock_conn_close(mock_conn_t* conn, bool reset) {
+    mock_t* mock = conn->mock;
+    if (reset) {
+        struct linger abort = {1, 0};
+        setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+    }
+    pthread_mutex_lock(&mock->lock);
+    close(conn->fd);
+    mock->conns[conn->slot] = -1;
+    mock->num_conns--;
+    pthread_cond_broadcast(&mock->wake);
+    pthread_mutex_unlock(&mock->lock);
+}
+
+/*
+mock_handle() answers the request whose head (without its blank line) is
+in head. Returns STATUS_OK to keep the connection, STATUS_EXIT to close
+it and STATUS_FAIL to reset it.
+*/
+int mock_handle(mock_conn_t* conn, char* head) {
+    mock_t*    mock   = conn->mock;
+    mock_buf_t body   = {NULL, 0, 0};
+    mock_buf_t reply  = {NULL, 0, 0};
+    char       reason[256];
+    int        code   = 200;
+    bool       keep   = !strstr(head, "HTTP/1.0") &&
+                        !strstr(head, "Connection: close") &&
+                        !strstr(head, "connection: close");
+    bool       reset  = mock_rand(&conn->rng) < mock->config.reset_rate;
+    bool       early  = mock_rand(&conn->rng) < 0.5;
+    bool       failed = mock_rand(&conn->rng) < mock->config.error_rate;
+    double     delay  = mock_delay(conn);
+
+    pthread_mutex_lock(&mock->lock);
+    unsigned long n = mock->requests++;
+    mock->resets += reset;
+    mock->errors += failed && !reset;
+    pthread_mutex_unlock(&mock->lock);
+    if (!mock_sleep(mock, delay / 1000.0) || (reset && early)) {
+        return STATUS_FAIL;
+    }
+
+    /*"GET /v1/forecast?latitude=...&longitude=... HTTP/1.1"*/
+    char* target = strchr(head, ' ');
+    char* query  = NULL;
+    target       = target ? target + 1 : head + strlen(head);
+    char* space  = strchr(target, ' ');
+    if (space) {
+        *space = '\0';
+    }
+    query = strchr(target, '?');
+    if (query) {
+        *query++ = '\0';
+    }
+    if (strncmp(head, "GET ", 4) != 0) {
+        code = 405;
+        snprintf(reason, sizeof(reason), "Method not allowed");
+    } else if (strcmp(target, "/v1/forecast") != 0) {
+        code = 404;
+        snprintf(reason, sizeof(reason), "Not Found");
+    } else if (failed && !reset) {
+        code = mock_errors[n % (sizeof(mock_errors) / sizeof(int))];
+        snprintf(reason, sizeof(reason), "Injected failure");
+    } else if (mock_forecast(&body, query ? query : (char*)"", reason,
+                             sizeof(reason)) != STATUS_OK) {
+        code = 400;
+    }
+
+    int status = STATUS_FAIL;
+    if (code != 200) {
+        free(body.data);
+        body.data = NULL;
+        body.len  = 0;
+        for (char* c = reason; *c; c++) {
+            *c = *c == '"' || *c == '\\' || (unsigned char)*c < ' ' ? '?' : *c;
+        }
+        if (mock_buf_printf(&body, "{\"error\":true,\"reason\":\"%s\"}",
+                            reason) != STATUS_OK) {
+            return STATUS_FAIL;
+        }
+    }
+    if (body.data &&
+        mock_buf_printf(&reply,
+                        "HTTP/1.1 %d %s\r\n"
+                        "Content-Type: application/json; charset=utf-8\r\n"
+                        "Content-Length: %zu\r\n%s%s\r\n",
+                        code, mock_status(code), body.len,
+                        code == 429 || code == 503 ? "Retry-After: 1\r\n"
+                                                   : "",
+                        keep ? "" : "Connection: close\r\n") == STATUS_OK) {
+
+        /*One send where possible, or Nagle holds the body back*/
+        size_t head_len = reply.len;
+        if (mock_buf_printf(&reply, "%s", body.data) == STATUS_OK) {
+            size_t len = reset ? head_len + body.len / 2 : reply.len;
+            if (mock_send(conn, reply.data, len) == STATUS_OK && !reset) {
+                status = keep ? STATUS_OK : STATUS_EXIT;
+            }
+        }
+    }
+    free(body.data);
+    free(reply.data);
+    return status;
+}
+
+const char* mock_status(int code) {
+    switch (code) {
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 429:
+        return "Too Many Requests";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Internal Server Error";
+    }
+}
+
+/* ----- FORECASTS ----- */
+/*
+mock_forecast() writes the answer to query into body: one forecast
+object for one location, an array of them with location_id for several.
+Returns STATUS_FAIL with the reason Open-Meteo would give for a bad
+query.
+*/
+int mock_forecast(mock_buf_t* body, char* query, char* reason, size_t max) {
+    mock_query_t* q = calloc(1, sizeof(mock_query_t));
+    if (!q) {
+        printf("Malloc failed\n");
+        snprintf(reason, max, "Out of memory");
+        return STATUS_FAIL;
+    }
+    char*  lats    = NULL;
+    char*  lons    = NULL;
+    char*  current = NULL;
+    char*  hourly  = NULL;
+    char*  save    = NULL;
+    size_t num_lon = 0;
+    q->days        = MOCK_DAYS_DEFAULT;
+    q->now         = time(NULL);
+    for (char* pair = strtok_r(query, "&", &save); pair;
+         pair       = strtok_r(NULL, "&", &save)) {
+        char* value = strchr(pair, '=');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        mock_decode(value);
+        if (strcmp(pair, "latitude") == 0) {
+            lats = value;
+        } else if (strcmp(pair, "longitude") == 0) {
+            lons = value;
+        } else if (strcmp(pair, "current") == 0) {
+            current = value;
+        } else if (strcmp(pair, "hourly") == 0) {
+            hourly = value;
+        } else if (strcmp(pair, "forecast_days") == 0) {
+            q->days = atoi(value);
+        }
+    }
+
+    int status = STATUS_FAIL;
+    if (!lats || !lons) {
+        snprintf(reason, max, "Parameter 'latitude' and 'longitude' must be "
+                              "set");
+    } else if (mock_coords(lats, 90.0, q->lat, &q->n) != STATUS_OK) {
+        snprintf(reason, max, "Latitude must be in range of -90 to 90°");
+    } else if (mock_coords(lons, 180.0, q->lon, &num_lon) != STATUS_OK) {
+        snprintf(reason, max, "Longitude must be in range of -180 to 180°");
+    } else if (q->n != num_lon) {
+        snprintf(reason, max, "Parameter 'latitude' and 'longitude' must "
+                              "have the same number of elements");
+    } else if (q->days < 1 || q->days > MOCK_DAYS_MAX) {
+        snprintf(reason, max, "Forecast days is invalid. Allowed range 1 to "
+                              "%d.", MOCK_DAYS_MAX);
+    } else if ((!current || mock_vars(current, q->current, &q->num_current,
+                                      reason, max) == STATUS_OK) &&
+               (!hourly || mock_vars(hourly, q->hourly, &q->num_hourly,
+                                     reason, max) == STATUS_OK)) {
+        status = q->n > 1 ? mock_buf_printf(body, "[") : STATUS_OK;
+        for (size_t i = 0; i < q->n && status == STATUS_OK; i++) {
+            if (i > 0) {
+                status = mock_buf_printf(body, ",");
+            }
+            if (status == STATUS_OK) {
+                status = mock_location(body, q, i);
+            }
+        }
+        if (status == STATUS_OK && q->n > 1) {
+            status = mock_buf_printf(body, "]");
+        }
+        if (status != STATUS_OK) {
+            snprintf(reason, max, "Out of memory");
+        }
+    }
+    free(q);
+    return status;
+}
+
+/*
+mock_coords() parses a comma-separated list of numbers, each from -limit
+to limit, into out.
+*/
+int mock_coords(char* list, double limit, double* out, size_t* out_n) {
+    size_t n = 0;
+    char*  c = list;
+    while (*c) {
+        char*  end   = NULL;
+        double value = strtod(c, &end);
+        if (end == c || (*end != ',' && *end != '\0') ||
+            !(value >= -limit && value <= limit) ||
+            n == MOCK_LOCATIONS_MAX) {
+            return STATUS_FAIL;
+        }
+        out[n++] = value;
+        c        = *end ? end + 1 : end;
+    }
+    *out_n = n; /* return through out-ptr */
+    return n > 0 ? STATUS_OK : STATUS_FAIL;
+}
+
+/*
+mock_vars() looks up every name of a comma-separated list of weather
+variables.
+*/
+int mock_vars(char* list, int* out, size_t* out_n, char* reason,
+              size_t max) {
+    size_t n    = 0;
+    char*  save = NULL;
+    for (char* name = strtok_r(list, ",", &save); name;
+         name       = strtok_r(NULL, ",", &save)) {
+        int var = 0;
+        while (var < MOCK_VARS && strcmp(name, mock_var_names[var]) != 0) {
+            var++;
+        }
+        if (var == MOCK_VARS || n == MOCK_VARS_MAX) {
+            snprintf(reason, max,
+                     "Cannot initialize WeatherVariable from invalid String "
+                     "value %.64s",
+                     name);
+            return STATUS_FAIL;
+        }
+        out[n++] = var;
+    }
+    *out_n = n; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+/*
+mock_location() writes the forecast object for location i of q, laid out
+like Open-Meteo's: current values for the quarter hour and hourly values
+from midnight UTC for q->days days.
+*/
+int mock_location(mock_buf_t* body, const mock_query_t* q, size_t i) {
+    double lat    = round(q->lat[i] * 100.0) / 100.0;
+    double lon    = round(q->lon[i] * 100.0) / 100.0;
+    double cell   = fabs(sin(lat * 4.1 + lon * 2.3));
+    char   stamp[32];
+    int    status = mock_buf_printf(body, "{\"latitude\":%.2f,"
+                                          "\"longitude\":%.2f,",
+                                    lat, lon);
+    if (q->n > 1 && status == STATUS_OK) {
+        status = mock_buf_printf(body, "\"location_id\":%zu,", i);
+    }
+    if (status == STATUS_OK) {
+        status = mock_buf_printf(
+            body,
+            "\"generationtime_ms\":0.05,\"utc_offset_seconds\":0,"
+            "\"timezone\":\"GMT\",\"timezone_abbreviation\":\"GMT\","
+            "\"elevation\":%.1f",
+            10.0 + 400.0 * cell);
+    }
+
+    if (q->num_current > 0 && status == STATUS_OK) {
+        time_t now = q->now - q->now % 900;
+        mock_time(stamp, sizeof(stamp), now);
+        status = mock_buf_printf(body, ",\"current_units\":{\"time\":"
+                                       "\"iso8601\",\"interval\":\"seconds\"");
+        for (size_t v = 0; v < q->num_current && status == STATUS_OK; v++) {
+            status = mock_buf_printf(body, ",\"%s\":\"%s\"",
+                                     mock_var_names[q->current[v]],
+                                     mock_var_units[q->current[v]]);
+        }
+        if (status == STATUS_OK) {
+            status = mock_buf_printf(
+                body, "},\"current\":{\"time\":\"%s\",\"interval\":900", stamp);
+        }
+        for (size_t v = 0; v < q->num_current && status == STATUS_OK; v++) {
+            int var = q->current[v];
+            status  = mock_buf_printf(body, ",\"%s\":%.*f", mock_var_names[var],
+                                      mock_var_decimals[var],
+                                      mock_value(var, lat, lon, now));
+        }
+        if (status == STATUS_OK) {
+            status = mock_buf_printf(body, "}");
+        }
+    }
+
+    if (q->num_hourly > 0 && status == STATUS_OK) {
+        time_t start = q->now - q->now % 86400;
+        int    hours = q->days * 24;
+        status = mock_buf_printf(body, ",\"hourly_units\":{\"time\":"
+                                       "\"iso8601\"");
+        for (size_t v = 0; v < q->num_hourly && status == STATUS_OK; v++) {
+            status = mock_buf_printf(body, ",\"%s\":\"%s\"",
+                                     mock_var_names[q->hourly[v]],
+                                     mock_var_units[q->hourly[v]]);
+        }
+        if (status == STATUS_OK) {
+            status = mock_buf_printf(body, "},\"hourly\":{\"time\":[");
+        }
+        for (int h = 0; h < hours && status == STATUS_OK; h++) {
+            mock_time(stamp, sizeof(stamp), start + h * 3600);
+            status = mock_buf_printf(body, "%s\"%s\"", h ? "," : "", stamp);
+        }
+        for (size_t v = 0; v < q->num_hourly && status == STATUS_OK; v++) {
+            int var = q->hourly[v];
+            status  = mock_buf_printf(body, "],\"%s\":[", mock_var_names[var]);
+            for (int h = 0; h < hours && status == STATUS_OK; h++) {
+                status = mock_buf_printf(
+                    body, "%s%.*f", h ? "," : "", mock_var_decimals[var],
+                    mock_value(var, lat, lon, start + h * 3600));
+            }
+        }
+        if (status == STATUS_OK) {
+            status = mock_buf_printf(body, "]}");
+        }
+    }
+    if (status == STATUS_OK) {
+        status = mock_buf_printf(body, "}");
+    }
+    return status;
+}
+
+/*
+mock_value() makes up a plausible value of var at a place and time:
+colder towards the poles, warmest mid-afternoon local time, with weather
+that drifts over the days. Every cell gets its own offsets.
+*/
+double mock_value(int var, double lat, double lon, time_t t) {
+    const double tau    = 6.283185307179586;
+    double       noise  = sin(lat * 12.9898 + lon * 78.233) * 43758.5453;
+    double       cell   = noise - floor(noise);
+    double       day    = (double)t / 86400.0;
+    double       hour   = fmod((double)(t % 86400) / 3600.0 + lon / 15.0 +
+                                   24.0,
+                               24.0);
+    double       diurnal = sin(tau * (hour - 9.0) / 24.0);
+    double       precip  = 0.0;
+    double       cloud   = 0.0;
+    switch (var) {
+    case MOCK_TEMP:
+        return 25.0 - 0.45 * fabs(lat) + 5.0 * diurnal +
+               4.0 * sin(day / 3.0 + cell * tau);
+    case MOCK_HUMIDITY:
+        return fmin(100.0, fmax(5.0, 70.0 - 20.0 * diurnal + 10.0 * cell));
+    case MOCK_WIND:
+        return 4.0 + 12.0 * cell + 4.0 * fabs(sin(day + lon));
+    case MOCK_PRECIP:
+        return fmax(0.0, 3.0 * sin(day * 1.7 + cell * tau) - 1.5);
+    case MOCK_CLOUD:
+        return fmin(100.0,
+                    fmax(0.0, 50.0 + 60.0 * sin(day * 1.3 + cell * tau +
+                                                hour / 12.0)));
+    case MOCK_CODE:
+        precip = mock_value(MOCK_PRECIP, lat, lon, t);
+        cloud  = mock_value(MOCK_CLOUD, lat, lon, t);
+        return precip > 1.0   ? 63.0
+               : precip > 0.0 ? 61.0
+               : cloud > 80.0 ? 3.0
+               : cloud > 50.0 ? 2.0
+               : cloud > 20.0 ? 1.0
+                              : 0.0;
+    default:
+        return 1013.0 - 10.0 * sin(day / 2.0 + cell * tau);
+    }
+}
+
+void mock_time(char* buf, size_t max, time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, max, "%Y-%m-%dT%H:%M", &tm);
+}
+
+/*
+mock_decode() undoes the percent-encoding of a query value in place.
+*/
+void mock_decode(char* str) {
+    char* out = str;
+    for (char* c = str; *c; c++) {
+        unsigned hex = 0;
+        if (*c == '%' && c[1] && c[2] && sscanf(c + 1, "%2x", &hex) == 1) {
+            *out++ = (char)hex;
+            c += 2;
+        } else {
+            *out++ = *c == '+' ? ' ' : *c;
+        }
+    }
+    *out = '\0';
+}
+
+/* ----- FAULTS ----- */
+/*
+mock_delay() draws the milliseconds to wait before a reply, see
+mock_dist_t.
+*/
+double mock_delay(mock_conn_t* conn) {
+    double latency = conn->mock->config.latency_ms;
+    double jitter  = conn->mock->config.jitter_ms;
+    double delay   = latency;
+    switch (conn->mock->config.dist) {
+    case MOCK_DIST_UNIFORM:
+        delay = latency - jitter + 2.0 * jitter * mock_rand(&conn->rng);
+        break;
+    case MOCK_DIST_NORMAL:
+        delay = latency + jitter * mock_gauss(&conn->rng);
+        break;
+    case MOCK_DIST_EXP:
+        delay = latency - jitter * log(1.0 - mock_rand(&conn->rng));
+        break;
+    case MOCK_DIST_LOGNORMAL:
+        delay = latency > 0.0 ? latency * exp(log1p(jitter / latency) *
+                                              mock_gauss(&conn->rng))
+                              : 0.0;
+        break;
+    default:
+        break;
+    }
+    return delay > 0.0 ? delay : 0.0;
+}
+
+/*
+mock_rand() returns the next number of an xorshift64* generator, from 0
+up to but not including 1.
+*/
+double mock_rand(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+/*
+mock_gauss() returns a standard normal number (Box-Muller).
+*/
+double mock_gauss(uint64_t* state) {
+    double u = 1.0 - mock_rand(state);
+    double v = mock_rand(state);
+    return sqrt(-2.0 * log(u)) * cos(6.283185307179586 * v);
+}
+
+/*
+mock_sleep() waits for seconds, or less if the stand-in is stopped
+meanwhile. Returns false if it was.
+*/
+bool mock_sleep(mock_t* mock, double seconds) {
+    struct timespec until;
+    int             rc = 0;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    if (seconds > 0.0) {
+        until.tv_sec += (time_t)seconds;
+        until.tv_nsec += (long)((seconds - (double)(time_t)seconds) * 1e9);
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+    }
+    pthread_mutex_lock(&mock->lock);
+    while (seconds > 0.0 && !mock->quit && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&mock->wake, &mock->lock, &until);
+    }
+    bool awake = !mock->quit;
+    pthread_mutex_unlock(&mock->lock);
+    return awake;
+}
+
+double mock_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+mock_send() sends len bytes of data. With a bandwidth cap they go out
+in pieces of MOCK_RATE_TICK seconds' worth, each sent once the ones
+before it are due, so a reply takes as long as it would on that link.
+*/
+int mock_send(mock_conn_t* conn, const char* data, size_t len) {
+    mock_t* mock  = conn->mock;
+    double  rate  = mock->config.bandwidth;
+    size_t  chunk = rate > 0.0 ? (size_t)(rate * MOCK_RATE_TICK) : len;
+    double  start = mock_now();
+    size_t  sent  = 0;
+    chunk         = chunk ? chunk : 1;
+    while (sent < len) {
+        size_t  part = len - sent < chunk ? len - sent : chunk;
+        ssize_t put  = send(conn->fd, data + sent, part, MSG_NOSIGNAL);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        } else if (put <= 0) {
+            return STATUS_FAIL;
+        }
+        sent += (size_t)put;
+        pthread_mutex_lock(&mock->lock);
+        mock->bytes += (unsigned long)put;
+        pthread_mutex_unlock(&mock->lock);
+        if (rate > 0.0 && sent < len &&
+            !mock_sleep(mock, start + (double)sent / rate - mock_now())) {
+            return STATUS_FAIL;
+        }
+    }
+    return STATUS_OK;
+}
+
+/*
+mock_buf_printf() appends to buf like printf, growing it as needed.
+*/
+int mock_buf_printf(mock_buf_t* buf, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (len < 0) {
+        return STATUS_FAIL;
+    }
+    if (buf->len + (size_t)len + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        while (cap < buf->len + (size_t)len + 1) {
+            cap *= 2;
+        }
+        char* data = realloc(buf->data, cap);
+        if (!data) {
+            printf("Malloc failed\n");
+            return STATUS_FAIL;
+        }
+        buf->data = data;
+        buf->cap  = cap;
+    }
+    va_start(args, fmt);
+    vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+    va_end(args);
+    buf->len += (size_t)len;
+    return STATUS_OK;
+}
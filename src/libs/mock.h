@@ -0,0 +1,118 @@
+/* mock.h */
+
+#ifndef __MOCK_H_
+#define __MOCK_H_
+#define MOCK_PORT 8089            /* default port of etherskies --mock */
+#define MOCK_BACKLOG 64           /* connections the kernel queues */
+#define MOCK_MAX_CONNS 256        /* clients served at once, more are reset */
+#define MOCK_REQUEST_MAX 16384    /* longest request head */
+#define MOCK_LOCATIONS_MAX 1000   /* coordinates per request, as Open-Meteo */
+#define MOCK_VARS_MAX 32          /* variables per current= or hourly= */
+#define MOCK_DAYS_DEFAULT 7       /* forecast_days when not given */
+#define MOCK_DAYS_MAX 16          /* largest forecast_days accepted */
+#define MOCK_RATE_TICK 0.02       /* seconds between bandwidth-capped sends */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* ----- Latency distributions ----- */
+/*
+How the delay before each reply is drawn, from latency_ms (L) and
+jitter_ms (J) of the config:
+
+    fixed      always L
+    uniform    between L - J and L + J
+    normal     mean L, standard deviation J
+    exp        L plus an exponential tail with mean J
+    lognormal  median L, with J the typical distance from it
+
+Negative draws are served at once.
+*/
+typedef enum {
+    MOCK_DIST_FIXED,
+    MOCK_DIST_UNIFORM,
+    MOCK_DIST_NORMAL,
+    MOCK_DIST_EXP,
+    MOCK_DIST_LOGNORMAL,
+} mock_dist_t;
+
+/* ----- Struct for what the stand-in injects ----- */
+typedef struct mock_config mock_config_t;
+struct mock_config {
+    int         port;       /* 0 picks a free one */
+    mock_dist_t dist;
+    double      latency_ms;
+    double      jitter_ms;
+    double      bandwidth;  /* bytes per second per reply, 0 for no cap */
+    double      error_rate; /* share of requests answered 500, 503 or 429 */
+    double      reset_rate; /* share of connections reset mid-request */
+    uint64_t    seed;       /* same seed, same sequence of faults */
+};
+
+/* ----- Struct for a running stand-in ----- */
+/*
+The stand-in for api.open-meteo.com listens on 127.0.0.1 and serves every
+client on a thread of its own, with HTTP/1.1 keep-alive as curl expects.
+Values are made up but depend only on the coordinates and the hour, so
+the same request always gets the same forecast.
+*/
+typedef struct mock mock_t;
+struct mock {
+    mock_config_t   config;
+    int             listen_fd;
+    int             port;
+    pthread_t       thread;    /* the accept loop */
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;      /* signalled on stop and when a client ends */
+    bool            quit;
+    int             conns[MOCK_MAX_CONNS]; /* socket per client, or -1 */
+    unsigned        num_conns;
+    unsigned long   accepted;
+    unsigned long   requests;
+    unsigned long   errors;    /* injected error replies */
+    unsigned long   resets;    /* injected resets */
+    unsigned long   bytes;     /* reply bytes sent */
+};
+
+/* ----- Struct for one client ----- */
+typedef struct mock_conn mock_conn_t;
+struct mock_conn {
+    mock_t*  mock;
+    int      fd;
+    unsigned slot; /* index in mock->conns */
+    uint64_t rng;  /* xorshift state, so clients draw independently */
+};
+
+/* ----- Struct for a parsed /v1/forecast query ----- */
+typedef struct mock_query mock_query_t;
+struct mock_query {
+    double lat[MOCK_LOCATIONS_MAX];
+    double lon[MOCK_LOCATIONS_MAX];
+    size_t n;
+    int    current[MOCK_VARS_MAX]; /* variables asked for, by index */
+    size_t num_current;
+    int    hourly[MOCK_VARS_MAX];
+    size_t num_hourly;
+    int    days;
+    time_t now;
+};
+
+/* ----- Struct for a reply being built ----- */
+typedef struct mock_buf mock_buf_t;
+struct mock_buf {
+    char*  data;
+    size_t len;
+    size_t cap;
+};
+
+/* ----- Public functions ----- */
+void mock_defaults(mock_config_t* config);
+int  mock_parse_dist(const char* name, mock_dist_t* out_dist);
+int  mock_start(mock_t** mock, const mock_config_t* config);
+int  mock_stop(mock_t** mock);
+int  mock_main(int argc, char** argv);
+
+#endif /* __MOCK_H_ */
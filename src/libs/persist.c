@@ -0,0 +1,298 @@
+/*
+    persist.c contains the write-behind stage of the cache:
+    - handles queueing saves without touching the disk
+    - handles the flusher thread, which writes the queue in batches once
+      PERSIST_BATCH saves are waiting or the oldest has waited
+      PERSIST_INTERVAL_MS
+    - handles flushing on demand (exit, SIGINT and SIGTERM)
+
+    Whoever saves a city only copies its row and signals; the caller never
+    waits for the disk. How a batch is written is up to the write function
+    (see city_write_rows()).
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "persist.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    sigset_t set;
+    void (*on_signal)(int sig);
+} persist_signal_t;
+
+/* ----- PRIVATE FUNCTIONS ----- */
+void* persist_run(void* arg);
+int   persist_reserve(persist_t* persist, city_id_t id);
+void* persist_signal_run(void* arg);
+
+/* ----- CREATE & DISPOSE ----- */
+/*
+persist_create() starts the flusher thread, which hands every batch to
+write along with userp.
+*/
+int persist_create(persist_t** out_persist, persist_write_fn write,
+                   void* userp) {
+    if (!out_persist || !write) {
+        return STATUS_FAIL;
+    }
+    persist_t* persist = calloc(1, sizeof(persist_t));
+    if (!persist) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    persist->write = write;
+    persist->userp = userp;
+    pthread_mutex_init(&persist->lock, NULL);
+    pthread_cond_init(&persist->wake, NULL);
+    pthread_cond_init(&persist->done, NULL);
+
+    /*
+    The flusher inherits the mask of whoever creates it, so SIGINT and
+    SIGTERM are blocked around the create: they must reach the signal
+    thread (see persist_signals()), not land mid-write on the flusher.
+    */
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    int created = pthread_create(&persist->thread, NULL, persist_run, persist);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (created != 0) {
+        fprintf(stderr, "Failed to start the cache flusher\n");
+        pthread_mutex_destroy(&persist->lock);
+        pthread_cond_destroy(&persist->wake);
+        pthread_cond_destroy(&persist->done);
+        free(persist);
+        return STATUS_FAIL;
+    }
+    *out_persist = persist; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+/*
+persist_dispose() writes what is still queued and stops the thread.
+*/
+int persist_dispose(persist_t** persist) {
+    if (!persist || !*persist) {
+        return STATUS_FAIL;
+    }
+    persist_t* p = *persist;
+    pthread_mutex_lock(&p->lock);
+    p->quit = true;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    int status = p->failed ? STATUS_FAIL : STATUS_OK;
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    pthread_cond_destroy(&p->done);
+    free(p->queue);
+    free(p->at);
+    free(p);
+    *persist = NULL;
+    return status;
+}
+
+/* ----- QUEUE ----- */
+/*
+persist_push() queues a save of the city's row as it is now. The first
+save in an empty queue sets when the batch is due. Never waits for I/O;
+only fails without memory, and then the save is lost.
+*/
+int persist_push(persist_t* persist, city_id_t id, const city_data_t* row) {
+    if (!persist || !row) {
+        return STATUS_FAIL;
+    }
+    pthread_mutex_lock(&persist->lock);
+    if (persist_reserve(persist, id) != STATUS_OK) {
+        pthread_mutex_unlock(&persist->lock);
+        return STATUS_FAIL;
+    }
+    if (persist->at[id]) {
+        persist->queue[persist->at[id] - 1].row = *row;
+    } else {
+        if (persist->size == 0) {
+            clock_gettime(CLOCK_REALTIME, &persist->due);
+            persist->due.tv_sec += PERSIST_INTERVAL_MS / 1000;
+            persist->due.tv_nsec += (PERSIST_INTERVAL_MS % 1000) * 1000000L;
+            if (persist->due.tv_nsec >= 1000000000L) {
+                persist->due.tv_sec++;
+                persist->due.tv_nsec -= 1000000000L;
+            }
+        }
+        persist_item_t* item = &persist->queue[persist->size++];
+        item->id             = id;
+        item->row            = *row;
+        persist->at[id]      = (uint32_t)persist->size;
+    }
+    persist->queued++;
+    if (persist->size == PERSIST_BATCH) {
+        pthread_cond_signal(&persist->wake);
+    }
+    pthread_mutex_unlock(&persist->lock);
+    return STATUS_OK;
+}
+
+/*
+persist_flush() has everything queued so far written now and waits for
+it. Returns STATUS_FAIL if a batch could not be written meanwhile.
+*/
+int persist_flush(persist_t* persist) {
+    if (!persist) {
+        return STATUS_FAIL;
+    }
+    pthread_mutex_lock(&persist->lock);
+    uint64_t target = persist->queued;
+    unsigned failed = persist->failed;
+    while (persist->written < target) {
+        persist->hurry = true;
+        pthread_cond_signal(&persist->wake);
+        pthread_cond_wait(&persist->done, &persist->lock);
+    }
+    int status = persist->failed == failed ? STATUS_OK : STATUS_FAIL;
+    pthread_mutex_unlock(&persist->lock);
+    return status;
+}
+
+/*
+persist_reserve() makes room in the queue for one more save and in at for
+the city. Both grow by doubling and are never shrunk.
+*/
+int persist_reserve(persist_t* persist, city_id_t id) {
+    if (persist->size == persist->cap) {
+        size_t          cap = persist->cap ? persist->cap * 2 : PERSIST_BATCH;
+        persist_item_t* queue =
+            realloc(persist->queue, cap * sizeof(persist_item_t));
+        if (!queue) {
+            printf("Malloc failed\n");
+            return STATUS_FAIL;
+        }
+        persist->queue = queue;
+        persist->cap   = cap;
+    }
+    if (id >= persist->at_cap) {
+        size_t cap = persist->at_cap ? persist->at_cap : CITY_STORE_MIN;
+        while (cap <= id) {
+            cap *= 2;
+        }
+        uint32_t* at = realloc(persist->at, cap * sizeof(uint32_t));
+        if (!at) {
+            printf("Malloc failed\n");
+            return STATUS_FAIL;
+        }
+        memset(at + persist->at_cap, 0,
+               (cap - persist->at_cap) * sizeof(uint32_t));
+        persist->at     = at;
+        persist->at_cap = cap;
+    }
+    return STATUS_OK;
+}
+
+/* ----- FLUSHER ----- */
+/*
+persist_run() is the flusher thread. It sleeps until a batch is full,
+due or asked for, takes the whole queue and writes it unlocked, so saves
+keep being queued meanwhile. The queue and a spare array are swapped
+rather than copied.
+*/
+void* persist_run(void* arg) {
+    persist_t*      p         = arg;
+    persist_item_t* spare     = NULL;
+    size_t          spare_cap = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (!p->quit && !p->hurry && p->size < PERSIST_BATCH) {
+            if (p->size == 0) {
+                pthread_cond_wait(&p->wake, &p->lock);
+            } else if (pthread_cond_timedwait(&p->wake, &p->lock, &p->due) ==
+                       ETIMEDOUT) {
+                break;
+            }
+        }
+        p->hurry = false;
+        if (p->size == 0) {
+            if (p->quit) {
+                break;
+            }
+            continue;
+        }
+
+        persist_item_t* items = p->queue;
+        size_t          n     = p->size;
+        size_t          cap   = p->cap;
+        uint64_t        upto  = p->queued;
+        for (size_t i = 0; i < n; i++) {
+            p->at[items[i].id] = 0;
+        }
+        p->queue  = spare;
+        p->cap    = spare_cap;
+        p->size   = 0;
+        spare     = items;
+        spare_cap = cap;
+        pthread_mutex_unlock(&p->lock);
+
+        int status = p->write(items, n, p->userp);
+
+        pthread_mutex_lock(&p->lock);
+        if (status != STATUS_OK) {
+            fprintf(stderr, "Failed to write %zu cities to cache\n", n);
+            p->failed++;
+        }
+        p->written = upto;
+        pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(spare);
+    return NULL;
+}
+
+/* ----- SIGNALS ----- */
+/*
+persist_signals() blocks SIGINT and SIGTERM and starts a thread that
+calls on_signal when one arrives, so it can flush and exit outside of a
+signal handler. Must be called before any other thread is started, as
+new threads inherit the blocked signals from the one creating them.
+*/
+int persist_signals(void (*on_signal)(int sig)) {
+    persist_signal_t* arg = malloc(sizeof(persist_signal_t));
+    if (!arg) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    arg->on_signal = on_signal;
+    sigemptyset(&arg->set);
+    sigaddset(&arg->set, SIGINT);
+    sigaddset(&arg->set, SIGTERM);
+
+    pthread_t thread;
+    if (pthread_sigmask(SIG_BLOCK, &arg->set, NULL) != 0) {
+        free(arg);
+        return STATUS_FAIL;
+    }
+    if (pthread_create(&thread, NULL, persist_signal_run, arg) != 0) {
+        pthread_sigmask(SIG_UNBLOCK, &arg->set, NULL);
+        free(arg);
+        return STATUS_FAIL;
+    }
+    pthread_detach(thread);
+    return STATUS_OK;
+}
+
+void* persist_signal_run(void* arg) {
+    persist_signal_t* sig_arg = arg;
+    int               sig     = 0;
+    while (sigwait(&sig_arg->set, &sig) != 0) {
+    }
+    sig_arg->on_signal(sig);
+    free(sig_arg);
+    return NULL;
+}
@@ -0,0 +1,63 @@
+/* persist.h */
+
+#ifndef __PERSIST_H_
+#define __PERSIST_H_
+#define PERSIST_BATCH 64         /* queued saves that start a flush at once */
+#define PERSIST_INTERVAL_MS 1000 /* longest a save waits in the queue */
+
+#include "city.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* ----- Struct for one queued save ----- */
+typedef struct persist_item persist_item_t;
+struct persist_item {
+    city_id_t   id;
+    city_data_t row; /* copied when queued, the strings belong to the list */
+};
+
+/* Writes a batch to disk, from the flusher thread; STATUS_OK if it did */
+typedef int (*persist_write_fn)(const persist_item_t* items, size_t n,
+                                void* userp);
+
+/* ----- Struct for the write-behind queue ----- */
+/*
+Saves are queued with a copy of the city's row, so the flusher thread
+never reads the list and needs none of its locks. A city saved again
+before it was written only has its row replaced. Every save bumps queued;
+written is what queued was when the last batch was taken, which is what
+persist_flush() waits for.
+*/
+typedef struct persist persist_t;
+struct persist {
+    pthread_mutex_t  lock;
+    pthread_cond_t   wake; /* a full batch, a flush asked for, or quit */
+    pthread_cond_t   done; /* written moved on */
+    pthread_t        thread;
+    persist_item_t*  queue;
+    size_t           size;
+    size_t           cap;
+    uint32_t*        at;     /* per city: its place in queue + 1, 0 if none */
+    size_t           at_cap;
+    struct timespec  due;    /* when the oldest queued save must be written */
+    uint64_t         queued;
+    uint64_t         written;
+    bool             hurry;  /* persist_flush() is waiting */
+    bool             quit;
+    unsigned         failed; /* batches that could not be written */
+    persist_write_fn write;
+    void*            userp;
+};
+
+/* ----- Public functions ----- */
+int persist_create(persist_t** persist, persist_write_fn write, void* userp);
+int persist_push(persist_t* persist, city_id_t id, const city_data_t* row);
+int persist_flush(persist_t* persist);
+int persist_dispose(persist_t** persist);
+int persist_signals(void (*on_signal)(int sig));
+
+#endif /* __PERSIST_H_ */
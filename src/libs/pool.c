@@ -0,0 +1,242 @@
+/*
+    pool.c contains a small work-stealing thread pool:
+    - handles starting and stopping the worker threads
+    - handles splitting a run of n items over the threads
+    - handles stealing work when a thread runs out
+
+    The items of a run are only told apart by index, so callers keep
+    their results in an array and get a stable order for free.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "pool.h"
+
+#include "city.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* ----- PRIVATE FUNCTIONS ----- */
+void* pool_worker(void* arg);
+void  pool_work(pool_t* pool, unsigned self);
+bool  pool_take(pool_t* pool, unsigned self, size_t* out_item);
+bool  pool_steal(pool_t* pool, unsigned self);
+
+typedef struct {
+    pool_t*  pool;
+    unsigned self;
+} pool_arg_t;
+
+/* ----- CREATE & DISPOSE ----- */
+/*
+pool_create() starts num_threads - 1 workers; the thread calling
+pool_run() is the last one. With num_threads 0 one thread per online
+core is used.
+*/
+int pool_create(pool_t** out_pool, unsigned num_threads) {
+    if (!out_pool) {
+        return STATUS_FAIL;
+    }
+    if (num_threads == 0) {
+        num_threads = pool_default_threads();
+    }
+
+    pool_t* pool = calloc(1, sizeof(pool_t));
+    if (!pool) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    pool->queues  = calloc(num_threads, sizeof(pool_queue_t));
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    if (!pool->queues || !pool->threads) {
+        printf("Malloc failed\n");
+        free(pool->queues);
+        free(pool->threads);
+        free(pool);
+        return STATUS_FAIL;
+    }
+    for (unsigned i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (unsigned i = 0; i + 1 < num_threads; i++) {
+        pool_arg_t* arg = malloc(sizeof(pool_arg_t));
+        if (!arg) {
+            break;
+        }
+        arg->pool = pool;
+        arg->self = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, arg) != 0) {
+            free(arg);
+            break;
+        }
+        pool->num_threads++;
+    }
+
+    *out_pool = pool; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+int pool_dispose(pool_t** pool) {
+    if (!pool || !*pool) {
+        return STATUS_FAIL;
+    }
+    pool_t* p = *pool;
+    pthread_mutex_lock(&p->lock);
+    p->quit = true;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+    for (unsigned i = 0; i < p->num_threads; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+
+    for (unsigned i = 0; i <= p->num_threads; i++) {
+        pthread_mutex_destroy(&p->queues[i].lock);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_cond_destroy(&p->done_cond);
+    free(p->queues);
+    free(p->threads);
+    free(p);
+    *pool = NULL;
+    return STATUS_OK;
+}
+
+unsigned pool_default_threads(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (unsigned)cores : 1;
+}
+
+/* ----- RUNNING ----- */
+/*
+pool_run() calls fn for every item in [0, n) and returns once all calls
+are done. Each thread starts with an equal, contiguous share of the items
+so neighbouring items stay on one thread unless work is stolen.
+*/
+int pool_run(pool_t* pool, size_t n, pool_fn fn, void* userp) {
+    if (!pool || !fn) {
+        return STATUS_FAIL;
+    }
+
+    unsigned parts = pool->num_threads + 1;
+    for (unsigned i = 0; i < parts; i++) {
+        pool->queues[i].next = n * i / parts;
+        pool->queues[i].end  = n * (i + 1) / parts;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn    = fn;
+    pool->userp = userp;
+    pool->busy  = pool->num_threads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool, pool->num_threads);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return STATUS_OK;
+}
+
+void* pool_worker(void* arg) {
+    pool_t*  pool = ((pool_arg_t*)arg)->pool;
+    unsigned self = ((pool_arg_t*)arg)->self;
+    free(arg);
+
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->quit && pool->generation == seen) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_work(pool, self);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void pool_work(pool_t* pool, unsigned self) {
+    size_t item;
+    while (1) {
+        if (pool_take(pool, self, &item)) {
+            pool->fn(item, pool->userp);
+        } else if (!pool_steal(pool, self)) {
+            return;
+        }
+    }
+}
+
+/* ----- QUEUES ----- */
+bool pool_take(pool_t* pool, unsigned self, size_t* out_item) {
+    pool_queue_t* q = &pool->queues[self];
+    pthread_mutex_lock(&q->lock);
+    bool taken = q->next < q->end;
+    if (taken) {
+        *out_item = q->next++;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return taken;
+}
+
+/*
+pool_steal() moves the back half of the fullest other queue into the
+queue of self. Returns false when every queue is empty, which ends the
+run for this thread.
+*/
+bool pool_steal(pool_t* pool, unsigned self) {
+    unsigned parts  = pool->num_threads + 1;
+    unsigned victim = self;
+    size_t   most   = 0;
+    for (unsigned i = 0; i < parts; i++) {
+        pool_queue_t* q = &pool->queues[i];
+        pthread_mutex_lock(&q->lock);
+        size_t left = q->end - q->next;
+        pthread_mutex_unlock(&q->lock);
+        if (i != self && left > most) {
+            most   = left;
+            victim = i;
+        }
+    }
+    if (victim == self) {
+        return false;
+    }
+
+    pool_queue_t* v = &pool->queues[victim];
+    pthread_mutex_lock(&v->lock);
+    size_t left = v->end - v->next;
+    size_t from = v->end - (left + 1) / 2;
+    size_t to   = v->end;
+    v->end      = from;
+    pthread_mutex_unlock(&v->lock);
+    if (from == to) {
+        return true; /* emptied meanwhile, look again */
+    }
+
+    pool_queue_t* q = &pool->queues[self];
+    pthread_mutex_lock(&q->lock);
+    q->next = from;
+    q->end  = to;
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
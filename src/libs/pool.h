@@ -0,0 +1,47 @@
+/* pool.h */
+
+#ifndef __POOL_H_
+#define __POOL_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Called once for every item index, from any of the pool's threads */
+typedef void (*pool_fn)(size_t i, void* userp);
+
+/* ----- Structs for work-stealing thread pool ----- */
+/*
+Every thread owns a queue, which is simply a range of item indexes. The
+owner takes items from the front; a thread that runs dry steals the back
+half of the fullest other queue.
+*/
+typedef struct pool_queue pool_queue_t;
+struct pool_queue {
+    pthread_mutex_t lock;
+    size_t          next;
+    size_t          end;
+};
+
+typedef struct pool pool_t;
+struct pool {
+    pthread_t*      threads;
+    unsigned        num_threads; /* spawned, the caller of pool_run() helps */
+    pool_queue_t*   queues;      /* num_threads + 1, the last is the caller's */
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cond;
+    pthread_cond_t  done_cond;
+    unsigned        generation; /* bumped by every pool_run() */
+    unsigned        busy;       /* workers still on the current run */
+    bool            quit;
+    pool_fn         fn;
+    void*           userp;
+};
+
+/* ----- Public functions ----- */
+int      pool_create(pool_t** pool, unsigned num_threads);
+int      pool_run(pool_t* pool, size_t n, pool_fn fn, void* userp);
+int      pool_dispose(pool_t** pool);
+unsigned pool_default_threads(void);
+
+#endif /* __POOL_H_ */
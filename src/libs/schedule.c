@@ -0,0 +1,264 @@
+/*
+    schedule.c contains the refresh scheduler:
+    - handles keeping a score of how often each city is looked up
+    - handles a min-heap of when each warm city is due for a refresh
+    - handles the budget of proactive requests
+
+    The scheduler does no I/O and takes no locks; the HTTP context runs it
+    on its refresh worker, under the pool lock.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "schedule.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ----- PRIVATE FUNCTIONS ----- */
+double schedule_score(schedule_t* schedule, city_id_t id, time_t now);
+time_t schedule_due(schedule_t* schedule, city_id_t id, time_t cached_at,
+                    time_t now);
+int    schedule_push(schedule_t* schedule, city_id_t id, time_t due);
+void   schedule_pop(schedule_t* schedule);
+int    schedule_grow(schedule_t* schedule, city_id_t id);
+void   schedule_refill(schedule_t* schedule, time_t now);
+
+/* ----- CREATE & DISPOSE ----- */
+int schedule_create(schedule_t** out_schedule, int max_age, unsigned budget) {
+    if (!out_schedule) {
+        return STATUS_FAIL;
+    }
+    schedule_t* schedule = calloc(1, sizeof(schedule_t));
+    if (!schedule) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    schedule->max_age  = max_age;
+    schedule->budget   = budget;
+    schedule->tokens   = budget;
+    schedule->refilled = time(NULL);
+    schedule->seed     = (unsigned)schedule->refilled;
+
+    *out_schedule = schedule; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+int schedule_dispose(schedule_t** schedule) {
+    if (!schedule || !*schedule) {
+        return STATUS_FAIL;
+    }
+    free((*schedule)->heap);
+    free((*schedule)->cities);
+    free(*schedule);
+    *schedule = NULL;
+    return STATUS_OK;
+}
+
+/* ----- SCHEDULING ----- */
+/*
+schedule_touch() records a lookup of a city whose data was cached at
+cached_at, and (re)schedules it. Returns STATUS_FAIL only if memory ran
+out.
+*/
+int schedule_touch(schedule_t* schedule, city_id_t id, time_t cached_at,
+                   time_t now) {
+    if (schedule->budget == 0) {
+        return STATUS_OK;
+    }
+    if (schedule_grow(schedule, id) != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+    schedule_city_t* city = &schedule->cities[id];
+    city->score           = schedule_score(schedule, id, now) + 1.0;
+    city->touched         = now;
+    return schedule_push(schedule, id,
+                         schedule_due(schedule, id, cached_at, now));
+}
+
+/*
+schedule_done() reschedules a city after its data was refreshed, by the
+scheduler or any other way. Cities that are cold, or were never looked
+up, are left alone.
+*/
+void schedule_done(schedule_t* schedule, city_id_t id, time_t cached_at,
+                   time_t now) {
+    if (schedule->budget == 0 ||
+        schedule_score(schedule, id, now) < SCHEDULE_MIN_SCORE) {
+        return;
+    }
+    schedule_push(schedule, id, schedule_due(schedule, id, cached_at, now));
+}
+
+/*
+schedule_next() hands out the next city to refresh, if one is due and the
+budget allows. Otherwise it returns STATUS_EXIT and how many seconds to
+wait through out_wait, or STATUS_FAIL if nothing is scheduled at all.
+Cities that went cold are dropped on the way.
+*/
+int schedule_next(schedule_t* schedule, time_t now, city_id_t* out_id,
+                  time_t* out_wait) {
+    schedule_refill(schedule, now);
+    while (schedule->size > 0) {
+        schedule_entry_t top  = schedule->heap[0];
+        schedule_city_t* city = &schedule->cities[top.id];
+        if (city->due != top.due) {
+            schedule_pop(schedule); /* rescheduled since */
+            continue;
+        }
+        if (top.due > now) {
+            *out_wait = top.due - now; /* return through out-ptr */
+            return STATUS_EXIT;
+        }
+        if (schedule_score(schedule, top.id, now) < SCHEDULE_MIN_SCORE) {
+            schedule_pop(schedule);
+            city->due = 0;
+            schedule->dropped++;
+            continue;
+        }
+        if (schedule->tokens < 1.0) {
+            double per_token = (double)SCHEDULE_WINDOW_S / schedule->budget;
+            *out_wait = (time_t)ceil((1.0 - schedule->tokens) * per_token);
+            schedule->deferred++;
+            return STATUS_EXIT;
+        }
+
+        schedule_pop(schedule);
+        city->due = 0;
+        schedule->tokens -= 1.0;
+        schedule->refreshes++;
+        *out_id = top.id; /* return through out-ptr */
+        return STATUS_OK;
+    }
+    return STATUS_FAIL;
+}
+
+/*
+schedule_score() is the access score of a city, decayed up to now.
+*/
+double schedule_score(schedule_t* schedule, city_id_t id, time_t now) {
+    if (id >= schedule->num_cities) {
+        return 0.0;
+    }
+    schedule_city_t* city = &schedule->cities[id];
+    double           age  = difftime(now, city->touched);
+    if (age <= 0) {
+        return city->score;
+    }
+    return city->score * pow(0.5, age / SCHEDULE_HALF_LIFE_S);
+}
+
+/*
+schedule_due() is when a city should be refreshed: SCHEDULE_LEAD_S before
+it expires, up to twice that for hot cities, and a random part of
+SCHEDULE_JITTER_S earlier so cities cached together do not all come due
+in the same second. Never before now.
+*/
+time_t schedule_due(schedule_t* schedule, city_id_t id, time_t cached_at,
+                    time_t now) {
+    double heat = schedule_score(schedule, id, now) / SCHEDULE_HOT;
+    if (heat > 1.0) {
+        heat = 1.0;
+    }
+    double lead   = SCHEDULE_LEAD_S * (1.0 + heat);
+    double random = rand_r(&schedule->seed) / (RAND_MAX + 1.0);
+    double jitter = SCHEDULE_JITTER_S * random;
+    time_t due    = cached_at + schedule->max_age - (time_t)(lead + jitter);
+    return due > now ? due : now;
+}
+
+/* ----- MIN-HEAP ----- */
+int schedule_push(schedule_t* schedule, city_id_t id, time_t due) {
+    if (schedule->size == schedule->cap) {
+        size_t cap = schedule->cap ? schedule->cap * 2 : CITY_STORE_MIN;
+        schedule_entry_t* heap =
+            realloc(schedule->heap, cap * sizeof(schedule_entry_t));
+        if (!heap) {
+            printf("Malloc failed\n");
+            return STATUS_FAIL;
+        }
+        schedule->heap = heap;
+        schedule->cap  = cap;
+    }
+    /*due 0 means not scheduled*/
+    if (due == 0) {
+        due = 1;
+    }
+    schedule->cities[id].due = due;
+
+    size_t i = schedule->size++;
+    while (i > 0 && schedule->heap[(i - 1) / 2].due > due) {
+        schedule->heap[i] = schedule->heap[(i - 1) / 2];
+        i                 = (i - 1) / 2;
+    }
+    schedule->heap[i].due = due;
+    schedule->heap[i].id  = id;
+    return STATUS_OK;
+}
+
+void schedule_pop(schedule_t* schedule) {
+    schedule_entry_t last = schedule->heap[--schedule->size];
+    size_t           i    = 0;
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= schedule->size) {
+            break;
+        }
+        if (child + 1 < schedule->size &&
+            schedule->heap[child + 1].due < schedule->heap[child].due) {
+            child++;
+        }
+        if (schedule->heap[child].due >= last.due) {
+            break;
+        }
+        schedule->heap[i] = schedule->heap[child];
+        i                 = child;
+    }
+    if (schedule->size > 0) {
+        schedule->heap[i] = last;
+    }
+}
+
+/*
+schedule_grow() makes room for the city in the by-ID array. New cities
+start cold and unscheduled.
+*/
+int schedule_grow(schedule_t* schedule, city_id_t id) {
+    if (id < schedule->num_cities) {
+        return STATUS_OK;
+    }
+    size_t num = schedule->num_cities ? schedule->num_cities : CITY_STORE_MIN;
+    while (num <= id) {
+        num *= 2;
+    }
+    schedule_city_t* cities =
+        realloc(schedule->cities, num * sizeof(schedule_city_t));
+    if (!cities) {
+        printf("Malloc failed\n");
+        return STATUS_FAIL;
+    }
+    memset(cities + schedule->num_cities, 0,
+           (num - schedule->num_cities) * sizeof(schedule_city_t));
+    schedule->cities     = cities;
+    schedule->num_cities = num;
+    return STATUS_OK;
+}
+
+/* ----- BUDGET ----- */
+/*
+schedule_refill() tops up the token bucket: budget tokens per SCHEDULE_WINDOW_S,
+never holding more than one window's worth.
+*/
+void schedule_refill(schedule_t* schedule, time_t now) {
+    if (schedule->budget == 0 || now <= schedule->refilled) {
+        return;
+    }
+    double elapsed = difftime(now, schedule->refilled);
+    schedule->tokens += elapsed * schedule->budget / SCHEDULE_WINDOW_S;
+    if (schedule->tokens > schedule->budget) {
+        schedule->tokens = schedule->budget;
+    }
+    schedule->refilled = now;
+}
@@ -0,0 +1,70 @@
+/* schedule.h */
+
+#ifndef __SCHEDULE_H_
+#define __SCHEDULE_H_
+#define SCHEDULE_LEAD_S 60        /* refresh this long before expiry, or 2x */
+#define SCHEDULE_JITTER_S 30      /* up to this much earlier, at random */
+#define SCHEDULE_HALF_LIFE_S 3600 /* access scores halve over this long */
+#define SCHEDULE_HOT 8.0          /* score that gets the full lead */
+#define SCHEDULE_MIN_SCORE 0.5    /* colder cities are no longer kept warm */
+#define SCHEDULE_WINDOW_S 60      /* the request budget is per this long */
+
+#include "city.h"
+
+#include <stddef.h>
+#include <time.h>
+
+/* ----- Structs for the refresh scheduler ----- */
+/*
+Cities that are looked up are kept warm: each is due to be refreshed a
+little before cached_at + max_age, the moment http_is_old() would turn
+true when max_age is DATA_MAX_AGE_S. Due times sit in a min-heap. A city
+that is rescheduled gets a new entry, and the old one is recognised and
+skipped because its due time no longer matches the city's.
+
+Every lookup adds 1 to a city's score, which decays with
+SCHEDULE_HALF_LIFE_S. Hotter cities are refreshed earlier, so they are
+first in line for the budget. Cities whose score has decayed below
+SCHEDULE_MIN_SCORE are dropped.
+*/
+typedef struct schedule_entry schedule_entry_t;
+struct schedule_entry {
+    time_t    due;
+    city_id_t id;
+};
+
+typedef struct schedule_city schedule_city_t;
+struct schedule_city {
+    double score;
+    time_t touched; /* when score was last brought up to date */
+    time_t due;     /* of the live heap entry, 0 if not scheduled */
+};
+
+typedef struct schedule schedule_t;
+struct schedule {
+    schedule_entry_t* heap;
+    size_t            size;
+    size_t            cap;
+    schedule_city_t*  cities; /* by city ID */
+    size_t            num_cities;
+    int               max_age; /* seconds data stays fresh */
+    unsigned          budget;  /* requests per SCHEDULE_WINDOW_S, 0 is off */
+    double            tokens;
+    time_t            refilled;
+    unsigned          seed; /* for the jitter */
+    unsigned long     refreshes;
+    unsigned long     deferred; /* times a due city waited for budget */
+    unsigned long     dropped;  /* cities that went cold */
+};
+
+/* ----- Public functions ----- */
+int  schedule_create(schedule_t** schedule, int max_age, unsigned budget);
+int  schedule_dispose(schedule_t** schedule);
+int  schedule_touch(schedule_t* schedule, city_id_t id, time_t cached_at,
+                    time_t now);
+void schedule_done(schedule_t* schedule, city_id_t id, time_t cached_at,
+                   time_t now);
+int  schedule_next(schedule_t* schedule, time_t now, city_id_t* out_id,
+                   time_t* out_wait);
+
+#endif /* __SCHEDULE_H_ */
@@ -0,0 +1,585 @@
+/*
+    search.c contains the name search of the city list:
+    - handles folding names (case, diacritics, separators)
+    - handles the trie over the folded names
+    - handles completing a prefix, shortest names first
+    - handles finding names within a few typos (edit distance, with
+      swapped letters counting as one typo)
+
+    Every search walks only the part of the trie that can still match, so
+    its cost depends on the query and not on the number of cities.
+*/
+
+#include "search.h"
+
+#include "city.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEARCH_ONE_TYPO_MIN 4  /* shorter queries are completed, not fixed */
+#define SEARCH_TWO_TYPOS_MIN 8 /* queries this long may have two typos */
+
+/* ----- Fold tables ----- */
+/*
+The base letter of every code point from U+00C0 to U+017F, Latin-1
+Supplement and Latin Extended-A. '*' marks letters that fold to two
+(see search_fold_char()), '.' signs that are kept as they are.
+*/
+static const char search_latin[] =
+    "aaaaaa*ceeeeiiiidnooooo.ouuuuy**" /* U+00C0 */
+    "aaaaaa*ceeeeiiiidnooooo.ouuuuy*y" /* U+00E0 */
+    "aaaaaaccccccccddddeeeeeeeeee"     /* U+0100 */
+    "gggggggghhhhiiiiiiiiii**jjkkk"    /* U+011C */
+    "llllllllllnnnnnnnnnoooooo**"      /* U+0139 */
+    "rrrrrrssssssssttttttuuuuuuuuuuuu" /* U+0154 */
+    "wwyyyzzzzzzs";                    /* U+0174 */
+
+/* Greek letters with tonos, and the plain vowel each folds to */
+static const uint32_t search_tonos[][2] = {
+    {0x386, 0x3B1}, {0x388, 0x3B5}, {0x389, 0x3B7}, {0x38A, 0x3B9},
+    {0x38C, 0x3BF}, {0x38E, 0x3C5}, {0x38F, 0x3C9}, {0x3AC, 0x3B1},
+    {0x3AD, 0x3B5}, {0x3AE, 0x3B7}, {0x3AF, 0x3B9}, {0x3CC, 0x3BF},
+    {0x3CD, 0x3C5}, {0x3CE, 0x3C9},
+};
+
+/* ----- Struct for a walk through the trie ----- */
+/*
+rows[d] is the row of the edit distance table for the key of depth d
+against the query; path[d] the character leading to that depth.
+*/
+typedef struct {
+    const search_t* search;
+    const uint32_t* query;
+    size_t          len;
+    unsigned        max_dist;
+    uint8_t         rows[SEARCH_KEY_MAX + 1][SEARCH_KEY_MAX + 1];
+    uint32_t        path[SEARCH_KEY_MAX + 1];
+    search_hit_t*   hits;
+    size_t          n;
+    size_t          max;
+} search_walk_t;
+
+/* ----- PRIVATE FUNCTIONS ----- */
+uint32_t search_decode(const unsigned char** s);
+size_t   search_fold_char(uint32_t cp, uint32_t out[2]);
+uint32_t search_child(search_t* search, uint32_t parent, uint32_t cp);
+uint32_t search_find_child(const search_t* search, uint32_t parent,
+                           uint32_t cp);
+int      search_reserve(search_t* search, uint32_t nodes, uint32_t ids);
+bool     search_link_ok(uint32_t link, uint32_t n, uint8_t* seen);
+size_t   search_prefix_key(const search_t* search, const uint32_t* key,
+                           size_t len, search_hit_t* out_hits, size_t max);
+size_t   search_fuzzy_key(const search_t* search, const uint32_t* key,
+                          size_t len, unsigned max_dist,
+                          search_hit_t* out_hits, size_t max);
+void     search_walk(search_walk_t* walk, uint32_t node, size_t depth);
+void     search_keep(search_hit_t* hits, size_t* n, size_t max,
+                     search_hit_t hit);
+bool     search_before(const search_hit_t* a, const search_hit_t* b);
+
+/* ----- FOLDING ----- */
+/*
+search_fold() folds a UTF-8 name into out_key, at most max characters,
+and returns how many there are. Letters are lowered and stripped of their
+diacritics (Latin, Greek and Cyrillic), combining marks and ASCII
+punctuation are dropped, and runs of spaces, hyphens and underscores
+become one space. Bytes that are not UTF-8 are read as Latin-1.
+*/
+size_t search_fold(const char* name, uint32_t* out_key, size_t max) {
+    const unsigned char* p     = (const unsigned char*)name;
+    size_t               n     = 0;
+    bool                 space = false;
+    while (*p) {
+        uint32_t cp = search_decode(&p);
+        if (cp == ' ' || cp == '-' || cp == '_' || cp == '\t') {
+            space = n > 0;
+            continue;
+        }
+        bool alnum = (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z') ||
+                     (cp >= '0' && cp <= '9');
+        if ((cp < 0x80 && !alnum) || (cp >= 0x300 && cp <= 0x36F)) {
+            continue;
+        }
+        uint32_t folded[2];
+        size_t   m = search_fold_char(cp, folded);
+        if (n + space + m > max) {
+            break;
+        }
+        if (space) {
+            out_key[n++] = ' ';
+            space        = false;
+        }
+        for (size_t i = 0; i < m; i++) {
+            out_key[n++] = folded[i];
+        }
+    }
+    return n;
+}
+
+/*
+search_fold_char() folds one letter, into one or two (e.g. "ß" is "ss").
+*/
+size_t search_fold_char(uint32_t cp, uint32_t out[2]) {
+    out[0] = cp;
+    if (cp >= 'A' && cp <= 'Z') {
+        out[0] = cp + ('a' - 'A');
+    } else if (cp >= 0xC0 && cp < 0xC0 + sizeof(search_latin) - 1) {
+        char base = search_latin[cp - 0xC0];
+        if (base == '*') {
+            const char* pair = cp == 0xC6 || cp == 0xE6     ? "ae"
+                               : cp == 0xDE || cp == 0xFE   ? "th"
+                               : cp == 0xDF                 ? "ss"
+                               : cp == 0x132 || cp == 0x133 ? "ij"
+                                                            : "oe";
+            out[0] = (uint32_t)pair[0];
+            out[1] = (uint32_t)pair[1];
+            return 2;
+        }
+        if (base != '.') {
+            out[0] = (uint32_t)base;
+        }
+    } else if (cp >= 0x391 && cp <= 0x3A9) {
+        out[0] = cp + 0x20; /* Greek capitals */
+    } else if (cp == 0x3C2) {
+        out[0] = 0x3C3; /* final sigma */
+    } else if (cp == 0x401 || cp == 0x451) {
+        out[0] = 0x435; /* Cyrillic yo is written as ye */
+    } else if (cp >= 0x410 && cp <= 0x42F) {
+        out[0] = cp + 0x20; /* Cyrillic capitals */
+    } else if (cp >= 0x400 && cp <= 0x40F) {
+        out[0] = cp + 0x50;
+    } else if (cp >= 0x386 && cp <= 0x3CE) {
+        size_t n = sizeof(search_tonos) / sizeof(search_tonos[0]);
+        for (size_t i = 0; i < n; i++) {
+            if (search_tonos[i][0] == cp) {
+                out[0] = search_tonos[i][1];
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+search_decode() reads one code point and moves *s past it. A byte that
+does not start a valid sequence is returned as is, which reads Latin-1
+text right.
+*/
+uint32_t search_decode(const unsigned char** s) {
+    const unsigned char* p   = *s;
+    uint32_t             cp  = p[0];
+    unsigned             len = 0;
+    if (p[0] >= 0xC2 && p[0] <= 0xDF) {
+        len = 2;
+        cp  = p[0] & 0x1F;
+    } else if (p[0] >= 0xE0 && p[0] <= 0xEF) {
+        len = 3;
+        cp  = p[0] & 0x0F;
+    } else if (p[0] >= 0xF0 && p[0] <= 0xF4) {
+        len = 4;
+        cp  = p[0] & 0x07;
+    } else {
+        *s = p + 1;
+        return p[0];
+    }
+    for (unsigned i = 1; i < len; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *s = p + 1;
+            return p[0];
+        }
+        cp = cp << 6 | (p[i] & 0x3F);
+    }
+    *s = p + len;
+    return cp;
+}
+
+/* ----- TRIE ----- */
+/*
+search_insert() adds a city under its folded name. Cities are inserted in
+order of ID, from 0; cities with the same key are kept in that order.
+Without memory the trie gives up (broken is set) and finds nothing from
+then on.
+*/
+int search_insert(search_t* search, uint32_t id, const char* name) {
+    if (search->broken) {
+        return STATUS_OK;
+    }
+    uint32_t key[SEARCH_KEY_MAX];
+    size_t   len = search_fold(name, key, SEARCH_KEY_MAX);
+    if (id != search->ids ||
+        search_reserve(search, search->size + len + 1, id + 1) != STATUS_OK) {
+        search->broken = true;
+        return STATUS_FAIL;
+    }
+    if (search->size == 0) {
+        memset(&search->nodes[0], 0, sizeof(search_node_t));
+        search->size = 1;
+    }
+    search->same[id] = 0;
+    search->ids++;
+    if (len == 0) {
+        return STATUS_OK; /* nothing to find it by */
+    }
+
+    uint32_t node = 0;
+    for (size_t i = 0; i < len; i++) {
+        node = search_child(search, node, key[i]);
+    }
+    uint32_t* last = &search->nodes[node].id;
+    while (*last) {
+        last = &search->same[*last - 1];
+    }
+    *last = id + 1;
+    return STATUS_OK;
+}
+
+/*
+search_child() finds the child of parent for cp, adding it if there is
+none yet. Room for the node must have been reserved.
+*/
+uint32_t search_child(search_t* search, uint32_t parent, uint32_t cp) {
+    uint32_t* link = &search->nodes[parent].child;
+    while (*link && search->nodes[*link].cp < cp) {
+        link = &search->nodes[*link].sibling;
+    }
+    if (*link && search->nodes[*link].cp == cp) {
+        return *link;
+    }
+    uint32_t       node = search->size++;
+    search_node_t* new  = &search->nodes[node];
+    new->cp             = cp;
+    new->child          = 0;
+    new->sibling        = *link;
+    new->id             = 0;
+    *link               = node;
+    return node;
+}
+
+uint32_t search_find_child(const search_t* search, uint32_t parent,
+                           uint32_t cp) {
+    uint32_t node = search->nodes[parent].child;
+    while (node && search->nodes[node].cp < cp) {
+        node = search->nodes[node].sibling;
+    }
+    return node && search->nodes[node].cp == cp ? node : 0;
+}
+
+int search_reserve(search_t* search, uint32_t nodes, uint32_t ids) {
+    if (nodes > search->cap) {
+        uint32_t cap = search->cap ? search->cap : CITY_STORE_MIN;
+        while (cap < nodes) {
+            cap = cap > UINT32_MAX / 2 ? nodes : cap * 2;
+        }
+        search_node_t* grown =
+            realloc(search->nodes, cap * sizeof(search_node_t));
+        if (!grown) {
+            printf("Malloc failed\n");
+            return STATUS_FAIL;
+        }
+        search->nodes = grown;
+        search->cap   = cap;
+    }
+    if (ids > search->ids_cap) {
+        uint32_t cap = search->ids_cap ? search->ids_cap : CITY_STORE_MIN;
+        while (cap < ids) {
+            cap = cap > UINT32_MAX / 2 ? ids : cap * 2;
+        }
+        uint32_t* grown = realloc(search->same, cap * sizeof(uint32_t));
+        if (!grown) {
+            printf("Malloc failed\n");
+            return STATUS_FAIL;
+        }
+        search->same    = grown;
+        search->ids_cap = cap;
+    }
+    return STATUS_OK;
+}
+
+/*
+search_load() replaces the trie with a copy of one built earlier (see
+snapshot_write()): size nodes and the same links of ids cities. The copy
+is checked before it is used, as it comes from a file: every link points
+inside it and no node or city is pointed to twice, so every walk through
+it ends. Returns STATUS_FAIL, leaving the trie empty, if it does not
+hold.
+*/
+int search_load(search_t* search, const search_node_t* nodes, uint32_t size,
+                const uint32_t* same, uint32_t ids) {
+    search_free(search);
+    if (size == 0 || search_reserve(search, size, ids) != STATUS_OK) {
+        search_free(search);
+        return STATUS_FAIL;
+    }
+    memcpy(search->nodes, nodes, size * sizeof(search_node_t));
+    memcpy(search->same, same, ids * sizeof(uint32_t));
+
+    /*Node 0 is the root, and 0 is no link, so nothing points at the root*/
+    uint8_t* seen   = calloc((size_t)size + ids + 1, 1);
+    bool     intact = seen != NULL;
+    for (uint32_t i = 0; intact && i < size; i++) {
+        const search_node_t* at = &search->nodes[i];
+        intact = search_link_ok(at->child, size, seen) &&
+                 search_link_ok(at->sibling, size, seen) &&
+                 search_link_ok(at->id, ids + 1, seen + size);
+    }
+    for (uint32_t i = 0; intact && i < ids; i++) {
+        intact = search_link_ok(search->same[i], ids + 1, seen + size);
+    }
+    free(seen);
+    if (!intact) {
+        search_free(search);
+        return STATUS_FAIL;
+    }
+    search->size = size;
+    search->ids  = ids;
+    return STATUS_OK;
+}
+
+/*
+search_link_ok() is false if link is n or more, or if another link
+already points where it does (marked in seen).
+*/
+bool search_link_ok(uint32_t link, uint32_t n, uint8_t* seen) {
+    if (link == 0) {
+        return true;
+    }
+    if (link >= n || seen[link]) {
+        return false;
+    }
+    seen[link] = 1;
+    return true;
+}
+
+/* ----- SEARCHES ----- */
+/*
+search_prefix() writes the best max cities whose folded names start with
+query to out_hits, shortest names first, and returns how many there are.
+*/
+size_t search_prefix(const search_t* search, const char* query,
+                     search_hit_t* out_hits, size_t max) {
+    uint32_t key[SEARCH_KEY_MAX];
+    size_t   len = search_fold(query, key, SEARCH_KEY_MAX);
+    return search_prefix_key(search, key, len, out_hits, max);
+}
+
+/*
+search_prefix_key() goes down to the node of the prefix and from there
+breadth first, one depth at a time, so names come out by length. Once
+max are found no longer name can rank above them.
+*/
+size_t search_prefix_key(const search_t* search, const uint32_t* key,
+                         size_t len, search_hit_t* out_hits, size_t max) {
+    if (search->broken || search->size == 0 || max == 0) {
+        return 0;
+    }
+    uint32_t node = 0;
+    for (size_t i = 0; i < len; i++) {
+        node = search_find_child(search, node, key[i]);
+        if (node == 0) {
+            return 0;
+        }
+    }
+
+    size_t    cap   = 64;
+    uint32_t* queue = malloc(cap * sizeof(uint32_t));
+    if (!queue) {
+        printf("Malloc failed\n");
+        return 0;
+    }
+    size_t n     = 0;
+    size_t start = 0;
+    size_t end   = 1;
+    queue[0]     = node;
+    for (size_t depth = len; start < end && n < max; depth++) {
+        size_t level_end = end;
+        for (size_t i = start; i < level_end; i++) {
+            const search_node_t* at = &search->nodes[queue[i]];
+            for (uint32_t id = at->id; id; id = search->same[id - 1]) {
+                search_hit_t hit = {id - 1, 0, (uint16_t)depth};
+                search_keep(out_hits, &n, max, hit);
+            }
+            for (uint32_t c = at->child; c; c = search->nodes[c].sibling) {
+                if (end == cap) {
+                    uint32_t* grown = realloc(queue, 2 * cap * sizeof(*queue));
+                    if (!grown) {
+                        printf("Malloc failed\n");
+                        free(queue);
+                        return n;
+                    }
+                    queue = grown;
+                    cap *= 2;
+                }
+                queue[end++] = c;
+            }
+        }
+        start = level_end;
+    }
+    free(queue);
+    return n;
+}
+
+/*
+search_fuzzy() writes the best max cities whose folded names are at most
+max_dist typos from query to out_hits, fewest typos first. A typo is a
+letter added, missing, wrong, or swapped with its neighbour.
+*/
+size_t search_fuzzy(const search_t* search, const char* query,
+                    unsigned max_dist, search_hit_t* out_hits, size_t max) {
+    uint32_t key[SEARCH_KEY_MAX];
+    size_t   len = search_fold(query, key, SEARCH_KEY_MAX);
+    return search_fuzzy_key(search, key, len, max_dist, out_hits, max);
+}
+
+size_t search_fuzzy_key(const search_t* search, const uint32_t* key,
+                        size_t len, unsigned max_dist,
+                        search_hit_t* out_hits, size_t max) {
+    if (search->broken || search->size == 0 || max == 0 || len == 0) {
+        return 0;
+    }
+    search_walk_t* walk = malloc(sizeof(search_walk_t));
+    if (!walk) {
+        printf("Malloc failed\n");
+        return 0;
+    }
+    walk->search   = search;
+    walk->query    = key;
+    walk->len      = len;
+    walk->max_dist = max_dist;
+    walk->hits     = out_hits;
+    walk->n        = 0;
+    walk->max      = max;
+    for (size_t j = 0; j <= len; j++) {
+        walk->rows[0][j] = (uint8_t)j;
+    }
+    search_walk(walk, 0, 0);
+    size_t n = walk->n;
+    free(walk);
+    return n;
+}
+
+/*
+search_walk() computes the edit distance table of the query against
+every key below node, one row per character of the key. A subtree is
+left out as soon as every entry of the row is over the limit: no key
+below it can get closer. Once max hits are kept the limit drops to the
+worst of them.
+*/
+void search_walk(search_walk_t* walk, uint32_t node, size_t depth) {
+    const search_t* search = walk->search;
+    const uint32_t* q      = walk->query;
+    size_t          len    = walk->len;
+    uint32_t        c      = search->nodes[node].child;
+    for (; c; c = search->nodes[c].sibling) {
+        uint32_t       cp   = search->nodes[c].cp;
+        const uint8_t* prev = walk->rows[depth];
+        uint8_t*       row  = walk->rows[depth + 1];
+        uint8_t        low  = (uint8_t)(depth + 1);
+
+        row[0]                = low;
+        walk->path[depth + 1] = cp;
+        for (size_t j = 1; j <= len; j++) {
+            uint8_t best = prev[j - 1] + (q[j - 1] != cp);
+            if (prev[j] + 1 < best) {
+                best = prev[j] + 1;
+            }
+            if (row[j - 1] + 1 < best) {
+                best = row[j - 1] + 1;
+            }
+            /*Two letters swapped*/
+            if (depth > 0 && j > 1 && cp == q[j - 2] &&
+                walk->path[depth] == q[j - 1] &&
+                walk->rows[depth - 1][j - 2] + 1 < best) {
+                best = walk->rows[depth - 1][j - 2] + 1;
+            }
+            row[j] = best;
+            if (best < low) {
+                low = best;
+            }
+        }
+
+        unsigned limit = walk->n == walk->max
+                             ? walk->hits[walk->max - 1].dist
+                             : walk->max_dist;
+        uint32_t id    = row[len] <= limit ? search->nodes[c].id : 0;
+        for (; id; id = search->same[id - 1]) {
+            search_hit_t hit = {id - 1, row[len], (uint16_t)(depth + 1)};
+            search_keep(walk->hits, &walk->n, walk->max, hit);
+        }
+        if (low <= limit && depth + 1 < SEARCH_KEY_MAX) {
+            search_walk(walk, c, depth + 1);
+        }
+    }
+}
+
+/*
+search_suggest() is what a user typing query is most likely after, best
+first: cities whose names start with it, then cities whose names are a
+typo away (or two, for long queries).
+*/
+size_t search_suggest(const search_t* search, const char* query,
+                      search_hit_t* out_hits, size_t max) {
+    uint32_t key[SEARCH_KEY_MAX];
+    size_t   len = search_fold(query, key, SEARCH_KEY_MAX);
+    if (len == 0) {
+        return 0;
+    }
+    size_t n = search_prefix_key(search, key, len, out_hits, max);
+    if (n == max || len < SEARCH_ONE_TYPO_MIN) {
+        return n;
+    }
+
+    search_hit_t* fuzzy = malloc(max * sizeof(search_hit_t));
+    if (!fuzzy) {
+        printf("Malloc failed\n");
+        return n;
+    }
+    unsigned max_dist = len < SEARCH_TWO_TYPOS_MIN ? 1 : 2;
+    size_t   found    = search_fuzzy_key(search, key, len, max_dist, fuzzy,
+                                         max);
+    for (size_t i = 0; i < found; i++) {
+        bool seen = false;
+        for (size_t j = 0; j < n && !seen; j++) {
+            seen = out_hits[j].id == fuzzy[i].id;
+        }
+        if (!seen) {
+            search_keep(out_hits, &n, max, fuzzy[i]);
+        }
+    }
+    free(fuzzy);
+    return n;
+}
+
+/*
+search_keep() inserts a hit into hits, kept sorted by rank and at most
+max long. A hit ranking below all of a full array is dropped.
+*/
+void search_keep(search_hit_t* hits, size_t* n, size_t max,
+                 search_hit_t hit) {
+    size_t i = *n < max ? (*n)++ : max;
+    while (i > 0 && search_before(&hit, &hits[i - 1])) {
+        if (i < max) {
+            hits[i] = hits[i - 1];
+        }
+        i--;
+    }
+    if (i < max) {
+        hits[i] = hit;
+    }
+}
+
+bool search_before(const search_hit_t* a, const search_hit_t* b) {
+    if (a->dist != b->dist) {
+        return a->dist < b->dist;
+    }
+    if (a->len != b->len) {
+        return a->len < b->len;
+    }
+    return a->id < b->id;
+}
+
+void search_free(search_t* search) {
+    free(search->nodes);
+    free(search->same);
+    memset(search, 0, sizeof(search_t));
+}
@@ -0,0 +1,67 @@
+/* search.h */
+
+#ifndef __SEARCH_H_
+#define __SEARCH_H_
+#define SEARCH_KEY_MAX 64 /* folded characters kept of a name */
+#define SEARCH_HITS_MAX 8 /* suggestions given by city_get() */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* ----- Structs for the name trie ----- */
+/*
+Names are folded before they go in: lower case, diacritics stripped
+("Göteborg" is "goteborg"), and spaces, hyphens and underscores turned
+into one space, so what users type without the right keyboard still
+matches. The trie branches on whole characters (Unicode code points), not
+bytes, so a typo in a non-ASCII name is one edit like any other.
+
+Nodes are kept in one array; node 0 is the root. Children hang off their
+parent as a list ordered by code point. A zeroed search_t is empty.
+*/
+typedef struct search_node search_node_t;
+struct search_node {
+    uint32_t cp;      /* the character leading here */
+    uint32_t child;   /* first child, 0 if none */
+    uint32_t sibling; /* next child of the same parent, 0 if none */
+    uint32_t id;      /* first city whose key ends here + 1, 0 if none */
+};
+
+typedef struct search search_t;
+struct search {
+    search_node_t* nodes;
+    uint32_t       size;
+    uint32_t       cap;
+    uint32_t*      same; /* per city: next city with the same key + 1 */
+    uint32_t       ids;  /* cities inserted */
+    uint32_t       ids_cap;
+    bool           broken; /* out of memory, searches find nothing */
+};
+
+/* ----- Struct for one match ----- */
+/*
+Matches are ranked by dist (the typos it took), then by len (shorter
+keys first, the closest completions) and then by city ID.
+*/
+typedef struct search_hit search_hit_t;
+struct search_hit {
+    uint32_t id;
+    uint16_t dist; /* edits between query and key, 0 for completions */
+    uint16_t len;  /* folded length of the key */
+};
+
+/* ----- Public functions ----- */
+int    search_insert(search_t* search, uint32_t id, const char* name);
+int    search_load(search_t* search, const search_node_t* nodes,
+                   uint32_t size, const uint32_t* same, uint32_t ids);
+size_t search_fold(const char* name, uint32_t* out_key, size_t max);
+size_t search_prefix(const search_t* search, const char* query,
+                     search_hit_t* out_hits, size_t max);
+size_t search_fuzzy(const search_t* search, const char* query,
+                    unsigned max_dist, search_hit_t* out_hits, size_t max);
+size_t search_suggest(const search_t* search, const char* query,
+                      search_hit_t* out_hits, size_t max);
+void   search_free(search_t* search);
+
+#endif /* __SEARCH_H_ */
@@ -0,0 +1,476 @@
+/*
+    server.c contains the daemon mode and its client:
+    - handles listening on a Unix domain socket and a thread per client
+    - handles the line protocol described in server.h
+    - handles shutting down cleanly on SIGINT and SIGTERM
+    - handles sending bulk queries to a running daemon (client mode)
+
+    A daemon boots the city list once and keeps it, with the HTTP context
+    and its warm connections, for as long as it runs. Queries sent to it
+    skip the boot and hit the shared in-memory tier.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* ----- PRIVATE FUNCTIONS ----- */
+int   server_listen(server_t* server, const char* path);
+void  server_spawn(server_t* server, int fd);
+void* server_conn_run(void* userp);
+void  server_conn_close(server_conn_t* conn);
+void  server_handle(server_t* server, batch_t* batch, char* line);
+void  server_stop(int sig);
+int   server_connect(const char* path);
+
+static volatile sig_atomic_t server_quit    = 0;
+static int                   server_wake[2] = {-1, -1}; /* self-pipe */
+
+/*
+server_main() runs the daemon until SIGINT or SIGTERM:
+
+    etherskies --serve [--socket PATH]
+
+Returns 0 after a clean shutdown, 1 if it could not start and
+BATCH_EXIT_USAGE for bad arguments.
+*/
+int server_main(int argc, char** argv) {
+    const char* path = SERVER_SOCKET_PATH;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--serve") == 0) {
+            continue;
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s --serve [--socket PATH]\n", argv[0]);
+            return BATCH_EXIT_USAGE;
+        }
+    }
+
+    server_t server;
+    memset(&server, 0, sizeof(server));
+    for (unsigned i = 0; i < SERVER_MAX_CONNS; i++) {
+        server.conns[i] = -1;
+    }
+    if (city_init(&server.list) != STATUS_OK) {
+        fprintf(stderr, "Failed to init app.\n");
+        return EXIT_FAILURE;
+    }
+    if (http_init(&server.http) != STATUS_OK) {
+        fprintf(stderr, "Failed to init HTTP.\n");
+        city_dispose(&server.list);
+        return EXIT_FAILURE;
+    }
+    if (server_listen(&server, path) != STATUS_OK) {
+        http_dispose(&server.http);
+        city_dispose(&server.list);
+        return EXIT_FAILURE;
+    }
+    /*server_stop() writes to the pipe: a signal between the check of
+    server_quit and poll() still wakes the loop*/
+    if (pipe(server_wake) != 0 ||
+        fcntl(server_wake[1], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(server.listen_fd, F_SETFL, O_NONBLOCK) != 0) {
+        perror("Failed to set up the accept loop");
+        close(server.listen_fd);
+        unlink(path);
+        http_dispose(&server.http);
+        city_dispose(&server.list);
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.idle_cond, NULL);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving %u cities on %s\n", server.list->size, path);
+    fflush(stdout);
+    while (!server_quit) {
+        struct pollfd fds[2] = {{.fd = server.listen_fd, .events = POLLIN},
+                                {.fd = server_wake[0], .events = POLLIN}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                perror("Poll failed");
+                break;
+            }
+            continue;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        /*The client may be gone again, which the socket reports as EAGAIN*/
+        int fd = accept(server.listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN &&
+                errno != EWOULDBLOCK) {
+                perror("Accept failed");
+                break;
+            }
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        server_spawn(&server, fd);
+    }
+
+    /*Wake every client thread up and wait for them to finish*/
+    close(server.listen_fd);
+    close(server_wake[0]);
+    close(server_wake[1]);
+    unlink(path);
+    pthread_mutex_lock(&server.lock);
+    for (unsigned i = 0; i < SERVER_MAX_CONNS; i++) {
+        if (server.conns[i] >= 0) {
+            shutdown(server.conns[i], SHUT_RDWR);
+        }
+    }
+    while (server.num_conns > 0) {
+        pthread_cond_wait(&server.idle_cond, &server.lock);
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    printf("Served %lu requests over %lu connections (%lu refused).\n",
+           server.requests, server.accepted, server.refused);
+    pthread_cond_destroy(&server.idle_cond);
+    pthread_mutex_destroy(&server.lock);
+    http_dispose(&server.http);
+    city_dispose(&server.list);
+    return EXIT_SUCCESS;
+}
+
+void server_stop(int sig) {
+    (void)sig;
+    int saved   = errno;
+    server_quit = 1;
+    /*A full pipe fails, but then the loop is woken already*/
+    ssize_t put = write(server_wake[1], "", 1);
+    (void)put;
+    errno = saved;
+}
+
+/*
+server_listen() binds the socket. A socket file left behind by a daemon
+that did not shut down cleanly is replaced, but not one that is in use.
+*/
+int server_listen(server_t* server, const char* path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return STATUS_FAIL;
+    }
+    int fd = server_connect(path);
+    if (fd >= 0) {
+        fprintf(stderr, "A daemon is already serving on %s\n", path);
+        close(fd);
+        return STATUS_FAIL;
+    }
+    unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SERVER_BACKLOG) != 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path,
+                strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return STATUS_FAIL;
+    }
+
+    server->listen_fd = fd;
+    return STATUS_OK;
+}
+
+/* ----- CLIENTS ----- */
+/*
+server_spawn() starts a thread for a new client. The thread does not
+take SIGINT or SIGTERM, so they always reach the accept loop.
+*/
+void server_spawn(server_t* server, int fd) {
+    pthread_mutex_lock(&server->lock);
+    unsigned slot = 0;
+    while (slot < SERVER_MAX_CONNS && server->conns[slot] >= 0) {
+        slot++;
+    }
+    if (slot == SERVER_MAX_CONNS) {
+        server->refused++;
+        pthread_mutex_unlock(&server->lock);
+        close(fd);
+        return;
+    }
+    server->conns[slot] = fd;
+    server->num_conns++;
+    server->accepted++;
+    pthread_mutex_unlock(&server->lock);
+
+    server_conn_t* conn = malloc(sizeof(server_conn_t));
+    if (!conn) {
+        printf("Malloc failed\n");
+        server_conn_t tmp = {server, fd, slot};
+        server_conn_close(&tmp);
+        return;
+    }
+    conn->server = server;
+    conn->fd     = fd;
+    conn->slot   = slot;
+
+    sigset_t block;
+    sigset_t old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    pthread_attr_t attr;
+    pthread_t      thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, server_conn_run, conn) != 0) {
+        fprintf(stderr, "Failed to start client thread\n");
+        server_conn_close(conn);
+        free(conn);
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+server_conn_run() serves one client until it hangs up. Replies are
+buffered and flushed once every complete request read so far is
+answered, so a pipelined batch costs one write.
+*/
+void* server_conn_run(void* userp) {
+    server_conn_t* conn   = userp;
+    server_t*      server = conn->server;
+    int            out_fd = dup(conn->fd);
+    FILE*          out    = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (!out) {
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+        server_conn_close(conn);
+        free(conn);
+        return NULL;
+    }
+
+    batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.list   = server->list;
+    batch.http   = server->http;
+    batch.out    = out;
+    batch.format = BATCH_NDJSON;
+
+    char          buf[SERVER_LINE_MAX];
+    size_t        used     = 0;
+    unsigned long requests = 0;
+    while (1) {
+        ssize_t got = read(conn->fd, buf + used, sizeof(buf) - used);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        used += (size_t)got;
+
+        char* line = buf;
+        char* end  = NULL;
+        while ((end = memchr(line, '\n', buf + used - line))) {
+            *end = '\0';
+            if (end > line && end[-1] == '\r') {
+                end[-1] = '\0';
+            }
+            server_handle(server, &batch, line);
+            requests++;
+            line = end + 1;
+        }
+        used -= (size_t)(line - buf);
+        memmove(buf, line, used);
+        if (used == sizeof(buf)) {
+            fputs("- request too long\n", out);
+            fflush(out);
+            break;
+        }
+        if (fflush(out) != 0) {
+            break;
+        }
+    }
+    fclose(out);
+
+    pthread_mutex_lock(&server->lock);
+    server->requests += requests;
+    pthread_mutex_unlock(&server->lock);
+    server_conn_close(conn);
+    free(conn);
+    return NULL;
+}
+
+/*
+server_conn_close() closes a client's socket and frees its slot. The
+slot is freed first, so the socket is never shut down by server_main()
+after its number was reused.
+*/
+void server_conn_close(server_conn_t* conn) {
+    server_t* server = conn->server;
+    pthread_mutex_lock(&server->lock);
+    server->conns[conn->slot] = -1;
+    server->num_conns--;
+    close(conn->fd);
+    pthread_cond_signal(&server->idle_cond);
+    pthread_mutex_unlock(&server->lock);
+}
+
+void server_handle(server_t* server, batch_t* batch, char* line) {
+    FILE* out = batch->out;
+    if (strncmp(line, "GET ", 4) == 0) {
+        const char*   name   = line + 4;
+        city_id_t     id     = 0;
+        city_data_t   row;
+        http_source_t source = HTTP_FROM_MEMORY;
+        if (city_find(server->list, name, &id) != STATUS_OK) {
+            fputs("- ", out);
+            batch_write_error(batch, name, "unknown city");
+        } else if (http_lookup(server->http, server->list, id, &row,
+                               &source) != STATUS_OK) {
+            fputs("- ", out);
+            batch_write_error(batch, name, "fetch failed");
+        } else {
+            bool stale = difftime(time(NULL), row.cached_at) > DATA_MAX_AGE_S;
+            fputs("+ ", out);
+            batch_write(batch, &row, source, stale);
+        }
+    } else if (strcmp(line, "FORMAT ndjson") == 0) {
+        batch->format = BATCH_NDJSON;
+        fputs("+ OK\n", out);
+    } else if (strcmp(line, "FORMAT csv") == 0) {
+        batch->format = BATCH_CSV;
+        fputs("+ OK\n", out);
+    } else if (strcmp(line, "PING") == 0) {
+        fputs("+ PONG\n", out);
+    } else {
+        fputs("- unknown request\n", out);
+    }
+}
+
+/* ----- CLIENT MODE ----- */
+int server_connect(const char* path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+server_query() asks the daemon on path for every city in names and copies
+the records to out, like batch_run() would write them. Requests go out
+SERVER_PIPELINE at a time, and all their replies are read before the next
+ones are sent, so neither side can fill its socket buffer and stall.
+Returns STATUS_FAIL if the daemon could not be reached or any city got an
+error record.
+*/
+int server_query(const char* path, batch_format_t format, char** names,
+                 size_t n, FILE* out) {
+    int fd = server_connect(path);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon on %s: %s\n", path,
+                strerror(errno));
+        return STATUS_FAIL;
+    }
+    int   req_fd = dup(fd);
+    FILE* req    = req_fd >= 0 ? fdopen(req_fd, "w") : NULL;
+    FILE* in     = fdopen(fd, "r");
+    if (!req || !in) {
+        fprintf(stderr, "Failed to set up connection\n");
+        if (req) {
+            fclose(req);
+        } else if (req_fd >= 0) {
+            close(req_fd);
+        }
+        if (in) {
+            fclose(in);
+        } else {
+            close(fd);
+        }
+        return STATUS_FAIL;
+    }
+
+    int    status = STATUS_OK;
+    char*  line   = NULL;
+    size_t size   = 0;
+    if (format == BATCH_CSV) {
+        fputs("FORMAT csv\n", req);
+        if (fflush(req) != 0 || getline(&line, &size, in) < 0 ||
+            strncmp(line, "+ ", 2) != 0) {
+            fprintf(stderr, "Daemon did not accept the format\n");
+            status = STATUS_FAIL;
+            n      = 0;
+        }
+        batch_header(format, out);
+    }
+
+    for (size_t i = 0; i < n; i += SERVER_PIPELINE) {
+        size_t end = i + SERVER_PIPELINE < n ? i + SERVER_PIPELINE : n;
+        for (size_t j = i; j < end; j++) {
+            fprintf(req, "GET %s\n", names[j]);
+        }
+        if (fflush(req) != 0) {
+            fprintf(stderr, "Failed to send to daemon\n");
+            status = STATUS_FAIL;
+            break;
+        }
+        size_t got = i;
+        while (got < end && getline(&line, &size, in) >= 2) {
+            if (line[0] != '+') {
+                status = STATUS_FAIL;
+            }
+            fputs(line + 2, out);
+            got++;
+        }
+        fflush(out);
+        if (got < end) {
+            fprintf(stderr, "Daemon closed the connection\n");
+            status = STATUS_FAIL;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(req);
+    fclose(in);
+    return status;
+}
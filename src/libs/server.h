@@ -0,0 +1,63 @@
+/* server.h */
+
+#ifndef __SERVER_H_
+#define __SERVER_H_
+#define SERVER_SOCKET_PATH "./etherskies.sock"
+#define SERVER_BACKLOG 64    /* connections the kernel queues for accept */
+#define SERVER_MAX_CONNS 256 /* clients served at once, more are refused */
+#define SERVER_LINE_MAX 512  /* longest request line */
+#define SERVER_PIPELINE 64   /* requests a client sends before reading */
+
+#include "HTTP.h"
+#include "batch.h"
+#include "city.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* ----- Protocol ----- */
+/*
+A client sends one request per line and gets exactly one reply line per
+request, in order, so requests can be pipelined. A reply starts with "+ "
+if the request succeeded and "- " if it did not.
+
+    GET <name>       the city's record, as written by bulk query mode
+    FORMAT <format>  "ndjson" (the default) or "csv" for later records
+    PING             "+ PONG"
+*/
+
+/* ----- Struct for the daemon ----- */
+/*
+The daemon owns the city list and the HTTP context for its whole life, so
+the cache is read once and the in-memory tier is shared by every client.
+Each client is served by a thread of its own.
+*/
+typedef struct server server_t;
+struct server {
+    city_list_t*    list;
+    http_ctx_t*     http;
+    int             listen_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t  idle_cond; /* signalled when a client disconnects */
+    int             conns[SERVER_MAX_CONNS]; /* socket per client, or -1 */
+    unsigned        num_conns;
+    unsigned long   accepted;
+    unsigned long   refused;
+    unsigned long   requests;
+};
+
+/* ----- Struct for one client ----- */
+typedef struct server_conn server_conn_t;
+struct server_conn {
+    server_t* server;
+    int       fd;
+    unsigned  slot; /* index in server->conns */
+};
+
+/* ----- Public functions ----- */
+int server_main(int argc, char** argv);
+int server_query(const char* path, batch_format_t format, char** names,
+                 size_t n, FILE* out);
+
+#endif /* __SERVER_H_ */
@@ -0,0 +1,302 @@
+/*
+    snapshot.c contains functions that:
+    - handles writing the binary snapshot of the city list on exit
+    - handles mapping the snapshot read-only at boot
+    - handles checking that a snapshot matches the cache it was taken of
+
+    Reading a snapshot does no parsing: the records are used in place and
+    the strings are used straight from the mapping.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "snapshot.h"
+
+#include "meteo.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* ----- PRIVATE FUNCTIONS ----- */
+int snapshot_src(const char* src_path, snapshot_header_t* header);
+int snapshot_check(const snapshot_t* snap);
+int snapshot_pad(FILE* f, uint64_t* off);
+
+/* ----- OPEN & CLOSE ----- */
+/*
+snapshot_open() maps the snapshot at path and checks it. STATUS_FAIL is
+returned if it is missing, damaged, written by another version, or if the
+cache at src_path has changed since the snapshot was taken.
+*/
+int snapshot_open(snapshot_t** out_snap, const char* path,
+                  const char* src_path) {
+    if (!out_snap || !path || !src_path) {
+        return STATUS_FAIL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return STATUS_FAIL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(snapshot_header_t)) {
+        close(fd);
+        return STATUS_FAIL;
+    }
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); /* the mapping keeps the file */
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return STATUS_FAIL;
+    }
+
+    snapshot_t* snap = malloc(sizeof(snapshot_t));
+    if (!snap) {
+        printf("Malloc failed\n");
+        munmap(base, st.st_size);
+        return STATUS_FAIL;
+    }
+    snap->base   = base;
+    snap->len    = st.st_size;
+    snap->header = base;
+    snap->recs   = (const snapshot_rec_t*)(snap->header + 1);
+    snap->strtab = (const char*)base + snap->header->strtab_off;
+    snap->trie   = NULL;
+    snap->geo    = NULL;
+
+    snapshot_header_t src;
+    if (snapshot_check(snap) != STATUS_OK ||
+        snapshot_src(src_path, &src) != STATUS_OK ||
+        src.src_size != snap->header->src_size ||
+        src.src_ino != snap->header->src_ino ||
+        src.src_mtime_ns != snap->header->src_mtime_ns) {
+        snapshot_close(&snap);
+        return STATUS_FAIL;
+    }
+    if (snap->header->trie_off) {
+        snap->trie      = (const search_node_t*)((const char*)base +
+                                                 snap->header->trie_off);
+        snap->trie_same = (const uint32_t*)(snap->trie +
+                                            snap->header->trie_nodes);
+    }
+    if (snap->header->geo_off) {
+        snap->geo =
+            (const geo_node_t*)((const char*)base + snap->header->geo_off);
+    }
+
+    *out_snap = snap; /* return through out-ptr */
+    return STATUS_OK;
+}
+
+int snapshot_close(snapshot_t** snap) {
+    if (!snap || !*snap) {
+        return STATUS_FAIL;
+    }
+    munmap((*snap)->base, (*snap)->len);
+    free(*snap);
+    *snap = NULL;
+    return STATUS_OK;
+}
+
+/*
+snapshot_check() makes sure the mapped file can be used without any
+further bounds checks: every string offset lies inside the string table
+and the table ends with a NUL, so every string is terminated. The indexes
+written after it have to lie inside the file too; what is in them is
+checked by search_load() and geo_load(). Snapshots of another version, or
+with urls for another grid or base url (see meteo_set_base()), are
+refused as well.
+*/
+int snapshot_check(const snapshot_t* snap) {
+    const snapshot_header_t* h = snap->header;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != SNAPSHOT_VERSION ||
+        h->rec_size != sizeof(snapshot_rec_t) ||
+        h->cell_deg != GRID_CELL_DEG) {
+        return STATUS_FAIL;
+    }
+    uint64_t recs_end = sizeof(snapshot_header_t) + h->count * h->rec_size;
+    if (h->count > snap->len / sizeof(snapshot_rec_t) ||
+        h->strtab_off < recs_end || h->strtab_size == 0 ||
+        h->strtab_off + h->strtab_size > snap->len ||
+        snap->strtab[h->strtab_size - 1] != '\0') {
+        return STATUS_FAIL;
+    }
+    for (uint64_t i = 0; i < h->count; i++) {
+        const snapshot_rec_t* r = &snap->recs[i];
+        if (r->name_off >= h->strtab_size || r->fp_off >= h->strtab_size ||
+            r->url_off >= h->strtab_size) {
+            return STATUS_FAIL;
+        }
+    }
+    uint64_t end  = h->strtab_off + h->strtab_size;
+    uint64_t trie = h->trie_nodes * sizeof(search_node_t) +
+                    h->count * sizeof(uint32_t);
+    if (h->trie_off &&
+        (h->trie_off % 8 || h->trie_off < end || h->trie_off > snap->len ||
+         h->trie_nodes == 0 ||
+         h->trie_nodes > snap->len / sizeof(search_node_t) ||
+         trie > snap->len - h->trie_off)) {
+        return STATUS_FAIL;
+    }
+    uint64_t geo = h->count * sizeof(geo_node_t);
+    if (h->geo_off &&
+        (h->geo_off % 8 || h->geo_off < end || h->geo_off > snap->len ||
+         h->geo_root >= h->count || geo > snap->len - h->geo_off)) {
+        return STATUS_FAIL;
+    }
+    const char* base = meteo_get_base();
+    const char* url  = h->count ? snap->strtab + snap->recs[0].url_off : "";
+    if (h->count > 0 && strncmp(url, base, strlen(base)) != 0) {
+        return STATUS_FAIL;
+    }
+    return STATUS_OK;
+}
+
+/*
+snapshot_src() fills in the src_* fields from the cache at src_path.
+*/
+int snapshot_src(const char* src_path, snapshot_header_t* header) {
+    struct stat st;
+    if (stat(src_path, &st) != 0) {
+        return STATUS_FAIL;
+    }
+    header->src_size = st.st_size;
+    header->src_ino  = st.st_ino;
+    header->src_mtime_ns =
+        (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return STATUS_OK;
+}
+
+/* ----- WRITING ----- */
+/*
+snapshot_write() writes the whole list in two passes, records first and
+then the strings they point to, followed by the name trie and the k-d
+tree when they cover every city. It goes to a temp file that is renamed
+over the old snapshot, so a snapshot still mapped by this (or any other)
+process stays valid.
+*/
+int snapshot_write(city_list_t* list, const char* path, const char* src_path) {
+    if (!list || !path || !src_path) {
+        return STATUS_FAIL;
+    }
+
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    if (snapshot_src(src_path, &header) != STATUS_OK) {
+        return STATUS_FAIL;
+    }
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version    = SNAPSHOT_VERSION;
+    header.rec_size   = sizeof(snapshot_rec_t);
+    header.cell_deg   = GRID_CELL_DEG;
+    header.count      = list->size;
+    header.strtab_off = sizeof(header) + list->size * sizeof(snapshot_rec_t);
+
+    size_t tmp_len = strlen(path) + 5;
+    char*  tmp     = malloc(tmp_len);
+    if (!tmp) {
+        return STATUS_FAIL;
+    }
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    FILE* f = fopen(tmp, "wb");
+    if (!f) {
+        perror("fopen");
+        free(tmp);
+        return STATUS_FAIL;
+    }
+
+    /*Records, with string offsets counted as if the table was written*/
+    fseek(f, sizeof(header), SEEK_SET);
+    uint64_t strtab_size = 0;
+    uint64_t count       = 0;
+    for (city_id_t id = 0; id < list->size; id++) {
+        city_text_t*   t = &list->text[id];
+        snapshot_rec_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.name_off = strtab_size;
+        strtab_size += strlen(t->name) + 1;
+        rec.fp_off = strtab_size;
+        strtab_size += strlen(t->fp) + 1;
+        rec.url_off = strtab_size;
+        strtab_size += (t->url ? strlen(t->url) : 0) + 1;
+        rec.hash      = list->hash[id];
+        rec.lat       = list->lat[id];
+        rec.lon       = list->lon[id];
+        rec.temp      = list->temp[id];
+        rec.windspeed = list->windspeed[id];
+        rec.rel_hum   = list->rel_hum[id];
+        rec.cached_at = list->cached_at[id];
+        fwrite(&rec, sizeof(rec), 1, f);
+        count++;
+    }
+
+    /*String table, in the same order*/
+    for (city_id_t id = 0; id < list->size; id++) {
+        city_text_t* t = &list->text[id];
+        fwrite(t->name, strlen(t->name) + 1, 1, f);
+        fwrite(t->fp, strlen(t->fp) + 1, 1, f);
+        fwrite(t->url ? t->url : "", (t->url ? strlen(t->url) : 0) + 1, 1, f);
+    }
+
+    header.strtab_size = strtab_size;
+
+    /*The indexes, as they are in memory*/
+    uint64_t        off    = header.strtab_off + strtab_size;
+    const search_t* search = &list->search;
+    if (!search->broken && search->size > 0 && search->ids == list->size &&
+        snapshot_pad(f, &off) == STATUS_OK) {
+        header.trie_off   = off;
+        header.trie_nodes = search->size;
+        fwrite(search->nodes, sizeof(search_node_t), search->size, f);
+        fwrite(search->same, sizeof(uint32_t), search->ids, f);
+        off += search->size * sizeof(search_node_t) +
+               search->ids * sizeof(uint32_t);
+    }
+    const geo_t* geo = &list->geo;
+    if (geo->ready && geo->size > 0 && geo->size == list->size &&
+        snapshot_pad(f, &off) == STATUS_OK) {
+        header.geo_off  = off;
+        header.geo_root = geo->root;
+        fwrite(geo->nodes, sizeof(geo_node_t), geo->size, f);
+    }
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, f);
+
+    int status = STATUS_OK;
+    if (count != list->size || strtab_size > UINT32_MAX || ferror(f)) {
+        status = STATUS_FAIL;
+    }
+    if (fclose(f) != 0) {
+        status = STATUS_FAIL;
+    }
+    if (status == STATUS_OK && rename(tmp, path) != 0) {
+        perror("rename");
+        status = STATUS_FAIL;
+    }
+    if (status != STATUS_OK) {
+        fprintf(stderr, "Failed to write snapshot %s\n", path);
+        unlink(tmp);
+    }
+    free(tmp);
+    return status;
+}
+
+/*
+snapshot_pad() writes zeros up to the next 8-byte boundary, where off
+(the position in the file) ends up.
+*/
+int snapshot_pad(FILE* f, uint64_t* off) {
+    static const char zeros[8] = {0};
+    size_t            pad      = (8 - *off % 8) % 8;
+    if (pad && fwrite(zeros, 1, pad, f) != pad) {
+        return STATUS_FAIL;
+    }
+    *off += pad; /* return through out-ptr */
+    return STATUS_OK;
+}
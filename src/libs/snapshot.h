@@ -0,0 +1,78 @@
+/* snapshot.h */
+
+#ifndef __SNAPSHOT_H_
+#define __SNAPSHOT_H_
+#define SNAPSHOT_PATH "./cities.snap"
+#define SNAPSHOT_MAGIC "ESKYSNAP"
+#define SNAPSHOT_VERSION 5
+
+#include "city.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ----- Structs for the file layout ----- */
+/*
+A snapshot is a header, count fixed-size records and a string table of
+NUL-terminated strings that the records point into by offset. The src_*
+fields describe the cache (log or directory) at the time the snapshot was
+written; if it has changed since, the snapshot is stale. So is a snapshot
+whose urls were built for another grid (cell_deg).
+
+After the strings come the name trie (trie_nodes nodes, then the same
+links of every city) and the k-d tree (count nodes), each starting on an
+8-byte boundary, so neither has to be built again at boot. An offset of
+0 means the index was not written (it was not whole at exit).
+*/
+typedef struct snapshot_header snapshot_header_t;
+struct snapshot_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t rec_size; /* sizeof(snapshot_rec_t) when written */
+    uint64_t count;
+    uint64_t strtab_off;
+    uint64_t strtab_size;
+    uint64_t src_size;
+    uint64_t src_ino;
+    int64_t  src_mtime_ns;
+    double   cell_deg; /* GRID_CELL_DEG when written */
+    uint64_t trie_off;
+    uint64_t trie_nodes;
+    uint64_t geo_off;
+    uint64_t geo_root;
+};
+
+typedef struct snapshot_rec snapshot_rec_t;
+struct snapshot_rec {
+    uint32_t name_off;
+    uint32_t fp_off;
+    uint32_t url_off;
+    uint32_t hash; /* city_hash() of the name */
+    double   lat;
+    double   lon;
+    double   temp;
+    double   windspeed;
+    double   rel_hum;
+    int64_t  cached_at;
+};
+
+/* ----- Struct for an open (mapped) snapshot ----- */
+typedef struct snapshot snapshot_t;
+struct snapshot {
+    void*                    base;
+    size_t                   len;
+    const snapshot_header_t* header;
+    const snapshot_rec_t*    recs;
+    const char*              strtab;
+    const search_node_t*     trie;      /* NULL if not written */
+    const uint32_t*          trie_same; /* count links */
+    const geo_node_t*        geo;       /* NULL if not written */
+};
+
+/* ----- Public functions ----- */
+int snapshot_open(snapshot_t** snap, const char* path, const char* src_path);
+int snapshot_close(snapshot_t** snap);
+int snapshot_write(city_list_t* city_list, const char* path,
+                   const char* src_path);
+
+#endif /* __SNAPSHOT_H_ */
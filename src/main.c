@@ -7,7 +7,13 @@
 */
 
 #include "libs/HTTP.h"
+#include "libs/batch.h"
 #include "libs/city.h"
+#include "libs/import.h"
+#include "libs/meteo.h"
+#include "libs/mock.h"
+#include "libs/persist.h"
+#include "libs/server.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,7 +21,31 @@
 #include <time.h>
 #include <unistd.h>
 
-int main() {
+void main_on_signal(int sig);
+
+int main(int argc, char** argv) {
+
+    /*Every fetch goes to ETHERSKIES_API_URL instead if it is set*/
+    meteo_set_base(getenv(METEO_BASE_ENV));
+
+    /*Any arguments mean a daemon, an import or a bulk query, not the loop*/
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        return server_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--mock") == 0) {
+        return mock_main(argc, argv);
+    }
+
+    /*Queued saves are written before Ctrl-C or SIGTERM ends the process*/
+    if (persist_signals(main_on_signal) != STATUS_OK) {
+        fprintf(stderr, "Saves still queued are lost on Ctrl-C.\n");
+    }
+    if (argc > 1 && strcmp(argv[1], "--import") == 0) {
+        return import_main(argc, argv);
+    }
+    if (argc > 1) {
+        return batch_main(argc, argv);
+    }
 
     city_list_t* list = NULL;
     if (city_init(&list) != STATUS_OK) {
@@ -23,6 +53,13 @@ int main() {
         return STATUS_FAIL;
     }
 
+    http_ctx_t* http = NULL;
+    if (http_init(&http) != STATUS_OK) {
+        fprintf(stderr, "Failed to init HTTP.\n");
+        city_dispose(&list);
+        return STATUS_FAIL;
+    }
+
     while (1) {
 
         if (city_print_list(&list) != STATUS_OK) {
@@ -30,32 +67,46 @@ int main() {
             return STATUS_FAIL;
         }
 
-        printf("Select a city: ");
-        city_node_t* user_city        = NULL;
-        unsigned     user_city_status = city_get(list, &user_city);
+        printf("Select a city (name or lat,lon): ");
+        city_id_t user_city        = 0;
+        unsigned  user_city_status = city_get(list, &user_city);
         if (user_city_status == STATUS_EXIT) {
             printf("User pressed 'q' to exit.\n");
+            http_dispose(&http);
             city_dispose(&list);
             return STATUS_OK;
         } else if (user_city_status == STATUS_FAIL) {
             printf("\nCity not found.\n");
             continue;
         }
-        printf("\nYou selected: %s\n", user_city->data->name);
+        const char* name = list->text[user_city].name;
+        printf("\nYou selected: %s\n", name);
 
-        if (http_get_weather_data(user_city) != STATUS_OK) {
-            fprintf(stderr, "Failed to get weather data for %s.\n",
-                    user_city->data->name);
+        if (http_get_weather_data(http, list, user_city) != STATUS_OK) {
+            fprintf(stderr, "Failed to get weather data for %s.\n", name);
+            http_dispose(&http);
             city_dispose(&list);
             return STATUS_FAIL;
         }
 
-        printf("\nCurrent Weather for %s:\n", user_city->data->name);
-        printf("Temperature: %.2f °C\n", user_city->data->temp);
-        printf("Wind speed: %.2f m/s\n", user_city->data->windspeed);
-        printf("Humidity: %.2f %%\n\n", user_city->data->rel_hum);
+        /*A background refresh may be writing to the list*/
+        http_list_lock(http);
+        printf("\nCurrent Weather for %s:\n", name);
+        printf("Temperature: %.2f °C\n", list->temp[user_city]);
+        printf("Wind speed: %.2f m/s\n", list->windspeed[user_city]);
+        printf("Humidity: %.2f %%\n\n", list->rel_hum[user_city]);
+        http_list_unlock(http);
     }
 
+    http_dispose(&http);
     city_dispose(&list);
     return STATUS_OK;
 }
+
+/*
+main_on_signal() runs on the signal thread, see persist_signals().
+*/
+void main_on_signal(int sig) {
+    city_flush();
+    _exit(128 + sig);
+}
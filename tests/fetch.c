@@ -0,0 +1,210 @@
+/*
+    fetch.c tests the concurrent fetch engine (fetch_run()) against the
+    local Open-Meteo stand-in (mock.c), so it needs no network:
+    - every city is refreshed and saved, one request per weather cell
+    - cities of one cell share a single request
+    - injected upstream errors fail every city and leave its data alone
+
+    It also prints the throughput of the first case, with the stand-in
+    answering after TEST_LATENCY_MS. Every case boots a list of its own
+    in a scratch directory, as fetched weather is cached like real
+    weather, and the test cities are added to the bootstrap ones.
+
+    Usage: fetch [CITIES]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "HTTP.h"
+#include "city.h"
+#include "fetch.h"
+#include "meteo.h"
+#include "mock.h"
+#include "snapshot.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_CITIES 64       /* cities of the throughput case */
+#define TEST_INFLIGHT 8      /* max_inflight passed to fetch_run() */
+#define TEST_LATENCY_MS 20.0 /* delay of the stand-in before each reply */
+#define TEST_CELL_STEP 1.0   /* degrees between cities, a cell each */
+#define TEST_COLUMN 40       /* cities per column of test_make_list() */
+
+/* ----- Struct for what on_done was told ----- */
+typedef struct {
+    unsigned* calls;  /* by id */
+    unsigned  ok;
+    unsigned  failed;
+} test_done_t;
+
+/* ----- PRIVATE FUNCTIONS ----- */
+double       test_now(void);
+int          test_check(int cond, const char* what);
+void         test_on_done(city_id_t id, int status, void* userp);
+city_list_t* test_make_list(unsigned n, double step, city_id_t* ids);
+int          test_run(const mock_config_t* config, unsigned n, double step,
+                      unsigned cells, int want_status);
+
+int main(int argc, char** argv) {
+    unsigned n = argc > 1 ? (unsigned)atoi(argv[1]) : TEST_CITIES;
+    if (n == 0) {
+        fprintf(stderr, "Usage: %s [CITIES]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    char dir[] = "/tmp/etherskies-test-XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) != 0) {
+        perror("Failed to make a scratch directory");
+        return EXIT_FAILURE;
+    }
+
+    mock_config_t config;
+    mock_defaults(&config);
+    config.port       = 0;
+    config.latency_ms = TEST_LATENCY_MS;
+    int failed        = 0;
+
+    printf("# every city refreshed, a request per cell\n");
+    failed += test_run(&config, n, TEST_CELL_STEP, n, STATUS_OK);
+
+    printf("# cities of one cell share a request\n");
+    failed += test_run(&config, 4, 0.0, 1, STATUS_OK);
+
+    printf("# upstream errors fail every city\n");
+    config.error_rate = 1.0;
+    failed += test_run(&config, 8, TEST_CELL_STEP, 8, STATUS_FAIL);
+
+    if (chdir("/") == 0) {
+        rmdir(dir);
+    }
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+test_run() fetches n new cities, step degrees apart, from a fresh
+stand-in and checks that fetch_run() returns want_status, that on_done
+is told about each city once, and that the stand-in got one request per
+cell. Returns the number of failed checks.
+*/
+int test_run(const mock_config_t* config, unsigned n, double step,
+             unsigned cells, int want_status) {
+    mock_t*      mock   = NULL;
+    http_ctx_t*  http   = NULL;
+    city_list_t* list   = NULL;
+    city_id_t*   ids    = malloc(n * sizeof(city_id_t));
+    test_done_t  done   = {NULL, 0, 0};
+    int          failed = 0;
+
+    /*Urls are built when a city is added, and base is not copied*/
+    static char base[64];
+    if (ids && mock_start(&mock, config) == STATUS_OK) {
+        snprintf(base, sizeof(base), "http://127.0.0.1:%d/v1/forecast",
+                 mock->port);
+        meteo_set_base(base);
+        list = test_make_list(n, step, ids);
+    }
+    if (list) {
+        done.calls = calloc(list->size, sizeof(unsigned));
+    }
+    if (!list || !done.calls || http_init(&http) != STATUS_OK) {
+        failed += test_check(0, "set up stand-in, list and HTTP");
+        goto cleanup;
+    }
+
+    double start  = test_now();
+    int    status = fetch_run(http, list, ids, n, TEST_INFLIGHT,
+                              test_on_done, &done);
+    double secs   = test_now() - start;
+
+    failed += test_check(status == want_status, "fetch_run() status");
+    unsigned once = 0;
+    unsigned kept = 0;
+    for (unsigned i = 0; i < n; i++) {
+        bool updated = list->temp[ids[i]] != INIT_VAL;
+        once += done.calls[ids[i]] == 1;
+        kept += updated == (want_status == STATUS_OK);
+    }
+    failed += test_check(once == n, "on_done told once per city");
+    failed += test_check(kept == n, want_status == STATUS_OK
+                                        ? "every city updated"
+                                        : "no city updated");
+    failed += test_check(want_status == STATUS_OK ? done.ok == n
+                                                  : done.failed == n,
+                         "on_done status");
+    failed += test_check(mock->requests == cells, "one request per cell");
+    if (want_status == STATUS_OK && n > 1) {
+        printf("  %u cities in %.1f ms, %.0f cities/s at %u in flight\n", n,
+               secs * 1000.0, n / secs, TEST_INFLIGHT);
+    }
+
+cleanup:
+    if (http) {
+        http_dispose(&http);
+    }
+    if (mock) {
+        mock_stop(&mock);
+    }
+    if (list) {
+        city_dispose(&list);
+    }
+    unlink(CITY_CACHE_LOG_PATH);
+    unlink(SNAPSHOT_PATH);
+    free(ids);
+    free(done.calls);
+    return failed;
+}
+
+/*
+test_make_list() boots a list and adds n cities without weather to it,
+in columns going north from 40S 15E (away from the bootstrap cities),
+step degrees apart, so a step of 0 puts them all in one cell. Their IDs
+go to ids.
+*/
+city_list_t* test_make_list(unsigned n, double step, city_id_t* ids) {
+    city_list_t* list = NULL;
+    if (city_init(&list) != STATUS_OK) {
+        return NULL;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Test %u", i);
+        double      lat  = -40.0 + (i % TEST_COLUMN) * step;
+        double      lon  = 15.0 + (i / TEST_COLUMN) * step + i * 1e-4;
+        city_data_t data = {.name      = name,
+                            .lat       = lat,
+                            .lon       = lon,
+                            .temp      = INIT_VAL,
+                            .windspeed = INIT_VAL,
+                            .rel_hum   = INIT_VAL};
+        if (city_add(list, &data, &ids[i]) != STATUS_OK) {
+            city_dispose(&list);
+            return NULL;
+        }
+    }
+    return list;
+}
+
+void test_on_done(city_id_t id, int status, void* userp) {
+    test_done_t* done = userp;
+    done->calls[id]++;
+    if (status == STATUS_OK) {
+        done->ok++;
+    } else {
+        done->failed++;
+    }
+}
+
+int test_check(int cond, const char* what) {
+    printf("  %s %s\n", cond ? "ok  " : "FAIL", what);
+    return cond ? 0 : 1;
+}
+
+double test_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}